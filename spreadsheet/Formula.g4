@@ -6,9 +6,16 @@ main
 
 expr
     : '(' expr ')'  # Parens
+    | IF '(' expr ',' expr ',' expr ')'  # If
+    | (AND | OR) '(' expr (',' expr)* ')'  # Logical
+    | MATCH '(' expr ',' RANGE ')'  # Lookup
+    | VLOOKUP '(' expr ',' RANGE ',' expr ')'  # Lookup
+    | XLOOKUP '(' expr ',' RANGE ',' RANGE (',' expr)? ')'  # Lookup
+    | (SUM | COUNT | AVERAGE) '(' RANGE ')'  # Aggregate
     | (ADD | SUB) expr  # UnaryOp
     | expr (MUL | DIV) expr  # BinaryOp
     | expr (ADD | SUB) expr  # BinaryOp
+    | expr (LT | LE | GT | GE | EQ | NE) expr  # Comparison
     | CELL  # Cell
     | NUMBER  # Literal
     ;
@@ -26,5 +33,26 @@ ADD: '+' ;
 SUB: '-' ;
 MUL: '*' ;
 DIV: '/' ;
-CELL: [A-Z]+[0-9]+ ;
+LT: '<' ;
+LE: '<=' ;
+GT: '>' ;
+GE: '>=' ;
+EQ: '=' ;
+NE: '<>' ;
+// function names are listed before CELL: a longer match (IF1) is still a cell
+IF: 'IF' ;
+AND: 'AND' ;
+OR: 'OR' ;
+MATCH: 'MATCH' ;
+VLOOKUP: 'VLOOKUP' ;
+XLOOKUP: 'XLOOKUP' ;
+SUM: 'SUM' ;
+COUNT: 'COUNT' ;
+AVERAGE: 'AVERAGE' ;
+// a cell of another sheet of the workbook is prefixed with the sheet name: Sheet1!A1
+fragment SHEET_NAME: [A-Za-z_][A-Za-z0-9_]* ;
+fragment POSITION: [A-Z]+[0-9]+ ;
+CELL: (SHEET_NAME '!')? POSITION ;
+// a rectangular range of cells: A1:B10 or Sheet1!A1:B10
+RANGE: (SHEET_NAME '!')? POSITION ':' POSITION ;
 WS: [ \t\n\r]+ -> skip ;
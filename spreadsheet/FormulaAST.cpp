@@ -6,15 +6,20 @@
 
 #include "common.h"
 
+#include <algorithm>
 #include <cassert>
 #include <cmath>
+#include <iterator>
 #include <memory>
+#include <mutex>
 #include <optional>
 #include <sstream>
+#include <vector>
 
 namespace ASTImpl {
 
 enum ExprPrecedence {
+    EP_CMP,
     EP_ADD,
     EP_SUB,
     EP_MUL,
@@ -60,13 +65,18 @@ enum PrecedenceRule {
 //     (currently in the table we're always putting in the parentheses)
 // +(A * B) - always okay (the resulting binary op has the highest grammatic precedence)
 // +(A / B) - always okay (the resulting binary op has the highest grammatic precedence)
+// Comparisons have the lowest grammatic precedence and are left-associative:
+// A < (B < C) - never okay, (A < B) < C - always okay,
+// any other parent needs the parentheses around a comparison.
+// Function arguments are printed as top-level expressions (EP_ATOM parent).
 constexpr PrecedenceRule PRECEDENCE_RULES[EP_END][EP_END] = {
-    /* EP_ADD */ {PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
-    /* EP_SUB */ {PR_RIGHT, PR_RIGHT, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
-    /* EP_MUL */ {PR_BOTH, PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
-    /* EP_DIV */ {PR_BOTH, PR_BOTH, PR_RIGHT, PR_RIGHT, PR_NONE, PR_NONE},
-    /* EP_UNARY */ {PR_BOTH, PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
-    /* EP_ATOM */ {PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+    /* EP_CMP */ {PR_RIGHT, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+    /* EP_ADD */ {PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+    /* EP_SUB */ {PR_BOTH, PR_RIGHT, PR_RIGHT, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+    /* EP_MUL */ {PR_BOTH, PR_BOTH, PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+    /* EP_DIV */ {PR_BOTH, PR_BOTH, PR_BOTH, PR_RIGHT, PR_RIGHT, PR_NONE, PR_NONE},
+    /* EP_UNARY */ {PR_BOTH, PR_BOTH, PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+    /* EP_ATOM */ {PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
 };
 
 class Expr {
@@ -74,11 +84,54 @@ public:
     virtual ~Expr() = default;
     virtual void Print(std::ostream& out) const = 0;
     virtual void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const = 0;
-    virtual double Evaluate(const std::function<double(Position)>& get_cell_value) const = 0;
+    virtual double Evaluate(const CellValueAccessor& cells) const = 0;
 
     // higher is tighter
     virtual ExprPrecedence GetPrecedence() const = 0;
 
+    // Emits machine code that evaluates the subtree the same way as Evaluate()
+    virtual void Compile(jit::Assembler& assembler) const = 0;
+
+    // Appends the subtree to a batch program (see batch::Program); returns false
+    // if the subtree cannot be evaluated by a batch program
+    virtual bool CompileBatch(batch::Program& /* program */, const FormulaAST& /* ast */) const {
+        return false;
+    }
+
+    // Memory used by the node and its subtree (including the original subtree of a folded node)
+    virtual size_t GetMemoryUsage() const = 0;
+
+    // Deep copy of the original (printed) subtree; copies of the referenced cells
+    // are added to cells. The copy has to be simplified again.
+    virtual std::unique_ptr<Expr> Clone(std::forward_list<CellReference>& cells, std::forward_list<CellRange>& ranges) const = 0;
+
+    // Simplifies the subtree for evaluation without changing how it is printed.
+    // Returns true if the subtree does not reference cells (and so can be folded by the parent).
+    virtual bool Simplify() = 0;
+
+    // The node that has to be evaluated instead of this one
+    // (e.g. the operand of a unary plus); printing always goes through the original tree
+    virtual const Expr* GetEvaluationNode() const {
+        return this;
+    }
+
+    // The value of the node if it is a known constant
+    virtual std::optional<double> GetConstant() const {
+        return std::nullopt;
+    }
+
+    // True if the evaluation result is known to be finite (binary operations check
+    // their results, while a cell may hold a text like "inf")
+    virtual bool IsCheckedFinite() const {
+        return false;
+    }
+
+    // True if some operands of the subtree are evaluated only depending on
+    // the values of other operands (IF, AND, OR)
+    virtual bool IsConditional() const {
+        return false;
+    }
+
     void PrintFormula(std::ostream& out, ExprPrecedence parent_precedence,
                       bool right_child = false) const {
         auto precedence = GetPrecedence();
@@ -97,6 +150,8 @@ public:
 };
 
 namespace {
+std::unique_ptr<Expr> Fold(std::unique_ptr<Expr> expr);
+
 class BinaryOpExpr final : public Expr {
 public:
     enum Type : char {
@@ -110,7 +165,9 @@ public:
     explicit BinaryOpExpr(Type type, std::unique_ptr<Expr> lhs, std::unique_ptr<Expr> rhs)
         : type_(type)
         , lhs_(std::move(lhs))
-        , rhs_(std::move(rhs)) {
+        , rhs_(std::move(rhs))
+        , lhs_eval_(lhs_.get())
+        , rhs_eval_(rhs_.get()) {
     }
 
     void Print(std::ostream& out) const override {
@@ -144,9 +201,9 @@ public:
         }
     }
 
-    double Evaluate(const std::function<double(Position)>& get_cell_value) const override {
-        double lhs_res = lhs_->Evaluate(get_cell_value);
-        double rhs_res = rhs_->Evaluate(get_cell_value);
+    double Evaluate(const CellValueAccessor& cells) const override {
+        double lhs_res = lhs_eval_->Evaluate(cells);
+        double rhs_res = rhs_eval_->Evaluate(cells);
         double res = 0.0;
         switch (type_)
         {
@@ -167,10 +224,437 @@ public:
         return res;
     }
 
+    void Compile(jit::Assembler& assembler) const override {
+        lhs_eval_->Compile(assembler);
+        assembler.PushOperand();
+        rhs_eval_->Compile(assembler);
+        assembler.BinaryOperation(static_cast<char>(type_));
+    }
+
+    bool CompileBatch(batch::Program& program, const FormulaAST& ast) const override {
+        if (!lhs_eval_->CompileBatch(program, ast) || !rhs_eval_->CompileBatch(program, ast)) {
+            return false;
+        }
+        program.BinaryOperation(static_cast<char>(type_));
+        return true;
+    }
+
+    std::unique_ptr<Expr> Clone(std::forward_list<CellReference>& cells, std::forward_list<CellRange>& ranges) const override {
+        return std::make_unique<BinaryOpExpr>(type_, lhs_->Clone(cells, ranges), rhs_->Clone(cells, ranges));
+    }
+
+    size_t GetMemoryUsage() const override {
+        return sizeof(*this) + lhs_->GetMemoryUsage() + rhs_->GetMemoryUsage();
+    }
+
+    bool Simplify() override {
+        bool lhs_constant = lhs_->Simplify();
+        bool rhs_constant = rhs_->Simplify();
+        if (lhs_constant && rhs_constant) {
+            return true;
+        }
+        if (lhs_constant) {
+            lhs_ = Fold(std::move(lhs_));
+        }
+        if (rhs_constant) {
+            rhs_ = Fold(std::move(rhs_));
+        }
+        lhs_eval_ = lhs_->GetEvaluationNode();
+        rhs_eval_ = rhs_->GetEvaluationNode();
+
+        // Identities x*1, 1*x, x/1 and x-0 give exactly x; they are applied only when
+        // x is known to be finite, otherwise this node's check turns it into #ARITHM!
+        auto is_constant = [](const Expr* expr, double value) {
+            auto constant = expr->GetConstant();
+            return constant && *constant == value && !std::signbit(*constant);
+        };
+        if (((type_ == Multiply || type_ == Divide) && is_constant(rhs_eval_, 1.0))
+            || (type_ == Subtract && is_constant(rhs_eval_, 0.0))) {
+            identity_operand_ = lhs_eval_->IsCheckedFinite() ? lhs_eval_ : nullptr;
+        } else if (type_ == Multiply && is_constant(lhs_eval_, 1.0)) {
+            identity_operand_ = rhs_eval_->IsCheckedFinite() ? rhs_eval_ : nullptr;
+        }
+        return false;
+    }
+
+    const Expr* GetEvaluationNode() const override {
+        return identity_operand_ ? identity_operand_ : this;
+    }
+
+    bool IsCheckedFinite() const override {
+        return true;
+    }
+
+    bool IsConditional() const override {
+        return lhs_->IsConditional() || rhs_->IsConditional();
+    }
+
 private:
     Type type_;
     std::unique_ptr<Expr> lhs_;
     std::unique_ptr<Expr> rhs_;
+    // Nodes evaluated in place of the operands (see Expr::GetEvaluationNode)
+    const Expr* lhs_eval_;
+    const Expr* rhs_eval_;
+    // The operand this node reduces to by an identity, if any
+    const Expr* identity_operand_ = nullptr;
+};
+
+// Comparison of two numbers: 1 if it holds, 0 otherwise
+class ComparisonExpr final : public Expr {
+public:
+    enum Type {
+        Less,
+        LessOrEqual,
+        Greater,
+        GreaterOrEqual,
+        Equal,
+        NotEqual,
+    };
+
+public:
+    explicit ComparisonExpr(Type type, std::unique_ptr<Expr> lhs, std::unique_ptr<Expr> rhs)
+        : type_(type)
+        , lhs_(std::move(lhs))
+        , rhs_(std::move(rhs))
+        , lhs_eval_(lhs_.get())
+        , rhs_eval_(rhs_.get()) {
+    }
+
+    void Print(std::ostream& out) const override {
+        out << '(' << GetSign() << ' ';
+        lhs_->Print(out);
+        out << ' ';
+        rhs_->Print(out);
+        out << ')';
+    }
+
+    void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
+        lhs_->PrintFormula(out, precedence);
+        out << GetSign();
+        rhs_->PrintFormula(out, precedence, /* right_child = */ true);
+    }
+
+    ExprPrecedence GetPrecedence() const override {
+        return EP_CMP;
+    }
+
+    double Evaluate(const CellValueAccessor& cells) const override {
+        double lhs_res = lhs_eval_->Evaluate(cells);
+        double rhs_res = rhs_eval_->Evaluate(cells);
+        bool res = false;
+        switch (type_) {
+            case Less: res = lhs_res < rhs_res; break;
+            case LessOrEqual: res = lhs_res <= rhs_res; break;
+            case Greater: res = lhs_res > rhs_res; break;
+            case GreaterOrEqual: res = lhs_res >= rhs_res; break;
+            case Equal: res = lhs_res == rhs_res; break;
+            case NotEqual: res = lhs_res != rhs_res; break;
+        }
+        return res ? 1.0 : 0.0;
+    }
+
+    void Compile(jit::Assembler& assembler) const override {
+        lhs_eval_->Compile(assembler);
+        assembler.PushOperand();
+        rhs_eval_->Compile(assembler);
+        assembler.Compare(GetSign());
+    }
+
+    std::unique_ptr<Expr> Clone(std::forward_list<CellReference>& cells, std::forward_list<CellRange>& ranges) const override {
+        return std::make_unique<ComparisonExpr>(type_, lhs_->Clone(cells, ranges), rhs_->Clone(cells, ranges));
+    }
+
+    size_t GetMemoryUsage() const override {
+        return sizeof(*this) + lhs_->GetMemoryUsage() + rhs_->GetMemoryUsage();
+    }
+
+    bool Simplify() override {
+        bool lhs_constant = lhs_->Simplify();
+        bool rhs_constant = rhs_->Simplify();
+        if (lhs_constant && rhs_constant) {
+            return true;
+        }
+        if (lhs_constant) {
+            lhs_ = Fold(std::move(lhs_));
+        }
+        if (rhs_constant) {
+            rhs_ = Fold(std::move(rhs_));
+        }
+        lhs_eval_ = lhs_->GetEvaluationNode();
+        rhs_eval_ = rhs_->GetEvaluationNode();
+        return false;
+    }
+
+    bool IsCheckedFinite() const override {
+        return true;
+    }
+
+    bool IsConditional() const override {
+        return lhs_->IsConditional() || rhs_->IsConditional();
+    }
+
+private:
+    std::string_view GetSign() const {
+        switch (type_) {
+            case Less: return "<";
+            case LessOrEqual: return "<=";
+            case Greater: return ">";
+            case GreaterOrEqual: return ">=";
+            case Equal: return "=";
+            case NotEqual: return "<>";
+        }
+        return "";
+    }
+
+private:
+    Type type_;
+    std::unique_ptr<Expr> lhs_;
+    std::unique_ptr<Expr> rhs_;
+    // Nodes evaluated in place of the operands (see Expr::GetEvaluationNode)
+    const Expr* lhs_eval_;
+    const Expr* rhs_eval_;
+};
+
+// IF(condition, then, else): only the branch selected by the condition is evaluated,
+// so the cells of the other branch are not requested. Any non-zero condition is true.
+class IfExpr final : public Expr {
+public:
+    explicit IfExpr(std::unique_ptr<Expr> condition, std::unique_ptr<Expr> then_branch,
+                    std::unique_ptr<Expr> else_branch)
+        : condition_(std::move(condition))
+        , then_(std::move(then_branch))
+        , else_(std::move(else_branch))
+        , condition_eval_(condition_.get())
+        , then_eval_(then_.get())
+        , else_eval_(else_.get()) {
+    }
+
+    void Print(std::ostream& out) const override {
+        out << "(IF ";
+        condition_->Print(out);
+        out << ' ';
+        then_->Print(out);
+        out << ' ';
+        else_->Print(out);
+        out << ')';
+    }
+
+    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
+        out << "IF(";
+        condition_->PrintFormula(out, EP_ATOM);
+        out << ',';
+        then_->PrintFormula(out, EP_ATOM);
+        out << ',';
+        else_->PrintFormula(out, EP_ATOM);
+        out << ')';
+    }
+
+    ExprPrecedence GetPrecedence() const override {
+        return EP_ATOM;
+    }
+
+    double Evaluate(const CellValueAccessor& cells) const override {
+        return condition_eval_->Evaluate(cells) != 0.0
+            ? then_eval_->Evaluate(cells)
+            : else_eval_->Evaluate(cells);
+    }
+
+    void Compile(jit::Assembler& assembler) const override {
+        auto else_label = assembler.NewLabel();
+        auto end_label = assembler.NewLabel();
+        condition_eval_->Compile(assembler);
+        assembler.JumpIfZero(else_label);
+        then_eval_->Compile(assembler);
+        assembler.Jump(end_label);
+        assembler.Bind(else_label);
+        else_eval_->Compile(assembler);
+        assembler.Bind(end_label);
+    }
+
+    std::unique_ptr<Expr> Clone(std::forward_list<CellReference>& cells, std::forward_list<CellRange>& ranges) const override {
+        return std::make_unique<IfExpr>(condition_->Clone(cells, ranges), then_->Clone(cells, ranges),
+                                        else_->Clone(cells, ranges));
+    }
+
+    size_t GetMemoryUsage() const override {
+        return sizeof(*this) + condition_->GetMemoryUsage() + then_->GetMemoryUsage() + else_->GetMemoryUsage();
+    }
+
+    bool Simplify() override {
+        bool condition_constant = condition_->Simplify();
+        bool then_constant = then_->Simplify();
+        bool else_constant = else_->Simplify();
+        if (condition_constant && then_constant && else_constant) {
+            return true;
+        }
+        if (condition_constant) {
+            condition_ = Fold(std::move(condition_));
+        }
+        if (then_constant) {
+            then_ = Fold(std::move(then_));
+        }
+        if (else_constant) {
+            else_ = Fold(std::move(else_));
+        }
+        condition_eval_ = condition_->GetEvaluationNode();
+        then_eval_ = then_->GetEvaluationNode();
+        else_eval_ = else_->GetEvaluationNode();
+        return false;
+    }
+
+    const Expr* GetEvaluationNode() const override {
+        // A constant condition selects the branch once and for all
+        auto condition = condition_eval_->GetConstant();
+        if (condition) {
+            return *condition != 0.0 ? then_eval_ : else_eval_;
+        }
+        return this;
+    }
+
+    bool IsCheckedFinite() const override {
+        return then_eval_->IsCheckedFinite() && else_eval_->IsCheckedFinite();
+    }
+
+    bool IsConditional() const override {
+        return true;
+    }
+
+private:
+    std::unique_ptr<Expr> condition_;
+    std::unique_ptr<Expr> then_;
+    std::unique_ptr<Expr> else_;
+    // Nodes evaluated in place of the operands (see Expr::GetEvaluationNode)
+    const Expr* condition_eval_;
+    const Expr* then_eval_;
+    const Expr* else_eval_;
+};
+
+// AND(...) and OR(...): 1 or 0; the operands are evaluated from left to right
+// until the result is known
+class LogicalExpr final : public Expr {
+public:
+    enum Type {
+        And,
+        Or,
+    };
+
+public:
+    explicit LogicalExpr(Type type, std::vector<std::unique_ptr<Expr>> operands)
+        : type_(type)
+        , operands_(std::move(operands)) {
+        for (const auto& operand : operands_) {
+            operands_eval_.push_back(operand.get());
+        }
+    }
+
+    void Print(std::ostream& out) const override {
+        out << '(' << GetName();
+        for (const auto& operand : operands_) {
+            out << ' ';
+            operand->Print(out);
+        }
+        out << ')';
+    }
+
+    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
+        out << GetName() << '(';
+        bool first = true;
+        for (const auto& operand : operands_) {
+            if (!first) {
+                out << ',';
+            }
+            first = false;
+            operand->PrintFormula(out, EP_ATOM);
+        }
+        out << ')';
+    }
+
+    ExprPrecedence GetPrecedence() const override {
+        return EP_ATOM;
+    }
+
+    double Evaluate(const CellValueAccessor& cells) const override {
+        // AND stops at the first false operand, OR at the first true one
+        bool stop_value = type_ == Or;
+        for (auto operand : operands_eval_) {
+            if ((operand->Evaluate(cells) != 0.0) == stop_value) {
+                return stop_value ? 1.0 : 0.0;
+            }
+        }
+        return stop_value ? 0.0 : 1.0;
+    }
+
+    void Compile(jit::Assembler& assembler) const override {
+        auto stop_label = assembler.NewLabel();
+        auto end_label = assembler.NewLabel();
+        for (auto operand : operands_eval_) {
+            operand->Compile(assembler);
+            if (type_ == Or) {
+                assembler.JumpIfNonZero(stop_label);
+            } else {
+                assembler.JumpIfZero(stop_label);
+            }
+        }
+        assembler.LoadConstant(type_ == Or ? 0.0 : 1.0);
+        assembler.Jump(end_label);
+        assembler.Bind(stop_label);
+        assembler.LoadConstant(type_ == Or ? 1.0 : 0.0);
+        assembler.Bind(end_label);
+    }
+
+    std::unique_ptr<Expr> Clone(std::forward_list<CellReference>& cells, std::forward_list<CellRange>& ranges) const override {
+        std::vector<std::unique_ptr<Expr>> operands;
+        for (const auto& operand : operands_) {
+            operands.push_back(operand->Clone(cells, ranges));
+        }
+        return std::make_unique<LogicalExpr>(type_, std::move(operands));
+    }
+
+    size_t GetMemoryUsage() const override {
+        size_t usage = sizeof(*this) + operands_.capacity() * sizeof(operands_[0])
+            + operands_eval_.capacity() * sizeof(operands_eval_[0]);
+        for (const auto& operand : operands_) {
+            usage += operand->GetMemoryUsage();
+        }
+        return usage;
+    }
+
+    bool Simplify() override {
+        std::vector<bool> constant;
+        for (auto& operand : operands_) {
+            constant.push_back(operand->Simplify());
+        }
+        if (std::find(constant.begin(), constant.end(), false) == constant.end()) {
+            return true;
+        }
+        for (size_t i = 0; i < operands_.size(); ++i) {
+            if (constant[i]) {
+                operands_[i] = Fold(std::move(operands_[i]));
+            }
+            operands_eval_[i] = operands_[i]->GetEvaluationNode();
+        }
+        return false;
+    }
+
+    bool IsCheckedFinite() const override {
+        return true;
+    }
+
+    bool IsConditional() const override {
+        return true;
+    }
+
+private:
+    std::string_view GetName() const {
+        return type_ == And ? "AND" : "OR";
+    }
+
+private:
+    Type type_;
+    std::vector<std::unique_ptr<Expr>> operands_;
+    // Nodes evaluated in place of the operands (see Expr::GetEvaluationNode)
+    std::vector<const Expr*> operands_eval_;
 };
 
 class UnaryOpExpr final : public Expr {
@@ -183,7 +667,8 @@ public:
 public:
     explicit UnaryOpExpr(Type type, std::unique_ptr<Expr> operand)
         : type_(type)
-        , operand_(std::move(operand)) {
+        , operand_(std::move(operand))
+        , operand_eval_(operand_.get()) {
     }
 
     void Print(std::ostream& out) const override {
@@ -201,28 +686,87 @@ public:
         return EP_UNARY;
     }
 
-    double Evaluate(const std::function<double(Position)>& get_cell_value) const override {
-        double res = operand_->Evaluate(get_cell_value);
+    double Evaluate(const CellValueAccessor& cells) const override {
+        double res = operand_eval_->Evaluate(cells);
         return type_ == Type::UnaryMinus ? -res : res;
     }
 
+    void Compile(jit::Assembler& assembler) const override {
+        operand_eval_->Compile(assembler);
+        if (type_ == UnaryMinus) {
+            assembler.Negate();
+        }
+    }
+
+    bool CompileBatch(batch::Program& program, const FormulaAST& ast) const override {
+        if (!operand_eval_->CompileBatch(program, ast)) {
+            return false;
+        }
+        if (type_ == UnaryMinus) {
+            program.Negate();
+        }
+        return true;
+    }
+
+    std::unique_ptr<Expr> Clone(std::forward_list<CellReference>& cells, std::forward_list<CellRange>& ranges) const override {
+        return std::make_unique<UnaryOpExpr>(type_, operand_->Clone(cells, ranges));
+    }
+
+    size_t GetMemoryUsage() const override {
+        return sizeof(*this) + operand_->GetMemoryUsage();
+    }
+
+    bool Simplify() override {
+        if (operand_->Simplify()) {
+            return true;
+        }
+        operand_eval_ = operand_->GetEvaluationNode();
+        return false;
+    }
+
+    const Expr* GetEvaluationNode() const override {
+        if (type_ == UnaryPlus) {
+            return operand_eval_;
+        }
+        // -(-x) is exactly x
+        auto operand = dynamic_cast<const UnaryOpExpr*>(operand_eval_);
+        if (operand && operand->type_ == UnaryMinus) {
+            return operand->operand_eval_;
+        }
+        return this;
+    }
+
+    bool IsCheckedFinite() const override {
+        return operand_eval_->IsCheckedFinite();
+    }
+
+    bool IsConditional() const override {
+        return operand_->IsConditional();
+    }
+
 private:
     Type type_;
     std::unique_ptr<Expr> operand_;
+    // Node evaluated in place of the operand (see Expr::GetEvaluationNode)
+    const Expr* operand_eval_;
 };
 
 class CellExpr final : public Expr {
 public:
-    explicit CellExpr(const Position* cell)
+    explicit CellExpr(const CellReference* cell)
         : cell_(cell) {
     }
 
     void Print(std::ostream& out) const override {
-        if (!cell_->IsValid()) {
+        if (!cell_->pos.IsValid()) {
             out << FormulaError::Category::Ref;
-        } else {
-            out << cell_->ToString();
+            return;
         }
+        if (!cell_->sheet.empty()) {
+            out << cell_->sheet << CellReference::SHEET_SEPARATOR;
+        }
+        char buffer[Position::MAX_STRING_LENGTH];
+        out.write(buffer, cell_->pos.ToChars(buffer));
     }
 
     void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
@@ -233,12 +777,39 @@ public:
         return EP_ATOM;
     }
 
-    double Evaluate(const std::function<double(Position)>& get_cell_value) const override {
-        return get_cell_value(*cell_);
+    double Evaluate(const CellValueAccessor& cells) const override {
+        return cells.get_value(*cell_);
+    }
+
+    void Compile(jit::Assembler& assembler) const override {
+        assembler.LoadCell(cell_);
+    }
+
+    bool CompileBatch(batch::Program& program, const FormulaAST& ast) const override {
+        // Batches are gathered from the cells of the formula's own sheet
+        if (cell_->IsExternal() || !cell_->pos.IsValid()) {
+            return false;
+        }
+        program.LoadCell(ast.GetCellSlot(*cell_));
+        return true;
+    }
+
+    std::unique_ptr<Expr> Clone(std::forward_list<CellReference>& cells,
+                                std::forward_list<CellRange>& /* ranges */) const override {
+        cells.push_front(*cell_);
+        return std::make_unique<CellExpr>(&cells.front());
+    }
+
+    size_t GetMemoryUsage() const override {
+        return sizeof(*this);
+    }
+
+    bool Simplify() override {
+        return false;
     }
 
 private:
-    const Position* cell_;
+    const CellReference* cell_;
 };
 
 class NumberExpr final : public Expr {
@@ -259,14 +830,415 @@ public:
         return EP_ATOM;
     }
 
-    double Evaluate(const std::function<double(Position)>& get_cell_value) const override {
+    double Evaluate(const CellValueAccessor& cells) const override {
+        return value_;
+    }
+
+    void Compile(jit::Assembler& assembler) const override {
+        assembler.LoadConstant(value_);
+    }
+
+    bool CompileBatch(batch::Program& program, const FormulaAST& /* ast */) const override {
+        program.LoadConstant(value_);
+        return true;
+    }
+
+    std::unique_ptr<Expr> Clone(std::forward_list<CellReference>& /* cells */, std::forward_list<CellRange>& /* ranges */) const override {
+        return std::make_unique<NumberExpr>(value_);
+    }
+
+    size_t GetMemoryUsage() const override {
+        return sizeof(*this);
+    }
+
+    bool Simplify() override {
+        return true;
+    }
+
+    std::optional<double> GetConstant() const override {
         return value_;
     }
 
+    bool IsCheckedFinite() const override {
+        return true;
+    }
+
 private:
     double value_;
 };
 
+// Evaluates a node by the interpreter from compiled code
+double EvaluateNode(const void* node, const CellValueAccessor& cells) {
+    return static_cast<const Expr*>(node)->Evaluate(cells);
+}
+
+void PrintRange(std::ostream& out, const CellRange& range) {
+    if (!range.IsValid()) {
+        out << FormulaError::Category::Ref;
+        return;
+    }
+    if (!range.sheet.empty()) {
+        out << range.sheet << CellReference::SHEET_SEPARATOR;
+    }
+    char buffer[Position::MAX_STRING_LENGTH];
+    out.write(buffer, range.first.ToChars(buffer));
+    out << CellRange::RANGE_SEPARATOR;
+    out.write(buffer, range.last.ToChars(buffer));
+}
+
+// Exact-match lookup functions; the key is searched in the first column of the range
+// through CellValueAccessor::find_value (an index of the sheet):
+//   MATCH(key, range) - the row number of the match within the range;
+//   VLOOKUP(key, range, column) - the value of the column-th column of the range in the matching row;
+//   XLOOKUP(key, range, result_range[, if_not_found]) - the value of result_range in the matching row.
+// If nothing matches, the result is #N/A (or if_not_found, evaluated only in this case).
+class LookupExpr final : public Expr {
+public:
+    enum Type {
+        Match,
+        VLookup,
+        XLookup,
+    };
+
+public:
+    explicit LookupExpr(Type type, std::unique_ptr<Expr> key, const CellRange* range,
+                        const CellRange* result_range = nullptr, std::unique_ptr<Expr> extra = nullptr)
+        : type_(type)
+        , key_(std::move(key))
+        , range_(range)
+        , result_range_(result_range)
+        , extra_(std::move(extra))
+        , key_eval_(key_.get())
+        , extra_eval_(extra_.get()) {
+    }
+
+    void Print(std::ostream& out) const override {
+        out << '(' << GetName() << ' ';
+        key_->Print(out);
+        out << ' ';
+        PrintRange(out, *range_);
+        if (result_range_) {
+            out << ' ';
+            PrintRange(out, *result_range_);
+        }
+        if (extra_) {
+            out << ' ';
+            extra_->Print(out);
+        }
+        out << ')';
+    }
+
+    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
+        out << GetName() << '(';
+        key_->PrintFormula(out, EP_ATOM);
+        out << ',';
+        PrintRange(out, *range_);
+        if (result_range_) {
+            out << ',';
+            PrintRange(out, *result_range_);
+        }
+        if (extra_) {
+            out << ',';
+            extra_->PrintFormula(out, EP_ATOM);
+        }
+        out << ')';
+    }
+
+    ExprPrecedence GetPrecedence() const override {
+        return EP_ATOM;
+    }
+
+    double Evaluate(const CellValueAccessor& cells) const override {
+        double key = key_eval_->Evaluate(cells);
+        if (!range_->IsValid() || (result_range_ && !result_range_->IsValid())) {
+            throw FormulaErrorException("lookup range error", FormulaError::Category::Ref);
+        }
+        // Deleted rows shrink each range on its own, so the rows of the ranges may no
+        // longer correspond to each other
+        if (result_range_
+            && result_range_->last.row - result_range_->first.row != range_->last.row - range_->first.row) {
+            throw FormulaErrorException("lookup ranges differ in height", FormulaError::Category::Ref);
+        }
+        auto found = cells.find_value(*range_, key);
+        if (!found) {
+            if (type_ == XLookup && extra_eval_) {
+                return extra_eval_->Evaluate(cells);
+            }
+            throw FormulaErrorException("lookup value not found", FormulaError::Category::NotAvailable);
+        }
+        int offset = found->row - range_->first.row;
+        switch (type_) {
+            case Match:
+                return offset + 1;
+            case VLookup: {
+                double column = std::floor(extra_eval_->Evaluate(cells));
+                if (!(column >= 1.0)) {
+                    throw FormulaErrorException("lookup column error", FormulaError::Category::Value);
+                }
+                if (column > range_->last.col - range_->first.col + 1) {
+                    throw FormulaErrorException("lookup column error", FormulaError::Category::Ref);
+                }
+                Position pos{found->row, range_->first.col + static_cast<int>(column) - 1};
+                return cells.get_range_value(*range_, pos);
+            }
+            case XLookup: {
+                Position pos{result_range_->first.row + offset, result_range_->first.col};
+                return cells.get_range_value(*result_range_, pos);
+            }
+        }
+        return 0.0;
+    }
+
+    void Compile(jit::Assembler& assembler) const override {
+        // The search goes through the index of the sheet anyway
+        assembler.EvaluateNode(&EvaluateNode, this);
+    }
+
+    std::unique_ptr<Expr> Clone(std::forward_list<CellReference>& cells,
+                                std::forward_list<CellRange>& ranges) const override {
+        ranges.push_front(*range_);
+        auto range = &ranges.front();
+        const CellRange* result_range = nullptr;
+        if (result_range_) {
+            ranges.push_front(*result_range_);
+            result_range = &ranges.front();
+        }
+        return std::make_unique<LookupExpr>(type_, key_->Clone(cells, ranges), range, result_range,
+                                            extra_ ? extra_->Clone(cells, ranges) : nullptr);
+    }
+
+    size_t GetMemoryUsage() const override {
+        return sizeof(*this) + key_->GetMemoryUsage() + (extra_ ? extra_->GetMemoryUsage() : 0);
+    }
+
+    bool Simplify() override {
+        if (key_->Simplify()) {
+            key_ = Fold(std::move(key_));
+        }
+        key_eval_ = key_->GetEvaluationNode();
+        if (extra_) {
+            if (extra_->Simplify()) {
+                extra_ = Fold(std::move(extra_));
+            }
+            extra_eval_ = extra_->GetEvaluationNode();
+        }
+        return false;
+    }
+
+    bool IsConditional() const override {
+        // The cells of the ranges are requested depending on the key
+        return true;
+    }
+
+private:
+    std::string_view GetName() const {
+        switch (type_) {
+            case Match: return "MATCH";
+            case VLookup: return "VLOOKUP";
+            case XLookup: return "XLOOKUP";
+        }
+        return "";
+    }
+
+private:
+    Type type_;
+    std::unique_ptr<Expr> key_;
+    const CellRange* range_;
+    const CellRange* result_range_;
+    // The column of VLOOKUP or if_not_found of XLOOKUP
+    std::unique_ptr<Expr> extra_;
+    // Nodes evaluated in place of the operands (see Expr::GetEvaluationNode)
+    const Expr* key_eval_;
+    const Expr* extra_eval_;
+};
+
+// Aggregate functions of a range: SUM, COUNT and AVERAGE of the numeric values
+// (numbers and numeric text) of its cells. The totals come from
+// CellValueAccessor::aggregate (maintained incrementally by the sheet).
+// An error in the range is the result; AVERAGE of no numbers is #ARITHM!.
+class AggregateExpr final : public Expr {
+public:
+    enum Type {
+        Sum,
+        Count,
+        Average,
+    };
+
+public:
+    explicit AggregateExpr(Type type, const CellRange* range)
+        : type_(type)
+        , range_(range) {
+    }
+
+    void Print(std::ostream& out) const override {
+        out << '(' << GetName() << ' ';
+        PrintRange(out, *range_);
+        out << ')';
+    }
+
+    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
+        out << GetName() << '(';
+        PrintRange(out, *range_);
+        out << ')';
+    }
+
+    ExprPrecedence GetPrecedence() const override {
+        return EP_ATOM;
+    }
+
+    double Evaluate(const CellValueAccessor& cells) const override {
+        if (!range_->IsValid()) {
+            throw FormulaErrorException("aggregate range error", FormulaError::Category::Ref);
+        }
+        auto totals = cells.aggregate(*range_);
+        if (totals.error) {
+            throw FormulaErrorException("aggregate value error", totals.error->GetCategory());
+        }
+        double result = 0.0;
+        switch (type_) {
+            case Sum:
+                result = totals.sum;
+                break;
+            case Count:
+                return static_cast<double>(totals.count);
+            case Average:
+                result = totals.sum / static_cast<double>(totals.count);
+                break;
+        }
+        if (!std::isfinite(result)) {
+            throw FormulaErrorException("aggregate arithmetic error", FormulaError::Category::Arithmetic);
+        }
+        return result;
+    }
+
+    void Compile(jit::Assembler& assembler) const override {
+        // The totals are maintained by the sheet
+        assembler.EvaluateNode(&EvaluateNode, this);
+    }
+
+    std::unique_ptr<Expr> Clone(std::forward_list<CellReference>& /* cells */,
+                                std::forward_list<CellRange>& ranges) const override {
+        ranges.push_front(*range_);
+        return std::make_unique<AggregateExpr>(type_, &ranges.front());
+    }
+
+    size_t GetMemoryUsage() const override {
+        return sizeof(*this);
+    }
+
+    bool Simplify() override {
+        return false;
+    }
+
+    bool IsConditional() const override {
+        // The cells of the range are requested by the sheet, not through references
+        return true;
+    }
+
+private:
+    std::string_view GetName() const {
+        switch (type_) {
+            case Sum: return "SUM";
+            case Count: return "COUNT";
+            case Average: return "AVERAGE";
+        }
+        return "";
+    }
+
+private:
+    Type type_;
+    const CellRange* range_;
+};
+
+// A constant subtree evaluated at parse time: prints as the original subtree,
+// evaluates to the precomputed value
+class FoldedExpr final : public Expr {
+public:
+    explicit FoldedExpr(double value, std::unique_ptr<Expr> source)
+        : value_(value)
+        , source_(std::move(source)) {
+    }
+
+    void Print(std::ostream& out) const override {
+        source_->Print(out);
+    }
+
+    void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
+        source_->DoPrintFormula(out, precedence);
+    }
+
+    ExprPrecedence GetPrecedence() const override {
+        return source_->GetPrecedence();
+    }
+
+    double Evaluate(const CellValueAccessor& /* cells */) const override {
+        return value_;
+    }
+
+    void Compile(jit::Assembler& assembler) const override {
+        assembler.LoadConstant(value_);
+    }
+
+    bool CompileBatch(batch::Program& program, const FormulaAST& /* ast */) const override {
+        program.LoadConstant(value_);
+        return true;
+    }
+
+    std::unique_ptr<Expr> Clone(std::forward_list<CellReference>& cells, std::forward_list<CellRange>& ranges) const override {
+        return std::make_unique<FoldedExpr>(value_, source_->Clone(cells, ranges));
+    }
+
+    size_t GetMemoryUsage() const override {
+        return sizeof(*this) + source_->GetMemoryUsage();
+    }
+
+    bool Simplify() override {
+        return true;
+    }
+
+    std::optional<double> GetConstant() const override {
+        return value_;
+    }
+
+    bool IsCheckedFinite() const override {
+        return std::isfinite(value_);
+    }
+
+private:
+    double value_;
+    std::unique_ptr<Expr> source_;
+};
+
+// Replaces a subtree without cell references with its value. Subtrees whose
+// evaluation fails (division by zero, overflow) are kept, so the error is
+// reported at evaluation time as before.
+std::unique_ptr<Expr> Fold(std::unique_ptr<Expr> expr) {
+    if (dynamic_cast<NumberExpr*>(expr.get()) || dynamic_cast<FoldedExpr*>(expr.get())) {
+        return expr;
+    }
+    double value = 0.0;
+    try {
+        CellValueAccessor no_cells{
+            [](const CellReference&) -> double {
+                throw FormulaErrorException("constant subtree references a cell", FormulaError::Category::Ref);
+            },
+            [](const CellRange&, Position) -> double {
+                throw FormulaErrorException("constant subtree references a range", FormulaError::Category::Ref);
+            },
+            [](const CellRange&, double) -> std::optional<Position> {
+                throw FormulaErrorException("constant subtree references a range", FormulaError::Category::Ref);
+            },
+            [](const CellRange&) -> RangeTotals {
+                throw FormulaErrorException("constant subtree references a range", FormulaError::Category::Ref);
+            },
+        };
+        value = expr->Evaluate(no_cells);
+    } catch (const FormulaErrorException&) {
+        return expr;
+    }
+    return std::make_unique<FoldedExpr>(value, std::move(expr));
+}
+
 class ParseASTListener final : public FormulaBaseListener {
 public:
     std::unique_ptr<Expr> MoveRoot() {
@@ -277,10 +1249,14 @@ public:
         return root;
     }
 
-    std::forward_list<Position> MoveCells() {
+    std::forward_list<CellReference> MoveCells() {
         return std::move(cells_);
     }
 
+    std::forward_list<CellRange> MoveRanges() {
+        return std::move(ranges_);
+    }
+
 public:
     void exitUnaryOp(FormulaParser::UnaryOpContext* ctx) override {
         assert(args_.size() >= 1);
@@ -314,12 +1290,12 @@ public:
 
     void exitCell(FormulaParser::CellContext* ctx) override {
         auto value_str = ctx->CELL()->getSymbol()->getText();
-        auto value = Position::FromString(value_str);
-        if (!value.IsValid()) {
+        auto value = CellReference::FromString(value_str);
+        if (!value.pos.IsValid()) {
             throw FormulaException("Invalid position: " + value_str);
         }
 
-        cells_.push_front(value);
+        cells_.push_front(std::move(value));
         auto node = std::make_unique<CellExpr>(&cells_.front());
         args_.push_back(std::move(node));
     }
@@ -348,13 +1324,141 @@ public:
         args_.back() = std::move(node);
     }
 
+    void exitComparison(FormulaParser::ComparisonContext* ctx) override {
+        assert(args_.size() >= 2);
+
+        auto rhs = std::move(args_.back());
+        args_.pop_back();
+
+        auto lhs = std::move(args_.back());
+
+        ComparisonExpr::Type type;
+        if (ctx->LT()) {
+            type = ComparisonExpr::Less;
+        } else if (ctx->LE()) {
+            type = ComparisonExpr::LessOrEqual;
+        } else if (ctx->GT()) {
+            type = ComparisonExpr::Greater;
+        } else if (ctx->GE()) {
+            type = ComparisonExpr::GreaterOrEqual;
+        } else if (ctx->EQ()) {
+            type = ComparisonExpr::Equal;
+        } else {
+            assert(ctx->NE() != nullptr);
+            type = ComparisonExpr::NotEqual;
+        }
+
+        auto node = std::make_unique<ComparisonExpr>(type, std::move(lhs), std::move(rhs));
+        args_.back() = std::move(node);
+    }
+
+    void exitIf(FormulaParser::IfContext* /* ctx */) override {
+        assert(args_.size() >= 3);
+
+        auto else_branch = std::move(args_.back());
+        args_.pop_back();
+        auto then_branch = std::move(args_.back());
+        args_.pop_back();
+
+        auto condition = std::move(args_.back());
+
+        auto node = std::make_unique<IfExpr>(std::move(condition), std::move(then_branch), std::move(else_branch));
+        args_.back() = std::move(node);
+    }
+
+    void exitLogical(FormulaParser::LogicalContext* ctx) override {
+        auto count = ctx->expr().size();
+        assert(args_.size() >= count);
+
+        std::vector<std::unique_ptr<Expr>> operands(std::make_move_iterator(args_.end() - count),
+                                                    std::make_move_iterator(args_.end()));
+        args_.resize(args_.size() - count);
+
+        LogicalExpr::Type type;
+        if (ctx->AND()) {
+            type = LogicalExpr::And;
+        } else {
+            assert(ctx->OR() != nullptr);
+            type = LogicalExpr::Or;
+        }
+
+        args_.push_back(std::make_unique<LogicalExpr>(type, std::move(operands)));
+    }
+
+    void exitLookup(FormulaParser::LookupContext* ctx) override {
+        auto count = ctx->expr().size();
+        assert(args_.size() >= count);
+
+        std::vector<const CellRange*> ranges;
+        for (auto range_token : ctx->RANGE()) {
+            auto value_str = range_token->getSymbol()->getText();
+            auto value = CellRange::FromString(value_str);
+            if (!value.IsValid()) {
+                throw FormulaException("Invalid range: " + value_str);
+            }
+            ranges_.push_front(std::move(value));
+            ranges.push_back(&ranges_.front());
+        }
+
+        std::unique_ptr<Expr> extra;
+        if (count == 2) {
+            extra = std::move(args_.back());
+            args_.pop_back();
+        }
+        auto key = std::move(args_.back());
+
+        auto is_column = [](const CellRange* range) {
+            return range->first.col == range->last.col;
+        };
+        std::unique_ptr<Expr> node;
+        if (ctx->MATCH()) {
+            if (!is_column(ranges[0])) {
+                throw FormulaException("MATCH range must be a single column");
+            }
+            node = std::make_unique<LookupExpr>(LookupExpr::Match, std::move(key), ranges[0]);
+        } else if (ctx->VLOOKUP()) {
+            node = std::make_unique<LookupExpr>(LookupExpr::VLookup, std::move(key), ranges[0], nullptr,
+                                                std::move(extra));
+        } else {
+            assert(ctx->XLOOKUP() != nullptr);
+            if (!is_column(ranges[0]) || !is_column(ranges[1])
+                || ranges[0]->last.row - ranges[0]->first.row != ranges[1]->last.row - ranges[1]->first.row) {
+                throw FormulaException("XLOOKUP ranges must be single columns of the same height");
+            }
+            node = std::make_unique<LookupExpr>(LookupExpr::XLookup, std::move(key), ranges[0], ranges[1],
+                                                std::move(extra));
+        }
+        args_.back() = std::move(node);
+    }
+
+    void exitAggregate(FormulaParser::AggregateContext* ctx) override {
+        auto value_str = ctx->RANGE()->getSymbol()->getText();
+        auto value = CellRange::FromString(value_str);
+        if (!value.IsValid()) {
+            throw FormulaException("Invalid range: " + value_str);
+        }
+        ranges_.push_front(std::move(value));
+
+        AggregateExpr::Type type;
+        if (ctx->SUM()) {
+            type = AggregateExpr::Sum;
+        } else if (ctx->COUNT()) {
+            type = AggregateExpr::Count;
+        } else {
+            assert(ctx->AVERAGE() != nullptr);
+            type = AggregateExpr::Average;
+        }
+        args_.push_back(std::make_unique<AggregateExpr>(type, &ranges_.front()));
+    }
+
     void visitErrorNode(antlr4::tree::ErrorNode* node) override {
         throw ParsingError("Error when parsing: " + node->getSymbol()->getText());
     }
 
 private:
     std::vector<std::unique_ptr<Expr>> args_;
-    std::forward_list<Position> cells_;
+    std::forward_list<CellReference> cells_;
+    std::forward_list<CellRange> ranges_;
 };
 
 class BailErrorListener : public antlr4::BaseErrorListener {
@@ -367,41 +1471,148 @@ public:
     }
 };
 
-}  // namespace
-}  // namespace ASTImpl
+// Prediction caches (DFA and prediction contexts) of one lexer and one parser.
+// ANTLR 4.7 extends the caches that all recognizers of a grammar share by default
+// without synchronization, so every thread predicts with caches of its own. Caches
+// of finished threads are kept in a pool: worker threads of the next batch start
+// with the DFA built by the previous ones instead of an empty one
+class PredictionCaches {
+public:
+    PredictionCaches(const antlr4::atn::ATN& lexer_atn, const antlr4::atn::ATN& parser_atn) {
+        for (size_t i = 0; i < lexer_atn.getNumberOfDecisions(); ++i) {
+            lexer_dfa_.emplace_back(lexer_atn.getDecisionState(i), i);
+        }
+        for (size_t i = 0; i < parser_atn.getNumberOfDecisions(); ++i) {
+            parser_dfa_.emplace_back(parser_atn.getDecisionState(i), i);
+        }
+    }
 
-FormulaAST ParseFormulaAST(std::istream& in) {
-    using namespace antlr4;
+    // Caches of a finished thread, or new ones if every cached set is in use
+    static std::unique_ptr<PredictionCaches> Acquire(const antlr4::atn::ATN& lexer_atn,
+                                                     const antlr4::atn::ATN& parser_atn) {
+        {
+            std::lock_guard lock(GetPoolMutex());
+            auto& pool = GetPool();
+            if (!pool.empty()) {
+                auto caches = std::move(pool.back());
+                pool.pop_back();
+                return caches;
+            }
+        }
+        return std::make_unique<PredictionCaches>(lexer_atn, parser_atn);
+    }
 
-    ANTLRInputStream input(in);
+    static void Release(std::unique_ptr<PredictionCaches> caches) {
+        std::lock_guard lock(GetPoolMutex());
+        GetPool().push_back(std::move(caches));
+    }
 
-    FormulaLexer lexer(&input);
-    ASTImpl::BailErrorListener error_listener;
-    lexer.removeErrorListeners();
-    lexer.addErrorListener(&error_listener);
+    // Replaces the interpreters of the recognizers (which use the shared caches)
+    void Install(FormulaLexer& lexer, FormulaParser& parser) {
+        auto lexer_interpreter = lexer.getInterpreter<antlr4::atn::LexerATNSimulator>();
+        lexer.setInterpreter(new antlr4::atn::LexerATNSimulator(&lexer, lexer.getATN(), lexer_dfa_, lexer_contexts_));
+        delete lexer_interpreter;
+        auto parser_interpreter = parser.getInterpreter<antlr4::atn::ParserATNSimulator>();
+        parser.setInterpreter(new antlr4::atn::ParserATNSimulator(&parser, parser.getATN(), parser_dfa_, parser_contexts_));
+        delete parser_interpreter;
+    }
 
-    CommonTokenStream tokens(&lexer);
+private:
+    static std::mutex& GetPoolMutex() {
+        static std::mutex mutex;
+        return mutex;
+    }
 
-    FormulaParser parser(&tokens);
-    auto error_handler = std::make_shared<BailErrorStrategy>();
-    parser.setErrorHandler(error_handler);
-    parser.removeErrorListeners();
+    static std::vector<std::unique_ptr<PredictionCaches>>& GetPool() {
+        static std::vector<std::unique_ptr<PredictionCaches>> pool;
+        return pool;
+    }
 
-    tree::ParseTree* tree = parser.main();
-    ASTImpl::ParseASTListener listener;
-    tree::ParseTreeWalker::DEFAULT.walk(&listener, tree);
+private:
+    std::vector<antlr4::dfa::DFA> lexer_dfa_;
+    antlr4::atn::PredictionContextCache lexer_contexts_;
+    std::vector<antlr4::dfa::DFA> parser_dfa_;
+    antlr4::atn::PredictionContextCache parser_contexts_;
+};
+
+// Lexer and parser of the current thread, reused for every formula parsed on it:
+// setting a new input resets them instead of constructing them anew. They share
+// nothing mutable with other threads, so formulas are parsed on several threads at once
+class ThreadParser {
+public:
+    ThreadParser() :
+        lexer_(&input_),
+        tokens_(&lexer_),
+        parser_(&tokens_)
+    {
+        lexer_.removeErrorListeners();
+        lexer_.addErrorListener(&error_listener_);
+        parser_.setErrorHandler(std::make_shared<antlr4::BailErrorStrategy>());
+        parser_.removeErrorListeners();
+        caches_.caches = PredictionCaches::Acquire(lexer_.getATN(), parser_.getATN());
+        caches_.caches->Install(lexer_, parser_);
+    }
+
+    static ThreadParser& Get() {
+        static thread_local ThreadParser parser;
+        return parser;
+    }
+
+    FormulaAST Parse(const std::string& text) {
+        input_.load(text);
+        lexer_.setInputStream(&input_);
+        tokens_.setTokenSource(&lexer_);
+        parser_.setTokenStream(&tokens_);
+        antlr4::tree::ParseTree* tree = parser_.main();
 
-    return FormulaAST(listener.MoveRoot(), listener.MoveCells());
+        ParseASTListener listener;
+        antlr4::tree::ParseTreeWalker::DEFAULT.walk(&listener, tree);
+
+        FormulaAST ast(listener.MoveRoot(), listener.MoveCells(), listener.MoveRanges());
+        ast.Simplify();
+        return ast;
+    }
+
+private:
+    // Returns the caches to the pool after the recognizers using them are destroyed
+    struct CachesLease {
+        std::unique_ptr<PredictionCaches> caches;
+
+        ~CachesLease() {
+            if (caches) {
+                PredictionCaches::Release(std::move(caches));
+            }
+        }
+    };
+
+private:
+    CachesLease caches_;
+    antlr4::ANTLRInputStream input_;
+    BailErrorListener error_listener_;
+    FormulaLexer lexer_;
+    antlr4::CommonTokenStream tokens_;
+    FormulaParser parser_;
+};
+
+}  // namespace
+}  // namespace ASTImpl
+
+FormulaAST ParseFormulaAST(std::istream& in) {
+    return ParseFormulaAST(std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>()));
 }
 
 FormulaAST ParseFormulaAST(const std::string& in_str) {
-    std::istringstream in(in_str);
-    return ParseFormulaAST(in);
+    return ASTImpl::ThreadParser::Get().Parse(in_str);
 }
 
 void FormulaAST::PrintCells(std::ostream& out) const {
-    for (auto cell : cells_) {
-        out << cell.ToString() << ' ';
+    char buffer[Position::MAX_STRING_LENGTH];
+    for (const auto& cell : cells_) {
+        if (!cell.sheet.empty()) {
+            out << cell.sheet << CellReference::SHEET_SEPARATOR;
+        }
+        out.write(buffer, cell.pos.ToChars(buffer));
+        out << ' ';
     }
 }
 
@@ -413,14 +1624,81 @@ void FormulaAST::PrintFormula(std::ostream& out) const {
     root_expr_->PrintFormula(out, ASTImpl::EP_ATOM);
 }
 
-double FormulaAST::Execute(const std::function<double(Position)>& get_cell_value) const {
-    return root_expr_->Evaluate(get_cell_value);
+double FormulaAST::Execute(const CellValueAccessor& cells) const {
+    if (jit::IsEnabled()) {
+        if (compiled_) {
+            return compiled_->Execute(cells);
+        }
+        if (++execution_count_ == jit::GetThreshold()) {
+            jit::Assembler assembler;
+            root_eval_->Compile(assembler);
+            // при неудаче формула остаётся в интерпретаторе
+            compiled_ = assembler.Finish();
+        }
+    }
+    return root_eval_->Evaluate(cells);
+}
+
+size_t FormulaAST::GetNodesMemoryUsage() const {
+    return root_expr_->GetMemoryUsage() + (compiled_ ? sizeof(*compiled_) + compiled_->GetSize() : 0)
+        + (batch_program_ ? batch_program_->GetMemoryUsage() : 0);
+}
+
+size_t FormulaAST::GetCellsMemoryUsage() const {
+    size_t usage = 0;
+    for (const auto& cell : cells_) {
+        // узел списка: указатель на следующий узел и ссылка
+        usage += sizeof(void*) + sizeof(CellReference) + memory_usage::StringHeapSize(cell.sheet);
+    }
+    usage += cell_slots_.capacity() * sizeof(const CellReference*);
+    for (const auto& range : ranges_) {
+        usage += sizeof(void*) + sizeof(CellRange) + memory_usage::StringHeapSize(range.sheet);
+    }
+    return usage;
+}
+
+FormulaAST FormulaAST::Clone() const {
+    std::forward_list<CellReference> cells;
+    std::forward_list<CellRange> ranges;
+    auto root = root_expr_->Clone(cells, ranges);
+    FormulaAST ast(std::move(root), std::move(cells), std::move(ranges));
+    ast.Simplify();
+    return ast;
 }
 
-FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_list<Position> cells)
+void FormulaAST::Simplify() {
+    if (root_expr_->Simplify()) {
+        root_expr_ = ASTImpl::Fold(std::move(root_expr_));
+    }
+    root_eval_ = root_expr_->GetEvaluationNode();
+    conditional_ = root_expr_->IsConditional();
+
+    auto program = std::make_unique<batch::Program>();
+    if (root_eval_->CompileBatch(*program, *this)) {
+        batch_program_ = std::move(program);
+    }
+}
+
+FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_list<CellReference> cells,
+                       std::forward_list<CellRange> ranges)
     : root_expr_(std::move(root_expr))
-    , cells_(std::move(cells)) {
+    , root_eval_(root_expr_.get())
+    , cells_(std::move(cells))
+    , ranges_(std::move(ranges)) {
     cells_.sort();  // to avoid sorting in GetReferencedCells
+    cell_slots_.reserve(std::distance(cells_.begin(), cells_.end()));
+    for (const auto& cell : cells_) {
+        cell_slots_.push_back(&cell);
+    }
+    std::sort(cell_slots_.begin(), cell_slots_.end(), std::less<const CellReference*>());
+}
+
+size_t FormulaAST::GetCellSlot(const CellReference& cell) const {
+    auto it = std::lower_bound(cell_slots_.begin(), cell_slots_.end(), &cell, std::less<const CellReference*>());
+    assert(it != cell_slots_.end() && *it == &cell);
+    return it - cell_slots_.begin();
 }
 
+FormulaAST::FormulaAST(FormulaAST&&) = default;
+FormulaAST& FormulaAST::operator=(FormulaAST&&) = default;
 FormulaAST::~FormulaAST() = default;
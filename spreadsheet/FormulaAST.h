@@ -1,11 +1,15 @@
 #pragma once
 
 #include "FormulaLexer.h"
+#include "batch.h"
 #include "common.h"
+#include "jit.h"
+#include "memory_usage.h"
 
 #include <forward_list>
 #include <functional>
 #include <stdexcept>
+#include <vector>
 
 namespace ASTImpl {
 class Expr;
@@ -18,32 +22,88 @@ class ParsingError : public std::runtime_error {
 class FormulaAST {
 public:
     explicit FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr,
-                        std::forward_list<Position> cells);
-    FormulaAST(FormulaAST&&) = default;
-    FormulaAST& operator=(FormulaAST&&) = default;
+                        std::forward_list<CellReference> cells,
+                        std::forward_list<CellRange> ranges = {});
+    // defined where ASTImpl::Expr is complete
+    FormulaAST(FormulaAST&&);
+    FormulaAST& operator=(FormulaAST&&);
     ~FormulaAST();
 
-    double Execute(const std::function<double(Position)>& get_cell_value) const;
+    // Вычисляет формулу интерпретатором; после jit::GetThreshold() вычислений
+    // формула компилируется и (пока JIT включён) вычисляется машинным кодом
+    double Execute(const CellValueAccessor& cells) const;
+    // Folds constant subexpressions and drops no-op operations for evaluation;
+    // the printed formula stays the same. Called by ParseFormulaAST.
+    void Simplify();
+    // Program evaluating the formula for a column of rows at once (nullptr if the formula
+    // has anything besides numbers, references to its own sheet and arithmetic)
+    const batch::Program* GetBatchProgram() const {
+        return batch_program_.get();
+    }
+    // Independent copy of the formula (without the compiled code)
+    FormulaAST Clone() const;
+    // Memory used by the AST nodes, the compiled code and the batch program, and by the cell list
+    size_t GetNodesMemoryUsage() const;
+    size_t GetCellsMemoryUsage() const;
+    // True if the formula contains IF, AND, OR or lookup functions: some of its cells are requested
+    // only depending on the values of other cells
+    bool IsConditional() const {
+        return conditional_;
+    }
     void PrintCells(std::ostream& out) const;
     void Print(std::ostream& out) const;
     void PrintFormula(std::ostream& out) const;
 
-    std::forward_list<Position>& GetCells() {
+    std::forward_list<CellReference>& GetCells() {
         return cells_;
     }
 
-    const std::forward_list<Position>& GetCells() const {
+    const std::forward_list<CellReference>& GetCells() const {
         return cells_;
     }
 
+    // References of the cell list in slot order. A reference keeps its slot for the lifetime
+    // of the AST (shifting references changes positions in place), so cells bound to the
+    // slots stay bound to the same references
+    const std::vector<const CellReference*>& GetCellSlots() const {
+        return cell_slots_;
+    }
+    // Slot of a reference from the cell list
+    size_t GetCellSlot(const CellReference& cell) const;
+
+    // Ranges of the lookup functions (in no particular order)
+    std::forward_list<CellRange>& GetRanges() {
+        return ranges_;
+    }
+
+    const std::forward_list<CellRange>& GetRanges() const {
+        return ranges_;
+    }
+
 private:
     std::unique_ptr<ASTImpl::Expr> root_expr_;
+    // the node evaluated in place of root_expr_ after simplification
+    const ASTImpl::Expr* root_eval_;
+
+    bool conditional_ = false;
+
+    mutable uint32_t execution_count_ = 0;
+    mutable std::unique_ptr<jit::CompiledFormula> compiled_;
+    std::unique_ptr<batch::Program> batch_program_;
 
     // physically stores cells so that they can be
     // efficiently traversed without going through
     // the whole AST
-    std::forward_list<Position> cells_;
+    std::forward_list<CellReference> cells_;
+    // addresses of the cell list nodes in ascending order: the slot of a reference
+    // is found by binary search
+    std::vector<const CellReference*> cell_slots_;
+    // ranges are not expanded into cells: a lookup into a large table
+    // would otherwise make every cell of the table a reference of the formula
+    std::forward_list<CellRange> ranges_;
 };
 
+// Parsing reuses the lexer and parser of the calling thread; formulas can be parsed
+// on several threads at once
 FormulaAST ParseFormulaAST(std::istream& in);
 FormulaAST ParseFormulaAST(const std::string& in_str);
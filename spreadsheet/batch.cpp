@@ -0,0 +1,136 @@
+#include "batch.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cmath>
+#include <cstring>
+
+namespace batch {
+
+namespace {
+
+std::atomic<bool> enabled = true;
+
+// Ошибка строки сохраняется, только если в строке ещё нет более ранней ошибки
+inline LaneError FirstError(LaneError current, LaneError error) {
+    return current != NO_ERROR ? current : error;
+}
+
+// values[k] = values[k] op rhs[k]; результат inf или nan - #ARITHM! (деление на ноль
+// тоже даёт inf или nan, поэтому отдельно не проверяется)
+template <typename BinaryOperation>
+void Apply(size_t count, double* values, const double* rhs, LaneError* errors, BinaryOperation operation) {
+    const LaneError arithmetic = ToLaneError(FormulaError::Category::Arithmetic);
+    for (size_t k = 0; k < count; ++k) {
+        double result = operation(values[k], rhs[k]);
+        errors[k] = FirstError(errors[k], std::isfinite(result) ? NO_ERROR : arithmetic);
+        values[k] = result;
+    }
+}
+
+}  // namespace
+
+void SetEnabled(bool value) {
+    enabled = value;
+}
+
+bool IsEnabled() {
+    return enabled;
+}
+
+void Program::LoadCell(size_t slot) {
+    Emit(Operation::LoadCell, static_cast<uint32_t>(slots_.size()), 1);
+    slots_.push_back(static_cast<uint32_t>(slot));
+}
+
+void Program::LoadConstant(double value) {
+    Emit(Operation::LoadConstant, static_cast<uint32_t>(constants_.size()), 1);
+    constants_.push_back(value);
+}
+
+void Program::Negate() {
+    Emit(Operation::Negate, 0, 0);
+}
+
+void Program::BinaryOperation(char operation) {
+    switch (operation) {
+        case '+': Emit(Operation::Add, 0, -1); break;
+        case '-': Emit(Operation::Subtract, 0, -1); break;
+        case '*': Emit(Operation::Multiply, 0, -1); break;
+        case '/': Emit(Operation::Divide, 0, -1); break;
+        default: assert(false);
+    }
+}
+
+bool Program::operator==(const Program& other) const {
+    // Константы сравниваются побитово: 0 и -0 дают разные результаты
+    auto same_bits = [](double lhs, double rhs) {
+        return std::memcmp(&lhs, &rhs, sizeof(double)) == 0;
+    };
+    return code_ == other.code_
+        && std::equal(constants_.begin(), constants_.end(), other.constants_.begin(), other.constants_.end(), same_bits);
+}
+
+void Program::Execute(size_t count, const double* const* operands, const LaneError* const* operand_errors,
+                      double* results, LaneError* errors) const {
+    assert(count <= LANES && depth_ == 1);
+    // Стек программы: массивы значений по строкам, вершина - последний массив
+    std::vector<double> stack(static_cast<size_t>(max_depth_) * LANES);
+    std::fill(errors, errors + count, NO_ERROR);
+    size_t depth = 0;
+    double* top = nullptr;
+    for (const auto& instruction : code_) {
+        switch (instruction.operation) {
+            case Operation::LoadCell: {
+                top = stack.data() + depth++ * LANES;
+                const double* values = operands[instruction.operand];
+                const LaneError* value_errors = operand_errors[instruction.operand];
+                for (size_t k = 0; k < count; ++k) {
+                    top[k] = values[k];
+                    errors[k] = FirstError(errors[k], value_errors[k]);
+                }
+                break;
+            }
+            case Operation::LoadConstant:
+                top = stack.data() + depth++ * LANES;
+                std::fill(top, top + count, constants_[instruction.operand]);
+                break;
+            case Operation::Negate:
+                for (size_t k = 0; k < count; ++k) {
+                    top[k] = -top[k];
+                }
+                break;
+            case Operation::Add:
+                top = stack.data() + (--depth - 1) * LANES;
+                Apply(count, top, top + LANES, errors, [](double lhs, double rhs) { return lhs + rhs; });
+                break;
+            case Operation::Subtract:
+                top = stack.data() + (--depth - 1) * LANES;
+                Apply(count, top, top + LANES, errors, [](double lhs, double rhs) { return lhs - rhs; });
+                break;
+            case Operation::Multiply:
+                top = stack.data() + (--depth - 1) * LANES;
+                Apply(count, top, top + LANES, errors, [](double lhs, double rhs) { return lhs * rhs; });
+                break;
+            case Operation::Divide:
+                top = stack.data() + (--depth - 1) * LANES;
+                Apply(count, top, top + LANES, errors, [](double lhs, double rhs) { return lhs / rhs; });
+                break;
+        }
+    }
+    std::copy(top, top + count, results);
+}
+
+size_t Program::GetMemoryUsage() const {
+    return sizeof(*this) + code_.capacity() * sizeof(Instruction) + constants_.capacity() * sizeof(double)
+        + slots_.capacity() * sizeof(uint32_t);
+}
+
+void Program::Emit(Operation operation, uint32_t operand, int depth_change) {
+    code_.push_back({operation, operand});
+    depth_ += depth_change;
+    max_depth_ = std::max(max_depth_, depth_);
+}
+
+}  // namespace batch
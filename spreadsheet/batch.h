@@ -0,0 +1,98 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Пакетное вычисление формул столбца. Формулы, протянутые вниз по столбцу (=A1*B1-C1,
+// =A2*B2-C2, ...), различаются только позициями ссылок, поэтому имеют одинаковую программу:
+// стековый код без переходов над массивами значений ссылок по строкам. Программа выполняет
+// каждую операцию сразу для LANES строк простым циклом по массивам, который компилятор
+// векторизует; ошибка строки запоминается в её маске, не прерывая вычисление остальных.
+// Программа повторяет семантику интерпретатора FormulaAST: ошибка строки - первая ошибка
+// в порядке вычисления операндов, результат бинарной операции inf/nan - #ARITHM!.
+namespace batch {
+
+// Переключатель пакетного вычисления во время работы (по умолчанию включено)
+void SetEnabled(bool enabled);
+bool IsEnabled();
+
+// Количество строк, которые программа вычисляет за один проход
+constexpr size_t LANES = 256;
+
+// Ошибка строки: NO_ERROR или 1 + FormulaError::Category
+using LaneError = uint8_t;
+constexpr LaneError NO_ERROR = 0;
+
+inline LaneError ToLaneError(FormulaError::Category category) {
+    return static_cast<LaneError>(1 + static_cast<int>(category));
+}
+
+inline FormulaError::Category ToCategory(LaneError error) {
+    return static_cast<FormulaError::Category>(error - 1);
+}
+
+// Программа формулы из чисел, ссылок на ячейки своей таблицы и арифметических операций.
+// Строится обходом дерева формулы (см. FormulaAST::GetBatchProgram); API генерации
+// повторяет jit::Assembler
+class Program {
+public:
+    // Помещает на стек значение ссылки слота slot (см. FormulaAST::GetCellSlots)
+    void LoadCell(size_t slot);
+    void LoadConstant(double value);
+    // Меняет знак значения на вершине стека
+    void Negate();
+    // Заменяет два значения на вершине стека результатом операции (+, -, *, /)
+    void BinaryOperation(char operation);
+
+    // Программы одинаковой структуры: совпадают код и константы, слоты ссылок могут различаться
+    bool operator==(const Program& other) const;
+    bool operator!=(const Program& other) const { return !(*this == other); }
+
+    // Слоты ссылок в порядке загрузки: значения i-й загружаемой ссылки передаются
+    // в Execute как operands[i]
+    const std::vector<uint32_t>& GetSlots() const { return slots_; }
+
+    // Вычисляет программу для count <= LANES строк: operands[i][k] - значение i-й ссылки
+    // в строке k, operand_errors[i][k] - ошибка её значения. Результат строки k - results[k],
+    // если errors[k] == NO_ERROR
+    void Execute(size_t count, const double* const* operands, const LaneError* const* operand_errors,
+                 double* results, LaneError* errors) const;
+
+    size_t GetMemoryUsage() const;
+
+private:
+    enum class Operation : uint8_t {
+        LoadCell,
+        LoadConstant,
+        Negate,
+        Add,
+        Subtract,
+        Multiply,
+        Divide,
+    };
+
+    struct Instruction {
+        Operation operation;
+        // Номер ссылки для LoadCell, номер константы для LoadConstant
+        uint32_t operand = 0;
+
+        bool operator==(const Instruction& other) const {
+            return operation == other.operation && operand == other.operand;
+        }
+    };
+
+    void Emit(Operation operation, uint32_t operand, int depth_change);
+
+private:
+    std::vector<Instruction> code_;
+    std::vector<double> constants_;
+    std::vector<uint32_t> slots_;
+    // Количество значений на стеке в конце кода и наибольшее за время выполнения
+    int depth_ = 0;
+    int max_depth_ = 0;
+};
+
+}  // namespace batch
@@ -0,0 +1,451 @@
+#include "benchmark.h"
+
+#include "batch.h"
+#include "common.h"
+#include "formula.h"
+#include "jit.h"
+#include "sheet.h"
+#include "wal.h"
+
+#include <chrono>
+#include <filesystem>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace std::literals;
+
+namespace {
+
+class Stopwatch {
+public:
+    // Время с момента создания, нс на одну операцию
+    double NanosecondsPer(uint64_t operation_count) const {
+        std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start_;
+        return elapsed.count() / operation_count;
+    }
+
+private:
+    std::chrono::steady_clock::time_point start_ = std::chrono::steady_clock::now();
+};
+
+int BenchmarkPositions() {
+    const uint64_t count = static_cast<uint64_t>(Position::MAX_ROWS) * Position::MAX_COLS;
+    char buffer[Position::MAX_STRING_LENGTH];
+    // Контрольная сумма не даёт компилятору выбросить вычисления
+    uint64_t checksum = 0;
+
+    Stopwatch to_chars;
+    for (int row = 0; row < Position::MAX_ROWS; ++row) {
+        for (int col = 0; col < Position::MAX_COLS; ++col) {
+            checksum += Position{row, col}.ToChars(buffer) + buffer[0];
+        }
+    }
+    std::cout << "Position::ToChars: "sv << to_chars.NanosecondsPer(count) << " ns"sv << std::endl;
+
+    Stopwatch to_string;
+    for (int row = 0; row < Position::MAX_ROWS; ++row) {
+        for (int col = 0; col < Position::MAX_COLS; ++col) {
+            checksum += Position{row, col}.ToString().size();
+        }
+    }
+    std::cout << "Position::ToString: "sv << to_string.NanosecondsPer(count) << " ns"sv << std::endl;
+
+    Stopwatch round_trip;
+    uint64_t mismatches = 0;
+    for (int row = 0; row < Position::MAX_ROWS; ++row) {
+        for (int col = 0; col < Position::MAX_COLS; ++col) {
+            Position pos{row, col};
+            if (!(Position::FromString({buffer, pos.ToChars(buffer)}) == pos)) {
+                ++mismatches;
+            }
+        }
+    }
+    std::cout << "Position::ToChars + FromString: "sv << round_trip.NanosecondsPer(count) << " ns"sv << std::endl;
+    std::cout << "positions: "sv << count << ", mismatches: "sv << mismatches << ", checksum: "sv << checksum << std::endl;
+    return mismatches == 0 ? 0 : 1;
+}
+
+// Многократное вычисление одной формулы интерпретатором и скомпилированным кодом
+int BenchmarkJit() {
+    const uint64_t count = 2'000'000;
+    auto sheet = CreateSheet();
+    sheet->SetCell(Position::FromString("A1"), "1.5");
+    sheet->SetCell(Position::FromString("B1"), "2");
+    sheet->SetCell(Position::FromString("C1"), "=A1*3");
+    auto formula = ParseFormula("(A1*B1+C1/(B1-A1))*(A1+2.5)-C1/4+B1*B1*B1");
+
+    double checksum = 0.0;
+    auto run = [&](bool jit_enabled) {
+        jit::SetEnabled(jit_enabled);
+        Stopwatch stopwatch;
+        for (uint64_t i = 0; i < count; ++i) {
+            checksum += std::get<double>(formula->Evaluate(*sheet));
+        }
+        return stopwatch.NanosecondsPer(count);
+    };
+    std::cout << "interpreter: "sv << run(false) << " ns"sv << std::endl;
+    if (jit::IsSupported()) {
+        std::cout << "jit: "sv << run(true) << " ns"sv << std::endl;
+    }
+    std::cout << "checksum: "sv << checksum << std::endl;
+    return 0;
+}
+
+// Накопительный итог длиной length: A1 = B1, Ai = A(i-1) + Bi. Строк в таблице меньше,
+// чем звеньев в длинной цепочке, поэтому она продолжается в следующей паре столбцов.
+// Замеряется первое чтение последней ячейки и чтение после изменения B1
+// (в обоих случаях вычисляется вся цепочка)
+double BenchmarkChain(int length, EvaluationStrategy strategy) {
+    auto total = [](int index) {
+        return Position{index % Position::MAX_ROWS, 2 * (index / Position::MAX_ROWS)};
+    };
+    auto summand = [&total](int index) {
+        auto pos = total(index);
+        return Position{pos.row, pos.col + 1};
+    };
+
+    Sheet sheet;
+    sheet.SetEvaluationStrategy(strategy);
+    sheet.SetCell(summand(0), "1");
+    sheet.SetCell(total(0), "=" + summand(0).ToString());
+    for (int i = 1; i < length; ++i) {
+        sheet.SetCell(summand(i), "1");
+        sheet.SetCell(total(i), "=" + total(i - 1).ToString() + "+" + summand(i).ToString());
+    }
+
+    Stopwatch stopwatch;
+    auto first = std::get<double>(sheet.GetCell(total(length - 1))->GetValue());
+    sheet.SetCell(summand(0), "2");
+    auto second = std::get<double>(sheet.GetCell(total(length - 1))->GetValue());
+    if (first != length || second != length + 1) {
+        std::cerr << "wrong chain value: "sv << first << ", "sv << second << std::endl;
+    }
+    return stopwatch.NanosecondsPer(2 * static_cast<uint64_t>(length));
+}
+
+// Вычисление длинных цепочек рекурсивно и с явным стеком
+int BenchmarkChains() {
+    // Длиннее рекурсивное вычисление не помещается в стек 8 МБ
+    const int max_recursive_length = 10'000;
+    for (int length : {1'000, 10'000, 200'000}) {
+        std::cout << "chain "sv << length << ": "sv;
+        if (length <= max_recursive_length) {
+            std::cout << "recursive "sv << BenchmarkChain(length, EvaluationStrategy::Recursive) << " ns/cell, "sv;
+        }
+        std::cout << "iterative "sv << BenchmarkChain(length, EvaluationStrategy::Iterative) << " ns/cell"sv << std::endl;
+    }
+    return 0;
+}
+
+// Чтение окна 50x10 ячеек таблицы из 100 тысяч ячеек: по одной ячейке и через ReadRange
+int BenchmarkViewport() {
+    const int rows = 10'000;
+    const int cols = 10;
+    const Size window{50, cols};
+    const int iterations = 200;
+
+    Sheet sheet;
+    for (int row = 0; row < rows; ++row) {
+        sheet.SetCell({row, 0}, std::to_string(row));
+        for (int col = 1; col < cols; ++col) {
+            sheet.SetCell({row, col}, col % 2 ? "text " + std::to_string(col) : "=A" + std::to_string(row + 1) + "*2");
+        }
+    }
+
+    const uint64_t count = static_cast<uint64_t>(iterations) * window.rows * window.cols;
+    size_t checksum = 0;
+    Stopwatch per_cell;
+    for (int i = 0; i < iterations; ++i) {
+        int top = i * window.rows % (rows - window.rows);
+        for (int row = top; row < top + window.rows; ++row) {
+            for (int col = 0; col < window.cols; ++col) {
+                if (auto cell = sheet.GetCell({row, col})) {
+                    checksum += cell->GetValue().index();
+                }
+            }
+        }
+    }
+    std::cout << "GetCell()->GetValue(): "sv << per_cell.NanosecondsPer(count) << " ns/cell"sv << std::endl;
+
+    std::vector<CellValueView> values(window.rows * window.cols);
+    Stopwatch range;
+    for (int i = 0; i < iterations; ++i) {
+        sheet.ReadRange({i * window.rows % (rows - window.rows), 0}, window, values.data());
+        for (const auto& value : values) {
+            checksum += value.index();
+        }
+    }
+    std::cout << "ReadRange: "sv << range.NanosecondsPer(count) << " ns/cell"sv << std::endl;
+    std::cout << "checksum: "sv << checksum << std::endl;
+    return 0;
+}
+
+// n формул VLOOKUP по таблице из n строк: с индексом столбца время на формулу почти не растёт с n
+int BenchmarkLookups() {
+    for (int rows : {1'000, 4'000, 16'000}) {
+        Sheet sheet;
+        auto range = "A1:B"s + std::to_string(rows);
+        for (int row = 0; row < rows; ++row) {
+            sheet.SetCell({row, 0}, std::to_string(rows - row));
+            sheet.SetCell({row, 1}, std::to_string(row));
+            sheet.SetCell({row, 3}, "=VLOOKUP(" + std::to_string(row + 1) + ", " + range + ", 2)");
+        }
+
+        double checksum = 0.0;
+        auto evaluate = [&sheet, &checksum, rows] {
+            for (int row = 0; row < rows; ++row) {
+                checksum += std::get<double>(sheet.GetCell({row, 3})->GetValue());
+            }
+        };
+        Stopwatch first;
+        evaluate();
+        std::cout << "lookups "sv << rows << ": first evaluation "sv << first.NanosecondsPer(rows) << " ns/formula, "sv;
+        // Изменение ячейки таблицы сбрасывает значения всех формул поиска
+        sheet.SetCell({0, 1}, "-1");
+        Stopwatch recalculation;
+        evaluate();
+        std::cout << "after change "sv << recalculation.NanosecondsPer(rows) << " ns/formula (checksum "sv
+                  << checksum << ")"sv << std::endl;
+    }
+    return 0;
+}
+
+// SUM по столбцу из n строк в n/10 формулах после изменения одной ячейки: итоги столбца
+// обновляются по изменившейся строке, время на формулу растёт как log n
+int BenchmarkAggregates() {
+    const int edits = 100;
+    for (int rows : {1'000, 4'000, 16'000}) {
+        Sheet sheet;
+        auto range = "A1:A"s + std::to_string(rows);
+        const int formulas = rows / 10;
+        for (int row = 0; row < rows; ++row) {
+            sheet.SetCell({row, 0}, std::to_string(row % 100));
+        }
+        for (int row = 0; row < formulas; ++row) {
+            sheet.SetCell({row, 1}, "=SUM(" + range + ")+" + std::to_string(row));
+        }
+
+        double checksum = 0.0;
+        auto evaluate = [&sheet, &checksum, formulas] {
+            for (int row = 0; row < formulas; ++row) {
+                checksum += std::get<double>(sheet.GetCell({row, 1})->GetValue());
+            }
+        };
+        evaluate();
+        Stopwatch recalculation;
+        for (int edit = 0; edit < edits; ++edit) {
+            sheet.SetCell({edit * rows / edits, 0}, std::to_string(edit));
+            evaluate();
+        }
+        std::cout << "aggregates "sv << rows << ": "sv << recalculation.NanosecondsPer(edits * formulas)
+                  << " ns/formula after change (checksum "sv << checksum << ")"sv << std::endl;
+    }
+    return 0;
+}
+
+// Восстановление таблицы из журнала: пакетная загрузка и применение записей по одной.
+// Формулы записаны сверху вниз и ссылаются на строку ниже, поэтому при задании по одной
+// каждая новая ячейка поднимает уровни всех формул над ней
+int BenchmarkRecovery() {
+    auto directory = std::filesystem::temp_directory_path() / "spreadsheet_wal_benchmark";
+    for (int rows : {1'000, 4'000, 16'000}) {
+        std::filesystem::remove_all(directory);
+        {
+            Sheet sheet;
+            WalOptions options;
+            options.checkpoint_records = 0;
+            DurableSheet durable(sheet, directory, options);
+            for (int row = 0; row < rows; ++row) {
+                durable.SetCell({row, 1}, std::to_string(row));
+                if (row + 1 < rows) {
+                    durable.SetCell({row, 0}, "=A" + std::to_string(row + 2) + "+B" + std::to_string(row + 1));
+                }
+            }
+        }
+
+        Stopwatch bulk;
+        Sheet recovered;
+        DurableSheet durable(recovered, directory);
+        std::cout << "recovery "sv << rows << ": bulk "sv << bulk.NanosecondsPer(2 * rows) << " ns/cell, "sv;
+
+        WriteAheadLog log(directory);
+        auto cells = log.TakeRecoveredCells();
+        Stopwatch one_by_one;
+        Sheet sheet;
+        for (auto& [pos, text] : cells) {
+            sheet.SetCell(pos, std::move(text));
+        }
+        std::cout << "one by one "sv << one_by_one.NanosecondsPer(2 * rows) << " ns/cell"sv << std::endl;
+    }
+    std::filesystem::remove_all(directory);
+    return 0;
+}
+
+// Вывод значений таблицы с вычисленными формулами: PrintValues и PrintValuesParallel
+int BenchmarkExport() {
+    const int rows = 16'000;
+    const int cols = 16;
+    Sheet sheet;
+    for (int row = 0; row < rows; ++row) {
+        for (int col = 0; col + 1 < cols; ++col) {
+            sheet.SetCell({row, col}, std::to_string((row + 1) * (col + 1) / 7.0));
+        }
+        sheet.SetCell({row, cols - 1}, "=A"s + std::to_string(row + 1) + "/3"s);
+    }
+    std::ostringstream warm_up;
+    sheet.PrintValues(warm_up);
+    const uint64_t cells = static_cast<uint64_t>(rows) * cols;
+
+    std::ostringstream serial_output;
+    Stopwatch serial;
+    sheet.PrintValues(serial_output);
+    std::cout << "export "sv << cells << " cells: serial "sv << serial.NanosecondsPer(cells) << " ns/cell"sv;
+
+    for (size_t threads : {2, 4, 8}) {
+        std::ostringstream output;
+        Stopwatch parallel;
+        sheet.PrintValuesParallel(output, {threads});
+        std::cout << ", "sv << threads << " threads "sv << parallel.NanosecondsPer(cells) << " ns/cell"sv;
+        if (output.str() != serial_output.str()) {
+            std::cout << std::endl << "output mismatch"sv << std::endl;
+            return 1;
+        }
+    }
+    std::cout << std::endl;
+    return 0;
+}
+
+// Пересчёт столбца формул, каждая из которых читает пять ячеек: после изменения F1
+// вычисляются все формулы столбца
+int BenchmarkReferences() {
+    const int rows = 16'000;
+    const int iterations = 20;
+    Sheet sheet;
+    sheet.SetCell({0, 5}, "1");
+    for (int row = 0; row < rows; ++row) {
+        auto r = std::to_string(row + 1);
+        for (int col = 0; col < 4; ++col) {
+            sheet.SetCell({row, col}, std::to_string(row + col));
+        }
+        sheet.SetCell({row, 4}, "=A"s + r + "+B"s + r + "*C"s + r + "-D"s + r + "+F1"s);
+    }
+
+    double checksum = 0.0;
+    Stopwatch stopwatch;
+    for (int i = 0; i < iterations; ++i) {
+        sheet.SetCell({0, 5}, std::to_string(i));
+        for (int row = 0; row < rows; ++row) {
+            checksum += std::get<double>(sheet.GetCell({row, 4})->GetValue());
+        }
+    }
+    const uint64_t count = static_cast<uint64_t>(iterations) * rows;
+    std::cout << "references: "sv << stopwatch.NanosecondsPer(count) << " ns/formula, checksum: "sv
+              << checksum << std::endl;
+    return 0;
+}
+
+// Пересчёт протянутой по столбцу формулы =A*B-C*F1 по одной формуле и пакетами
+// (см. batch::Program): после изменения F1 вычисляются все формулы столбца
+int BenchmarkBatch() {
+    const int rows = 16'000;
+    const int iterations = 20;
+    Sheet sheet;
+    sheet.SetCell({0, 5}, "1");
+    for (int row = 0; row < rows; ++row) {
+        auto r = std::to_string(row + 1);
+        for (int col = 0; col < 3; ++col) {
+            sheet.SetCell({row, col}, std::to_string(row + col));
+        }
+        sheet.SetCell({row, 3}, "=A"s + r + "*B"s + r + "-C"s + r + "*F1"s);
+    }
+
+    std::cout << "batch:"sv;
+    for (bool enabled : {false, true}) {
+        batch::SetEnabled(enabled);
+        double checksum = 0.0;
+        Stopwatch stopwatch;
+        for (int i = 0; i < iterations; ++i) {
+            sheet.SetCell({0, 5}, std::to_string(i));
+            for (int row = 0; row < rows; ++row) {
+                checksum += std::get<double>(sheet.GetCell({row, 3})->GetValue());
+            }
+        }
+        const uint64_t count = static_cast<uint64_t>(iterations) * rows;
+        std::cout << (enabled ? " batched "sv : " one by one "sv) << stopwatch.NanosecondsPer(count)
+                  << " ns/formula (checksum "sv << checksum << ")"sv;
+    }
+    batch::SetEnabled(true);
+    std::cout << std::endl;
+    return 0;
+}
+
+// Разбор формул ParseFormulas в одном и нескольких потоках: потоки предсказывают
+// со своими кэшами ANTLR и разбирают формулы одновременно
+int BenchmarkParse() {
+    const int count = 64'000;
+    std::vector<std::string> expressions;
+    expressions.reserve(count);
+    for (int i = 0; i < count; ++i) {
+        auto r = std::to_string(i % Position::MAX_ROWS + 1);
+        expressions.push_back("A"s + r + "*(B"s + r + "-"s + std::to_string(i % 97) + ")/SUM(C1:C"s + r + ")"s);
+    }
+    ParseFormulas(expressions, 1);
+
+    std::cout << "parse "sv << count << " formulas:"sv;
+    for (size_t threads : {1, 2, 4, 8}) {
+        Stopwatch stopwatch;
+        auto results = ParseFormulas(expressions, threads);
+        std::cout << (threads == 1 ? " "sv : ", "sv) << threads << (threads == 1 ? " thread "sv : " threads "sv)
+                  << stopwatch.NanosecondsPer(count) << " ns/formula"sv;
+        for (const auto& result : results) {
+            if (!result.formula) {
+                std::cout << std::endl << "parse error"sv << std::endl;
+                return 1;
+            }
+        }
+    }
+    std::cout << std::endl;
+    return 0;
+}
+
+}  // namespace
+
+int RunBenchmark(std::string_view name) {
+    if (name == "positions"sv) {
+        return BenchmarkPositions();
+    }
+    if (name == "jit"sv) {
+        return BenchmarkJit();
+    }
+    if (name == "chains"sv) {
+        return BenchmarkChains();
+    }
+    if (name == "viewport"sv) {
+        return BenchmarkViewport();
+    }
+    if (name == "lookups"sv) {
+        return BenchmarkLookups();
+    }
+    if (name == "aggregates"sv) {
+        return BenchmarkAggregates();
+    }
+    if (name == "recovery"sv) {
+        return BenchmarkRecovery();
+    }
+    if (name == "export"sv) {
+        return BenchmarkExport();
+    }
+    if (name == "references"sv) {
+        return BenchmarkReferences();
+    }
+    if (name == "batch"sv) {
+        return BenchmarkBatch();
+    }
+    if (name == "parse"sv) {
+        return BenchmarkParse();
+    }
+    std::cerr << "unknown benchmark: "sv << name << std::endl;
+    return 1;
+}
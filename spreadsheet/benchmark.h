@@ -0,0 +1,17 @@
+#pragma once
+
+#include <string_view>
+
+// Запускает бенчмарк с заданным именем и печатает результаты в std::cout.
+// Доступные бенчмарки:
+//   positions - кодирование и разбор всех позиций таблицы (MAX_ROWS x MAX_COLS)
+//   jit       - вычисление формулы интерпретатором и JIT-скомпилированным кодом
+//   lookups   - вычисление формул VLOOKUP по таблицам разного размера
+//   aggregates - пересчёт формул SUM по столбцу после изменения одной ячейки
+//   recovery  - восстановление таблицы из журнала изменений (см. wal.h)
+//   export    - последовательный и параллельный вывод значений таблицы
+//   references - пересчёт столбца формул, читающих значения нескольких ячеек
+//   batch     - пересчёт протянутой по столбцу формулы по одной формуле и пакетами
+//   parse     - разбор формул в одном и нескольких потоках
+// Возвращает код завершения программы.
+int RunBenchmark(std::string_view name);
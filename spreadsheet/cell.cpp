@@ -1,67 +1,344 @@
 #include "cell.h"
 
+#include "batch.h"
+
+#include <algorithm>
 #include <cassert>
+#include <cstring>
 #include <iostream>
 #include <string>
 #include <optional>
+#include <queue>
+
+namespace {
+
+// Ячейка, значение которой понадобилось при пробном вычислении условной формулы
+struct MissingValue {
+    const Cell* cell;
+};
+
+// Пробное вычисление: вместо вложенного вычисления невычисленной ячейки бросается MissingValue
+thread_local bool probing = false;
+
+// Пакетное вычисление столбца: меньше строк вычисляются по одной, больше - следующим пакетом
+constexpr size_t BATCH_MIN_ROWS = 8;
+constexpr size_t BATCH_MAX_ROWS = 16 * batch::LANES;
+
+// Вид выгруженной реализации ячейки
+enum class PagedImpl : char {
+    // Реализация не выгружена (осталась в памяти)
+    Resident,
+    Empty,
+    Text,
+    Formula,
+};
+
+// Значение формулы в кэше выгруженной ячейки
+enum class PagedValue : char {
+    None,
+    Number,
+    Error,
+};
+
+template <typename T>
+void AppendRaw(std::string& buffer, T value) {
+    buffer.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+template <typename T>
+T ReadRaw(std::string_view& buffer) {
+    T value;
+    std::memcpy(&value, buffer.data(), sizeof(value));
+    buffer.remove_prefix(sizeof(value));
+    return value;
+}
+
+}  // namespace
+
+thread_local size_t ImplPin::pin_count_ = 0;
 
-Cell::Cell(Sheet* sheet) :
+Cell::Cell(Sheet* sheet, Position pos) :
     impl_(std::make_unique<EmptyImpl>()),
-    sheet_(sheet)
+    sheet_(sheet),
+    pos_(pos)
 {}
 
 Cell::~Cell() {}
 
 void Cell::Set(std::string text) {
-    // Если происходит установка такого же текста: выход
-    if (!IsEmpty() && impl_->GetInitialText() == text) {
-        return;
-    }
-
     // Создаем новую реализацию ячейки
     std::unique_ptr<Impl> new_impl;
-    if (text.empty()) {
-        new_impl = std::make_unique<TextImpl>();
-    } else if (FormulaImpl::IsFormulaText(text)) {
-        new_impl = std::make_unique<FormulaImpl>(text, *sheet_);
+    if (FormulaImpl::IsFormulaText(text)) {
+        // Если происходит установка такого же текста: выход
+        if (!IsEmpty() && GetImpl().GetInitialText() == text) {
+            return;
+        }
+        auto formula = sheet_->InternFormula(std::string(text.begin() + 1, text.end()));
+        new_impl = std::make_unique<FormulaImpl>(std::move(text), std::move(formula), *sheet_, sheet_->GetValueCache());
     } else {
-        new_impl = std::make_unique<TextImpl>(std::move(text));
+        // Одинаковые тексты - одна строка пула: такой же текст определяется по ссылке
+        auto interned = sheet_->InternText(std::move(text));
+        auto text_impl = dynamic_cast<const TextImpl*>(&GetImpl());
+        if (text_impl && text_impl->GetHandle() == interned) {
+            return;
+        }
+        new_impl = std::make_unique<TextImpl>(std::move(interned));
+    }
+
+    // Ссылки на другие таблицы допустимы только на существующие таблицы книги
+    for (const auto& referenced_cell : new_impl->GetExternalReferencedCells()) {
+        if (!sheet_->FindSheet(referenced_cell.sheet)) {
+            throw FormulaException("Unknown sheet: "s + referenced_cell.sheet);
+        }
+    }
+    for (const auto& referenced_range : new_impl->GetReferencedRanges()) {
+        if (referenced_range.IsExternal() && !sheet_->FindSheet(referenced_range.sheet)) {
+            throw FormulaException("Unknown sheet: "s + referenced_range.sheet);
+        }
     }
 
     // Проверяем наличие цикл. зависимости
-    if (CheckCircularDependency(new_impl->GetReferencedCells())) {
+    if (CheckCircularDependency(ResolveReferencedCells(*new_impl, false), ResolveReferencedRanges(*new_impl))) {
         throw CircularDependencyException("Found circular dependency"s);
     }
 
-    // Сбрасываем кэш
-    InvalidateCache();
+    // Сбрасываем кэш (в режиме Eager значения пересчитываются после установки)
+    bool eager = sheet_->GetRecalculationMode() == RecalculationMode::Eager;
+    auto old_value = eager ? GetImpl().GetCachedValue() : std::nullopt;
+    if (!eager) {
+        InvalidateCache();
+    }
 
     // Очищаем связи
     ClearLinksFrom();
+    DetachRanges();
 
     // Устанавливаем новую реализацию ячейки
     impl_ = std::move(new_impl);
 
-    // Устанавливаем связи
+    // Устанавливаем связи (области поиска учитывают уровень формулы, поэтому после его вычисления)
     CreateLinksFrom();
+    UpdateLevel();
+    AttachRanges();
+
+    if (eager) {
+        Recalculate(std::move(old_value));
+    }
 }
 
 void Cell::Clear() {
-    // Сбрасываем кэш (рекурсивно)
-    InvalidateCache();
+    bool eager = sheet_->GetRecalculationMode() == RecalculationMode::Eager;
+    auto old_value = eager ? GetImpl().GetCachedValue() : std::nullopt;
+    if (!eager) {
+        // Сбрасываем кэш (рекурсивно)
+        InvalidateCache();
+    }
 
+    // Пустая ячейка ни на что не ссылается: связи у бывших ссылок убираются, иначе они
+    // указывали бы на ячейку после её удаления и давали бы ложные циклы
+    ClearLinksFrom();
+    DetachRanges();
     impl_ = std::make_unique<EmptyImpl>();
+
+    if (eager) {
+        Recalculate(std::move(old_value));
+    }
+}
+
+bool Cell::Load(std::string& text, std::shared_ptr<FormulaInterface> parsed) {
+    if (FormulaImpl::IsFormulaText(text)) {
+        auto formula = sheet_->InternFormula(text.substr(1), std::move(parsed));
+        if (!formula->GetReferencedRanges().empty() || !formula->GetExternalReferencedCells().empty()) {
+            return false;
+        }
+        impl_ = std::make_unique<FormulaImpl>(std::move(text), std::move(formula), *sheet_, sheet_->GetValueCache());
+    } else {
+        impl_ = std::make_unique<TextImpl>(sheet_->InternText(std::move(text)));
+    }
+    return true;
+}
+
+void Cell::LinkLoaded(const std::vector<Cell*>& cells) {
+    // Алгоритм Кана: ячейка упорядочивается после всех загруженных ячеек, на которые
+    // она ссылается. Уровни вычисляются один раз, без повторного подъёма уровней
+    // зависимых ячеек, как при задании ячеек по одной
+    std::unordered_map<Cell*, size_t> pending_references;
+    pending_references.reserve(cells.size());
+    for (auto cell : cells) {
+        pending_references.emplace(cell, 0);
+    }
+    std::vector<Cell*> ready_cells;
+    for (auto cell : cells) {
+        auto& pending = pending_references.at(cell);
+        for (auto ref : cell->ResolveReferencedCells(cell->GetImpl(), true)) {
+            ref->cells_from_.insert(cell);
+            pending += pending_references.count(ref);
+        }
+        cell->BindReferencedCells();
+        if (pending == 0) {
+            ready_cells.push_back(cell);
+        }
+    }
+
+    size_t ordered_count = 0;
+    while (!ready_cells.empty()) {
+        auto cell = ready_cells.back();
+        ready_cells.pop_back();
+        ++ordered_count;
+        for (auto ref : cell->ResolveReferencedCells(cell->GetImpl(), false)) {
+            cell->level_ = std::max(cell->level_, ref->level_ + 1);
+        }
+        cell->sheet_->UpdateColumnLevel(cell->pos_.col, cell->level_);
+        for (auto cell_from : cell->cells_from_) {
+            auto it = pending_references.find(cell_from);
+            if (it != pending_references.end() && --it->second == 0) {
+                ready_cells.push_back(cell_from);
+            }
+        }
+    }
+    // Ячейки цикла так и не становятся готовыми
+    if (ordered_count != cells.size()) {
+        throw CircularDependencyException("Found circular dependency"s);
+    }
 }
 
 Cell::Value Cell::GetValue() const {
-    return impl_->GetValue();
+    // Значения, вычисленные для этого значения, не вытесняются до его получения
+    ValueCache::Evaluation evaluation(sheet_->GetValueCache());
+    if (!HasCache() && IsFormula()
+        && sheet_->GetEvaluationStrategy() == EvaluationStrategy::Iterative) {
+        if (probing) {
+            throw MissingValue{this};
+        }
+        EvaluateReferencedCells();
+    }
+    return EvaluateImpl();
 }
 std::string Cell::GetText() const {
-    return impl_->GetText();
+    return std::string(GetImpl().GetText());
+}
+
+std::string_view Cell::GetTextView() const {
+    return GetImpl().GetText();
+}
+
+CellValueView Cell::GetValueView() const {
+    ValueCache::Evaluation evaluation(sheet_->GetValueCache());
+    if (!HasCache() && IsFormula()) {
+        if (sheet_->GetEvaluationStrategy() == EvaluationStrategy::Iterative) {
+            EvaluateReferencedCells();
+        }
+        EvaluateImpl();
+    }
+    return GetImpl().GetValueView();
+}
+
+Cell::Value Cell::GetValue(const EvaluationLimits& limits) const {
+    ValueCache::Evaluation evaluation(sheet_->GetValueCache());
+    if (!HasCache() && IsFormula()) {
+        EvaluateReferencedCells(&limits);
+    }
+    return EvaluateImpl();
+}
+
+Cell::Value Cell::EvaluateImpl() const {
+    bool evaluated = !HasCache();
+    if (evaluated) {
+        EvaluateColumnBatch();
+    }
+    Value value;
+    {
+        // Формула читает значения других ячеек: пока она вычисляется, её реализация не выгружается
+        ImplPin pin;
+        value = GetImpl().GetValue();
+    }
+    // Вычисленное значение формулы поиска нужно сбросить при следующем изменении её областей
+    if (evaluated && has_ranges_) {
+        for (const auto& [sheet, range] : ResolveReferencedRanges(GetImpl())) {
+            sheet->ArmRangeDependent(const_cast<Cell*>(this), range.first, range.last);
+        }
+    }
+    return value;
+}
+
+void Cell::EvaluateColumnBatch() const {
+    auto formula_impl = dynamic_cast<const FormulaImpl*>(impl_.get());
+    auto program = formula_impl ? formula_impl->GetBatchProgram() : nullptr;
+    if (!program || !batch::IsEnabled()) {
+        return;
+    }
+    // Пакет ничего не вычисляет рекурсивно: значения всех ссылок строки должны быть известны.
+    // Ссылка на невычисленную формулу (в том числе на строку самого пакета) завершает пакет
+    auto has_operand_values = [](const FormulaImpl& impl) {
+        const auto& cells = impl.GetBoundCells();
+        for (auto slot : impl.GetBatchProgram()->GetSlots()) {
+            // К слотам привязываются ячейки таблиц книги
+            auto cell = slot < cells.size() ? static_cast<const Cell*>(cells[slot]) : nullptr;
+            if (!cell || cell->IsPagedOut() || !cell->HasValue()) {
+                return false;
+            }
+        }
+        return true;
+    };
+    std::vector<const FormulaImpl*> rows;
+    for (Position pos = pos_; pos.row < Position::MAX_ROWS && rows.size() < BATCH_MAX_ROWS; ++pos.row) {
+        const Cell* cell = pos.row == pos_.row ? this : sheet_->GetConcreteCell(pos);
+        auto impl = cell && !cell->IsPagedOut() ? dynamic_cast<const FormulaImpl*>(cell->impl_.get()) : nullptr;
+        if (!impl || impl->HasCache()) {
+            break;
+        }
+        auto row_program = impl->GetBatchProgram();
+        if (!row_program || (row_program != program && *row_program != *program) || !has_operand_values(*impl)) {
+            break;
+        }
+        rows.push_back(impl);
+    }
+    if (rows.size() < BATCH_MIN_ROWS) {
+        return;
+    }
+
+    // Значения записываются в кэш значений таблицы: до конца пакета они не вытесняются
+    ValueCache::Evaluation evaluation(sheet_->GetValueCache());
+    ImplPin pin;
+    const size_t refs = program->GetSlots().size();
+    std::vector<double> operands(refs * batch::LANES);
+    std::vector<batch::LaneError> operand_errors(refs * batch::LANES);
+    std::vector<const double*> operand_columns(refs);
+    std::vector<const batch::LaneError*> error_columns(refs);
+    for (size_t i = 0; i < refs; ++i) {
+        operand_columns[i] = operands.data() + i * batch::LANES;
+        error_columns[i] = operand_errors.data() + i * batch::LANES;
+    }
+    std::vector<double> results(batch::LANES);
+    std::vector<batch::LaneError> errors(batch::LANES);
+    for (size_t first = 0; first < rows.size(); first += batch::LANES) {
+        size_t count = std::min(batch::LANES, rows.size() - first);
+        // Значения ссылок собираются по столбцам программы: ссылки строк различаются позициями
+        for (size_t k = 0; k < count; ++k) {
+            const auto& cells = rows[first + k]->GetBoundCells();
+            const auto& slots = rows[first + k]->GetBatchProgram()->GetSlots();
+            for (size_t i = 0; i < refs; ++i) {
+                auto cell = static_cast<const Cell*>(cells[slots[i]]);
+                auto operand = GetOperandValue(cell->GetImpl().GetValueView());
+                auto value = std::get_if<double>(&operand);
+                operands[i * batch::LANES + k] = value ? *value : 0.0;
+                operand_errors[i * batch::LANES + k] =
+                    value ? batch::NO_ERROR : batch::ToLaneError(std::get<FormulaError>(operand).GetCategory());
+            }
+        }
+        program->Execute(count, operand_columns.data(), error_columns.data(), results.data(), errors.data());
+        for (size_t k = 0; k < count; ++k) {
+            if (errors[k] == batch::NO_ERROR) {
+                rows[first + k]->SetCachedValue(results[k]);
+            } else {
+                rows[first + k]->SetCachedValue(FormulaError(batch::ToCategory(errors[k])));
+            }
+        }
+    }
 }
 
 std::vector<Position> Cell::GetReferencedCells() const {
-    auto formula_impl = dynamic_cast<FormulaImpl*>(impl_.get());
+    auto formula_impl = dynamic_cast<FormulaImpl*>(&GetImpl());
     if (!formula_impl) {
         return {};
     }
@@ -69,81 +346,461 @@ std::vector<Position> Cell::GetReferencedCells() const {
 }
 
 bool Cell::IsEmpty() const {
-    return dynamic_cast<EmptyImpl*>(impl_.get());
+    return dynamic_cast<EmptyImpl*>(&GetImpl());
+}
+
+bool Cell::IsFormula() const {
+    return dynamic_cast<FormulaImpl*>(&GetImpl());
+}
+
+void Cell::DropCache() const {
+    // Подписчики таблицы узнают об изменении по сброшенному кэшу
+    if (sheet_->IsSubscribed(pos_)) {
+        sheet_->RecordValueChange(pos_, impl_ ? impl_->GetCachedValue() : std::nullopt);
+    }
+    if (impl_) {
+        impl_->InvalidateCache();
+    } else {
+        paged_out_cache_ = PagedCache::None;
+    }
 }
 
 void Cell::InvalidateCache() {
-    impl_->InvalidateCache();
+    DropCache();
     
-    // Если были ячейки, которые зависят от текущей ячейки: сбрасываем их кэш значений тоже
-    for (auto cell_from : cells_from_) {
-        cell_from->InvalidateCache();
+    // Если были ячейки, которые зависят от текущей ячейки: сбрасываем их кэш значений тоже.
+    // Если кэш зависимой ячейки уже пуст, то пусты и кэши всех ячеек, зависящих от неё
+    // (при вычислении любой из них кэш этой ячейки был бы заполнен). Вытесненное из кэша
+    // значение таблицы действительно: зависимые от него значения сбрасываются.
+    // Обход без рекурсии: цепочка зависимостей может быть сколь угодно длинной
+    // Формулы поиска зависят от всех ячеек своих областей, хотя не связаны с ними через cells_from_
+    std::vector<const Cell*> cells_to_invalidate{this};
+    std::vector<Cell*> range_dependents;
+    auto invalidate = [&cells_to_invalidate](const Cell* cell_from) {
+        if (cell_from->IsValueValid()) {
+            cell_from->DropCache();
+            cells_to_invalidate.push_back(cell_from);
+        }
+    };
+    while (!cells_to_invalidate.empty()) {
+        auto cell = cells_to_invalidate.back();
+        cells_to_invalidate.pop_back();
+        range_dependents.clear();
+        cell->sheet_->MarkValueChanged(cell->pos_, range_dependents);
+        for (auto cell_from : range_dependents) {
+            invalidate(cell_from);
+        }
+        for (auto cell_from : cell->cells_from_) {
+            invalidate(cell_from);
+        }
     }
 }
 
-void Cell::ClearLinksFrom() {
-    // У ячеек, от которых зависело значение тек. ячейки: убираем связь
-    for (auto referenced_cell : GetReferencedCells()) {
-        if (!referenced_cell.IsValid()) {
+void Cell::EvaluateReferencedCells(const EvaluationLimits* limits) const {
+    // Обход в глубину с явным стеком: ячейка вычисляется после всех невычисленных
+    // формул, на которые она ссылается. К моменту вычисления ячейки значения её ссылок
+    // уже в кэше, поэтому вложенность вызовов GetValue не превышает одного уровня
+    // независимо от длины цепочки.
+    // Условные формулы (IF, AND, OR) не запрашивают значения всех своих ссылок, поэтому
+    // их ссылки заранее не вычисляются: формула вычисляется пробно, и ячейка, значение
+    // которой понадобилось, вычисляется перед повторной попыткой
+    struct Frame {
+        const Cell* cell;
+        bool expanded;
+    };
+    std::vector<Frame> stack{{this, false}};
+    while (!stack.empty()) {
+        auto& frame = stack.back();
+        auto cell = frame.cell;
+        if (cell->HasCache()) {
+            stack.pop_back();
             continue;
         }
-        auto cell = dynamic_cast<Cell*>(sheet_->GetCell(referenced_cell));
-        if (cell) {
-            cell->cells_from_.erase(this);
+        if (frame.expanded) {
+            if (limits) {
+                limits->Check();
+            }
+            stack.pop_back();
+            cell->EvaluateImpl();
+            continue;
+        }
+        if (cell->GetImpl().IsConditional()) {
+            if (limits) {
+                limits->Check();
+            }
+            try {
+                probing = true;
+                cell->EvaluateImpl();
+                probing = false;
+                stack.pop_back();
+            } catch (const MissingValue& missing) {
+                probing = false;
+                stack.push_back({missing.cell, false});
+            } catch (...) {
+                probing = false;
+                throw;
+            }
+            continue;
+        }
+        frame.expanded = true;
+        for (auto ref : cell->ResolveReferencedCells(cell->GetImpl(), false)) {
+            if (!ref->HasCache() && ref->IsFormula()) {
+                stack.push_back({ref, false});
+            }
         }
     }
 }
 
+void Cell::ShiftReferences(const Sheet& sheet, std::string_view sheet_name,
+                           const std::function<Position(Position)>& shift) {
+    ImplPin pin;
+    auto formula_impl = dynamic_cast<FormulaImpl*>(&GetImpl());
+    if (!formula_impl) {
+        return;
+    }
+
+    // Формула может быть общей для нескольких ячеек книги: изменяется только своя копия.
+    // Изменённая формула больше не соответствует тексту, под которым она хранится в кэше книги
+    auto& formula = formula_impl->GetFormula();
+    if (formula.use_count() > 1) {
+        formula = formula->Clone();
+    } else {
+        sheet_->ForgetFormula(formula_impl->GetInitialText().substr(1), *formula);
+    }
+
+    bool changed = false;
+    if (sheet_ == &sheet) {
+        changed |= formula->ShiftReferences(""sv, shift);
+    }
+    if (!sheet_name.empty()) {
+        changed |= formula->ShiftReferences(sheet_name, shift);
+    }
+    // Копия формулы - новые слоты ссылок, удалённые ячейки - ссылки #REF!
+    BindReferencedCells();
+    if (changed) {
+        formula_impl->UpdateText();
+        InvalidateCache();
+    }
+}
+
+void Cell::AddMemoryUsage(MemoryUsage& usage) const {
+    usage.cells += sizeof(*this);
+    // std::hash для указателей быстрый: хэш в узлах не хранится
+    usage.dependency_sets += memory_usage::HashTableSize(cells_from_, /* hash_cached = */ false);
+    // Реализация выгруженной ячейки не занимает памяти
+    if (impl_) {
+        impl_->AddMemoryUsage(usage);
+    }
+}
+
+void Cell::PageOut(std::string& buffer) {
+    auto formula_impl = dynamic_cast<FormulaImpl*>(impl_.get());
+    auto text = impl_->GetInitialText();
+    if (formula_impl && text.find(FormulaError(FormulaError::Category::Ref).ToString()) != std::string_view::npos) {
+        AppendRaw(buffer, PagedImpl::Resident);
+        return;
+    }
+    if (dynamic_cast<EmptyImpl*>(impl_.get())) {
+        AppendRaw(buffer, PagedImpl::Empty);
+    } else {
+        AppendRaw(buffer, formula_impl ? PagedImpl::Formula : PagedImpl::Text);
+        AppendRaw(buffer, static_cast<uint32_t>(text.size()));
+        buffer.append(text);
+    }
+    if (formula_impl) {
+        auto value = formula_impl->GetCachedValue();
+        if (value) {
+            paged_out_cache_ = PagedCache::Value;
+        } else {
+            paged_out_cache_ = formula_impl->IsValueEvicted() ? PagedCache::Evicted : PagedCache::None;
+        }
+        if (!value) {
+            AppendRaw(buffer, PagedValue::None);
+        } else if (std::holds_alternative<double>(*value)) {
+            AppendRaw(buffer, PagedValue::Number);
+            AppendRaw(buffer, std::get<double>(*value));
+        } else {
+            AppendRaw(buffer, PagedValue::Error);
+            AppendRaw(buffer, std::get<FormulaError>(*value).GetCategory());
+        }
+    }
+    impl_.reset();
+}
+
+void Cell::PageIn(std::string_view& buffer) {
+    auto kind = ReadRaw<PagedImpl>(buffer);
+    if (kind == PagedImpl::Resident) {
+        return;
+    }
+    std::string text;
+    if (kind != PagedImpl::Empty) {
+        auto size = ReadRaw<uint32_t>(buffer);
+        text = buffer.substr(0, size);
+        buffer.remove_prefix(size);
+    }
+    std::optional<Value> value;
+    if (kind == PagedImpl::Formula) {
+        auto value_kind = ReadRaw<PagedValue>(buffer);
+        if (value_kind == PagedValue::Number) {
+            value = ReadRaw<double>(buffer);
+        } else if (value_kind == PagedValue::Error) {
+            value = FormulaError(ReadRaw<FormulaError::Category>(buffer));
+        }
+    }
+    // Ячейка могла получить новое содержимое, пока её область была выгружена
+    if (impl_) {
+        return;
+    }
+
+    if (kind == PagedImpl::Empty) {
+        impl_ = std::make_unique<EmptyImpl>();
+    } else if (kind == PagedImpl::Text) {
+        impl_ = std::make_unique<TextImpl>(sheet_->InternText(std::move(text)));
+    } else {
+        // Текст формулы был принят при задании ячейки, поэтому разбирается без ошибок
+        auto formula = sheet_->InternFormula(text.substr(1));
+        auto formula_impl = std::make_unique<FormulaImpl>(std::move(text), std::move(formula), *sheet_,
+                                                           sheet_->GetValueCache());
+        if (value && paged_out_cache_ == PagedCache::Value) {
+            formula_impl->SetCachedValue(*value);
+        } else if (paged_out_cache_ == PagedCache::Evicted) {
+            formula_impl->MarkValueEvicted();
+        }
+        impl_ = std::move(formula_impl);
+        BindReferencedCells();
+    }
+    paged_out_cache_ = PagedCache::None;
+}
+
+Cell::Impl& Cell::GetImpl() const {
+    if (!impl_) {
+        sheet_->TouchRegion(pos_);
+    }
+    return *impl_;
+}
+
+void Cell::Detach() {
+    ClearLinksFrom();
+    DetachRanges();
+    InvalidateCache();
+}
+
+void Cell::DetachRanges() {
+    if (!has_ranges_) {
+        return;
+    }
+    for (const auto& [sheet, range] : ResolveReferencedRanges(GetImpl())) {
+        sheet->RemoveRangeDependent(this, range.first, range.last);
+    }
+    has_ranges_ = false;
+}
+
+void Cell::AttachRanges() {
+    // Ячейки областей поиска не создаются: таблицы областей сами сообщают об их изменении
+    for (const auto& [sheet, range] : ResolveReferencedRanges(GetImpl())) {
+        sheet->AddRangeDependent(this, range.first, range.last);
+        has_ranges_ = true;
+    }
+    // Новая связь не взведена (см. Sheet::ArmRangeDependent): значение, вычисленное до неё,
+    // не сбросилось бы при изменении области. При переносе ячеек значение к тому же могло
+    // измениться вместе с областью, поэтому оно вычисляется заново
+    if (has_ranges_ && IsValueValid()) {
+        InvalidateCache();
+    }
+}
+
+void Cell::ClearLinksFrom() {
+    // У ячеек, от которых зависело значение тек. ячейки: убираем связь
+    for (auto cell : ResolveReferencedCells(GetImpl(), false)) {
+        cell->cells_from_.erase(this);
+    }
+}
+
 void Cell::CreateLinksFrom() {
     // У ячеек, от которых зависит значение тек. ячейки: устанавливаем связь к тек. ячейке
-    for (auto referenced_cell : GetReferencedCells()) {
-        if (!referenced_cell.IsValid()) {
-            continue;
+    for (auto cell : ResolveReferencedCells(GetImpl(), true)) {
+        cell->cells_from_.insert(this);
+    }
+    BindReferencedCells();
+}
+
+void Cell::BindReferencedCells() {
+    auto formula_impl = dynamic_cast<FormulaImpl*>(impl_.get());
+    if (!formula_impl) {
+        return;
+    }
+    std::vector<const CellInterface*> cells;
+    for (const auto& ref : formula_impl->GetFormula()->GetCellSlots()) {
+        auto sheet = ref.IsExternal() ? sheet_->FindSheet(ref.sheet) : sheet_;
+        cells.push_back(sheet && ref.pos.IsValid() ? sheet->GetConcreteCell(ref.pos) : nullptr);
+    }
+    formula_impl->BindCells(std::move(cells));
+}
+
+std::vector<Cell*> Cell::ResolveReferencedCells(const Impl& impl, bool create) const {
+    // Создание ячейки может загрузить область таблицы, пока используется реализация impl
+    std::optional<ImplPin> pin;
+    if (create) {
+        pin.emplace();
+    }
+    std::vector<Cell*> cells;
+    auto resolve = [&cells, create](Sheet* sheet, Position pos) {
+        if (!sheet || !pos.IsValid()) {
+            return;
         }
+        auto cell = sheet->GetConcreteCell(pos);
         // Если ячейки из формулы не существует: создаем пустую ячейку
-        auto cell = dynamic_cast<Cell*>(sheet_->GetCell(referenced_cell));
-        if (!cell) {
-            sheet_->SetCell(referenced_cell, ""s);
-            cell = dynamic_cast<Cell*>(sheet_->GetCell(referenced_cell));
+        if (!cell && create) {
+            sheet->SetCell(pos, ""s);
+            cell = sheet->GetConcreteCell(pos);
         }
-        cell->cells_from_.insert(this);
+        if (cell) {
+            cells.push_back(cell);
+        }
+    };
+    for (auto referenced_cell : impl.GetReferencedCells()) {
+        resolve(sheet_, referenced_cell);
+    }
+    for (const auto& referenced_cell : impl.GetExternalReferencedCells()) {
+        resolve(sheet_->FindSheet(referenced_cell.sheet), referenced_cell.pos);
     }
+    return cells;
 }
 
-bool Cell::CheckCircularDependency(const std::vector<Position>& referenced_cells) const {
-    for (auto referenced_cell : referenced_cells) {
-        std::vector<Position> checked_cells;
-        if (CheckCircularDependency(referenced_cell, checked_cells)) {
-            return true;
+std::vector<std::pair<Sheet*, CellRange>> Cell::ResolveReferencedRanges(const Impl& impl) const {
+    std::vector<std::pair<Sheet*, CellRange>> ranges;
+    for (auto& range : impl.GetReferencedRanges()) {
+        auto sheet = range.IsExternal() ? sheet_->FindSheet(range.sheet) : sheet_;
+        if (sheet) {
+            ranges.emplace_back(sheet, std::move(range));
         }
     }
-    return false;
+    return ranges;
 }
 
-bool Cell::CheckCircularDependency(Position cell_position, std::vector<Position>& checked_cells) const {
-    if (!cell_position.IsValid()) {
-        return false;
+void Cell::UpdateLevel() {
+    level_ = 0;
+    for (auto cell : ResolveReferencedCells(GetImpl(), false)) {
+        level_ = std::max(level_, cell->level_ + 1);
     }
-    auto cell = sheet_->GetConcreteCell(cell_position);
-    if (!cell) {
-        return false;
+    // Уровень формулы поиска выше уровней всех ячеек столбцов её областей
+    for (const auto& [sheet, range] : ResolveReferencedRanges(GetImpl())) {
+        for (int col = range.first.col; col <= range.last.col; ++col) {
+            level_ = std::max(level_, sheet->GetColumnLevel(col) + 1);
+        }
     }
-    if (cell == this) {
-        return true;
+
+    // Повышаем уровни зависимых ячеек, чтобы они оставались выше уровня текущей ячейки
+    // (понижать не обязательно: важен только порядок)
+    std::vector<Cell*> cells_to_update{this};
+    std::vector<Cell*> range_dependents;
+    while (!cells_to_update.empty()) {
+        auto cell = cells_to_update.back();
+        cells_to_update.pop_back();
+        cell->sheet_->UpdateColumnLevel(cell->pos_.col, cell->level_);
+        auto raise = [&cells_to_update, cell](Cell* cell_from) {
+            if (cell_from->level_ <= cell->level_) {
+                cell_from->level_ = cell->level_ + 1;
+                cells_to_update.push_back(cell_from);
+            }
+        };
+        range_dependents.clear();
+        cell->sheet_->GetRangeDependentsToRaise(cell->pos_, cell->level_, range_dependents);
+        for (auto cell_from : range_dependents) {
+            raise(cell_from);
+        }
+        for (auto cell_from : cell->cells_from_) {
+            raise(cell_from);
+        }
     }
+}
 
-    // Помечаем ячейку, что мы её прошли
-    checked_cells.push_back(cell_position);
+void Cell::Recalculate(std::optional<Value> old_value) {
+    // Ячейки пересчитываются по возрастанию уровня: к моменту пересчёта ячейки
+    // все изменившиеся ячейки, от которых она зависит, уже пересчитаны
+    auto by_level = [](const Cell* lhs, const Cell* rhs) {
+        return lhs->level_ > rhs->level_;
+    };
+    std::priority_queue<Cell*, std::vector<Cell*>, decltype(by_level)> cells_to_recalculate(by_level);
+    std::unordered_set<Cell*> queued_cells;
+    size_t recalculated_count = 0;
+    std::vector<Cell*> range_dependents;
+    if (sheet_->IsSubscribed(pos_)) {
+        sheet_->RecordValueChange(pos_, old_value);
+    }
 
-    // Проходим по ячейкам, от которых зависит cell_position
-    auto next_cells = cell->GetReferencedCells();
-    for (auto next_cell : next_cells) {
-        if (std::find(checked_cells.begin(), checked_cells.end(), next_cell) != checked_cells.end()) {
-            return true;
+    auto recalculate = [&](Cell* cell, const std::optional<Value>& old_value) {
+        ++recalculated_count;
+        // Если значение не изменилось: зависимые ячейки пересчитывать не нужно
+        if (old_value && *old_value == cell->GetValue()) {
+            return;
+        }
+        range_dependents.clear();
+        cell->sheet_->MarkValueChanged(cell->pos_, range_dependents);
+        for (auto cell_from : range_dependents) {
+            if (queued_cells.insert(cell_from).second) {
+                cells_to_recalculate.push(cell_from);
+            }
         }
-        if (CheckCircularDependency(next_cell, checked_cells)) {
+        for (auto cell_from : cell->cells_from_) {
+            if (queued_cells.insert(cell_from).second) {
+                cells_to_recalculate.push(cell_from);
+            }
+        }
+    };
+
+    recalculate(this, old_value);
+    while (!cells_to_recalculate.empty()) {
+        auto cell = cells_to_recalculate.top();
+        cells_to_recalculate.pop();
+        auto cell_old_value = cell->GetImpl().GetCachedValue();
+        cell->DropCache();
+        recalculate(cell, cell_old_value);
+    }
+    sheet_->AddRecalculatedCells(recalculated_count);
+}
+
+bool Cell::CheckCircularDependency(const std::vector<Cell*>& referenced_cells,
+                                   const std::vector<std::pair<Sheet*, CellRange>>& referenced_ranges) const {
+    // Формула поиска зависит от всех ячеек своих областей (в том числе ещё не созданных)
+    auto in_ranges = [&referenced_ranges](const Cell* cell) {
+        return std::any_of(referenced_ranges.begin(), referenced_ranges.end(), [cell](const auto& range) {
+            return range.first == cell->sheet_ && range.second.Contains(cell->pos_);
+        });
+    };
+    if (in_ranges(this)) {
+        return true;
+    }
+    std::unordered_set<const Cell*> referenced;
+    for (auto cell : referenced_cells) {
+        if (cell == this) {
             return true;
         }
+        referenced.insert(cell);
+    }
+    if (referenced.empty() && referenced_ranges.empty()) {
+        return false;
+    }
+
+    // Цикл возникает, если какая-то из ячеек формулы сама (транзитивно) зависит от текущей ячейки:
+    // обходим зависимые ячейки (обычно их меньше, чем ячеек, от которых зависит формула)
+    std::unordered_set<const Cell*> checked_cells{this};
+    std::vector<const Cell*> cells_to_check{this};
+    std::vector<Cell*> range_dependents;
+    while (!cells_to_check.empty()) {
+        auto cell = cells_to_check.back();
+        cells_to_check.pop_back();
+        range_dependents.clear();
+        cell->sheet_->GetRangeDependents(cell->pos_, range_dependents);
+        range_dependents.insert(range_dependents.end(), cell->cells_from_.begin(), cell->cells_from_.end());
+        for (auto cell_from : range_dependents) {
+            if (referenced.count(cell_from) || in_ranges(cell_from)) {
+                return true;
+            }
+            if (checked_cells.insert(cell_from).second) {
+                cells_to_check.push_back(cell_from);
+            }
+        }
     }
     return false;
 }
@@ -1,8 +1,11 @@
 #pragma once
 
 #include "common.h"
+#include "executor.h"
 #include "formula.h"
 #include "sheet.h"
+#include "string_pool.h"
+#include "value_cache.h"
 
 #include <algorithm>
 #include <optional>
@@ -12,9 +15,25 @@ using namespace std::literals;
 
 class Sheet;
 
+// Пока в текущем потоке существует объект ImplPin, реализации ячеек не выгружаются на диск
+// (см. Sheet::EnablePaging): выше по стеку вызовов используется ссылка на реализацию
+class ImplPin {
+public:
+    ImplPin() { ++pin_count_; }
+    ~ImplPin() { --pin_count_; }
+
+    ImplPin(const ImplPin&) = delete;
+    ImplPin& operator=(const ImplPin&) = delete;
+
+    static bool IsAnyPinned() { return pin_count_ > 0; }
+
+private:
+    static thread_local size_t pin_count_;
+};
+
 class Cell : public CellInterface {
 public:
-    explicit Cell(Sheet* sheet);
+    Cell(Sheet* sheet, Position pos);
     Cell(Cell&&) = default;
     Cell& operator=(Cell&&) = default;
     ~Cell();
@@ -22,10 +41,67 @@ public:
 public:
     void Set(std::string text);
     void Clear();
+    // Пакетная загрузка (см. Sheet::LoadCells): задаёт содержимое новой ячейки без проверки
+    // циклов и без связей; при успехе text перемещается в ячейку. Формула parsed, если
+    // передана, уже разобрана из text. Возвращает false и не изменяет ячейку, если формула
+    // ищет значения в областях или ссылается на другие таблицы книги: такие ячейки
+    // задаются через Set
+    bool Load(std::string& text, std::shared_ptr<FormulaInterface> parsed = nullptr);
+    // Текст задаёт формулу (начинается со знака "=" и не состоит только из него)
+    static bool IsFormulaText(const std::string& text) { return FormulaImpl::IsFormulaText(text); }
+    // Связывает загруженные ячейки cells с ячейками, на которые они ссылаются, и вычисляет
+    // их уровни за один проход в топологическом порядке. Если ячейки образуют цикл,
+    // бросает CircularDependencyException
+    static void LinkLoaded(const std::vector<Cell*>& cells);
     Value GetValue() const override;
     std::string GetText() const override;    
+    // Текст ячейки без копирования (действителен до следующего изменения ячейки, а если
+    // таблица выгружает ячейки на диск, - до следующего обращения к таблице)
+    std::string_view GetTextView() const;
+    CellValueView GetValueView() const;
+    // Вычисляет значение ячейки итеративно (независимо от способа вычисления таблицы),
+    // проверяя limits перед вычислением каждой формулы. При отмене бросает
+    // EvaluationCancelledException; уже вычисленные значения остаются в кэше,
+    // и повторный вызов продолжает вычисление с места остановки
+    Value GetValue(const EvaluationLimits& limits) const;
+    // Значение известно без вычисления (ячейка не формула или значение формулы в кэше)
+    bool HasValue() const { return !IsFormula() || HasCache(); }
     std::vector<Position> GetReferencedCells() const override;
     bool IsEmpty() const;
+    bool IsFormula() const;
+
+    // Ячейки, которые непосредственно зависят от текущей ячейки
+    const std::unordered_set<Cell*>& GetDependentCells() const { return cells_from_; }
+    // Сбрасывает кэш значения только текущей ячейки (без зависимых ячеек)
+    void DropCache() const;
+
+    // Переводит ссылки формулы на ячейки таблицы sheet (с именем sheet_name в книге)
+    // функцией shift после вставки или удаления строк и столбцов
+    void ShiftReferences(const Sheet& sheet, std::string_view sheet_name,
+                         const std::function<Position(Position)>& shift);
+    // Удаляет связи с ячейками, от которых зависит ячейка, перед удалением ячейки из таблицы
+    void Detach();
+    // Снимает связи формулы с областями поиска и восстанавливает их (при переносе ячеек
+    // таблицы, в которой находятся области, - после изменения ссылок). Восстановление
+    // сбрасывает значение формулы и зависимых от неё ячеек
+    void DetachRanges();
+    void AttachRanges();
+
+    Position GetPosition() const { return pos_; }
+    // Переносит ячейку на позицию pos при вставке и удалении строк и столбцов
+    void SetPosition(Position pos) { pos_ = pos; }
+    size_t GetLevel() const { return level_; }
+
+    // Добавляет к usage память ячейки, её реализации и множества зависимых ячеек
+    void AddMemoryUsage(MemoryUsage& usage) const;
+
+    // Выгрузка на диск (см. Sheet::EnablePaging). PageOut дописывает в buffer текст ячейки и
+    // значение формулы в кэше и освобождает реализацию; формула с недействительной ссылкой
+    // (#REF!) остаётся в памяти, так как её текст не разбирается заново. PageIn восстанавливает
+    // реализацию из начала buffer и сдвигает buffer за прочитанную запись
+    void PageOut(std::string& buffer);
+    void PageIn(std::string_view& buffer);
+    bool IsPagedOut() const { return !impl_; }
 
 private:
     class Impl {
@@ -35,34 +111,61 @@ private:
 
         public:
             virtual Value GetValue() const = 0;
-            virtual std::string GetText() const = 0;
-            virtual std::string GetInitialText() const = 0;
+            virtual CellValueView GetValueView() const = 0;
+            virtual std::string_view GetText() const = 0;
+            virtual std::string_view GetInitialText() const = 0;
             virtual void InvalidateCache() const {}
+            virtual bool HasCache() const { return false; }
+            // Значение вычислено, но вытеснено из кэша значений таблицы
+            virtual bool IsValueEvicted() const { return false; }
+            // Значение ячейки, если оно известно без вычисления
+            virtual std::optional<Value> GetCachedValue() const { return GetValue(); }
             virtual std::vector<Position> GetReferencedCells() const { return {}; }
+            virtual std::vector<CellReference> GetExternalReferencedCells() const { return {}; }
+            virtual std::vector<CellRange> GetReferencedRanges() const { return {}; }
+            // Значения ссылок запрашиваются в зависимости от условий (см. FormulaInterface::IsConditional)
+            virtual bool IsConditional() const { return false; }
+            virtual void AddMemoryUsage(MemoryUsage& usage) const = 0;
     };
     class EmptyImpl final : public Impl {
         public:
             Value GetValue() const override { return ""s; }
-            std::string GetText() const override { return ""s; }
-            std::string GetInitialText() const override { return ""s; }
+            CellValueView GetValueView() const override { return ""sv; }
+            std::string_view GetText() const override { return ""sv; }
+            std::string_view GetInitialText() const override { return ""sv; }
+            void AddMemoryUsage(MemoryUsage& usage) const override { usage.impls += sizeof(*this); }
     };
     class TextImpl final : public Impl {
         public:
-            TextImpl(std::string text = ""s) :
-                text_(text) 
+            // Текст хранится в пуле строк таблицы (см. Sheet::InternText)
+            explicit TextImpl(StringPool::Handle text = {}) :
+                text_(std::move(text))
             {}
 
         public:
             Value GetValue() const override { 
-                return (text_.size() > 0 && text_.at(0) == '\''
-                        ? std::string(text_.begin() + 1, text_.end())
-                        : text_);
+                return std::string(std::get<std::string_view>(GetValueView()));
+            }
+            CellValueView GetValueView() const override {
+                std::string_view text = text_.Get();
+                if (!text.empty() && text.front() == '\'') {
+                    text.remove_prefix(1);
+                }
+                return text;
+            }
+            std::string_view GetText() const override { return text_.Get(); }
+            std::string_view GetInitialText() const override { return text_.Get(); }
+            const StringPool::Handle& GetHandle() const { return text_; }
+            void AddMemoryUsage(MemoryUsage& usage) const override {
+                usage.impls += sizeof(*this);
+                // Строка пула делится между всеми ячейками с этим текстом
+                if (auto owners = text_.GetRefCount()) {
+                    usage.text_payloads += text_.GetPooledSize() / owners;
+                }
             }
-            std::string GetText() const override { return text_; }
-            std::string GetInitialText() const override { return text_; }
 
         private: 
-            std::string text_;
+            StringPool::Handle text_;
     };
     class FormulaImpl final : public Impl {
         private:
@@ -70,54 +173,180 @@ private:
             static const char FORMULA_SIGN = '=';
 
         public:
-            FormulaImpl(std::string text, const SheetInterface& sheet) :
-                text_(text),
-                formula_(std::move(ParseFormula(std::string(text.begin() + 1, text.end())))),
-                sheet_(sheet) 
-            {}
+            FormulaImpl(std::string text, std::shared_ptr<FormulaInterface> formula, const SheetInterface& sheet,
+                        ValueCache& value_cache) :
+                formula_(std::move(formula)),
+                sheet_(sheet),
+                value_cache_(value_cache)
+            {
+                // Каноничный текст формулы вычисляется один раз при разборе
+                text_ = FORMULA_SIGN + formula_->GetExpression();
+                if (text != text_) {
+                    initial_text_ = std::move(text);
+                }
+                // Стоимость повторного вычисления: формулы с большим числом ссылок и
+                // с областями вытесняются из кэша значений позже
+                auto cost = 1 + formula_->GetCellSlots().size() + 4 * formula_->GetReferencedRanges().size();
+                cost_ = static_cast<uint8_t>(std::min<size_t>(cost, ValueCache::MAX_COST));
+            }
+            ~FormulaImpl() override {
+                value_cache_.Release(value_slot_);
+            }
+
+            std::shared_ptr<FormulaInterface>& GetFormula() { return formula_; }
+            // Привязывает слоты ссылок формулы к ячейкам (cells[i] - ячейка слота i)
+            void BindCells(std::vector<const CellInterface*> cells) { bound_cells_ = std::move(cells); }
+            const std::vector<const CellInterface*>& GetBoundCells() const { return bound_cells_; }
+            const batch::Program* GetBatchProgram() const { return formula_->GetBatchProgram(); }
+            // Обновляет текст после изменения ссылок формулы
+            void UpdateText() {
+                text_ = FORMULA_SIGN + formula_->GetExpression();
+                initial_text_.clear();
+            }
             
         public:
             Value GetValue() const override {
-                if (value_cache_) {
-                    return *value_cache_;
+                return ToValue(GetFormulaValue());
+            }
+            CellValueView GetValueView() const override {
+                auto value = GetFormulaValue();
+                if (std::holds_alternative<double>(value)) {
+                    return std::get<double>(value);
                 }
-                
-                FormulaInterface::Value value = formula_->Evaluate(sheet_);
+                return std::get<FormulaError>(value);
+            }
+            std::string_view GetText() const override { return text_; }
+            std::string_view GetInitialText() const override { return initial_text_.empty() ? text_ : initial_text_; }
+            void InvalidateCache() const override {
+                value_cache_.Release(value_slot_);
+                value_slot_ = ValueCache::NO_SLOT;
+            }
+            bool HasCache() const override { return ValueCache::IsStored(value_slot_); }
+            bool IsValueEvicted() const override { return value_slot_ == ValueCache::EVICTED; }
+            std::optional<Value> GetCachedValue() const override {
+                if (!HasCache()) {
+                    return std::nullopt;
+                }
+                return ToValue(value_cache_.Get(value_slot_));
+            }
+            void SetCachedValue(const Value& value) const {
                 if (std::holds_alternative<double>(value)) {
-                    value_cache_ = std::get<double>(value);
+                    value_cache_.Store(&value_slot_, std::get<double>(value), cost_);
                 } else {
-                    value_cache_ = std::get<FormulaError>(value);
+                    value_cache_.Store(&value_slot_, std::get<FormulaError>(value), cost_);
                 }
-                return *value_cache_;
             }
-            std::string GetText() const override { return '=' + formula_->GetExpression(); }
-            std::string GetInitialText() const override { return text_; }
-            void InvalidateCache() const override { value_cache_ = std::nullopt; }
+            // Значение вытеснено, пока ячейка была выгружена на диск
+            void MarkValueEvicted() const { value_slot_ = ValueCache::EVICTED; }
             std::vector<Position> GetReferencedCells() const override { return formula_->GetReferencedCells(); }
+            std::vector<CellReference> GetExternalReferencedCells() const override {
+                return formula_->GetExternalReferencedCells();
+            }
+            std::vector<CellRange> GetReferencedRanges() const override { return formula_->GetReferencedRanges(); }
+            bool IsConditional() const override { return formula_->IsConditional(); }
+            void AddMemoryUsage(MemoryUsage& usage) const override {
+                usage.impls += sizeof(*this) - sizeof(value_slot_)
+                               + bound_cells_.capacity() * sizeof(const CellInterface*);
+                // Записи кэша значений учитывает таблица
+                usage.cached_values += sizeof(value_slot_);
+                usage.formula_texts += memory_usage::StringHeapSize(text_) + memory_usage::StringHeapSize(initial_text_);
+                // Формула, общая для нескольких ячеек книги, делится между ними
+                MemoryUsage formula_usage;
+                formula_->AddMemoryUsage(formula_usage);
+                auto owners = static_cast<size_t>(formula_.use_count());
+                usage.formula_ast_nodes += formula_usage.formula_ast_nodes / owners;
+                usage.formula_cell_lists += formula_usage.formula_cell_lists / owners;
+            }
             static bool IsFormulaText(std::string text) { return (!text.empty() && text.at(0) == FORMULA_SIGN && text.size() > 1); };
 
+        private:
+            FormulaInterface::Value GetFormulaValue() const {
+                if (HasCache()) {
+                    return value_cache_.Get(value_slot_);
+                }
+                auto value = bound_cells_.empty() ? formula_->Evaluate(sheet_) : formula_->Evaluate(sheet_, bound_cells_);
+                value_cache_.Store(&value_slot_, value, cost_);
+                return value;
+            }
+            static Value ToValue(const FormulaInterface::Value& value) {
+                if (std::holds_alternative<double>(value)) {
+                    return std::get<double>(value);
+                }
+                return std::get<FormulaError>(value);
+            }
+
         private: 
+            // Каноничный текст формулы (со знаком "=")
             std::string text_;
-            std::unique_ptr<FormulaInterface> formula_;
+            // Исходный текст формулы (хранится, только если отличается от каноничного)
+            std::string initial_text_;
+            // Разобранная формула (в книге может быть общей для ячеек с одинаковым текстом формулы)
+            std::shared_ptr<FormulaInterface> formula_;
             // таблица ячейки 
             // (необходима для получения доступа к ячейкам в случае формульных ячеек, содержащих в формулах индексы на ячейки)
             const SheetInterface& sheet_;
-            // Кэш вычисленного значения
-            mutable std::optional<Value> value_cache_;
+            // Ячейки, привязанные к слотам ссылок формулы: значения читаются без поиска ячеек
+            // в таблице (пусто - формула без ссылок или ещё не связана с ячейками)
+            std::vector<const CellInterface*> bound_cells_;
+            // Кэш значений таблицы и запись вычисленного значения в нём
+            ValueCache& value_cache_;
+            mutable ValueCache::Slot value_slot_ = ValueCache::NO_SLOT;
+            // Стоимость повторного вычисления (для вытеснения из кэша значений)
+            uint8_t cost_ = 1;
     };
 
 private:
+    // Реализация ячейки (выгруженная реализация загружается вместе со своей областью)
+    Impl& GetImpl() const;
+    bool HasCache() const { return impl_ ? impl_->HasCache() : paged_out_cache_ == PagedCache::Value; }
+    // Значение вычислено и не сброшено (в том числе вытесненное из кэша значений): от такой
+    // ячейки зависимые ячейки могли получить значения, и сброс кэша проходит через неё
+    bool IsValueValid() const {
+        return impl_ ? impl_->HasCache() || impl_->IsValueEvicted() : paged_out_cache_ != PagedCache::None;
+    }
     void InvalidateCache();
     void ClearLinksFrom();
     void CreateLinksFrom();
-    bool CheckCircularDependency(const std::vector<Position>& referenced_cells) const;
-    bool CheckCircularDependency(Position cell_position, std::vector<Position>& checked_cells) const;
+    // Привязывает ссылки формулы к ячейкам, на которые они указывают. Ячейки не перемещаются
+    // в памяти, поэтому привязка обновляется только при смене формулы или её ссылок
+    void BindReferencedCells();
+    void UpdateLevel();
+    void EvaluateReferencedCells(const EvaluationLimits* limits = nullptr) const;
+    // Значение реализации (с вычислением формулы, если значения нет в кэше)
+    Value EvaluateImpl() const;
+    // Вычисляет пакетом (см. batch::Program) формулу ячейки вместе с формулами той же
+    // структуры ниже по столбцу, если таких строк набирается достаточно
+    void EvaluateColumnBatch() const;
+    // Ячейки, на которые ссылается реализация impl (в том числе ячейки других таблиц книги).
+    // Если create = true, несуществующие ячейки создаются пустыми
+    std::vector<Cell*> ResolveReferencedCells(const Impl& impl, bool create) const;
+    // Области поиска реализации impl вместе с их таблицами
+    std::vector<std::pair<Sheet*, CellRange>> ResolveReferencedRanges(const Impl& impl) const;
+    void Recalculate(std::optional<Value> old_value);
+    bool CheckCircularDependency(const std::vector<Cell*>& referenced_cells,
+                                 const std::vector<std::pair<Sheet*, CellRange>>& referenced_ranges) const;
 
 private:
+    // Реализация (nullptr - выгружена на диск)
     std::unique_ptr<Impl> impl_;
     // таблица ячейки
     Sheet* sheet_;
+    // позиция ячейки в таблице (необходима для связей с областями поиска формул)
+    Position pos_;
+    // формула ищет значения в областях (зарегистрирована в таблицах этих областей)
+    bool has_ranges_ = false;
+    // значение выгруженной формулы в кэше действительно (сбрасывается без загрузки ячейки)
+    // или действительно, но вытеснено из кэша значений
+    enum class PagedCache : uint8_t {
+        None,
+        Value,
+        Evicted,
+    };
+    mutable PagedCache paged_out_cache_ = PagedCache::None;
     // ячейки, которые ссылаются на текущую ячейку (т.е. ячейки, чье вычисление значения зависит от текущей ячейки)
     // (необходим для инвалидации кэша)
     std::unordered_set<Cell*> cells_from_;
+    // топологический уровень: больше уровня любой ячейки, от которой зависит текущая ячейка
+    // (необходим для пересчёта в режиме RecalculationMode::Eager)
+    size_t level_ = 0;
 };
\ No newline at end of file
@@ -1,7 +1,11 @@
 #pragma once
 
+#include <array>
+#include <cstddef>
+#include <functional>
 #include <iosfwd>
 #include <memory>
+#include <optional>
 #include <stdexcept>
 #include <string>
 #include <string_view>
@@ -16,16 +20,81 @@ struct Position {
     bool operator==(Position rhs) const;
     bool operator<(Position rhs) const;
 
-    bool IsValid() const;
+    constexpr bool IsValid() const {
+        return row >= 0 && col >= 0 && row < MAX_ROWS && col < MAX_COLS;
+    }
     std::string ToString() const;
+    // Записывает позицию в формате "A1" в buffer (не меньше MAX_STRING_LENGTH символов)
+    // без выделения памяти. Возвращает количество записанных символов (0 для некорректной позиции).
+    constexpr size_t ToChars(char* buffer) const;
 
     static Position FromString(std::string_view str);
 
     static const int MAX_ROWS = 16384;
     static const int MAX_COLS = 16384;
+    // Длина самой длинной позиции "XFD16384"
+    static const size_t MAX_STRING_LENGTH = 8;
     static const Position NONE;
 };
 
+namespace position_codec {
+
+inline constexpr int LETTERS = 26;
+
+// Пары цифр "00", "01", ..., "99": номер строки записывается по две цифры за шаг
+inline constexpr auto DIGIT_PAIRS = [] {
+    std::array<char, 200> pairs{};
+    for (int i = 0; i < 100; ++i) {
+        pairs[2 * i] = static_cast<char>('0' + i / 10);
+        pairs[2 * i + 1] = static_cast<char>('0' + i % 10);
+    }
+    return pairs;
+}();
+
+// Количество букв в названии столбца: A..Z, AA..ZZ, AAA..XFD
+constexpr size_t LetterCount(int col) {
+    return col < LETTERS ? 1 : col < LETTERS + LETTERS * LETTERS ? 2 : 3;
+}
+
+constexpr size_t DigitCount(int number) {
+    return number < 10 ? 1 : number < 100 ? 2 : number < 1000 ? 3 : number < 10000 ? 4 : 5;
+}
+
+static_assert(LetterCount(Position::MAX_COLS - 1) + DigitCount(Position::MAX_ROWS) <= Position::MAX_STRING_LENGTH);
+static_assert(Position::MAX_ROWS < 100000);
+
+}  // namespace position_codec
+
+constexpr size_t Position::ToChars(char* buffer) const {
+    using namespace position_codec;
+
+    if (!IsValid()) {
+        return 0;
+    }
+
+    size_t letter_count = LetterCount(col);
+    for (int c = col, i = static_cast<int>(letter_count) - 1; i >= 0; c = c / LETTERS - 1, --i) {
+        buffer[i] = static_cast<char>('A' + c % LETTERS);
+    }
+
+    int number = row + 1;
+    size_t length = letter_count + DigitCount(number);
+    char* digit = buffer + length;
+    while (number >= 100) {
+        int pair = number % 100 * 2;
+        *--digit = DIGIT_PAIRS[pair + 1];
+        *--digit = DIGIT_PAIRS[pair];
+        number /= 100;
+    }
+    if (number >= 10) {
+        *--digit = DIGIT_PAIRS[number * 2 + 1];
+        *--digit = DIGIT_PAIRS[number * 2];
+    } else {
+        *--digit = static_cast<char>('0' + number);
+    }
+    return length;
+}
+
 struct Size {
     int rows = 0;
     int cols = 0;
@@ -33,6 +102,45 @@ struct Size {
     bool operator==(Size rhs) const;
 };
 
+// Ссылка формулы на ячейку. Для ячейки той же таблицы sheet пусто,
+// иначе это имя таблицы книги (ссылка вида Sheet1!A1)
+struct CellReference {
+    std::string sheet;
+    Position pos;
+
+    bool operator==(const CellReference& rhs) const;
+    bool operator<(const CellReference& rhs) const;
+
+    bool IsExternal() const { return !sheet.empty(); }
+    std::string ToString() const;
+
+    // Разбирает "A1" или "Sheet1!A1"; некорректная позиция становится Position::NONE
+    static CellReference FromString(std::string_view str);
+
+    static const char SHEET_SEPARATOR = '!';
+};
+
+// Ссылка формулы на прямоугольную область ячеек (A1:B10 или Sheet1!A1:B10)
+struct CellRange {
+    std::string sheet;
+    // Левый верхний и правый нижний углы области
+    Position first;
+    Position last;
+
+    bool operator==(const CellRange& rhs) const;
+
+    bool IsExternal() const { return !sheet.empty(); }
+    bool IsValid() const { return first.IsValid() && last.IsValid(); }
+    bool Contains(Position pos) const;
+    std::string ToString() const;
+
+    // Разбирает "A1:B10" или "Sheet1!A1:B10"; углы упорядочиваются (B10:A1 - то же, что A1:B10).
+    // Если позиция угла некорректна, оба угла становятся Position::NONE
+    static CellRange FromString(std::string_view str);
+
+    static const char RANGE_SEPARATOR = ':';
+};
+
 // Описывает ошибки, которые могут возникнуть при вычислении формулы.
 class FormulaError {
 public:
@@ -40,6 +148,7 @@ public:
         Ref,    // ссылка на ячейку с некорректной позицией
         Value,  // ячейка не может быть трактована как число
         Arithmetic,  // в результате вычисления возникло деление на ноль
+        NotAvailable,  // функция поиска не нашла значение
     };
 
     FormulaError(Category category) :
@@ -48,7 +157,7 @@ public:
 
     Category GetCategory() const { return category_; }
 
-    bool operator==(FormulaError rhs) const { return rhs.ToString() == rhs.ToString(); }
+    bool operator==(FormulaError rhs) const { return category_ == rhs.category_; }
 
     std::string_view ToString() const {
         using namespace std::literals;
@@ -57,6 +166,7 @@ public:
         case FormulaError::Category::Ref: return "#REF!"sv;
         case FormulaError::Category::Value: return "#VALUE!"sv;
         case FormulaError::Category::Arithmetic: return "#ARITHM!"sv;
+        case FormulaError::Category::NotAvailable: return "#N/A"sv;
         default: break;
         }
         return ""sv;
@@ -68,6 +178,29 @@ private:
 
 std::ostream& operator<<(std::ostream& output, FormulaError fe);
 
+// Итоги числовых значений области (для функций SUM, COUNT, AVERAGE)
+struct RangeTotals {
+    double sum = 0.0;
+    // Количество числовых значений
+    size_t count = 0;
+    // Первая (по строкам) ошибка среди значений области
+    std::optional<FormulaError> error;
+};
+
+// Доступ формулы к ячейкам при вычислении
+struct CellValueAccessor {
+    // Числовое значение ячейки, на которую ссылается формула; ошибки бросаются как
+    // FormulaErrorException
+    std::function<double(const CellReference&)> get_value;
+    // Числовое значение ячейки pos области (результат функции поиска); ячейки областей
+    // не привязываются к формуле, поэтому читаются по позиции
+    std::function<double(const CellRange&, Position pos)> get_range_value;
+    // Первая сверху ячейка первого столбца области с числовым значением value
+    std::function<std::optional<Position>(const CellRange&, double value)> find_value;
+    // Итоги значений области
+    std::function<RangeTotals(const CellRange&)> aggregate;
+};
+
 class FormulaErrorException : public std::runtime_error {
 public:
     using std::runtime_error::runtime_error;
@@ -104,6 +237,13 @@ public:
     using std::runtime_error::runtime_error;
 };
 
+// Исключение, выбрасываемое при отмене асинхронного вычисления или истечении его срока.
+// Значения ячеек, вычисленные до отмены, остаются в кэше
+class EvaluationCancelledException : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
 class CellInterface {
 public:
     // Либо текст ячейки, либо значение формулы, либо сообщение об ошибке из
@@ -127,6 +267,9 @@ public:
     virtual std::vector<Position> GetReferencedCells() const = 0;
 };
 
+// Значение ячейки без копирования текста (действительно до следующего изменения ячейки)
+using CellValueView = std::variant<std::string_view, double, FormulaError>;
+
 inline constexpr char FORMULA_SIGN = '=';
 inline constexpr char ESCAPE_SIGN = '\'';
 
@@ -171,6 +314,21 @@ public:
     // соответственно. Пустая ячейка представляется пустой строкой в любом случае.
     virtual void PrintValues(std::ostream& output) const = 0;
     virtual void PrintTexts(std::ostream& output) const = 0;
+
+    // Возвращает таблицу той же книги с именем name (для ссылок вида Sheet1!A1)
+    // либо nullptr, если такой таблицы нет или таблица не входит в книгу.
+    virtual const SheetInterface* FindSheet(std::string_view /* name */) const { return nullptr; }
+
+    // Ищет в столбце first.col между строками first.row и last.row (включительно) первую
+    // сверху ячейку, числовое значение которой (число или текст, записанный числом) равно
+    // value. Используется функциями поиска формул. Реализация по умолчанию просматривает
+    // ячейки по очереди.
+    virtual std::optional<Position> FindValue(Position first, Position last, double value) const;
+
+    // Считает сумму и количество числовых значений (чисел и текста, записанного числом)
+    // области first..last и находит первую по строкам ошибку. Используется агрегатными
+    // функциями формул. Реализация по умолчанию просматривает ячейки по очереди.
+    virtual RangeTotals AggregateValues(Position first, Position last) const;
 };
 
 // Создаёт готовую к работе пустую таблицу.
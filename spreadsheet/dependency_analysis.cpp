@@ -0,0 +1,242 @@
+#include "dependency_analysis.h"
+
+#include "cell.h"
+#include "sheet.h"
+
+#include <algorithm>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <unordered_map>
+
+namespace {
+
+// Количество раундов оценки транзитивного fan-out
+const int FAN_OUT_ESTIMATE_ROUNDS = 64;
+// Сколько ячеек печатать с начала и с конца длинной цепочки
+const size_t PRINTED_PATH_EDGE = 10;
+const size_t NO_CELL = std::numeric_limits<size_t>::max();
+
+// Граф зависимостей в компактном виде (CSR):
+// рёбра ведут от ячейки к ячейкам, которые от неё зависят
+struct DependencyGraph {
+    std::vector<Position> positions;
+    std::vector<Cell*> cells;
+    std::vector<size_t> offsets;
+    std::vector<size_t> links;
+
+    size_t Size() const {
+        return cells.size();
+    }
+
+    template <typename Func>
+    void ForEachDependent(size_t cell, Func func) const {
+        for (size_t i = offsets[cell]; i < offsets[cell + 1]; ++i) {
+            func(links[i]);
+        }
+    }
+};
+
+DependencyGraph BuildGraph(Sheet& sheet) {
+    DependencyGraph graph;
+    std::unordered_map<const Cell*, size_t> index;
+    sheet.ForEachCell([&](Position pos, Cell& cell) {
+        index[&cell] = graph.cells.size();
+        graph.positions.push_back(pos);
+        graph.cells.push_back(&cell);
+    });
+
+    graph.offsets.reserve(graph.Size() + 1);
+    graph.offsets.push_back(0);
+    for (auto cell : graph.cells) {
+        for (auto dependent : cell->GetDependentCells()) {
+            graph.links.push_back(index.at(dependent));
+        }
+        graph.offsets.push_back(graph.links.size());
+    }
+    return graph;
+}
+
+// Топологическая сортировка (алгоритм Кана): ячейка идёт после всех ячеек, от которых зависит
+std::vector<size_t> SortTopologically(const DependencyGraph& graph) {
+    std::vector<size_t> in_degree(graph.Size(), 0);
+    for (auto link : graph.links) {
+        ++in_degree[link];
+    }
+
+    std::vector<size_t> order;
+    order.reserve(graph.Size());
+    for (size_t i = 0; i < graph.Size(); ++i) {
+        if (in_degree[i] == 0) {
+            order.push_back(i);
+        }
+    }
+    for (size_t i = 0; i < order.size(); ++i) {
+        graph.ForEachDependent(order[i], [&](size_t dependent) {
+            if (--in_degree[dependent] == 0) {
+                order.push_back(dependent);
+            }
+        });
+    }
+    return order;
+}
+
+// Точное количество ячеек, транзитивно зависящих от cell (обход в ширину)
+size_t CountDependents(const DependencyGraph& graph, size_t cell, std::vector<size_t>& visited_mark) {
+    std::vector<size_t> queue{cell};
+    visited_mark[cell] = cell;
+    for (size_t i = 0; i < queue.size(); ++i) {
+        graph.ForEachDependent(queue[i], [&](size_t dependent) {
+            if (visited_mark[dependent] != cell) {
+                visited_mark[dependent] = cell;
+                queue.push_back(dependent);
+            }
+        });
+    }
+    return queue.size() - 1;
+}
+
+// Ищет ячейки с наибольшим транзитивным fan-out.
+// Точный подсчёт для всех ячеек квадратичен, поэтому сначала fan-out оценивается
+// за линейное время (min-rank оценка Коэна), а затем для лучших кандидатов
+// считается точно.
+std::vector<DependencyReport::FanOut> FindFanOutHotspots(const DependencyGraph& graph,
+                                                         const std::vector<size_t>& order,
+                                                         size_t top_count) {
+    std::vector<double> rank_sums(graph.Size(), 0.0);
+    std::vector<double> min_ranks(graph.Size());
+    std::mt19937_64 generator;
+    std::exponential_distribution<double> distribution;
+    for (int round = 0; round < FAN_OUT_ESTIMATE_ROUNDS; ++round) {
+        for (auto it = order.rbegin(); it != order.rend(); ++it) {
+            double min_rank = distribution(generator);
+            graph.ForEachDependent(*it, [&](size_t dependent) {
+                min_rank = std::min(min_rank, min_ranks[dependent]);
+            });
+            min_ranks[*it] = min_rank;
+            rank_sums[*it] += min_rank;
+        }
+    }
+
+    std::vector<size_t> candidates;
+    for (size_t i = 0; i < graph.Size(); ++i) {
+        if (graph.offsets[i] != graph.offsets[i + 1]) {
+            candidates.push_back(i);
+        }
+    }
+    // Чем меньше сумма рангов, тем больше оценка fan-out
+    size_t candidate_count = std::min(candidates.size(), 4 * top_count);
+    std::partial_sort(candidates.begin(), candidates.begin() + candidate_count, candidates.end(),
+                      [&rank_sums](size_t lhs, size_t rhs) {
+                          return rank_sums[lhs] < rank_sums[rhs];
+                      });
+    candidates.resize(candidate_count);
+
+    std::vector<DependencyReport::FanOut> hotspots;
+    std::vector<size_t> visited_mark(graph.Size(), NO_CELL);
+    for (auto candidate : candidates) {
+        hotspots.push_back({graph.positions[candidate], CountDependents(graph, candidate, visited_mark)});
+    }
+    std::sort(hotspots.begin(), hotspots.end(), [](const auto& lhs, const auto& rhs) {
+        return lhs.dependent_count > rhs.dependent_count;
+    });
+    if (hotspots.size() > top_count) {
+        hotspots.resize(top_count);
+    }
+    return hotspots;
+}
+
+}  // namespace
+
+DependencyReport AnalyzeDependencies(Sheet& sheet, size_t top_count) {
+    DependencyReport report;
+    auto graph = BuildGraph(sheet);
+    auto order = SortTopologically(graph);
+
+    report.cell_count = graph.Size();
+    report.link_count = graph.links.size();
+
+    // Уровень ячейки - длина самой длинной цепочки, которая в ней заканчивается
+    std::vector<size_t> levels(graph.Size(), 0);
+    std::vector<size_t> previous(graph.Size(), NO_CELL);
+    size_t deepest_cell = NO_CELL;
+    for (auto cell : order) {
+        graph.ForEachDependent(cell, [&](size_t dependent) {
+            if (levels[dependent] < levels[cell] + 1) {
+                levels[dependent] = levels[cell] + 1;
+                previous[dependent] = cell;
+            }
+        });
+        if (deepest_cell == NO_CELL || levels[cell] > levels[deepest_cell]) {
+            deepest_cell = cell;
+        }
+    }
+    if (deepest_cell != NO_CELL) {
+        report.level_count = levels[deepest_cell] + 1;
+        for (auto cell = deepest_cell; cell != NO_CELL; cell = previous[cell]) {
+            report.critical_path.push_back(graph.positions[cell]);
+        }
+        std::reverse(report.critical_path.begin(), report.critical_path.end());
+    }
+
+    report.fan_out_hotspots = FindFanOutHotspots(graph, order, top_count);
+
+    // Замер времени: в топологическом порядке к моменту вычисления ячейки
+    // все ячейки, от которых она зависит, уже вычислены
+    for (auto cell : graph.cells) {
+        cell->DropCache();
+    }
+    for (auto cell : order) {
+        if (graph.cells[cell]->IsFormula()) {
+            ++report.formula_count;
+        }
+        auto start = std::chrono::steady_clock::now();
+        graph.cells[cell]->GetValue();
+        auto time = std::chrono::steady_clock::now() - start;
+        report.total_evaluation_time += time;
+        report.slowest_cells.push_back({graph.positions[cell], time});
+    }
+    size_t timing_count = std::min(report.slowest_cells.size(), top_count);
+    std::partial_sort(report.slowest_cells.begin(), report.slowest_cells.begin() + timing_count,
+                      report.slowest_cells.end(), [](const auto& lhs, const auto& rhs) {
+                          return lhs.time > rhs.time;
+                      });
+    report.slowest_cells.resize(timing_count);
+
+    return report;
+}
+
+std::ostream& operator<<(std::ostream& output, const DependencyReport& report) {
+    using std::chrono::duration;
+    using std::chrono::duration_cast;
+    using Microseconds = duration<double, std::micro>;
+
+    output << "cells: " << report.cell_count << ", formulas: " << report.formula_count
+           << ", links: " << report.link_count << '\n';
+    output << "topological levels: " << report.level_count << '\n';
+
+    const auto& path = report.critical_path;
+    output << "critical path (" << path.size() << " cells):";
+    for (size_t i = 0; i < path.size(); ++i) {
+        if (path.size() > 2 * PRINTED_PATH_EDGE && i == PRINTED_PATH_EDGE) {
+            output << " ...";
+            i = path.size() - PRINTED_PATH_EDGE;
+        }
+        output << ' ' << path[i].ToString();
+    }
+    output << '\n';
+
+    output << "fan-out hotspots:\n";
+    for (const auto& hotspot : report.fan_out_hotspots) {
+        output << '\t' << hotspot.pos.ToString() << '\t' << hotspot.dependent_count << '\n';
+    }
+
+    output << "slowest cells (us):\n";
+    for (const auto& timing : report.slowest_cells) {
+        output << '\t' << timing.pos.ToString() << '\t' << duration_cast<Microseconds>(timing.time).count()
+               << '\n';
+    }
+    output << "total evaluation time (us): "
+           << duration_cast<Microseconds>(report.total_evaluation_time).count() << '\n';
+    return output;
+}
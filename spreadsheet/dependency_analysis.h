@@ -0,0 +1,48 @@
+#pragma once
+
+#include "common.h"
+
+#include <chrono>
+#include <iosfwd>
+#include <vector>
+
+class Sheet;
+
+// Отчёт о структуре графа зависимостей ячеек таблицы.
+// Позволяет найти формулы, которые замедляют пересчёт таблицы.
+struct DependencyReport {
+    struct FanOut {
+        Position pos;
+        // Количество ячеек, которые прямо или транзитивно зависят от ячейки
+        size_t dependent_count = 0;
+    };
+
+    struct Timing {
+        Position pos;
+        // Время вычисления самой ячейки (значения ячеек, от которых она зависит, уже вычислены)
+        std::chrono::nanoseconds time{};
+    };
+
+    size_t cell_count = 0;
+    size_t formula_count = 0;
+    // Количество связей "ячейка -> зависящая от неё ячейка"
+    size_t link_count = 0;
+    // Количество топологических уровней: ограничивает параллелизм пересчёта
+    size_t level_count = 0;
+    // Самая длинная цепочка зависимостей (от исходной ячейки к самой "глубокой" формуле)
+    std::vector<Position> critical_path;
+    // Ячейки с наибольшим количеством транзитивно зависящих ячеек (по убыванию)
+    std::vector<FanOut> fan_out_hotspots;
+    // Ячейки с наибольшим временем вычисления (по убыванию)
+    std::vector<Timing> slowest_cells;
+    // Время полного пересчёта таблицы
+    std::chrono::nanoseconds total_evaluation_time{};
+};
+
+// Анализирует граф зависимостей таблицы за линейное от размера графа время.
+// Для замера времени вычисления сбрасывает кэши всех ячеек и заново вычисляет
+// их в топологическом порядке.
+// top_count - количество ячеек в списках fan_out_hotspots и slowest_cells.
+DependencyReport AnalyzeDependencies(Sheet& sheet, size_t top_count = 10);
+
+std::ostream& operator<<(std::ostream& output, const DependencyReport& report);
@@ -0,0 +1,51 @@
+#include "executor.h"
+
+#include "common.h"
+
+using namespace std::literals;
+
+void EvaluationLimits::Check() const {
+    if (token.IsCancelled()) {
+        throw EvaluationCancelledException("evaluation cancelled"s);
+    }
+    if (deadline != Clock::time_point::max() && Clock::now() >= deadline) {
+        throw EvaluationCancelledException("evaluation deadline exceeded"s);
+    }
+}
+
+Executor::Executor() :
+    thread_([this] { Run(); })
+{}
+
+Executor::~Executor() {
+    {
+        std::lock_guard lock(mutex_);
+        stopped_ = true;
+    }
+    has_tasks_.notify_one();
+    thread_.join();
+}
+
+void Executor::Submit(std::function<void()> task) {
+    {
+        std::lock_guard lock(mutex_);
+        tasks_.push_back(std::move(task));
+    }
+    has_tasks_.notify_one();
+}
+
+void Executor::Run() {
+    while (true) {
+        std::function<void()> task;
+        {
+            std::unique_lock lock(mutex_);
+            has_tasks_.wait(lock, [this] { return stopped_ || !tasks_.empty(); });
+            if (tasks_.empty()) {
+                return;
+            }
+            task = std::move(tasks_.front());
+            tasks_.pop_front();
+        }
+        task();
+    }
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+// Флаг кооперативной отмены асинхронного вычисления. Копии токена разделяют один флаг:
+// вызывающая сторона оставляет копию себе и вызывает Cancel(), вычисление проверяет
+// IsCancelled() между шагами.
+class CancellationToken {
+public:
+    CancellationToken() :
+        cancelled_(std::make_shared<std::atomic<bool>>(false))
+    {}
+
+    void Cancel() { *cancelled_ = true; }
+    bool IsCancelled() const { return *cancelled_; }
+
+private:
+    std::shared_ptr<std::atomic<bool>> cancelled_;
+};
+
+// Ограничения асинхронного вычисления: проверяются перед вычислением каждой ячейки
+struct EvaluationLimits {
+    using Clock = std::chrono::steady_clock;
+
+    Clock::time_point deadline = Clock::time_point::max();
+    CancellationToken token;
+
+    // Бросает EvaluationCancelledException, если вычисление отменено или срок истёк
+    void Check() const;
+};
+
+// Однопоточный исполнитель задач движка: задачи выполняются по очереди в порядке
+// постановки. Деструктор дожидается завершения уже поставленных задач.
+class Executor {
+public:
+    Executor();
+    Executor(const Executor&) = delete;
+    Executor& operator=(const Executor&) = delete;
+    ~Executor();
+
+    void Submit(std::function<void()> task);
+
+private:
+    void Run();
+
+private:
+    std::mutex mutex_;
+    std::condition_variable has_tasks_;
+    std::deque<std::function<void()>> tasks_;
+    bool stopped_ = false;
+    // Поток создаётся последним, когда остальные поля уже инициализированы
+    std::thread thread_;
+};
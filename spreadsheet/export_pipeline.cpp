@@ -0,0 +1,152 @@
+#include "export_pipeline.h"
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+namespace {
+
+class ExportPipeline {
+public:
+    ExportPipeline(std::ostream& output, size_t block_count, size_t threads) :
+        output_(output),
+        blocks_(block_count),
+        max_in_flight_(2 * threads)
+    {
+        workers_.reserve(threads);
+        for (size_t i = 0; i < threads; ++i) {
+            workers_.emplace_back([this] { RunWorker(); });
+        }
+    }
+
+    ~ExportPipeline() {
+        {
+            std::lock_guard lock(mutex_);
+            stopping_ = true;
+        }
+        has_tasks_.notify_all();
+        for (auto& worker : workers_) {
+            worker.join();
+        }
+    }
+
+    void Run(const std::function<BlockFormatter(size_t)>& prepare) {
+        size_t next_prepared = 0;
+        for (size_t next_written = 0; next_written < blocks_.size(); ++next_written) {
+            while (next_prepared < blocks_.size() && next_prepared - next_written < max_in_flight_) {
+                Submit(next_prepared, prepare(next_prepared));
+                ++next_prepared;
+            }
+            Write(next_written);
+        }
+        // Ширина поля действует только на первое значение вывода, как при выводе без блоков
+        output_.width(0);
+    }
+
+private:
+    struct Block {
+        std::unique_ptr<std::ostringstream> buffer;
+        bool formatted = false;
+    };
+    struct Task {
+        size_t index;
+        BlockFormatter format;
+        std::ostringstream* buffer;
+    };
+
+    void Submit(size_t index, BlockFormatter format) {
+        // Настройки форматирования копируются в вызывающем потоке: output в это время не пишется
+        auto buffer = std::make_unique<std::ostringstream>();
+        buffer->copyfmt(output_);
+        if (index != 0) {
+            buffer->width(0);
+        }
+        {
+            std::lock_guard lock(mutex_);
+            tasks_.push_back({index, std::move(format), buffer.get()});
+            blocks_[index].buffer = std::move(buffer);
+        }
+        has_tasks_.notify_one();
+    }
+
+    void Write(size_t index) {
+        std::unique_lock lock(mutex_);
+        block_formatted_.wait(lock, [this, index] {
+            return blocks_[index].formatted || error_;
+        });
+        if (error_) {
+            std::rethrow_exception(error_);
+        }
+        auto buffer = std::move(blocks_[index].buffer);
+        lock.unlock();
+
+        auto data = buffer->str();
+        output_.write(data.data(), static_cast<std::streamsize>(data.size()));
+    }
+
+    void RunWorker() {
+        while (true) {
+            std::optional<Task> task;
+            {
+                std::unique_lock lock(mutex_);
+                has_tasks_.wait(lock, [this] { return stopping_ || !tasks_.empty(); });
+                if (stopping_) {
+                    return;
+                }
+                task = std::move(tasks_.front());
+                tasks_.pop_front();
+            }
+
+            std::exception_ptr error;
+            try {
+                task->format(*task->buffer);
+            } catch (...) {
+                error = std::current_exception();
+            }
+
+            {
+                std::lock_guard lock(mutex_);
+                if (error && !error_) {
+                    error_ = error;
+                }
+                blocks_[task->index].formatted = true;
+            }
+            block_formatted_.notify_all();
+        }
+    }
+
+private:
+    std::ostream& output_;
+    std::vector<Block> blocks_;
+    size_t max_in_flight_;
+
+    std::mutex mutex_;
+    std::condition_variable has_tasks_;
+    std::condition_variable block_formatted_;
+    std::deque<Task> tasks_;
+    bool stopping_ = false;
+    std::exception_ptr error_;
+    // Потоки создаются последними, когда остальные поля уже инициализированы
+    std::vector<std::thread> workers_;
+};
+
+}  // namespace
+
+void RunExportPipeline(std::ostream& output, size_t block_count, size_t threads,
+                       const std::function<BlockFormatter(size_t)>& prepare) {
+    if (threads <= 1 || block_count <= 1) {
+        // Параллелить нечего: блоки форматируются сразу в output
+        for (size_t i = 0; i < block_count; ++i) {
+            prepare(i)(output);
+        }
+        return;
+    }
+    ExportPipeline pipeline(output, block_count, threads);
+    pipeline.Run(prepare);
+}
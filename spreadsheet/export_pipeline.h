@@ -0,0 +1,25 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <iosfwd>
+
+// Параметры параллельного вывода таблицы (см. Sheet::PrintValuesParallel)
+struct ExportOptions {
+    // Количество потоков форматирования (0 - по количеству ядер)
+    size_t threads = 0;
+    // Количество строк таблицы в блоке
+    int block_rows = 1024;
+};
+
+// Форматирует блок в переданный поток
+using BlockFormatter = std::function<void(std::ostream&)>;
+
+// Конвейер вывода блоками. Блоки подготавливаются по порядку в вызывающем потоке
+// (prepare(i) собирает данные блока i и возвращает его форматирование), форматируются
+// параллельно в threads потоках, каждый в свой буфер с настройками форматирования output,
+// и записываются в output строго по порядку. Одновременно в работе не больше 2 * threads
+// блоков. Исключение подготовки или форматирования останавливает конвейер и бросается
+// из вызова; блоки, записанные до него, остаются в output.
+void RunExportPipeline(std::ostream& output, size_t block_count, size_t threads,
+                       const std::function<BlockFormatter(size_t)>& prepare);
@@ -1,11 +1,17 @@
 #include "formula.h"
 
 #include "FormulaAST.h"
+#include "range_sum_tree.h"
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cctype>
+#include <cerrno>
+#include <cmath>
+#include <cstdlib>
 #include <sstream>
+#include <thread>
 
 using namespace std::literals;
 
@@ -21,62 +27,195 @@ public:
         ast_(ParseFormulaAST(expression)) 
     {}
 
+    explicit Formula(FormulaAST ast) :
+        ast_(std::move(ast))
+    {}
+
     Value Evaluate(const SheetInterface& sheet) const override {
-        std::function<double(Position)> get_cell_value = [&sheet](Position pos) {
-            if (!pos.IsValid()) {
-                throw FormulaErrorException("ref error"s, FormulaError::Category::Ref);
+        return Evaluate(sheet, nullptr);
+    }
+
+    Value Evaluate(const SheetInterface& sheet, const std::vector<const CellInterface*>& cells) const override {
+        return Evaluate(sheet, &cells);
+    }
+
+    std::string GetExpression() const override {
+        std::ostringstream out;
+        ast_.PrintFormula(out);
+        return out.str();
+    }
+
+    std::vector<CellReference> GetCellSlots() const override {
+        std::vector<CellReference> slots;
+        slots.reserve(ast_.GetCellSlots().size());
+        for (auto cell : ast_.GetCellSlots()) {
+            slots.push_back(*cell);
+        }
+        return slots;
+    }
+
+    std::vector<Position> GetReferencedCells() const override {
+        // Ячейки AST отсортированы: ссылки на текущую таблицу (с пустым именем) идут первыми
+        std::vector<Position> cells_v;
+        for (const auto& cell : ast_.GetCells()) {
+            if (cell.IsExternal()) {
+                break;
+            }
+            // Ссылки на удалённые ячейки (#REF!) не задействуют ячеек
+            if (!cell.pos.IsValid()) {
+                continue;
+            }
+            if (cells_v.empty() || !(cells_v.back() == cell.pos)) {
+                cells_v.push_back(cell.pos);
+            }
+        }
+        return cells_v;
+    };
+
+    std::vector<CellReference> GetExternalReferencedCells() const override {
+        std::vector<CellReference> cells_v;
+        for (const auto& cell : ast_.GetCells()) {
+            if (cell.IsExternal() && cell.pos.IsValid() && (cells_v.empty() || !(cells_v.back() == cell))) {
+                cells_v.push_back(cell);
+            }
+        }
+        return cells_v;
+    }
+
+    std::vector<CellRange> GetReferencedRanges() const override {
+        std::vector<CellRange> ranges;
+        for (const auto& range : ast_.GetRanges()) {
+            if (range.IsValid() && std::find(ranges.begin(), ranges.end(), range) == ranges.end()) {
+                ranges.push_back(range);
+            }
+        }
+        return ranges;
+    }
+
+    bool IsConditional() const override {
+        return ast_.IsConditional();
+    }
+
+    const batch::Program* GetBatchProgram() const override {
+        return ast_.GetBatchProgram();
+    }
+
+    bool ShiftReferences(std::string_view sheet, const std::function<Position(Position)>& shift) override {
+        // Позиции меняются прямо в списке ячеек AST: узлы формулы ссылаются на его элементы
+        bool changed = false;
+        for (auto& cell : ast_.GetCells()) {
+            if (cell.sheet != sheet || !cell.pos.IsValid()) {
+                continue;
+            }
+            auto pos = shift(cell.pos);
+            if (!(pos == cell.pos)) {
+                cell.pos = pos;
+                changed = true;
+            }
+        }
+        if (changed) {
+            // Порядок ссылок на удалённые ячейки мог нарушиться
+            ast_.GetCells().sort();
+        }
+        for (auto& range : ast_.GetRanges()) {
+            if (range.sheet != sheet || !range.IsValid()) {
+                continue;
+            }
+            auto first = ShiftCorner(range.first, range.last, 1, shift);
+            auto last = ShiftCorner(range.last, range.first, -1, shift);
+            if (!(first == range.first) || !(last == range.last)) {
+                range.first = first;
+                range.last = last;
+                changed = true;
+            }
+        }
+        return changed;
+    }
+
+    std::unique_ptr<FormulaInterface> Clone() const override {
+        return std::make_unique<Formula>(ast_.Clone());
+    }
+
+    void AddMemoryUsage(MemoryUsage& usage) const override {
+        usage.formula_ast_nodes += sizeof(*this) + ast_.GetNodesMemoryUsage();
+        usage.formula_cell_lists += ast_.GetCellsMemoryUsage();
+    }
+
+private:
+    Value Evaluate(const SheetInterface& sheet, const std::vector<const CellInterface*>* bound_cells) const {
+        auto find_sheet = [&sheet](const std::string& name) {
+            auto ref_sheet = name.empty() ? &sheet : sheet.FindSheet(name);
+            if (!ref_sheet) {
+                throw FormulaErrorException("unknown sheet"s, FormulaError::Category::Ref);
+            }
+            return ref_sheet;
+        };
+        auto read_value = [](const CellInterface& cell) {
+            auto cell_value = cell.GetValue();
+            auto operand = GetOperandValue(std::visit([](const auto& value) -> CellValueView { return value; }, cell_value));
+            if (std::holds_alternative<FormulaError>(operand)) {
+                throw FormulaErrorException("get value failed"s, std::get<FormulaError>(operand).GetCategory());
             }
-            auto cell = sheet.GetCell(pos);
+            return std::get<double>(operand);
+        };
+        CellValueAccessor cells;
+        cells.get_value = [this, &find_sheet, &read_value, bound_cells](const CellReference& ref) {
+            // Привязанная ячейка читается без поиска таблицы и ячейки в ней
+            const CellInterface* cell = bound_cells ? (*bound_cells)[ast_.GetCellSlot(ref)] : nullptr;
             if (!cell) {
-                return 0.0;
-            }
-            
-            auto cell_value = cell->GetValue();
-            if (std::holds_alternative<FormulaError>(cell_value)) {
-                throw FormulaErrorException("get value failed"s, std::get<FormulaError>(cell_value).GetCategory());
-            }
-
-            double value = 0.0;
-            if (std::holds_alternative<double>(cell_value)) {
-                value = std::get<double>(cell_value);
-            } else {
-                std::string value_str = std::get<std::string>(cell_value);
-                if (!value_str.empty()) {
-                    size_t not_num_pos = 0;
-                    try {
-                        value = std::stod(std::get<std::string>(cell_value), &not_num_pos);
-                    } catch (...) {
-                        throw FormulaErrorException("value is not numeric"s, FormulaError::Category::Value);
-                    }
-                    if (not_num_pos != value_str.size()) {
-                        throw FormulaErrorException("value is not numeric"s, FormulaError::Category::Value);
-                    }
+                if (!ref.pos.IsValid()) {
+                    throw FormulaErrorException("ref error"s, FormulaError::Category::Ref);
+                }
+                cell = find_sheet(ref.sheet)->GetCell(ref.pos);
+                if (!cell) {
+                    return 0.0;
                 }
             }
-            return value;
+            return read_value(*cell);
+        };
+        cells.get_range_value = [&find_sheet, &read_value](const CellRange& range, Position pos) {
+            auto cell = find_sheet(range.sheet)->GetCell(pos);
+            return cell ? read_value(*cell) : 0.0;
+        };
+        cells.find_value = [&find_sheet](const CellRange& range, double value) {
+            if (!range.IsValid()) {
+                throw FormulaErrorException("ref error"s, FormulaError::Category::Ref);
+            }
+            return find_sheet(range.sheet)->FindValue(range.first, {range.last.row, range.first.col}, value);
+        };
+        cells.aggregate = [&find_sheet](const CellRange& range) {
+            if (!range.IsValid()) {
+                throw FormulaErrorException("ref error"s, FormulaError::Category::Ref);
+            }
+            return find_sheet(range.sheet)->AggregateValues(range.first, range.last);
         };
         try {
-            return Value(ast_.Execute(get_cell_value));
+            return Value(ast_.Execute(cells));
         } catch (const FormulaErrorException &e) {
             return Value(FormulaError(e.GetCategory()));
         }
     }
 
-    std::string GetExpression() const override {
-        std::ostringstream out;
-        ast_.PrintFormula(out);
-        return out.str();
+    // Новая позиция угла области corner. Если угол удалён, область сужается до ближайшей
+    // оставшейся строки (столбца) в направлении противоположного угла opposite (step = 1
+    // для левого верхнего угла, -1 для правого нижнего); если не осталось ничего - Position::NONE
+    static Position ShiftCorner(Position corner, Position opposite, int step,
+                                const std::function<Position(Position)>& shift) {
+        for (int row = corner.row; row != opposite.row + step; row += step) {
+            auto pos = shift({row, corner.col});
+            if (!(pos == Position::NONE)) {
+                return pos;
+            }
+        }
+        for (int col = corner.col; col != opposite.col + step; col += step) {
+            auto pos = shift({corner.row, col});
+            if (!(pos == Position::NONE)) {
+                return pos;
+            }
+        }
+        return Position::NONE;
     }
 
-    std::vector<Position> GetReferencedCells() const override {
-        auto cells = ast_.GetCells();
-        std::vector cells_v(cells.begin(), cells.end());
-        auto last = std::unique(cells_v.begin(), cells_v.end());
-        cells_v.erase(last, cells_v.end());
-        std::sort(cells_v.begin(), cells_v.end());
-        return cells_v;
-    };
-
 private:
     FormulaAST ast_;
 };
@@ -88,4 +227,139 @@ std::unique_ptr<FormulaInterface> ParseFormula(std::string expression) {
     } catch (...) {
         throw FormulaException("Parse formula error");
     }    
-}
\ No newline at end of file
+}
+std::vector<ParsedFormula> ParseFormulas(const std::vector<std::string>& expressions, size_t threads) {
+    // Меньшие доли не окупают запуск потока
+    const size_t min_expressions_per_thread = 256;
+    // Потоки берут выражения частями: общий счётчик не становится узким местом
+    const size_t chunk_size = 64;
+
+    std::vector<ParsedFormula> results(expressions.size());
+    std::atomic<size_t> next_chunk = 0;
+    auto parse = [&expressions, &results, &next_chunk] {
+        while (true) {
+            size_t begin = next_chunk.fetch_add(chunk_size);
+            if (begin >= expressions.size()) {
+                return;
+            }
+            size_t end = std::min(begin + chunk_size, expressions.size());
+            for (size_t i = begin; i < end; ++i) {
+                try {
+                    results[i].formula = ParseFormula(expressions[i]);
+                } catch (const FormulaException& e) {
+                    results[i].error = e;
+                }
+            }
+        }
+    };
+
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    threads = std::min(threads, expressions.size() / min_expressions_per_thread);
+    if (threads <= 1) {
+        parse();
+        return results;
+    }
+
+    std::vector<std::exception_ptr> errors(threads);
+    std::vector<std::thread> workers;
+    workers.reserve(threads - 1);
+    auto run = [&parse, &errors](size_t thread) {
+        try {
+            parse();
+        } catch (...) {
+            errors[thread] = std::current_exception();
+        }
+    };
+    for (size_t thread = 1; thread < threads; ++thread) {
+        workers.emplace_back(run, thread);
+    }
+    run(0);
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    for (const auto& error : errors) {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+    return results;
+}
+
+std::optional<double> ParseNumber(const std::string& text) {
+    if (text.empty()) {
+        return std::nullopt;
+    }
+    // Как std::stod: пробелы в начале допустимы, выход за пределы double - не число
+    char* end = nullptr;
+    errno = 0;
+    double value = std::strtod(text.c_str(), &end);
+    if (end == text.c_str() || end != text.c_str() + text.size() || errno == ERANGE) {
+        return std::nullopt;
+    }
+    return value;
+}
+
+FormulaInterface::Value GetOperandValue(const CellValueView& value) {
+    if (std::holds_alternative<double>(value)) {
+        return std::get<double>(value);
+    }
+    if (std::holds_alternative<FormulaError>(value)) {
+        return std::get<FormulaError>(value);
+    }
+    auto text = std::get<std::string_view>(value);
+    if (text.empty()) {
+        return 0.0;
+    }
+    auto number = ParseNumber(std::string(text));
+    if (!number) {
+        return FormulaError(FormulaError::Category::Value);
+    }
+    return *number;
+}
+
+std::optional<double> GetLookupValue(const CellInterface::Value& value) {
+    if (std::holds_alternative<double>(value)) {
+        return std::get<double>(value);
+    }
+    if (std::holds_alternative<std::string>(value)) {
+        return ParseNumber(std::get<std::string>(value));
+    }
+    return std::nullopt;
+}
+
+std::optional<Position> SheetInterface::FindValue(Position first, Position last, double value) const {
+    for (int row = first.row; row <= last.row; ++row) {
+        Position pos{row, first.col};
+        auto cell = GetCell(pos);
+        if (cell && GetLookupValue(cell->GetValue()) == value) {
+            return pos;
+        }
+    }
+    return std::nullopt;
+}
+
+RangeTotals SheetInterface::AggregateValues(Position first, Position last) const {
+    RangeTotals totals;
+    CompensatedSum sum;
+    for (int row = first.row; row <= last.row; ++row) {
+        for (int col = first.col; col <= last.col; ++col) {
+            auto cell = GetCell({row, col});
+            if (!cell) {
+                continue;
+            }
+            auto value = cell->GetValue();
+            if (std::holds_alternative<FormulaError>(value)) {
+                if (!totals.error) {
+                    totals.error = std::get<FormulaError>(value);
+                }
+            } else if (auto number = GetLookupValue(value); number && !std::isnan(*number)) {
+                sum.Add(*number);
+                ++totals.count;
+            }
+        }
+    }
+    totals.sum = sum.Get();
+    return totals;
+}
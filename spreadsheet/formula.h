@@ -1,14 +1,28 @@
 #pragma once
 
 #include "common.h"
+#include "memory_usage.h"
 
+#include <functional>
 #include <memory>
+#include <optional>
 #include <vector>
 
+namespace batch {
+class Program;
+}
+
 // Формула, позволяющая вычислять и обновлять арифметическое выражение.
 // Поддерживаемые возможности:
 // * Простые бинарные операции и числа, скобки: 1+2*3, 2.5*(2+3.5/7)
 // * Значения ячеек в качестве переменных: A1+B2*C3
+// * Ячейки других таблиц книги: Sheet2!A1*2
+// * Сравнения (1 - истина, 0 - ложь) и условия: IF(A1>=0,A1,-A1), AND(A1,B1<>2), OR(...);
+//   вычисляется только выбранная ветвь IF и операнды AND/OR до известного результата
+// * Функции поиска точного совпадения в области: MATCH(A1,B1:B100), VLOOKUP(A1,B1:D100,3),
+//   XLOOKUP(A1,B1:B100,D1:D100[,0]); поиск выполняется по индексу столбца таблицы
+// * Агрегатные функции области: SUM(A1:B100), COUNT(A1:A100), AVERAGE(A1:A100); итоги
+//   столбцов таблица обновляет по изменившимся ячейкам, не суммируя область заново
 // Ячейки, указанные в формуле, могут быть как формулами, так и текстом. Если это
 // текст, но он представляет число, тогда его нужно трактовать как число. Пустая
 // ячейка или ячейка с пустым текстом трактуется как число ноль.
@@ -26,16 +40,79 @@ public:
     // любая.
 
     virtual Value Evaluate(const SheetInterface& sheet) const = 0;
+    // Вычисляет формулу по ячейкам, заранее привязанным к слотам ссылок (cells[i] - ячейка
+    // слота i списка GetCellSlots()): значения привязанных ячеек читаются без поиска в таблице.
+    // Ячейка слота без привязки (nullptr) ищется в sheet, как в Evaluate(sheet)
+    virtual Value Evaluate(const SheetInterface& sheet, const std::vector<const CellInterface*>& cells) const = 0;
     // Возвращает выражение, которое описывает формулу.
     // Не содержит пробелов и лишних скобок.
     virtual std::string GetExpression() const = 0;
 
+    // Возвращает ссылки формулы на ячейки по слотам (с повторами и ссылками #REF!).
+    // Ссылка сохраняет свой слот, пока существует формула: ShiftReferences меняет
+    // позиции ссылок, но не их слоты
+    virtual std::vector<CellReference> GetCellSlots() const = 0;
+
     // Возвращает список ячеек, которые непосредственно задействованы в вычислении
     // формулы. Список отсортирован по возрастанию и не содержит повторяющихся
     // ячеек.
     virtual std::vector<Position> GetReferencedCells() const = 0;
+
+    // Возвращает отсортированный список ячеек других таблиц книги (Sheet1!A1),
+    // задействованных в вычислении формулы, без повторов.
+    virtual std::vector<CellReference> GetExternalReferencedCells() const = 0;
+
+    // Возвращает области функций поиска (в том числе области других таблиц книги).
+    // Ячейки областей не входят в списки ячеек формулы.
+    virtual std::vector<CellRange> GetReferencedRanges() const = 0;
+
+    // Возвращает true, если формула содержит IF, AND, OR или функции поиска: значения части ячеек
+    // запрашиваются только в зависимости от значений других ячеек. Списки
+    // GetReferencedCells содержат все ячейки формулы независимо от условий.
+    virtual bool IsConditional() const = 0;
+
+    // Программа пакетного вычисления формулы для столбца строк (см. batch::Program) или
+    // nullptr, если формула содержит что-то кроме чисел, ссылок на ячейки своей таблицы и
+    // арифметических операций. Формулы, протянутые по столбцу, имеют равные программы
+    virtual const batch::Program* GetBatchProgram() const = 0;
+
+    // Переводит позиции ссылок на таблицу sheet (пустое имя - ссылки без имени таблицы)
+    // функцией shift; позиция Position::NONE делает ссылку недействительной (#REF!).
+    // Используется при вставке и удалении строк и столбцов. Возвращает true,
+    // если изменилась хотя бы одна ссылка.
+    virtual bool ShiftReferences(std::string_view sheet, const std::function<Position(Position)>& shift) = 0;
+
+    // Возвращает независимую копию формулы
+    virtual std::unique_ptr<FormulaInterface> Clone() const = 0;
+
+    // Добавляет к usage память формулы (formula_ast_nodes, formula_cell_lists)
+    virtual void AddMemoryUsage(MemoryUsage& usage) const = 0;
 };
 
 // Парсит переданное выражение и возвращает объект формулы.
 // Бросает FormulaException в случае, если формула синтаксически некорректна.
 std::unique_ptr<FormulaInterface> ParseFormula(std::string expression);
+
+// Результат разбора одного выражения пакета
+struct ParsedFormula {
+    // nullptr, если выражение синтаксически некорректно
+    std::unique_ptr<FormulaInterface> formula;
+    // Исключение, которое бросил бы ParseFormula для некорректного выражения
+    std::optional<FormulaException> error;
+};
+
+// Разбирает выражения пакетом в threads потоках (0 - по количеству ядер; небольшой пакет
+// разбирается в вызывающем потоке). Результаты - в порядке выражений, некорректное
+// выражение не прерывает разбор остальных.
+std::vector<ParsedFormula> ParseFormulas(const std::vector<std::string>& expressions, size_t threads = 0);
+
+// Число, которым записан текст ячейки (nullopt, если текст не является числом)
+std::optional<double> ParseNumber(const std::string& text);
+
+// Число, которым формула читает значение ячейки: текст, записанный числом, - это число,
+// пустой текст - ноль. Для прочего текста - ошибка #VALUE!, для ошибки - сама ошибка
+FormulaInterface::Value GetOperandValue(const CellValueView& value);
+
+// Значение ячейки, по которому её находят функции поиска и учитывают агрегатные функции:
+// число или текст, записанный числом. Для пустых ячеек, прочего текста и ошибок - nullopt
+std::optional<double> GetLookupValue(const CellInterface::Value& value);
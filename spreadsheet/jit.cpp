@@ -0,0 +1,363 @@
+#include "jit.h"
+
+#include <atomic>
+#include <cstring>
+
+#if defined(__x86_64__) && defined(__unix__)
+#define SPREADSHEET_JIT_SUPPORTED 1
+#include <sys/mman.h>
+#else
+#define SPREADSHEET_JIT_SUPPORTED 0
+#endif
+
+using namespace std::literals;
+
+namespace jit {
+
+namespace {
+
+std::atomic<bool> enabled = SPREADSHEET_JIT_SUPPORTED;
+std::atomic<uint32_t> threshold = 100;
+
+// Коды возврата скомпилированной функции
+enum ResultCode : int {
+    RESULT_OK = 0,
+    // RESULT_ERROR + категория FormulaError
+    RESULT_ERROR = 1,
+    // доступ к ячейкам бросил исключение, не являющееся ошибкой формулы
+    RESULT_EXCEPTION = 100,
+};
+
+// Состояние одного вызова скомпилированной формулы; поле result_code
+// должно быть первым, сгенерированный код читает его по адресу контекста
+struct Context {
+    int result_code = RESULT_OK;
+    const CellValueAccessor* cells = nullptr;
+    std::exception_ptr exception;
+};
+
+// Вызывается из сгенерированного кода: исключения не должны выходить за её пределы
+double LoadCellValue(Context* context, const CellReference* cell) {
+    try {
+        return context->cells->get_value(*cell);
+    } catch (const FormulaErrorException& e) {
+        context->result_code = RESULT_ERROR + static_cast<int>(e.GetCategory());
+    } catch (...) {
+        context->exception = std::current_exception();
+        context->result_code = RESULT_EXCEPTION;
+    }
+    return 0.0;
+}
+
+// То же для узлов, вычисляемых интерпретатором
+double EvaluateNodeValue(Context* context, Assembler::NodeEvaluator evaluate, const void* node) {
+    try {
+        return evaluate(node, *context->cells);
+    } catch (const FormulaErrorException& e) {
+        context->result_code = RESULT_ERROR + static_cast<int>(e.GetCategory());
+    } catch (...) {
+        context->exception = std::current_exception();
+        context->result_code = RESULT_EXCEPTION;
+    }
+    return 0.0;
+}
+
+// Коды условий для инструкций Jcc (0F 80+cc)
+const uint8_t CC_ALWAYS = 0x00;
+const uint8_t CC_AE = 0x03;
+const uint8_t CC_E = 0x04;
+const uint8_t CC_NE = 0x05;
+const uint8_t CC_P = 0x0A;
+
+// Метка, которая ещё не привязана к месту в коде
+const size_t UNBOUND_LABEL = SIZE_MAX;
+
+}  // namespace
+
+bool IsSupported() {
+    return SPREADSHEET_JIT_SUPPORTED;
+}
+
+void SetEnabled(bool value) {
+    enabled = value && IsSupported();
+}
+
+bool IsEnabled() {
+    return enabled;
+}
+
+void SetThreshold(uint32_t value) {
+    threshold = value;
+}
+
+uint32_t GetThreshold() {
+    return threshold;
+}
+
+CompiledFormula::CompiledFormula(void* memory, size_t size) :
+    memory_(memory),
+    size_(size)
+{
+    static_assert(sizeof(Entry) == sizeof(void*));
+    std::memcpy(&entry_, &memory_, sizeof(entry_));
+}
+
+CompiledFormula::~CompiledFormula() {
+#if SPREADSHEET_JIT_SUPPORTED
+    munmap(memory_, size_);
+#endif
+}
+
+double CompiledFormula::Execute(const CellValueAccessor& cells) const {
+    Context context;
+    context.cells = &cells;
+    double result = 0.0;
+    int code = entry_(&context, &result);
+    if (code == RESULT_OK) {
+        return result;
+    }
+    if (code == RESULT_EXCEPTION) {
+        std::rethrow_exception(context.exception);
+    }
+    throw FormulaErrorException("compiled formula error"s, static_cast<FormulaError::Category>(code - RESULT_ERROR));
+}
+
+Assembler::Assembler() {
+    // Сигнатура: int (Context* rdi, double* rsi)
+    Emit({0x55});              // push rbp
+    Emit({0x48, 0x89, 0xE5});  // mov rbp, rsp
+    Emit({0x53});              // push rbx
+    Emit({0x41, 0x54});        // push r12  (стек выровнен на 16)
+    Emit({0x48, 0x89, 0xFB});  // mov rbx, rdi
+    Emit({0x49, 0x89, 0xF4});  // mov r12, rsi
+}
+
+void Assembler::LoadConstant(double value) {
+    uint64_t bits = 0;
+    std::memcpy(&bits, &value, sizeof(bits));
+    Emit({0x48, 0xB8});                    // mov rax, imm64
+    EmitImmediate(bits, 8);
+    Emit({0x66, 0x48, 0x0F, 0x6E, 0xC0});  // movq xmm0, rax
+}
+
+void Assembler::LoadCell(const CellReference* cell) {
+    // Перед вызовом стек должен быть выровнен на 16 байт
+    bool align = depth_ % 2 != 0;
+    if (align) {
+        Emit({0x48, 0x83, 0xEC, 0x08});  // sub rsp, 8
+    }
+    Emit({0x48, 0x89, 0xDF});  // mov rdi, rbx
+    Emit({0x48, 0xBE});        // mov rsi, imm64
+    EmitImmediate(reinterpret_cast<uint64_t>(cell), 8);
+    double (*load)(Context*, const CellReference*) = &LoadCellValue;
+    Emit({0x48, 0xB8});  // mov rax, imm64
+    EmitImmediate(reinterpret_cast<uint64_t>(load), 8);
+    Emit({0xFF, 0xD0});  // call rax
+    if (align) {
+        Emit({0x48, 0x83, 0xC4, 0x08});  // add rsp, 8
+    }
+    Emit({0x8B, 0x03});  // mov eax, [rbx]  (Context::result_code)
+    Emit({0x85, 0xC0});  // test eax, eax
+    JumpToFail(CC_NE);
+}
+
+void Assembler::EvaluateNode(NodeEvaluator evaluate, const void* node) {
+    bool align = depth_ % 2 != 0;
+    if (align) {
+        Emit({0x48, 0x83, 0xEC, 0x08});  // sub rsp, 8
+    }
+    Emit({0x48, 0x89, 0xDF});  // mov rdi, rbx
+    Emit({0x48, 0xBE});        // mov rsi, imm64
+    EmitImmediate(reinterpret_cast<uint64_t>(evaluate), 8);
+    Emit({0x48, 0xBA});        // mov rdx, imm64
+    EmitImmediate(reinterpret_cast<uint64_t>(node), 8);
+    double (*load)(Context*, NodeEvaluator, const void*) = &EvaluateNodeValue;
+    Emit({0x48, 0xB8});  // mov rax, imm64
+    EmitImmediate(reinterpret_cast<uint64_t>(load), 8);
+    Emit({0xFF, 0xD0});  // call rax
+    if (align) {
+        Emit({0x48, 0x83, 0xC4, 0x08});  // add rsp, 8
+    }
+    Emit({0x8B, 0x03});  // mov eax, [rbx]  (Context::result_code)
+    Emit({0x85, 0xC0});  // test eax, eax
+    JumpToFail(CC_NE);
+}
+
+void Assembler::Negate() {
+    Emit({0x48, 0xB8});  // mov rax, imm64
+    EmitImmediate(0x8000000000000000ull, 8);
+    Emit({0x66, 0x48, 0x0F, 0x6E, 0xC8});  // movq xmm1, rax
+    Emit({0x66, 0x0F, 0x57, 0xC1});        // xorpd xmm0, xmm1
+}
+
+void Assembler::PushOperand() {
+    Emit({0x48, 0x83, 0xEC, 0x08});        // sub rsp, 8
+    Emit({0xF2, 0x0F, 0x11, 0x04, 0x24});  // movsd [rsp], xmm0
+    ++depth_;
+}
+
+void Assembler::BinaryOperation(char operation) {
+    Emit({0x66, 0x0F, 0x28, 0xC8});        // movapd xmm1, xmm0
+    Emit({0xF2, 0x0F, 0x10, 0x04, 0x24});  // movsd xmm0, [rsp]
+    Emit({0x48, 0x83, 0xC4, 0x08});        // add rsp, 8
+    --depth_;
+
+    switch (operation) {
+        case '+': Emit({0xF2, 0x0F, 0x58, 0xC1}); break;  // addsd xmm0, xmm1
+        case '-': Emit({0xF2, 0x0F, 0x5C, 0xC1}); break;  // subsd xmm0, xmm1
+        case '*': Emit({0xF2, 0x0F, 0x59, 0xC1}); break;  // mulsd xmm0, xmm1
+        case '/': {
+            Emit({0x66, 0x0F, 0x57, 0xD2});  // xorpd xmm2, xmm2
+            Emit({0x66, 0x0F, 0x2E, 0xCA});  // ucomisd xmm1, xmm2
+            // NaN не равен нулю: деление выполняется и даёт NaN
+            Emit({0x7A, 0x0B});              // jp +11 (пропустить mov и je)
+            Emit({0xB8});                    // mov eax, imm32
+            EmitImmediate(RESULT_ERROR + static_cast<int>(FormulaError::Category::Arithmetic), 4);
+            JumpToFail(CC_E);                // 6 байт
+            Emit({0xF2, 0x0F, 0x5E, 0xC1});  // divsd xmm0, xmm1
+            break;
+        }
+        default: break;
+    }
+
+    // Результат inf или nan: модуль битового представления >= 0x7FF0000000000000
+    Emit({0x66, 0x48, 0x0F, 0x7E, 0xC0});  // movq rax, xmm0
+    Emit({0x48, 0x0F, 0xBA, 0xF0, 0x3F});  // btr rax, 63
+    Emit({0x48, 0xB9});                    // mov rcx, imm64
+    EmitImmediate(0x7FF0000000000000ull, 8);
+    Emit({0x48, 0x39, 0xC8});              // cmp rax, rcx
+    JumpToError(CC_AE, FormulaError::Category::Arithmetic);
+}
+
+void Assembler::Compare(std::string_view sign) {
+    Emit({0x66, 0x0F, 0x28, 0xC8});        // movapd xmm1, xmm0
+    Emit({0xF2, 0x0F, 0x10, 0x04, 0x24});  // movsd xmm0, [rsp]
+    Emit({0x48, 0x83, 0xC4, 0x08});        // add rsp, 8
+    --depth_;
+
+    // Для NaN ucomisd выставляет ZF, PF и CF: сравнения с условиями "выше"
+    // (с переставленными операндами для < и <=) дают 0, как в интерпретаторе
+    if (sign == "<"sv || sign == "<="sv) {
+        Emit({0x66, 0x0F, 0x2E, 0xC8});  // ucomisd xmm1, xmm0
+    } else {
+        Emit({0x66, 0x0F, 0x2E, 0xC1});  // ucomisd xmm0, xmm1
+    }
+    if (sign == "<"sv || sign == ">"sv) {
+        Emit({0x0F, 0x97, 0xC0});  // seta al
+    } else if (sign == "<="sv || sign == ">="sv) {
+        Emit({0x0F, 0x93, 0xC0});  // setae al
+    } else if (sign == "="sv) {
+        Emit({0x0F, 0x94, 0xC0});  // sete al
+        Emit({0x0F, 0x9B, 0xC1});  // setnp cl
+        Emit({0x20, 0xC8});        // and al, cl
+    } else {
+        Emit({0x0F, 0x95, 0xC0});  // setne al
+        Emit({0x0F, 0x9A, 0xC1});  // setp cl
+        Emit({0x08, 0xC8});        // or al, cl
+    }
+    Emit({0x0F, 0xB6, 0xC0});        // movzx eax, al
+    Emit({0xF2, 0x0F, 0x2A, 0xC0});  // cvtsi2sd xmm0, eax
+}
+
+Assembler::Label Assembler::NewLabel() {
+    labels_.push_back(UNBOUND_LABEL);
+    return labels_.size() - 1;
+}
+
+void Assembler::Bind(Label label) {
+    labels_[label] = code_.size();
+}
+
+void Assembler::Jump(Label label) {
+    JumpToLabel(CC_ALWAYS, label);
+}
+
+void Assembler::JumpIfZero(Label label) {
+    Emit({0x66, 0x0F, 0x57, 0xC9});  // xorpd xmm1, xmm1
+    Emit({0x66, 0x0F, 0x2E, 0xC1});  // ucomisd xmm0, xmm1
+    Emit({0x7A, 0x06});              // jp +6 (NaN: пропустить je)
+    JumpToLabel(CC_E, label);        // 6 байт
+}
+
+void Assembler::JumpIfNonZero(Label label) {
+    Emit({0x66, 0x0F, 0x57, 0xC9});  // xorpd xmm1, xmm1
+    Emit({0x66, 0x0F, 0x2E, 0xC1});  // ucomisd xmm0, xmm1
+    JumpToLabel(CC_P, label);
+    JumpToLabel(CC_NE, label);
+}
+
+std::unique_ptr<CompiledFormula> Assembler::Finish() {
+    Emit({0xF2, 0x41, 0x0F, 0x11, 0x04, 0x24});  // movsd [r12], xmm0
+    Emit({0x31, 0xC0});                          // xor eax, eax
+
+    for (auto [jump, label] : label_jumps_) {
+        int32_t offset = static_cast<int32_t>(labels_[label] - (jump + 4));
+        std::memcpy(code_.data() + jump, &offset, sizeof(offset));
+    }
+
+    // Выход (в том числе с ошибкой, код в eax)
+    size_t fail = code_.size();
+    for (auto jump : fail_jumps_) {
+        int32_t offset = static_cast<int32_t>(fail - (jump + 4));
+        std::memcpy(code_.data() + jump, &offset, sizeof(offset));
+    }
+    Emit({0x48, 0x8D, 0x65, 0xF0});  // lea rsp, [rbp - 16]
+    Emit({0x41, 0x5C});              // pop r12
+    Emit({0x5B});                    // pop rbx
+    Emit({0x5D});                    // pop rbp
+    Emit({0xC3});                    // ret
+
+#if SPREADSHEET_JIT_SUPPORTED
+    void* memory = mmap(nullptr, code_.size(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        return nullptr;
+    }
+    std::memcpy(memory, code_.data(), code_.size());
+    if (mprotect(memory, code_.size(), PROT_READ | PROT_EXEC) != 0) {
+        munmap(memory, code_.size());
+        return nullptr;
+    }
+    return std::make_unique<CompiledFormula>(memory, code_.size());
+#else
+    return nullptr;
+#endif
+}
+
+void Assembler::Emit(std::initializer_list<uint8_t> bytes) {
+    code_.insert(code_.end(), bytes);
+}
+
+void Assembler::EmitImmediate(uint64_t value, int size) {
+    for (int i = 0; i < size; ++i) {
+        code_.push_back(static_cast<uint8_t>(value >> (8 * i)));
+    }
+}
+
+void Assembler::JumpToError(uint8_t condition, FormulaError::Category category) {
+    // Код ошибки загружается заранее: mov не меняет флаги
+    Emit({0xB8});  // mov eax, imm32
+    EmitImmediate(RESULT_ERROR + static_cast<int>(category), 4);
+    JumpToFail(condition);
+}
+
+void Assembler::JumpToFail(uint8_t condition) {
+    if (condition == CC_ALWAYS) {
+        Emit({0xE9});  // jmp rel32
+    } else {
+        Emit({0x0F, static_cast<uint8_t>(0x80 | condition)});  // jcc rel32
+    }
+    fail_jumps_.push_back(code_.size());
+    EmitImmediate(0, 4);
+}
+
+void Assembler::JumpToLabel(uint8_t condition, Label label) {
+    if (condition == CC_ALWAYS) {
+        Emit({0xE9});  // jmp rel32
+    } else {
+        Emit({0x0F, static_cast<uint8_t>(0x80 | condition)});  // jcc rel32
+    }
+    label_jumps_.emplace_back(code_.size(), label);
+    EmitImmediate(0, 4);
+}
+
+}  // namespace jit
@@ -0,0 +1,110 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <string_view>
+#include <vector>
+
+// JIT-компиляция часто вычисляемых формул в машинный код x86-64 (SSE2).
+// Формула компилируется, когда количество её вычислений достигает порога; до этого
+// и на платформах без поддержки формула вычисляется интерпретатором FormulaAST.
+// Скомпилированный код повторяет семантику интерпретатора: порядок вычисления
+// операндов, загрузку ячеек с ошибками #REF!/#VALUE! и проверки #ARITHM!.
+namespace jit {
+
+// Поддерживается ли JIT на текущей платформе
+bool IsSupported();
+
+// Переключатель JIT во время работы (по умолчанию включён, если поддерживается).
+// При выключении уже скомпилированный код не используется.
+void SetEnabled(bool enabled);
+bool IsEnabled();
+
+// Количество вычислений формулы, после которого она компилируется
+void SetThreshold(uint32_t threshold);
+uint32_t GetThreshold();
+
+// Скомпилированная формула в исполняемой памяти
+class CompiledFormula {
+public:
+    using Entry = int (*)(void* context, double* result);
+
+    CompiledFormula(void* memory, size_t size);
+    CompiledFormula(const CompiledFormula&) = delete;
+    CompiledFormula& operator=(const CompiledFormula&) = delete;
+    ~CompiledFormula();
+
+    // Вычисляет формулу; как и интерпретатор, бросает FormulaErrorException
+    double Execute(const CellValueAccessor& cells) const;
+
+    // Размер машинного кода в байтах
+    size_t GetSize() const { return size_; }
+
+private:
+    void* memory_;
+    size_t size_;
+    Entry entry_;
+};
+
+// Генератор кода формулы. Код стековый: результат каждого узла оказывается в xmm0,
+// промежуточные значения хранятся на машинном стеке.
+class Assembler {
+public:
+    // Метка перехода внутри формулы
+    using Label = size_t;
+    // Вычисление узла формулы интерпретатором
+    using NodeEvaluator = double (*)(const void* node, const CellValueAccessor& cells);
+
+    Assembler();
+
+    // xmm0 = value
+    void LoadConstant(double value);
+    // xmm0 = значение ячейки (через CellValueAccessor::get_value, как в интерпретаторе)
+    void LoadCell(const CellReference* cell);
+    // xmm0 = evaluate(node, ...): узел, для которого машинный код не генерируется
+    void EvaluateNode(NodeEvaluator evaluate, const void* node);
+    // xmm0 = -xmm0
+    void Negate();
+    // Сохраняет xmm0 как левый операнд следующей бинарной операции
+    void PushOperand();
+    // xmm0 = <сохранённый операнд> op xmm0 с проверками деления на ноль и inf/nan
+    void BinaryOperation(char operation);
+    // xmm0 = 1, если <сохранённый операнд> sign xmm0 (sign: <, <=, >, >=, =, <>), иначе 0
+    void Compare(std::string_view sign);
+
+    // Переходы для условных вычислений (IF, AND, OR). Ветви между переходом и меткой
+    // не должны менять количество промежуточных значений на стеке
+    Label NewLabel();
+    void Bind(Label label);
+    void Jump(Label label);
+    // Переход, если xmm0 равен (не равен) нулю; NaN считается ненулевым, как в интерпретаторе
+    void JumpIfZero(Label label);
+    void JumpIfNonZero(Label label);
+
+    // Возвращает nullptr, если не удалось выделить исполняемую память
+    std::unique_ptr<CompiledFormula> Finish();
+
+private:
+    void Emit(std::initializer_list<uint8_t> bytes);
+    void EmitImmediate(uint64_t value, int size);
+    // Условный (или безусловный при condition = 0) переход на выход с ошибкой category
+    void JumpToError(uint8_t condition, FormulaError::Category category);
+    void JumpToFail(uint8_t condition);
+    void JumpToLabel(uint8_t condition, Label label);
+
+private:
+    std::vector<uint8_t> code_;
+    // Количество промежуточных значений на стеке
+    int depth_ = 0;
+    // Смещения 32-битных адресов переходов на выход с ошибкой
+    std::vector<size_t> fail_jumps_;
+    // Смещения меток в коде и переходы на метки (смещение адреса перехода, метка)
+    std::vector<size_t> labels_;
+    std::vector<std::pair<size_t, Label>> label_jumps_;
+};
+
+}  // namespace jit
@@ -1,8 +1,18 @@
+#include <filesystem>
+#include <fstream>
 #include <limits>
 
 #include "common.h"
+#include "batch.h"
+#include "dependency_analysis.h"
 #include "formula.h"
+#include "jit.h"
+#include "sheet.h"
 #include "test_runner_p.h"
+#include "tools.h"
+#include "trace.h"
+#include "wal.h"
+#include "workbook.h"
 
 inline std::ostream& operator<<(std::ostream& output, Position pos) {
     return output << "(" << pos.row << ", " << pos.col << ")";
@@ -53,6 +63,20 @@ void TestPositionAndStringConversion() {
     testSingle(Position{Position::MAX_ROWS - 1, Position::MAX_COLS - 1}, "XFD16384");
 }
 
+void TestPositionToChars() {
+    constexpr auto xfd = [] {
+        std::array<char, Position::MAX_STRING_LENGTH> buffer{};
+        Position{Position::MAX_ROWS - 1, Position::MAX_COLS - 1}.ToChars(buffer.data());
+        return buffer;
+    }();
+    static_assert(std::string_view(xfd.data(), xfd.size()) == "XFD16384");
+
+    char buffer[Position::MAX_STRING_LENGTH];
+    ASSERT_EQUAL(std::string_view(buffer, Position{9, 27}.ToChars(buffer)), "AB10");
+    ASSERT_EQUAL(std::string_view(buffer, Position{99, 701}.ToChars(buffer)), "ZZ100");
+    ASSERT_EQUAL(Position::NONE.ToChars(buffer), 0u);
+}
+
 void TestPositionToStringInvalid() {
     ASSERT_EQUAL((Position{-1, -1}).ToString(), "");
     ASSERT_EQUAL((Position{-10, 0}).ToString(), "");
@@ -176,6 +200,15 @@ void TestFormulaExpressionFormatting() {
     ASSERT_EQUAL(reformat("(2*3)+4"), "2*3+4");
     ASSERT_EQUAL(reformat("(2*3)-4"), "2*3-4");
     ASSERT_EQUAL(reformat("( ( (  1) ) )"), "1");
+    ASSERT_EQUAL(reformat("IF( A1 >= 1 , (A2), A3 <> 2 )"), "IF(A1>=1,A2,A3<>2)");
+    ASSERT_EQUAL(reformat("AND(1, OR(A1, 0)) * (A1 < A2)"), "AND(1,OR(A1,0))*(A1<A2)");
+    ASSERT_EQUAL(reformat("MATCH( A1 + 1 , B10:B1 )"), "MATCH(A1+1,B1:B10)");
+    ASSERT_EQUAL(reformat("VLOOKUP(2, A1:C5, (1 + 1))"), "VLOOKUP(2,A1:C5,1+1)");
+    ASSERT_EQUAL(reformat("XLOOKUP(2, Sheet2!A1:A5, B1:B5, -1)"), "XLOOKUP(2,Sheet2!A1:A5,B1:B5,-1)");
+    ASSERT_EQUAL(reformat("SUM( B2:A1 ) / COUNT(A1:A5) - (AVERAGE(Sheet2!C1:C3))"),
+                 "SUM(A1:B2)/COUNT(A1:A5)-AVERAGE(Sheet2!C1:C3)");
+    ASSERT_EQUAL(reformat("(A1 < A2) = (A3 + 1 > 0)"), "A1<A2=(A3+1>0)");
+    ASSERT_EQUAL(reformat("-(A1 <= 2)"), "-(A1<=2)");
 }
 
 void TestFormulaReferencedCells() {
@@ -192,6 +225,385 @@ void TestFormulaReferencedCells() {
     ASSERT_EQUAL(tricky->GetReferencedCells(), (std::vector{"A1"_pos, "A2"_pos, "A3"_pos}));
 }
 
+void TestFormulaCanonicalText() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "= ( 1 + B2 ) ");
+    sheet.SetCell("B1"_pos, "=1+B2");
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "=1+B2");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), "=1+B2");
+
+    // Повторная установка того же исходного текста не меняет ячейку
+    auto value = sheet.GetCell("A1"_pos)->GetValue();
+    sheet.SetCell("A1"_pos, "= ( 1 + B2 ) ");
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), value);
+
+    std::ostringstream texts;
+    sheet.PrintTexts(texts);
+    ASSERT_EQUAL(texts.str(), "=1+B2\t=1+B2\n\t\n");
+}
+
+void TestFormulaSimplification() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "3");
+    auto check = [&](std::string expr, std::string expected_text, CellInterface::Value expected_value) {
+        auto formula = ParseFormula(expr);
+        ASSERT_EQUAL(formula->GetExpression(), expected_text);
+        auto value = formula->Evaluate(*sheet);
+        if (std::holds_alternative<double>(value)) {
+            ASSERT_EQUAL(CellInterface::Value(std::get<double>(value)), expected_value);
+        } else {
+            ASSERT_EQUAL(CellInterface::Value(std::get<FormulaError>(value)), expected_value);
+        }
+    };
+
+    check("(2*3.5+1)*A1/(4-2)", "(2*3.5+1)*A1/(4-2)", 12.0);
+    check("+(+A1)*1-0", "++A1*1-0", 3.0);
+    check("-(-A1)/1", "--A1/1", 3.0);
+    check("-(1+2)", "-(1+2)", -3.0);
+    check("1/(2-2)+A1", "1/(2-2)+A1", FormulaError::Category::Arithmetic);
+    check("A1+1e200*1e200", "A1+1e+200*1e+200", FormulaError::Category::Arithmetic);
+
+    // Текст "inf" превращается в бесконечность: умножение на 1 по-прежнему даёт ошибку
+    sheet->SetCell("B1"_pos, "inf");
+    check("B1*1", "B1*1", FormulaError::Category::Arithmetic);
+}
+
+void TestJitMatchesInterpreter() {
+    if (!jit::IsSupported()) {
+        return;
+    }
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "3");
+    sheet->SetCell("A2"_pos, "-0.5");
+    sheet->SetCell("B1"_pos, "text");
+    sheet->SetCell("B2"_pos, "=1/0");
+    sheet->SetCell("C1"_pos, "nan");
+    sheet->SetCell("C2"_pos, "0");
+
+    auto threshold = jit::GetThreshold();
+    jit::SetThreshold(1);
+    for (std::string expr : {"1", "A1", "-A1", "A1+A2*(A1-A2)/4", "(A1*A2+A1/A2)*(A1-A2)-A1/(A2+A1)",
+                             "-(A1+A2)*+A2", "A1/C2", "A1/(A2-A2)", "A1+B1", "B1/0", "A1/0+B1", "A1+B2",
+                             "A1/C1", "E5*A1", "1e200*A1*1e200", "A1*1", "+A1/1-0",
+                             "A1<A2", "A1>=A2", "A1=3", "A1<>A1", "C1=C1", "C1<>C1", "C1<A1", "C1>=A1",
+                             "IF(A1>0,A2,B1)", "IF(A2>0,A2,B1)", "IF(C1,1,2)", "IF(A1-3,B2,A1*(A2<0))",
+                             "AND(A1,A2,C2)", "AND(A1,A2)", "OR(C2,0,B2)", "OR(C2,A1,B2)", "AND(C2,B1)",
+                             "A1+IF(A2<0,AND(A1,OR(C2,A2)),B1)*2", "MATCH(-0.5,A1:A2)", "MATCH(1,A1:A2)",
+                             "VLOOKUP(3,A1:C2,2)", "VLOOKUP(-0.5,A1:C2,3)", "VLOOKUP(3,A1:C2,4)", "XLOOKUP(A1,A1:A2,B1:B2)",
+                             "XLOOKUP(7,A1:A2,B1:B2,A1*2)", "A1+MATCH(0,C1:C2)*2", "SUM(A1:C2)", "SUM(A1:A2)",
+                             "COUNT(A1:C2)*2", "AVERAGE(C1:C2)", "AVERAGE(A1:B1)+A2"}) {
+        auto formula = ParseFormula(expr);
+        jit::SetEnabled(false);
+        auto expected = formula->Evaluate(*sheet);
+        jit::SetEnabled(true);
+        // первое вычисление компилирует формулу, второе выполняет машинный код
+        formula->Evaluate(*sheet);
+        auto compiled = formula->Evaluate(*sheet);
+        ASSERT(compiled == expected);
+    }
+    jit::SetThreshold(threshold);
+}
+
+void TestConditionalFormulas() {
+    auto evaluate = [](const Sheet& sheet, Position pos) {
+        return sheet.GetCell(pos)->GetValue();
+    };
+    for (auto strategy : {EvaluationStrategy::Recursive, EvaluationStrategy::Iterative}) {
+        Sheet sheet;
+        sheet.SetEvaluationStrategy(strategy);
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("C1"_pos, "7");
+        sheet.SetCell("B1"_pos, "=C1*2");
+        sheet.SetCell("B2"_pos, "=1/0");
+        sheet.SetCell("A2"_pos, "=IF(A1>0, 10, B1)");
+        sheet.SetCell("A3"_pos, "=OR(A1=1, B2) + AND(A1<>1, B2)");
+
+        // Невыбранная ветвь и операнды после известного результата не вычисляются
+        ASSERT_EQUAL(evaluate(sheet, "A2"_pos), CellInterface::Value(10.0));
+        ASSERT_EQUAL(evaluate(sheet, "A3"_pos), CellInterface::Value(1.0));
+        ASSERT(!sheet.GetConcreteCell("B1"_pos)->HasValue());
+        ASSERT(!sheet.GetConcreteCell("B2"_pos)->HasValue());
+
+        // Зависимости статические: изменение невыбранной ветви сбрасывает кэш
+        ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetReferencedCells(), (std::vector{"A1"_pos, "B1"_pos}));
+        sheet.SetCell("A1"_pos, "0");
+        ASSERT_EQUAL(evaluate(sheet, "A2"_pos), CellInterface::Value(14.0));
+        ASSERT_EQUAL(evaluate(sheet, "A3"_pos), CellInterface::Value(FormulaError::Category::Arithmetic));
+        sheet.SetCell("C1"_pos, "8");
+        ASSERT_EQUAL(evaluate(sheet, "A2"_pos), CellInterface::Value(16.0));
+
+        try {
+            sheet.SetCell("B1"_pos, "=IF(1, 2, A2)");
+            ASSERT(false);
+        } catch (const CircularDependencyException&) {
+        }
+    }
+
+    // Длинная цепочка условных формул вычисляется без рекурсии; ячейка E1
+    // из невыбранных ветвей не вычисляется
+    const int length = 50'000;
+    auto pos = [](int index) {
+        return Position{index % Position::MAX_ROWS, index / Position::MAX_ROWS};
+    };
+    Sheet sheet;
+    sheet.SetCell("E1"_pos, "=1/0");
+    sheet.SetCell(pos(0), "1");
+    for (int i = 1; i < length; ++i) {
+        auto prev = pos(i - 1).ToString();
+        sheet.SetCell(pos(i), "=IF(" + prev + ">0, " + prev + "+1, E1)");
+    }
+    ASSERT_EQUAL(sheet.GetCell(pos(length - 1))->GetValue(), CellInterface::Value(double(length)));
+    ASSERT(!sheet.GetConcreteCell("E1"_pos)->HasValue());
+}
+
+void TestLookupFunctions() {
+    for (auto strategy : {EvaluationStrategy::Recursive, EvaluationStrategy::Iterative}) {
+        Sheet sheet;
+        sheet.SetEvaluationStrategy(strategy);
+        sheet.SetCell("A1"_pos, "10");
+        sheet.SetCell("A2"_pos, "=A1*2");
+        sheet.SetCell("A3"_pos, "30");
+        sheet.SetCell("A4"_pos, "'20");
+        sheet.SetCell("B1"_pos, "first");
+        sheet.SetCell("B2"_pos, "2");
+        sheet.SetCell("B3"_pos, "3");
+        sheet.SetCell("B4"_pos, "4");
+        sheet.SetCell("D1"_pos, "=MATCH(20, A1:A4)");
+        sheet.SetCell("D2"_pos, "=VLOOKUP(30, A1:B4, 2)");
+        sheet.SetCell("D3"_pos, "=XLOOKUP(40, A1:A4, B1:B4, -1)");
+        sheet.SetCell("D4"_pos, "=MATCH(20, A3:A4) + VLOOKUP(10, A1:B4, 1)");
+        sheet.SetCell("D5"_pos, "=VLOOKUP(10, A1:B4, 2)");
+        sheet.SetCell("D6"_pos, "=MATCH(40, A1:A4)");
+        sheet.SetCell("D7"_pos, "=VLOOKUP(10, A1:B4, 3)");
+
+        auto value = [&sheet](Position pos) {
+            return sheet.GetCell(pos)->GetValue();
+        };
+        ASSERT_EQUAL(value("D1"_pos), CellInterface::Value(2.0));
+        ASSERT_EQUAL(value("D2"_pos), CellInterface::Value(3.0));
+        ASSERT_EQUAL(value("D3"_pos), CellInterface::Value(-1.0));
+        ASSERT_EQUAL(value("D4"_pos), CellInterface::Value(12.0));
+        ASSERT_EQUAL(value("D5"_pos), CellInterface::Value(FormulaError::Category::Value));
+        ASSERT_EQUAL(value("D6"_pos), CellInterface::Value(FormulaError::Category::NotAvailable));
+        ASSERT_EQUAL(value("D7"_pos), CellInterface::Value(FormulaError::Category::Ref));
+
+        // Индекс столбца обновляется после изменения, очистки и пересчёта его ячеек
+        sheet.SetCell("A3"_pos, "40");
+        ASSERT_EQUAL(value("D2"_pos), CellInterface::Value(FormulaError::Category::NotAvailable));
+        ASSERT_EQUAL(value("D3"_pos), CellInterface::Value(3.0));
+        sheet.SetCell("A1"_pos, "15");
+        ASSERT_EQUAL(value("D1"_pos), CellInterface::Value(4.0));
+        sheet.ClearCell("A4"_pos);
+        ASSERT_EQUAL(value("D1"_pos), CellInterface::Value(FormulaError::Category::NotAvailable));
+        ASSERT_EQUAL(value("D4"_pos), CellInterface::Value(FormulaError::Category::NotAvailable));
+        sheet.SetCell("A1"_pos, "10");
+        ASSERT_EQUAL(value("D1"_pos), CellInterface::Value(2.0));
+        sheet.SetCell("B2"_pos, "=B3+B4");
+        sheet.SetCell("D8"_pos, "=XLOOKUP(20, A1:A4, B1:B4)");
+        ASSERT_EQUAL(value("D8"_pos), CellInterface::Value(7.0));
+        sheet.SetCell("B4"_pos, "5");
+        ASSERT_EQUAL(value("D8"_pos), CellInterface::Value(8.0));
+
+        // Формула не может искать в области, которая зависит от неё самой
+        for (std::string text : {"=MATCH(1, A1:A4)", "=XLOOKUP(1, C1:C3, D1:D3)"}) {
+            try {
+                sheet.SetCell("A3"_pos, text);
+                ASSERT(false);
+            } catch (const CircularDependencyException&) {
+            }
+        }
+        try {
+            sheet.SetCell("A3"_pos, "=D1");
+            ASSERT(false);
+        } catch (const CircularDependencyException&) {
+        }
+        ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetText(), "40"s);
+
+        // Области сдвигаются вместе с ячейками
+        sheet.InsertRows(1);
+        ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetText(), "=MATCH(20,A1:A5)"s);
+        ASSERT_EQUAL(value("D1"_pos), CellInterface::Value(3.0));
+        sheet.DeleteRows(0, 2);
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos), nullptr);
+        ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetText(), "=VLOOKUP(30,A1:B3,2)"s);
+        ASSERT_EQUAL(value("D1"_pos), CellInterface::Value(FormulaError::Category::NotAvailable));
+        ASSERT_EQUAL(sheet.GetCell("D2"_pos)->GetText(), "=XLOOKUP(40,A1:A3,B1:B3,-1)"s);
+        ASSERT_EQUAL(value("D2"_pos), CellInterface::Value(3.0));
+
+        // Ключ - ссылка на ячейку: ячейка результата не входит в ссылки формулы
+        // и читается по позиции
+        Sheet keyed;
+        keyed.SetEvaluationStrategy(strategy);
+        keyed.SetCell("A1"_pos, "5");
+        keyed.SetCell("B2"_pos, "5");
+        keyed.SetCell("C2"_pos, "42");
+        keyed.SetCell("D1"_pos, "=VLOOKUP(A1, B1:C10, 2)");
+        keyed.SetCell("D2"_pos, "=XLOOKUP(A1, B1:B10, C1:C10) + A1");
+        ASSERT_EQUAL(keyed.GetCell("D1"_pos)->GetValue(), CellInterface::Value(42.0));
+        ASSERT_EQUAL(keyed.GetCell("D2"_pos)->GetValue(), CellInterface::Value(47.0));
+        keyed.SetCell("C2"_pos, "7");
+        ASSERT_EQUAL(keyed.GetCell("D1"_pos)->GetValue(), CellInterface::Value(7.0));
+        ASSERT_EQUAL(keyed.GetCell("D2"_pos)->GetValue(), CellInterface::Value(12.0));
+    }
+
+    try {
+        ParseFormula("XLOOKUP(1, A1:A4, B1:B3)");
+        ASSERT(false);
+    } catch (const FormulaException&) {
+    }
+    try {
+        ParseFormula("MATCH(1, A1:B4)");
+        ASSERT(false);
+    } catch (const FormulaException&) {
+    }
+
+    // Режим Eager: формулы поиска пересчитываются после изменения ячеек областей
+    Workbook workbook;
+    workbook.SetRecalculationMode(RecalculationMode::Eager);
+    auto& data = workbook.AddSheet("Data");
+    auto& report = workbook.AddSheet("Report");
+    data.SetCell("A1"_pos, "1");
+    data.SetCell("A2"_pos, "2");
+    data.SetCell("B1"_pos, "100");
+    data.SetCell("B2"_pos, "=B1*2");
+    report.SetCell("A1"_pos, "=VLOOKUP(2, Data!A1:B2, 2) + 1");
+    ASSERT_EQUAL(report.GetCell("A1"_pos)->GetValue(), CellInterface::Value(201.0));
+    data.SetCell("B1"_pos, "50");
+    ASSERT_EQUAL(report.GetCell("A1"_pos)->GetValue(), CellInterface::Value(101.0));
+    ASSERT(report.GetConcreteCell("A1"_pos)->HasValue());
+    data.SetCell("A2"_pos, "3");
+    ASSERT_EQUAL(report.GetCell("A1"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::NotAvailable));
+    try {
+        report.SetCell("A2"_pos, "=MATCH(1, Unknown!A1:A2)");
+        ASSERT(false);
+    } catch (const FormulaException&) {
+    }
+
+    // Вычисленное значение не сохраняется после вставки и удаления строк: ячейки области
+    // изменились вместе с переносом
+    Sheet moved;
+    moved.SetCell("A5"_pos, "0");
+    moved.SetCell("B1"_pos, "=A5+3");
+    moved.SetCell("C1"_pos, "=MATCH(3, B1:B2)");
+    ASSERT_EQUAL(moved.GetCell("C1"_pos)->GetValue(), CellInterface::Value(1.0));
+    moved.DeleteRows(4);
+    ASSERT_EQUAL(moved.GetCell("B1"_pos)->GetText(), "=#REF!+3"s);
+    ASSERT_EQUAL(moved.GetCell("C1"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::NotAvailable));
+    moved.SetCell("C2"_pos, "4");
+    moved.SetCell("B2"_pos, "=IF(C2>1,D6,A12)");
+    moved.SetCell("C7"_pos, "=MATCH(5, B2:B5)");
+    ASSERT_EQUAL(moved.GetCell("C7"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::NotAvailable));
+    moved.InsertRows(8);
+    moved.SetCell("D6"_pos, "5");
+    ASSERT_EQUAL(moved.GetCell("C7"_pos)->GetValue(), CellInterface::Value(1.0));
+
+    // Удаление строк из одной области XLOOKUP: строки областей больше не соответствуют
+    // друг другу, и формула не читает ячейки за пределами своей области результатов
+    Sheet shrunk;
+    shrunk.SetCell("A10"_pos, "5");
+    shrunk.SetCell("C20"_pos, "2100");
+    shrunk.SetCell("E1"_pos, "=XLOOKUP(5, A1:A10, C11:C20)");
+    ASSERT_EQUAL(shrunk.GetCell("E1"_pos)->GetValue(), CellInterface::Value(2100.0));
+    shrunk.DeleteRows(14);
+    ASSERT_EQUAL(shrunk.GetCell("E1"_pos)->GetText(), "=XLOOKUP(5,A1:A10,C11:C19)"s);
+    ASSERT_EQUAL(shrunk.GetCell("E1"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Ref));
+    shrunk.SetCell("C20"_pos, "7");
+    ASSERT_EQUAL(shrunk.GetCell("E1"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Ref));
+}
+
+void TestAggregateFunctions() {
+    for (auto strategy : {EvaluationStrategy::Recursive, EvaluationStrategy::Iterative}) {
+        Sheet sheet;
+        sheet.SetEvaluationStrategy(strategy);
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("A2"_pos, "=A1*2");
+        sheet.SetCell("A3"_pos, "'4");
+        sheet.SetCell("A4"_pos, "text");
+        sheet.SetCell("B1"_pos, "8");
+        sheet.SetCell("B3"_pos, "=A3+B1");
+        sheet.SetCell("D1"_pos, "=SUM(A1:B4)");
+        sheet.SetCell("D2"_pos, "=COUNT(A1:B4)");
+        sheet.SetCell("D3"_pos, "=AVERAGE(A1:A4)");
+        sheet.SetCell("D4"_pos, "=SUM(B2:B2) + COUNT(C1:C100)");
+        sheet.SetCell("D5"_pos, "=AVERAGE(C1:C100)");
+
+        auto value = [&sheet](Position pos) {
+            return sheet.GetCell(pos)->GetValue();
+        };
+        ASSERT_EQUAL(value("D1"_pos), CellInterface::Value(27.0));
+        ASSERT_EQUAL(value("D2"_pos), CellInterface::Value(5.0));
+        ASSERT_EQUAL(value("D3"_pos), CellInterface::Value(7.0 / 3));
+        ASSERT_EQUAL(value("D4"_pos), CellInterface::Value(0.0));
+        ASSERT_EQUAL(value("D5"_pos), CellInterface::Value(FormulaError::Category::Arithmetic));
+
+        // Итоги обновляются по изменившимся ячейкам, в том числе пересчитанным формулам
+        sheet.SetCell("A1"_pos, "10");
+        ASSERT_EQUAL(value("D1"_pos), CellInterface::Value(54.0));
+        sheet.SetCell("A4"_pos, "5");
+        sheet.ClearCell("A3"_pos);
+        ASSERT_EQUAL(value("D1"_pos), CellInterface::Value(51.0));
+        ASSERT_EQUAL(value("D2"_pos), CellInterface::Value(5.0));
+        ASSERT_EQUAL(value("D3"_pos), CellInterface::Value(35.0 / 3));
+
+        // Ошибка области - первая по строкам
+        sheet.SetCell("B2"_pos, "=1/0");
+        sheet.SetCell("A4"_pos, "=B5");
+        sheet.SetCell("B5"_pos, "x");
+        ASSERT_EQUAL(value("D1"_pos), CellInterface::Value(FormulaError::Category::Arithmetic));
+        sheet.ClearCell("B2"_pos);
+        ASSERT_EQUAL(value("D1"_pos), CellInterface::Value(FormulaError::Category::Value));
+        ASSERT_EQUAL(value("D4"_pos), CellInterface::Value(0.0));
+        sheet.ClearCell("B5"_pos);
+        ASSERT_EQUAL(value("D1"_pos), CellInterface::Value(46.0));
+
+        // Суммы компенсируют ошибку округления
+        sheet.SetCell("C1"_pos, "1e20");
+        sheet.SetCell("C2"_pos, "1");
+        sheet.SetCell("C3"_pos, "-1e20");
+        ASSERT_EQUAL(value("D5"_pos), CellInterface::Value(1.0 / 3));
+
+        try {
+            sheet.SetCell("C50"_pos, "=COUNT(A1:D10)");
+            ASSERT(false);
+        } catch (const CircularDependencyException&) {
+        }
+        try {
+            sheet.SetCell("B5"_pos, "=SUM(A1:A4)");
+            ASSERT(false);
+        } catch (const CircularDependencyException&) {
+        }
+    }
+
+    // Режим Eager
+    Sheet sheet;
+    sheet.SetRecalculationMode(RecalculationMode::Eager);
+    for (int row = 0; row < 100; ++row) {
+        sheet.SetCell({row, 0}, std::to_string(row));
+    }
+    sheet.SetCell("B1"_pos, "=SUM(A1:A100)");
+    sheet.SetCell("B2"_pos, "=B1/COUNT(A1:A100)");
+    ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetValue(), CellInterface::Value(49.5));
+    sheet.SetCell("A50"_pos, "149");
+    ASSERT(sheet.GetConcreteCell("B2"_pos)->HasValue());
+    ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetValue(), CellInterface::Value(50.5));
+
+    // Итог области пересчитывается после вставки и удаления строк
+    Sheet moved;
+    moved.SetCell("A5"_pos, "0");
+    moved.SetCell("B1"_pos, "=A5+3");
+    moved.SetCell("C1"_pos, "=SUM(B1:B2)");
+    ASSERT_EQUAL(moved.GetCell("C1"_pos)->GetValue(), CellInterface::Value(3.0));
+    moved.DeleteRows(4);
+    ASSERT_EQUAL(moved.GetCell("C1"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Ref));
+    moved.SetCell("C2"_pos, "4");
+    moved.SetCell("B2"_pos, "=IF(C2>1,D6,A12)");
+    moved.SetCell("B7"_pos, "=SUM(B2:B5)");
+    ASSERT_EQUAL(moved.GetCell("B7"_pos)->GetValue(), CellInterface::Value(0.0));
+    moved.InsertRows(8);
+    moved.SetCell("D6"_pos, "=1/0");
+    ASSERT_EQUAL(moved.GetCell("B7"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Arithmetic));
+}
+
 void TestErrorValue() {
     auto sheet = CreateSheet();
     sheet->SetCell("E2"_pos, "A1");
@@ -345,12 +757,851 @@ void TestCellCircularReferences() {
 
     ASSERT(caught);
     ASSERT_EQUAL(sheet->GetCell("M6"_pos)->GetText(), "Ready");
+
+    // После очистки формулы её бывшие ссылки не образуют с ней цикла
+    sheet->SetCell("A1"_pos, "=B1+1");
+    sheet->ClearCell("A1"_pos);
+    sheet->SetCell("B1"_pos, "=A1");
+    ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetValue(), CellInterface::Value(0.0));
+}
+
+void TestEagerRecalculation() {
+    Sheet sheet;
+    sheet.SetRecalculationMode(RecalculationMode::Eager);
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("B1"_pos, "=A1*0");
+    sheet.SetCell("B2"_pos, "=B1+1");
+    sheet.SetCell("B3"_pos, "=B2+1");
+    sheet.SetCell("C1"_pos, "=A1+B3");
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(3.0));
+
+    // Значение B1 не изменилось: B2 и B3 не пересчитываются
+    sheet.SetCell("A1"_pos, "2");
+    ASSERT_EQUAL(sheet.GetLastRecalculationCount(), 3u);
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(4.0));
+
+    sheet.SetCell("A1"_pos, "text");
+    ASSERT_EQUAL(sheet.GetLastRecalculationCount(), 5u);
+    ASSERT_EQUAL(sheet.GetCell("B3"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Value));
+
+    sheet.ClearCell("A1"_pos);
+    ASSERT_EQUAL(sheet.GetLastRecalculationCount(), 5u);
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(2.0));
+
+    // Результаты совпадают с ленивым пересчётом
+    sheet.SetRecalculationMode(RecalculationMode::Lazy);
+    sheet.SetCell("A1"_pos, "5");
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(7.0));
+}
+
+void TestLongDependencyChain() {
+    // Цепочка длиннее, чем допускает рекурсивное вычисление (продолжается по столбцам)
+    const int length = 100'000;
+    auto pos = [](int index) {
+        return Position{index % Position::MAX_ROWS, index / Position::MAX_ROWS};
+    };
+    Sheet sheet;
+    sheet.SetCell(pos(0), "1");
+    for (int i = 1; i < length; ++i) {
+        sheet.SetCell(pos(i), "=" + pos(i - 1).ToString() + "+1");
+    }
+    ASSERT_EQUAL(sheet.GetCell(pos(length - 1))->GetValue(), CellInterface::Value(double(length)));
+
+    sheet.SetCell(pos(0), "=-1");
+    ASSERT_EQUAL(sheet.GetCell(pos(length - 1))->GetValue(), CellInterface::Value(double(length - 2)));
+}
+
+void TestGetValueAsync() {
+    const int length = 50'000;
+    auto pos = [](int index) {
+        return Position{index % Position::MAX_ROWS, index / Position::MAX_ROWS};
+    };
+    Sheet sheet;
+    sheet.SetCell(pos(0), "1");
+    for (int i = 1; i < length; ++i) {
+        sheet.SetCell(pos(i), "=" + pos(i - 1).ToString() + "+1");
+    }
+    auto is_cancelled = [](std::future<CellInterface::Value>& value) {
+        try {
+            value.get();
+        } catch (const EvaluationCancelledException&) {
+            return true;
+        }
+        return false;
+    };
+
+    EvaluationLimits expired;
+    expired.deadline = EvaluationLimits::Clock::now();
+    auto value = sheet.GetValueAsync(pos(length - 1), expired);
+    ASSERT(is_cancelled(value));
+    ASSERT(!sheet.GetConcreteCell(pos(1))->HasValue());
+
+    EvaluationLimits cancelled;
+    cancelled.token.Cancel();
+    value = sheet.GetValueAsync(pos(length - 1), cancelled);
+    ASSERT(is_cancelled(value));
+
+    // Вычисление, прерванное по сроку, продолжается повторным запросом
+    EvaluationLimits short_deadline;
+    short_deadline.deadline = EvaluationLimits::Clock::now() + 1ms;
+    value = sheet.GetValueAsync(pos(length - 1), short_deadline);
+    value.wait();
+    ASSERT_EQUAL(sheet.GetValueAsync(pos(length - 1)).get(), CellInterface::Value(double(length)));
+    ASSERT_EQUAL(sheet.GetValueAsync("A1"_pos).get(), CellInterface::Value("1"s));
+    ASSERT_EQUAL(sheet.GetValueAsync(pos(length)).get(), CellInterface::Value(""s));
+
+    try {
+        sheet.GetValueAsync(Position::NONE);
+        ASSERT(false);
+    } catch (const InvalidPositionException&) {
+    }
+}
+
+void TestWorkbook() {
+    Workbook workbook;
+    auto& data = workbook.AddSheet("Data");
+    auto& report = workbook.AddSheet("Report");
+    ASSERT_EQUAL(workbook.GetSheetNames(), (std::vector<std::string>{"Data", "Report"}));
+    ASSERT(workbook.GetSheet("Data") == &data);
+    ASSERT(workbook.GetSheet("Other") == nullptr);
+
+    data.SetCell("A1"_pos, "2");
+    data.SetCell("A2"_pos, "=A1*10");
+    report.SetCell("B1"_pos, "=Data!A2+ Data!A1");
+    ASSERT_EQUAL(report.GetCell("B1"_pos)->GetText(), "=Data!A2+Data!A1");
+    ASSERT_EQUAL(report.GetCell("B1"_pos)->GetValue(), CellInterface::Value(22.0));
+    ASSERT(report.GetCell("B1"_pos)->GetReferencedCells().empty());
+
+    // Изменение ячейки одной таблицы сбрасывает кэш зависимых ячеек другой
+    data.SetCell("A1"_pos, "3");
+    ASSERT_EQUAL(report.GetCell("B1"_pos)->GetValue(), CellInterface::Value(33.0));
+
+    // Ссылка на пустую ячейку другой таблицы создаёт её
+    report.SetCell("B2"_pos, "=Data!C3+1");
+    ASSERT_EQUAL(report.GetCell("B2"_pos)->GetValue(), CellInterface::Value(1.0));
+    ASSERT_EQUAL(data.GetPrintableSize(), (Size{3, 3}));
+
+    // Циклы через границы таблиц
+    try {
+        data.SetCell("C3"_pos, "=Report!B2");
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+    ASSERT_EQUAL(data.GetCell("C3"_pos)->GetText(), "");
+
+    try {
+        report.SetCell("C1"_pos, "=Missing!A1");
+        ASSERT(false);
+    } catch (const FormulaException&) {
+    }
+    ASSERT_EQUAL(report.GetCell("C1"_pos), nullptr);
+
+    // Одинаковые формулы разных таблиц разбираются один раз
+    auto& copy = workbook.AddSheet("Copy");
+    copy.SetCell("B1"_pos, "=Data!A2+ Data!A1");
+    ASSERT_EQUAL(workbook.GetInternedFormulaCount(), 3u);
+    ASSERT_EQUAL(copy.GetCell("B1"_pos)->GetValue(), CellInterface::Value(33.0));
+
+    // Отдельная таблица не может ссылаться на другие таблицы
+    Sheet sheet;
+    try {
+        sheet.SetCell("A1"_pos, "=Data!A1");
+        ASSERT(false);
+    } catch (const FormulaException&) {
+    }
+
+    try {
+        workbook.AddSheet("Data");
+        ASSERT(false);
+    } catch (const std::invalid_argument&) {
+    }
+    try {
+        workbook.AddSheet("My sheet");
+        ASSERT(false);
+    } catch (const std::invalid_argument&) {
+    }
+}
+
+void TestInsertDeleteRowsColumns() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("A2"_pos, "2");
+    sheet.SetCell("A3"_pos, "=A1+A2");
+    sheet.SetCell("B3"_pos, "=A3*2");
+    ASSERT_EQUAL(sheet.GetCell("B3"_pos)->GetValue(), CellInterface::Value(6.0));
+
+    sheet.InsertRows(1);
+    ASSERT_EQUAL(sheet.GetCell("A2"_pos), nullptr);
+    ASSERT_EQUAL(sheet.GetCell("A4"_pos)->GetText(), "=A1+A3");
+    ASSERT_EQUAL(sheet.GetCell("B4"_pos)->GetText(), "=A4*2");
+    ASSERT_EQUAL(sheet.GetCell("B4"_pos)->GetValue(), CellInterface::Value(6.0));
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{4, 2}));
+
+    sheet.SetCell("A3"_pos, "5");
+    ASSERT_EQUAL(sheet.GetCell("B4"_pos)->GetValue(), CellInterface::Value(12.0));
+
+    // Ссылки на удалённые ячейки становятся #REF!
+    sheet.DeleteRows(0);
+    ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetText(), "=#REF!+A2");
+    ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetReferencedCells(), std::vector{"A2"_pos});
+    ASSERT_EQUAL(sheet.GetCell("B3"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Ref));
+
+    sheet.InsertColumns(0, 2);
+    ASSERT_EQUAL(sheet.GetCell("D3"_pos)->GetText(), "=C3*2");
+    sheet.SetCell("E1"_pos, "=C3+1");
+    sheet.DeleteColumns(1);
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetText(), "=B3+1");
+    ASSERT_EQUAL(sheet.GetCell("C3"_pos)->GetText(), "=B3*2");
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{3, 4}));
+
+    // Ячейки не выходят за пределы таблицы
+    sheet.SetCell({Position::MAX_ROWS - 1, 0}, "last");
+    try {
+        sheet.InsertRows(0);
+        ASSERT(false);
+    } catch (const InvalidPositionException&) {
+    }
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetText(), "=B3+1");
+
+    // Ссылки из других таблиц книги; общая формула меняется только в своей таблице
+    Workbook workbook;
+    auto& data = workbook.AddSheet("Data");
+    auto& report = workbook.AddSheet("Report");
+    data.SetCell("A1"_pos, "1");
+    data.SetCell("B1"_pos, "=A1+1");
+    report.SetCell("A1"_pos, "10");
+    report.SetCell("B1"_pos, "=A1+1");
+    report.SetCell("C1"_pos, "=Data!B1*2");
+    data.InsertRows(0);
+    ASSERT_EQUAL(data.GetCell("B2"_pos)->GetText(), "=A2+1");
+    ASSERT_EQUAL(report.GetCell("B1"_pos)->GetText(), "=A1+1");
+    ASSERT_EQUAL(report.GetCell("B1"_pos)->GetValue(), CellInterface::Value(11.0));
+    ASSERT_EQUAL(report.GetCell("C1"_pos)->GetText(), "=Data!B2*2");
+    ASSERT_EQUAL(report.GetCell("C1"_pos)->GetValue(), CellInterface::Value(4.0));
+    data.SetCell("B3"_pos, "=A1+1");
+    ASSERT_EQUAL(data.GetCell("B3"_pos)->GetValue(), CellInterface::Value(1.0));
+
+    // Очищенная и затем удалённая формула не остаётся среди зависимых ячеек своих бывших ссылок
+    Sheet cleared;
+    cleared.SetCell("A2"_pos, "=B1");
+    cleared.SetCell("C1"_pos, "=B1*2");
+    cleared.ClearCell("A2"_pos);
+    cleared.DeleteRows(1);
+    cleared.SetCell("B1"_pos, "5");
+    ASSERT_EQUAL(cleared.GetCell("C1"_pos)->GetValue(), CellInterface::Value(10.0));
+}
+
+void TestMemoryUsage() {
+    Sheet sheet;
+    ASSERT_EQUAL(sheet.GetMemoryUsage(MemoryUsageMode::Exact).Total(), 0u);
+
+    sheet.SetCell("A1"_pos, "a text that does not fit into the inline string buffer");
+    sheet.SetCell("A2"_pos, "=A3+A3*2");
+    sheet.SetCell("A3"_pos, "3");
+    sheet.GetCell("A2"_pos)->GetValue();
+    auto exact = sheet.GetMemoryUsage(MemoryUsageMode::Exact);
+    ASSERT(exact.cell_map > 0);
+    ASSERT_EQUAL(exact.cells, 3 * sizeof(Cell));
+    ASSERT(exact.text_payloads > 50);
+    ASSERT(exact.formula_ast_nodes > 0);
+    ASSERT(exact.formula_cell_lists > 2 * sizeof(CellReference));
+    ASSERT(exact.cached_values > 0);
+    ASSERT(exact.dependency_sets > 0);
+    // Небольшая таблица целиком попадает в выборку
+    ASSERT_EQUAL(sheet.GetMemoryUsage().Total(), exact.Total());
+
+    // Оценка по выборке однородной таблицы близка к точному значению
+    for (int row = 0; row < 4000; ++row) {
+        sheet.SetCell({row, 1}, "=A3*" + std::to_string(row));
+    }
+    auto approximate = sheet.GetMemoryUsage().Total();
+    exact = sheet.GetMemoryUsage(MemoryUsageMode::Exact);
+    ASSERT(approximate > exact.Total() * 9 / 10 && approximate < exact.Total() * 11 / 10);
+}
+
+void TestReadRange() {
+    Sheet sheet;
+    sheet.SetCell("B2"_pos, "text");
+    sheet.SetCell("C2"_pos, "'=escaped");
+    sheet.SetCell("B3"_pos, "=C3*2");
+    sheet.SetCell("C3"_pos, "=1/0");
+    sheet.SetCell("E5"_pos, "=B3");
+
+    std::vector<CellValueView> values(3 * 3);
+    sheet.ReadRange("B2"_pos, {3, 3}, values.data());
+    ASSERT(values[0] == CellValueView("text"sv));
+    ASSERT(values[1] == CellValueView("=escaped"sv));
+    ASSERT(values[2] == CellValueView(""sv));
+    ASSERT(values[3] == CellValueView(FormulaError::Category::Arithmetic));
+    ASSERT(values[4] == CellValueView(FormulaError::Category::Arithmetic));
+    ASSERT(values[6] == CellValueView(""sv));
+
+    sheet.SetCell("C3"_pos, "4");
+    sheet.ReadRange("B3"_pos, {1, 2}, values.data());
+    ASSERT(values[0] == CellValueView(8.0));
+    ASSERT(values[1] == CellValueView("4"sv));
+    // Формула вне области не вычисляется
+    ASSERT(!static_cast<const Cell*>(sheet.GetConcreteCell("E5"_pos))->HasValue());
+
+    try {
+        sheet.ReadRange({Position::MAX_ROWS - 1, 0}, {2, 1}, values.data());
+        ASSERT(false);
+    } catch (const InvalidPositionException&) {
+    }
+}
+
+void TestDependencyAnalysis() {
+    Sheet sheet;
+    std::istringstream input("1\t=A1+1\t=B1*2\n=A1\t=A2+B1\t=C1-A2\n");
+    LoadTexts(input, sheet);
+
+    auto report = AnalyzeDependencies(sheet, 2);
+    ASSERT_EQUAL(report.cell_count, 6u);
+    ASSERT_EQUAL(report.formula_count, 5u);
+    ASSERT_EQUAL(report.link_count, 7u);
+    ASSERT_EQUAL(report.level_count, 4u);
+    ASSERT_EQUAL(report.critical_path, (std::vector{"A1"_pos, "B1"_pos, "C1"_pos, "C2"_pos}));
+
+    ASSERT_EQUAL(report.fan_out_hotspots.size(), 2u);
+    ASSERT_EQUAL(report.fan_out_hotspots[0].pos, "A1"_pos);
+    ASSERT_EQUAL(report.fan_out_hotspots[0].dependent_count, 5u);
+    ASSERT_EQUAL(report.fan_out_hotspots[1].pos, "B1"_pos);
+    ASSERT_EQUAL(report.fan_out_hotspots[1].dependent_count, 3u);
+    ASSERT_EQUAL(report.slowest_cells.size(), 2u);
+
+    // Значения после замера остаются корректными
+    ASSERT_EQUAL(sheet.GetCell("C2"_pos)->GetValue(), CellInterface::Value(3.0));
+}
+
+void TestTraceRecordAndReplay() {
+    auto sheet = CreateSheet();
+    std::ostringstream trace;
+    {
+        RecordingSheet recording(*sheet, trace, /* anonymize = */ true);
+        recording.SetCell("A1"_pos, "Secret 42");
+        recording.SetCell("B1"_pos, "=A2*2");
+        recording.GetCell("B1"_pos)->GetValue();
+        recording.ClearCell("A1"_pos);
+        try {
+            recording.SetCell("A2"_pos, "=B1");
+        } catch (const CircularDependencyException&) {
+        }
+        std::ostringstream values;
+        recording.PrintValues(values);
+        ASSERT_EQUAL(values.str(), "\t0\n\t\n");
+    }
+
+    std::istringstream input(trace.str());
+    TraceReader reader(input);
+    TraceRecord record;
+    ASSERT(reader.Read(record));
+    ASSERT(record.operation == TraceOperation::SetCell);
+    ASSERT_EQUAL(record.pos, "A1"_pos);
+    ASSERT_EQUAL(record.text, "xxxxxx 11");
+    ASSERT(reader.Read(record));
+    ASSERT_EQUAL(record.text, "=A2*2");
+
+    input.clear();
+    input.seekg(0);
+    auto replayed = CreateSheet();
+    auto report = ReplayTrace(input, *replayed);
+    const auto& set_cell = report.operations[static_cast<size_t>(TraceOperation::SetCell)];
+    ASSERT_EQUAL(set_cell.count, 3u);
+    ASSERT_EQUAL(set_cell.errors, 1u);
+    ASSERT_EQUAL(report.operations[static_cast<size_t>(TraceOperation::GetValue)].count, 1u);
+    ASSERT_EQUAL(report.operations[static_cast<size_t>(TraceOperation::PrintValues)].count, 1u);
+    ASSERT_EQUAL(replayed->GetCell("B1"_pos)->GetText(), "=A2*2");
+}
+
+void TestLoadCells() {
+    Sheet sheet;
+    // Формулы ссылаются на ячейки, которые загружаются позже: уровни строятся одним проходом
+    std::vector<std::pair<Position, std::string>> cells;
+    for (int row = 0; row < 100; ++row) {
+        cells.emplace_back(Position{row, 0}, "=A" + std::to_string(row + 2) + "+1");
+    }
+    cells.emplace_back("A101"_pos, "1");
+    cells.emplace_back("B1"_pos, "=SUM(A1:A3)");
+    cells.emplace_back("C1"_pos, "old");
+    cells.emplace_back("C1"_pos, "new");
+    sheet.LoadCells(std::move(cells));
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("A1"_pos)->GetValue()), 101.0);
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("B1"_pos)->GetValue()), 101.0 + 100.0 + 99.0);
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetText(), "new");
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{101, 3}));
+    sheet.SetCell("A101"_pos, "2");
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("A1"_pos)->GetValue()), 102.0);
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("B1"_pos)->GetValue()), 102.0 + 101.0 + 100.0);
+    try {
+        sheet.SetCell("A101"_pos, "=A1");
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+
+    Sheet cyclic;
+    try {
+        cyclic.LoadCells({{"A1"_pos, "=B1"}, {"B1"_pos, "=A1"}, {"C1"_pos, "text"}});
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+    ASSERT_EQUAL(cyclic.GetPrintableSize(), (Size{0, 0}));
+}
+
+void TestWriteAheadLog() {
+    auto directory = std::filesystem::temp_directory_path() / "spreadsheet_wal_test";
+    std::filesystem::remove_all(directory);
+    std::string texts;
+    {
+        Sheet sheet;
+        DurableSheet durable(sheet, directory);
+        durable.SetCell("A1"_pos, "2");
+        durable.SetCell("A2"_pos, "=A1*3");
+        durable.SetCell("B1"_pos, "=SUM(A1:A2)");
+        durable.SetCell("C3"_pos, "temporary");
+        durable.ClearCell("C3"_pos);
+        durable.SetCell("D1"_pos, "");
+        try {
+            durable.SetCell("A1"_pos, "=B1");
+            ASSERT(false);
+        } catch (const CircularDependencyException&) {
+        }
+        durable.Commit();
+        std::ostringstream output;
+        durable.PrintTexts(output);
+        texts = output.str();
+    }
+
+    auto recover = [&directory](WalOptions options = {}) {
+        auto sheet = std::make_unique<Sheet>();
+        DurableSheet durable(*sheet, directory, options);
+        return sheet;
+    };
+    auto print_texts = [](const Sheet& sheet) {
+        std::ostringstream output;
+        sheet.PrintTexts(output);
+        return output.str();
+    };
+    {
+        auto sheet = recover();
+        ASSERT_EQUAL(print_texts(*sheet), texts);
+        ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{2, 4}));
+        ASSERT_EQUAL(std::get<double>(sheet->GetCell("B1"_pos)->GetValue()), 8.0);
+    }
+
+    // Запись, прерванная сбоем, отбрасывается, и журнал продолжается с её места
+    {
+        std::ofstream log(directory / "wal", std::ios::binary | std::ios::app);
+        log.write("\x00\x05\x00\x07garb", 8);
+    }
+    {
+        Sheet sheet;
+        DurableSheet durable(sheet, directory, {WalDurability::Sync});
+        ASSERT_EQUAL(print_texts(sheet), texts);
+        durable.SetCell("A1"_pos, "5");
+    }
+    ASSERT_EQUAL(std::get<double>(recover()->GetCell("B1"_pos)->GetValue()), 20.0);
+
+    // Контрольная точка очищает журнал
+    WalOptions options;
+    options.checkpoint_records = 4;
+    {
+        Sheet sheet;
+        DurableSheet durable(sheet, directory, options);
+        for (int row = 0; row < 10; ++row) {
+            durable.SetCell({row, 5}, std::to_string(row));
+        }
+        durable.ClearCell("A2"_pos);
+    }
+    ASSERT(std::filesystem::file_size(directory / "wal") < 64);
+    {
+        auto sheet = recover(options);
+        ASSERT(sheet->GetCell("A2"_pos) == nullptr);
+        ASSERT_EQUAL(std::get<double>(sheet->GetCell("B1"_pos)->GetValue()), 5.0);
+        ASSERT_EQUAL(sheet->GetCell("F10"_pos)->GetText(), "9");
+    }
+    std::filesystem::remove_all(directory);
+}
+
+void TestPaging() {
+    auto file = std::filesystem::temp_directory_path() / "spreadsheet_paging_test";
+    Sheet paged;
+    Sheet reference;
+    paged.EnablePaging({file, 4, 2, 2});
+    auto set_cell = [&](Position pos, const std::string& text) {
+        paged.SetCell(pos, text);
+        reference.SetCell(pos, text);
+    };
+    auto print = [](const Sheet& sheet) {
+        std::ostringstream output;
+        sheet.PrintValues(output);
+        output << '|';
+        sheet.PrintTexts(output);
+        return output.str();
+    };
+
+    for (int row = 0; row < 32; ++row) {
+        set_cell({row, 0}, std::to_string(row));
+        set_cell({row, 1}, row == 0 ? "=A1" : "=B" + std::to_string(row) + "+A" + std::to_string(row + 1));
+        set_cell({row, 4}, "'text " + std::to_string(row));
+    }
+    set_cell("G1"_pos, "=SUM(B1:B32)");
+    set_cell("G2"_pos, "=A32/0");
+    ASSERT_EQUAL(print(paged), print(reference));
+    ASSERT(paged.GetPager()->GetResidentRegionCount() <= 2);
+    ASSERT(paged.GetPager()->GetRegionCount() > 2);
+
+    // Изменение выгруженной ячейки сбрасывает кэш зависимых выгруженных формул
+    set_cell("A1"_pos, "100");
+    ASSERT_EQUAL(std::get<double>(paged.GetCell("G1"_pos)->GetValue()),
+                 std::get<double>(reference.GetCell("G1"_pos)->GetValue()));
+    paged.InsertRows(5, 3);
+    reference.InsertRows(5, 3);
+    paged.DeleteRows(1);
+    reference.DeleteRows(1);
+    set_cell("H1"_pos, "=A30*2");
+    ASSERT_EQUAL(print(paged), print(reference));
+    ASSERT(paged.GetPager()->GetResidentRegionCount() <= 2);
+
+    paged.DisablePaging();
+    ASSERT(paged.GetPager() == nullptr);
+    ASSERT(!std::filesystem::exists(file));
+    ASSERT_EQUAL(print(paged), print(reference));
+
+    // Пакетная загрузка в таблицу с выгрузкой
+    Sheet loaded;
+    loaded.EnablePaging({file, 2, 2, 1});
+    std::vector<std::pair<Position, std::string>> cells;
+    for (int row = 0; row < 16; ++row) {
+        cells.emplace_back(Position{row, 0}, std::to_string(row));
+        cells.emplace_back(Position{row, 3}, "=A" + std::to_string(row + 1) + "*2");
+    }
+    loaded.LoadCells(std::move(cells));
+    ASSERT(loaded.GetPager()->GetResidentRegionCount() <= 1);
+    ASSERT_EQUAL(std::get<double>(loaded.GetCell("D16"_pos)->GetValue()), 30.0);
+}
+
+void TestInternedTexts() {
+    auto directory = std::filesystem::temp_directory_path() / "spreadsheet_interned_test";
+    std::filesystem::remove_all(directory);
+    const std::vector<std::string> labels = {"N/A", "'USD", "Europe/Middle East"};
+    {
+        Sheet sheet;
+        DurableSheet durable(sheet, directory);
+        for (int row = 0; row < 300; ++row) {
+            durable.SetCell({row, 0}, labels[row % labels.size()]);
+            durable.SetCell({row, 1}, "=1+" + std::to_string(row % 2));
+        }
+        ASSERT_EQUAL(sheet.GetInternedTextCount(), labels.size());
+        ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetText(), "'USD");
+        ASSERT_EQUAL(std::get<std::string>(sheet.GetCell("A2"_pos)->GetValue()), "USD");
+
+        // Такой же текст не изменяет ячейку
+        sheet.SetCell("C1"_pos, "=A1");
+        sheet.GetCell("C1"_pos)->GetValue();
+        sheet.SetCell("A1"_pos, "N/A");
+        ASSERT(static_cast<const Cell*>(sheet.GetCell("C1"_pos))->HasValue());
+
+        // Строка удаляется из пула вместе с последней ячейкой
+        for (int row = 1; row < 300; row += 3) {
+            durable.ClearCell({row, 0});
+        }
+        ASSERT_EQUAL(sheet.GetInternedTextCount(), 2u);
+        sheet.ClearCell("C1"_pos);
+
+        // Словарь контрольной точки содержит каждый текст один раз
+        durable.Checkpoint();
+        ASSERT(std::filesystem::file_size(directory / "checkpoint") < 300 * 8);
+    }
+    Sheet sheet;
+    DurableSheet durable(sheet, directory);
+    ASSERT(sheet.GetCell("A2"_pos) == nullptr);
+    ASSERT_EQUAL(sheet.GetCell("A300"_pos)->GetText(), "Europe/Middle East");
+    ASSERT_EQUAL(sheet.GetCell("B300"_pos)->GetText(), "=1+1");
+    ASSERT_EQUAL(sheet.GetInternedTextCount(), 2u);
+    std::filesystem::remove_all(directory);
+}
+
+void TestParallelExport() {
+    Sheet sheet;
+    for (int row = 0; row < 50; ++row) {
+        if (row % 7 == 3) {
+            continue;
+        }
+        sheet.SetCell({row, 0}, std::to_string(row / 3.0));
+        sheet.SetCell({row, 1}, row % 5 == 0 ? "'=text" : "label " + std::to_string(row % 4));
+        sheet.SetCell({row, 3}, row % 6 == 0 ? "=1/0" : "=A" + std::to_string(row + 1) + "*2+SUM(A1:A3)");
+    }
+    sheet.SetCell("F52"_pos, "=D2");
+
+    auto print = [&sheet](bool values, std::optional<ExportOptions> options) {
+        std::ostringstream output;
+        output.precision(3);
+        if (!options) {
+            values ? sheet.PrintValues(output) : sheet.PrintTexts(output);
+        } else if (values) {
+            sheet.PrintValuesParallel(output, *options);
+        } else {
+            sheet.PrintTextsParallel(output, *options);
+        }
+        return output.str();
+    };
+    for (bool values : {true, false}) {
+        auto serial = print(values, std::nullopt);
+        ASSERT_EQUAL(print(values, ExportOptions{4, 3}), serial);
+        ASSERT_EQUAL(print(values, ExportOptions{1, 3}), serial);
+        ASSERT_EQUAL(print(values, ExportOptions{3, 100}), serial);
+    }
+
+    // Формулы без значений в кэше вычисляются при выводе
+    sheet.SetCell("A1"_pos, "100");
+    auto values = print(true, ExportOptions{4, 2});
+    ASSERT_EQUAL(values, print(true, std::nullopt));
+
+    sheet.EnablePaging({std::filesystem::temp_directory_path() / "spreadsheet_export_test", 4, 2, 1});
+    ASSERT_EQUAL(print(true, ExportOptions{4, 5}), values);
+
+    std::ostringstream empty;
+    Sheet().PrintValuesParallel(empty);
+    ASSERT(empty.str().empty());
+}
+
+void TestParseFormulas() {
+    std::vector<std::string> expressions;
+    for (int i = 0; i < 3000; ++i) {
+        if (i % 500 == 7) {
+            expressions.push_back("1+*" + std::to_string(i));
+        } else if (i % 3 == 0) {
+            expressions.push_back("IF(A" + std::to_string(i + 1) + ">0, SUM(B1:B" + std::to_string(i + 1) + "), 2)");
+        } else {
+            expressions.push_back("(A1 + " + std::to_string(i) + ") * B" + std::to_string(i % 100 + 1));
+        }
+    }
+    for (size_t threads : {1, 4}) {
+        auto results = ParseFormulas(expressions, threads);
+        ASSERT_EQUAL(results.size(), expressions.size());
+        for (size_t i = 0; i < expressions.size(); ++i) {
+            if (i % 500 == 7) {
+                ASSERT(!results[i].formula && results[i].error);
+            } else {
+                ASSERT(results[i].formula && !results[i].error);
+                ASSERT_EQUAL(results[i].formula->GetExpression(), ParseFormula(expressions[i])->GetExpression());
+            }
+        }
+    }
+
+    // Пакетная загрузка: одинаковые формулы разбираются один раз, ошибка оставляет таблицу пустой
+    std::vector<std::pair<Position, std::string>> cells;
+    for (int row = 0; row < 1000; ++row) {
+        cells.emplace_back(Position{row, 0}, std::to_string(row));
+        cells.emplace_back(Position{row, 1}, row % 2 ? "=A1*2" : "=A" + std::to_string(row + 1) + "+1");
+    }
+    Sheet sheet;
+    sheet.LoadCells(cells);
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("B999"_pos)->GetValue()), 999.0);
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("B1000"_pos)->GetValue()), 0.0);
+    cells.emplace_back("C5"_pos, "=1+*2");
+    Sheet invalid;
+    try {
+        invalid.LoadCells(std::move(cells));
+        ASSERT(false);
+    } catch (const FormulaException&) {
+    }
+    ASSERT_EQUAL(invalid.GetPrintableSize(), (Size{0, 0}));
+}
+
+void TestSubscriptions() {
+    using Changes = std::vector<std::vector<Position>>;
+    for (auto mode : {RecalculationMode::Lazy, RecalculationMode::Eager}) {
+        Sheet sheet;
+        sheet.SetRecalculationMode(mode);
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("A2"_pos, "2");
+        sheet.SetCell("B1"_pos, "=A1+A2");
+        sheet.SetCell("B2"_pos, "=A1*0");
+        Changes changes;
+        auto id = sheet.Subscribe("A1"_pos, "B3"_pos, [&changes](const std::vector<Position>& changed) {
+            changes.push_back(changed);
+        });
+
+        // Формула, значение которой не изменилось, не сообщается
+        sheet.SetCell("A1"_pos, "5");
+        ASSERT_EQUAL(changes, (Changes{{"A1"_pos, "B1"_pos}}));
+        sheet.SetCell("A1"_pos, "5");
+        ASSERT_EQUAL(changes.size(), 1u);
+
+        // Изменения пакета сообщаются одним списком
+        changes.clear();
+        sheet.BeginChanges();
+        sheet.SetCell("A2"_pos, "3");
+        sheet.SetCell("B3"_pos, "=B1");
+        sheet.SetCell("C1"_pos, "text");
+        ASSERT(changes.empty());
+        sheet.EndChanges();
+        ASSERT_EQUAL(changes, (Changes{{"B1"_pos, "A2"_pos, "B3"_pos}}));
+
+        changes.clear();
+        sheet.ClearCell("A2"_pos);
+        ASSERT_EQUAL(changes, (Changes{{"B1"_pos, "A2"_pos, "B3"_pos}}));
+
+        // Вставка строки переносит значения прямоугольника
+        changes.clear();
+        sheet.InsertRows(1, 1);
+        ASSERT_EQUAL(changes, (Changes{{"B2"_pos, "B3"_pos}}));
+
+        changes.clear();
+        sheet.Unsubscribe(id);
+        sheet.SetCell("A1"_pos, "7");
+        ASSERT(changes.empty());
+    }
+
+    // Изменение другой таблицы книги
+    Workbook workbook;
+    auto& data = workbook.AddSheet("Data");
+    auto& report = workbook.AddSheet("Report");
+    data.SetCell("A1"_pos, "2");
+    report.SetCell("A1"_pos, "=Data!A1*10");
+    Changes changes;
+    report.Subscribe("A1"_pos, "A1"_pos, [&changes](const std::vector<Position>& changed) {
+        changes.push_back(changed);
+    });
+    data.SetCell("A1"_pos, "3");
+    ASSERT_EQUAL(changes, (Changes{{"A1"_pos}}));
+    ASSERT_EQUAL(report.GetCell("A1"_pos)->GetValue(), CellInterface::Value(30.0));
+}
+
+void TestBoundReferences() {
+    // Одна формула книги у ячеек разных таблиц: ссылки каждой ячейки привязаны к своим ячейкам
+    Workbook workbook;
+    auto& first = workbook.AddSheet("First");
+    auto& second = workbook.AddSheet("Second");
+    for (auto sheet : {&first, &second}) {
+        sheet->SetCell("A1"_pos, sheet == &first ? "1" : "10");
+        sheet->SetCell("A2"_pos, sheet == &first ? "2" : "20");
+        sheet->SetCell("A3"_pos, sheet == &first ? "3" : "30");
+        sheet->SetCell("B1"_pos, "=A1+A2*A3+A2");
+    }
+    second.SetCell("C1"_pos, "=First!A3-A1");
+    ASSERT_EQUAL(first.GetCell("B1"_pos)->GetValue(), CellInterface::Value(9.0));
+    ASSERT_EQUAL(second.GetCell("B1"_pos)->GetValue(), CellInterface::Value(630.0));
+    ASSERT_EQUAL(second.GetCell("C1"_pos)->GetValue(), CellInterface::Value(-7.0));
+
+    // После удаления строки ссылки указывают на перенесённые ячейки и #REF!
+    first.DeleteRows(1, 1);
+    ASSERT_EQUAL(first.GetCell("B1"_pos)->GetText(), "=A1+#REF!*A2+#REF!");
+    ASSERT_EQUAL(first.GetCell("B1"_pos)->GetValue(), CellInterface::Value(FormulaError(FormulaError::Category::Ref)));
+    ASSERT_EQUAL(second.GetCell("C1"_pos)->GetText(), "=First!A2-A1");
+    first.SetCell("A2"_pos, "5");
+    ASSERT_EQUAL(second.GetCell("C1"_pos)->GetValue(), CellInterface::Value(-5.0));
+    second.InsertRows(0, 1);
+    second.SetCell("A2"_pos, "100");
+    ASSERT_EQUAL(second.GetCell("B2"_pos)->GetValue(), CellInterface::Value(720.0));
+    ASSERT_EQUAL(second.GetCell("C2"_pos)->GetValue(), CellInterface::Value(-95.0));
+
+    // Выгруженная и снова загруженная формула привязывается заново
+    second.EnablePaging({std::filesystem::temp_directory_path() / "spreadsheet_bound_test", 1, 1, 1});
+    second.SetCell("A4"_pos, "40");
+    ASSERT_EQUAL(second.GetCell("B2"_pos)->GetValue(), CellInterface::Value(920.0));
+    second.DisablePaging();
+}
+
+void TestColumnBatch() {
+    // Значения столбца, вычисленного пакетом, совпадают со значениями интерпретатора
+    const int rows = 300;
+    auto fill = [](Sheet& sheet) {
+        for (int row = 0; row < rows; ++row) {
+            auto r = std::to_string(row + 1);
+            std::string a = std::to_string(row);
+            switch (row % 50) {
+                case 7: a = "text"; break;
+                case 9: a = "'12"; break;
+                case 11: a = ""; break;
+                case 13: a = "=1/0"; break;
+                case 17: a = "1e308"; break;
+            }
+            sheet.SetCell({row, 0}, a);
+            sheet.SetCell({row, 1}, row % 50 == 17 ? "0.001" : std::to_string(row % 5));
+            // Ошибка #VALUE! в A и деление на ноль в одной строке: первой вычисляется ошибка A
+            sheet.SetCell({row, 2}, row == 150 ? "=A151+B151" : "=(A" + r + "-1)/B" + r + "*-A" + r + "+2");
+            sheet.SetCell({row, 3}, row == 0 ? "=C1" : "=D" + std::to_string(row) + "+C" + r);
+        }
+    };
+    Sheet batched;
+    Sheet reference;
+    fill(batched);
+    fill(reference);
+    for (int row = 0; row < rows; ++row) {
+        batched.GetCell({row, 0})->GetValue();
+    }
+    size_t cached = batched.GetValueCache().GetSize();
+    batched.GetCell("C1"_pos)->GetValue();
+    ASSERT(batched.GetValueCache().GetSize() >= cached + 150);
+
+    batch::SetEnabled(false);
+    for (int row = 0; row < rows; ++row) {
+        for (int col = 0; col < 4; ++col) {
+            ASSERT_EQUAL(batched.GetCell({row, col})->GetValue(), reference.GetCell({row, col})->GetValue());
+        }
+    }
+    batch::SetEnabled(true);
+    ASSERT_EQUAL(batched.GetCell("C3"_pos)->GetValue(), CellInterface::Value(1.0));
+    ASSERT_EQUAL(batched.GetCell("C8"_pos)->GetValue(), CellInterface::Value(FormulaError(FormulaError::Category::Value)));
+    ASSERT_EQUAL(batched.GetCell("C18"_pos)->GetValue(), CellInterface::Value(FormulaError(FormulaError::Category::Arithmetic)));
+
+    // Изменённая строка вычисляется заново
+    batched.SetCell("B3"_pos, "4");
+    ASSERT_EQUAL(batched.GetCell("C3"_pos)->GetValue(), CellInterface::Value(1.5));
+}
+
+void TestValueCacheLimit() {
+    for (auto mode : {RecalculationMode::Lazy, RecalculationMode::Eager}) {
+        Sheet sheet;
+        sheet.SetRecalculationMode(mode);
+        sheet.SetValueCacheLimit(1024);
+        const int rows = 1000;
+        for (int row = 0; row < rows; ++row) {
+            sheet.SetCell({row, 0}, std::to_string(row));
+            sheet.SetCell({row, 1}, "=A" + std::to_string(row + 1) + "*2");
+        }
+        // Цепочка C1 = B1 + 1, Ci = C(i-1) + Bi длиннее, чем помещается в кэш
+        sheet.SetCell("C1"_pos, "=B1+1");
+        for (int row = 1; row < rows; ++row) {
+            sheet.SetCell({row, 2}, "=C" + std::to_string(row) + "+B" + std::to_string(row + 1));
+        }
+        ASSERT_EQUAL(sheet.GetCell({rows - 1, 2})->GetValue(), CellInterface::Value(rows * (rows - 1) + 1.0));
+        for (int row = 0; row < rows; ++row) {
+            ASSERT_EQUAL(sheet.GetCell({row, 1})->GetValue(), CellInterface::Value(2.0 * row));
+        }
+        const auto& cache = sheet.GetValueCache();
+        ASSERT(cache.GetSize() < 100);
+        ASSERT(cache.GetEvictedCount() > 0);
+
+        // Изменение сбрасывает значения, зависящие от вытесненных значений
+        sheet.SetCell("A1"_pos, "1000");
+        ASSERT_EQUAL(sheet.GetCell({rows - 1, 2})->GetValue(), CellInterface::Value(rows * (rows - 1) + 2001.0));
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(2001.0));
+    }
+
+    // Без ограничения значения не вытесняются
+    Sheet sheet;
+    for (int row = 0; row < 100; ++row) {
+        sheet.SetCell({row, 0}, "=" + std::to_string(row) + "/2");
+        sheet.GetCell({row, 0})->GetValue();
+    }
+    ASSERT_EQUAL(sheet.GetValueCache().GetSize(), 100u);
+    sheet.SetValueCacheLimit(1);
+    ASSERT_EQUAL(sheet.GetValueCache().GetSize(), 1u);
+    ASSERT_EQUAL(sheet.GetCell("A100"_pos)->GetValue(), CellInterface::Value(49.5));
 }
 }  // namespace
 
-int main() {
+int main(int argc, char* argv[]) {
+    if (argc > 1) {
+        return RunTool(argc, argv);
+    }
+
     TestRunner tr;
     RUN_TEST(tr, TestPositionAndStringConversion);
+    RUN_TEST(tr, TestPositionToChars);
     RUN_TEST(tr, TestPositionToStringInvalid);
     RUN_TEST(tr, TestStringToPositionInvalid);
     RUN_TEST(tr, TestEmpty);
@@ -361,6 +1612,12 @@ int main() {
     RUN_TEST(tr, TestFormulaReferences);
     RUN_TEST(tr, TestFormulaExpressionFormatting);
     RUN_TEST(tr, TestFormulaReferencedCells);
+    RUN_TEST(tr, TestFormulaCanonicalText);
+    RUN_TEST(tr, TestFormulaSimplification);
+    RUN_TEST(tr, TestJitMatchesInterpreter);
+    RUN_TEST(tr, TestConditionalFormulas);
+    RUN_TEST(tr, TestLookupFunctions);
+    RUN_TEST(tr, TestAggregateFunctions);
     RUN_TEST(tr, TestErrorValue);
     RUN_TEST(tr, TestErrorArithmetic);
     RUN_TEST(tr, TestEmptyCellTreatedAsZero);
@@ -369,4 +1626,23 @@ int main() {
     RUN_TEST(tr, TestCellReferences);
     RUN_TEST(tr, TestFormulaIncorrect);
     RUN_TEST(tr, TestCellCircularReferences);
+    RUN_TEST(tr, TestEagerRecalculation);
+    RUN_TEST(tr, TestLongDependencyChain);
+    RUN_TEST(tr, TestGetValueAsync);
+    RUN_TEST(tr, TestWorkbook);
+    RUN_TEST(tr, TestInsertDeleteRowsColumns);
+    RUN_TEST(tr, TestMemoryUsage);
+    RUN_TEST(tr, TestReadRange);
+    RUN_TEST(tr, TestDependencyAnalysis);
+    RUN_TEST(tr, TestTraceRecordAndReplay);
+    RUN_TEST(tr, TestLoadCells);
+    RUN_TEST(tr, TestWriteAheadLog);
+    RUN_TEST(tr, TestPaging);
+    RUN_TEST(tr, TestInternedTexts);
+    RUN_TEST(tr, TestParallelExport);
+    RUN_TEST(tr, TestParseFormulas);
+    RUN_TEST(tr, TestSubscriptions);
+    RUN_TEST(tr, TestBoundReferences);
+    RUN_TEST(tr, TestColumnBatch);
+    RUN_TEST(tr, TestValueCacheLimit);
 }
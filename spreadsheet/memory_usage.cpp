@@ -0,0 +1,45 @@
+#include "memory_usage.h"
+
+#include <iostream>
+
+using namespace std::literals;
+
+size_t MemoryUsage::Total() const {
+    return cell_map + cells + impls + formula_texts + formula_ast_nodes + formula_cell_lists
+           + dependency_sets + cached_values + text_payloads;
+}
+
+MemoryUsage& MemoryUsage::operator+=(const MemoryUsage& rhs) {
+    cell_map += rhs.cell_map;
+    cells += rhs.cells;
+    impls += rhs.impls;
+    formula_texts += rhs.formula_texts;
+    formula_ast_nodes += rhs.formula_ast_nodes;
+    formula_cell_lists += rhs.formula_cell_lists;
+    dependency_sets += rhs.dependency_sets;
+    cached_values += rhs.cached_values;
+    text_payloads += rhs.text_payloads;
+    return *this;
+}
+
+void MemoryUsage::Scale(double factor) {
+    for (auto field : {&cells, &impls, &formula_texts, &formula_ast_nodes, &formula_cell_lists,
+                       &dependency_sets, &cached_values, &text_payloads}) {
+        *field = static_cast<size_t>(*field * factor);
+    }
+}
+
+std::ostream& operator<<(std::ostream& output, const MemoryUsage& usage) {
+    output << "memory usage (bytes):\n"sv;
+    output << "\tcell map\t"sv << usage.cell_map << '\n';
+    output << "\tcells\t"sv << usage.cells << '\n';
+    output << "\tcell impls\t"sv << usage.impls << '\n';
+    output << "\tformula texts\t"sv << usage.formula_texts << '\n';
+    output << "\tformula AST nodes\t"sv << usage.formula_ast_nodes << '\n';
+    output << "\tformula cell lists\t"sv << usage.formula_cell_lists << '\n';
+    output << "\tdependency sets\t"sv << usage.dependency_sets << '\n';
+    output << "\tcached values\t"sv << usage.cached_values << '\n';
+    output << "\ttext payloads\t"sv << usage.text_payloads << '\n';
+    output << "\ttotal\t"sv << usage.Total() << '\n';
+    return output;
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <cstddef>
+#include <iosfwd>
+#include <string>
+
+// Способ подсчёта памяти таблицы
+enum class MemoryUsageMode {
+    // Точно считаются только хэш-таблица ячеек, счётчики печатной области и кэш значений, остальное
+    // оценивается по выборке ячеек. Время не зависит от размера таблицы:
+    // подходит для постоянного мониторинга
+    Approximate,
+    // Обходятся все ячейки, формулы и связи (для исследования потребления памяти)
+    Exact,
+};
+
+// Память, занимаемая таблицей, в байтах по компонентам. Учитываются размеры объектов
+// и выделенных для них блоков; служебные данные распределителя памяти не учитываются.
+// Формула, общая для нескольких ячеек книги, и текст из пула строк таблицы делятся
+// между использующими их ячейками поровну.
+struct MemoryUsage {
+    // Хэш-таблица ячеек (корзины и узлы) и счётчики печатной области
+    size_t cell_map = 0;
+    // Объекты Cell
+    size_t cells = 0;
+    // Объекты реализаций ячеек (без кэшей значений)
+    size_t impls = 0;
+    // Тексты формул (каноничный и исходный)
+    size_t formula_texts = 0;
+    // Узлы AST формул и скомпилированный код
+    size_t formula_ast_nodes = 0;
+    // Узлы списков ячеек, на которые ссылаются формулы
+    size_t formula_cell_lists = 0;
+    // Множества зависимых ячеек (cells_from_)
+    size_t dependency_sets = 0;
+    // Кэш значений формул таблицы (записи значений и их номера в формулах)
+    size_t cached_values = 0;
+    // Строки текстовых ячеек в пуле строк таблицы
+    size_t text_payloads = 0;
+
+    size_t Total() const;
+    MemoryUsage& operator+=(const MemoryUsage& rhs);
+    // Масштабирует оценку по выборке ячеек на все ячейки (кроме cell_map)
+    void Scale(double factor);
+};
+
+std::ostream& operator<<(std::ostream& output, const MemoryUsage& usage);
+
+namespace memory_usage {
+
+// Размер блока, выделенного строкой (0, если строка помещается во внутренний буфер)
+inline size_t StringHeapSize(const std::string& str) {
+    static const size_t inline_capacity = std::string().capacity();
+    return str.capacity() > inline_capacity ? str.capacity() + 1 : 0;
+}
+
+// Размер узла хэш-таблицы с элементом Value (следующий узел и сохранённый хэш)
+template <typename Value>
+constexpr size_t HashNodeSize(bool hash_cached = true) {
+    return sizeof(void*) + sizeof(Value) + (hash_cached ? sizeof(size_t) : 0);
+}
+
+// Размер хэш-таблицы: массив корзин (кроме встроенной единственной корзины) и узлы
+template <typename HashTable>
+size_t HashTableSize(const HashTable& table, bool hash_cached = true) {
+    size_t buckets = table.bucket_count() > 1 ? table.bucket_count() * sizeof(void*) : 0;
+    return buckets + table.size() * HashNodeSize<typename HashTable::value_type>(hash_cached);
+}
+
+// Размер узла std::map/std::set с элементом Value (цвет и три указателя)
+template <typename Value>
+constexpr size_t TreeNodeSize() {
+    return 4 * sizeof(void*) + sizeof(Value);
+}
+
+}  // namespace memory_usage
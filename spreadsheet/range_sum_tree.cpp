@@ -0,0 +1,79 @@
+#include "range_sum_tree.h"
+
+#include <algorithm>
+#include <cmath>
+
+void CompensatedSum::Add(double value) {
+    double sum = sum_ + value;
+    // Бесконечности и NaN не компенсируются: их разность дала бы NaN
+    if (std::isfinite(sum)) {
+        error_ += std::abs(sum_) >= std::abs(value) ? (sum_ - sum) + value : (value - sum) + sum_;
+    }
+    sum_ = sum;
+}
+
+void CompensatedSum::Add(const CompensatedSum& other) {
+    Add(other.sum_);
+    error_ += other.error_;
+}
+
+void RangeSumTree::Set(int row, std::optional<double> value) {
+    auto index = static_cast<size_t>(row);
+    if (index >= capacity_) {
+        size_t capacity = capacity_ == 0 ? MIN_CAPACITY : capacity_;
+        while (capacity <= index) {
+            capacity *= 2;
+        }
+        Grow(capacity);
+    }
+
+    index += capacity_;
+    nodes_[index] = {};
+    if (value) {
+        nodes_[index].sum.Add(*value);
+        nodes_[index].count = 1;
+    }
+    // Узлы на пути к корню пересчитываются из детей (без вычитания старого значения)
+    for (index /= 2; index > 0; index /= 2) {
+        auto& node = nodes_[index];
+        node = nodes_[2 * index];
+        node.sum.Add(nodes_[2 * index + 1].sum);
+        node.count += nodes_[2 * index + 1].count;
+    }
+}
+
+RangeSumTree::Totals RangeSumTree::Query(int first, int last) const {
+    Totals totals;
+    if (capacity_ == 0 || first > last || static_cast<size_t>(first) >= capacity_) {
+        return totals;
+    }
+    size_t left = first + capacity_;
+    size_t right = std::min(static_cast<size_t>(last), capacity_ - 1) + capacity_ + 1;
+    auto add = [&totals](const Node& node) {
+        totals.sum.Add(node.sum);
+        totals.count += node.count;
+    };
+    for (; left < right; left /= 2, right /= 2) {
+        if (left % 2 == 1) {
+            add(nodes_[left++]);
+        }
+        if (right % 2 == 1) {
+            add(nodes_[--right]);
+        }
+    }
+    return totals;
+}
+
+void RangeSumTree::Grow(size_t capacity) {
+    std::vector<Node> nodes(2 * capacity);
+    for (size_t row = 0; row < capacity_; ++row) {
+        nodes[capacity + row] = nodes_[capacity_ + row];
+    }
+    for (size_t index = capacity - 1; index > 0; --index) {
+        nodes[index] = nodes[2 * index];
+        nodes[index].sum.Add(nodes[2 * index + 1].sum);
+        nodes[index].count += nodes[2 * index + 1].count;
+    }
+    nodes_ = std::move(nodes);
+    capacity_ = capacity;
+}
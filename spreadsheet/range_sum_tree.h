@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+// Сумма с компенсацией ошибки округления (алгоритм Ноймайера): результат точнее
+// простого сложения и почти не зависит от порядка слагаемых
+class CompensatedSum {
+public:
+    void Add(double value);
+    void Add(const CompensatedSum& other);
+    double Get() const { return sum_ + error_; }
+
+private:
+    double sum_ = 0.0;
+    // Потерянные при округлении младшие разряды суммы
+    double error_ = 0.0;
+};
+
+// Суммы и количества чисел в строках столбца (дерево отрезков): изменение строки
+// и запрос по диапазону строк выполняются за O(log n). Ёмкость растёт по мере
+// появления строк с большими номерами
+class RangeSumTree {
+public:
+    struct Totals {
+        CompensatedSum sum;
+        size_t count = 0;
+    };
+
+    // Задаёт число строки row (nullopt - в строке нет числа)
+    void Set(int row, std::optional<double> value);
+    // Итоги строк first..last (включительно)
+    Totals Query(int first, int last) const;
+
+private:
+    struct Node {
+        CompensatedSum sum;
+        uint32_t count = 0;
+    };
+
+    void Grow(size_t capacity);
+
+private:
+    static const size_t MIN_CAPACITY = 64;
+
+    // Количество листьев (степень двойки); листья - nodes_[capacity_..2*capacity_)
+    size_t capacity_ = 0;
+    std::vector<Node> nodes_;
+};
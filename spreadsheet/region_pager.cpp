@@ -0,0 +1,186 @@
+#include "region_pager.h"
+
+#include "cell.h"
+
+#include <algorithm>
+
+using namespace std::literals;
+
+namespace fs = std::filesystem;
+
+namespace {
+
+const auto PAGING_FILE_MODE = std::ios::in | std::ios::out | std::ios::binary;
+
+void OpenPagingFile(std::fstream& file, const fs::path& path, std::ios::openmode mode) {
+    file.open(path, mode);
+    if (!file) {
+        throw std::runtime_error("cannot open paging file: "s + path.string());
+    }
+}
+
+}  // namespace
+
+RegionPager::RegionPager(PagingOptions options) :
+    options_(std::move(options))
+{
+    options_.region_rows = std::max(options_.region_rows, 1);
+    options_.region_cols = std::max(options_.region_cols, 1);
+    options_.max_resident_regions = std::max<size_t>(options_.max_resident_regions, 1);
+    OpenPagingFile(file_, options_.file, PAGING_FILE_MODE | std::ios::trunc);
+}
+
+RegionPager::~RegionPager() {
+    file_.close();
+    std::error_code error;
+    fs::remove(options_.file, error);
+}
+
+void RegionPager::AddCell(Cell* cell) {
+    auto [it, inserted] = regions_.try_emplace(GetRegionKey(cell->GetPosition()));
+    auto& region = it->second;
+    if (inserted) {
+        resident_regions_.push_front(&region);
+        region.lru_position = resident_regions_.begin();
+    } else if (!region.resident) {
+        PageIn(region);
+    }
+    region.cells.push_back(cell);
+}
+
+void RegionPager::Touch(Position pos) {
+    auto it = regions_.find(GetRegionKey(pos));
+    if (it == regions_.end()) {
+        return;
+    }
+    auto& region = it->second;
+    if (!region.resident) {
+        PageIn(region);
+    } else if (region.lru_position != resident_regions_.begin()) {
+        resident_regions_.splice(resident_regions_.begin(), resident_regions_, region.lru_position);
+    }
+    EvictColdRegions();
+}
+
+void RegionPager::EvictColdRegions() {
+    if (ImplPin::IsAnyPinned()) {
+        return;
+    }
+    while (resident_regions_.size() > options_.max_resident_regions) {
+        PageOut(*resident_regions_.back());
+    }
+    // Сжатие освобождает место, которое остаётся после перемещения выросших областей
+    uint64_t garbage = file_size_ - used_bytes_;
+    if (garbage > std::max(used_bytes_, MIN_COMPACTION_GARBAGE)) {
+        Compact();
+    }
+}
+
+void RegionPager::PageInAll() {
+    for (auto& [key, region] : regions_) {
+        if (!region.resident) {
+            PageIn(region);
+        }
+    }
+}
+
+void RegionPager::Clear() {
+    regions_.clear();
+    resident_regions_.clear();
+    file_.close();
+    OpenPagingFile(file_, options_.file, PAGING_FILE_MODE | std::ios::trunc);
+    file_size_ = 0;
+    used_bytes_ = 0;
+}
+
+uint64_t RegionPager::GetRegionKey(Position pos) const {
+    return (static_cast<uint64_t>(pos.row / options_.region_rows) << 32)
+           | static_cast<uint32_t>(pos.col / options_.region_cols);
+}
+
+void RegionPager::PageIn(Region& region) {
+    std::string data(region.size, '\0');
+    file_.seekg(region.offset);
+    if (!file_.read(data.data(), data.size())) {
+        throw std::runtime_error("cannot read paging file: "s + options_.file.string());
+    }
+    std::string_view buffer = data;
+    for (auto cell : region.cells) {
+        cell->PageIn(buffer);
+    }
+    region.resident = true;
+    resident_regions_.push_front(&region);
+    region.lru_position = resident_regions_.begin();
+}
+
+void RegionPager::PageOut(Region& region) {
+    std::string data;
+    for (auto cell : region.cells) {
+        cell->PageOut(data);
+    }
+
+    // Выросшая область переносится в конец файла, её прежнее место освобождается
+    if (data.size() > region.capacity) {
+        used_bytes_ += data.size() - region.capacity;
+        region.offset = file_size_;
+        region.capacity = data.size();
+        file_size_ += region.capacity;
+    }
+    file_.seekp(region.offset);
+    if (!file_.write(data.data(), data.size())) {
+        // Ячейки восстанавливаются из ещё не записанных данных
+        file_.clear();
+        std::string_view buffer = data;
+        for (auto cell : region.cells) {
+            cell->PageIn(buffer);
+        }
+        throw std::runtime_error("cannot write paging file: "s + options_.file.string());
+    }
+    region.size = data.size();
+    region.resident = false;
+    resident_regions_.erase(region.lru_position);
+}
+
+void RegionPager::Compact() {
+    auto compacted_path = options_.file;
+    compacted_path += ".compact";
+    std::fstream compacted;
+    OpenPagingFile(compacted, compacted_path, PAGING_FILE_MODE | std::ios::trunc);
+
+    // Новые места областей применяются только после успешной записи всего файла
+    std::vector<std::pair<Region*, uint64_t>> offsets;
+    uint64_t offset = 0;
+    std::string data;
+    for (auto& [key, region] : regions_) {
+        if (region.resident || region.size == 0) {
+            continue;
+        }
+        data.resize(region.size);
+        file_.seekg(region.offset);
+        if (!file_.read(data.data(), data.size()) || !compacted.write(data.data(), data.size())) {
+            file_.clear();
+            throw std::runtime_error("cannot compact paging file: "s + options_.file.string());
+        }
+        offsets.emplace_back(&region, offset);
+        offset += region.size;
+    }
+    if (!compacted.flush()) {
+        throw std::runtime_error("cannot compact paging file: "s + options_.file.string());
+    }
+
+    for (auto& [key, region] : regions_) {
+        // Место областей в памяти выделяется заново при их следующей выгрузке
+        region.offset = region.capacity = 0;
+    }
+    for (auto [region, new_offset] : offsets) {
+        region->offset = new_offset;
+        region->capacity = region->size;
+    }
+
+    file_.close();
+    compacted.close();
+    fs::rename(compacted_path, options_.file);
+    OpenPagingFile(file_, options_.file, PAGING_FILE_MODE);
+    file_size_ = offset;
+    used_bytes_ = offset;
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <list>
+#include <unordered_map>
+#include <vector>
+
+class Cell;
+
+// Параметры хранения таблицы вне памяти (см. Sheet::EnablePaging)
+struct PagingOptions {
+    // Файл выгрузки (создаётся заново и удаляется при отключении выгрузки)
+    std::filesystem::path file;
+    // Размер области ячеек, которая загружается и выгружается целиком
+    int region_rows = 256;
+    int region_cols = 16;
+    // Наибольшее количество областей в памяти (не меньше одной)
+    size_t max_resident_regions = 64;
+};
+
+// Выгрузка реализаций ячеек таблицы на диск по прямоугольным областям.
+// В памяти остаются max_resident_regions недавно использованных областей (LRU),
+// остальные записываются в файл выгрузки и загружаются при обращении к ним.
+// Ошибки ввода-вывода бросаются как std::runtime_error.
+class RegionPager {
+public:
+    explicit RegionPager(PagingOptions options);
+    ~RegionPager();
+
+    RegionPager(const RegionPager&) = delete;
+    RegionPager& operator=(const RegionPager&) = delete;
+
+    const PagingOptions& GetOptions() const { return options_; }
+
+    // Добавляет ячейку в её область (выгруженная область загружается)
+    void AddCell(Cell* cell);
+    // Отмечает область позиции pos как недавно использованную; выгруженная область
+    // загружается, и лишние области выгружаются
+    void Touch(Position pos);
+    // Выгружает давно не использованные области сверх max_resident_regions. Пока
+    // реализации ячеек используются выше по стеку (см. ImplPin), выгрузка откладывается
+    void EvictColdRegions();
+    // Загружает все области
+    void PageInAll();
+    // Забывает все ячейки и области (ячейки должны быть загружены)
+    void Clear();
+
+    size_t GetRegionCount() const { return regions_.size(); }
+    size_t GetResidentRegionCount() const { return resident_regions_.size(); }
+    // Размер файла выгрузки (с местом, которое освободилось после перемещения областей)
+    uint64_t GetFileSize() const { return file_size_; }
+
+private:
+    struct Region {
+        std::vector<Cell*> cells;
+        bool resident = true;
+        // Место области в списке resident_regions_ (если область в памяти)
+        std::list<Region*>::iterator lru_position;
+        // Место в файле выгрузки: записанная область занимает size байт из capacity
+        uint64_t offset = 0;
+        uint64_t size = 0;
+        uint64_t capacity = 0;
+    };
+
+    uint64_t GetRegionKey(Position pos) const;
+    void PageIn(Region& region);
+    void PageOut(Region& region);
+    // Переписывает файл выгрузки без освободившегося места
+    void Compact();
+
+private:
+    // Файл сжимается, когда освободившееся место больше занятого и этого порога
+    static constexpr uint64_t MIN_COMPACTION_GARBAGE = 1 << 20;
+
+    PagingOptions options_;
+    std::fstream file_;
+    uint64_t file_size_ = 0;
+    // Место в файле, занятое областями (остальное освободилось при их перемещении)
+    uint64_t used_bytes_ = 0;
+    std::unordered_map<uint64_t, Region> regions_;
+    // Области в памяти: в начале недавно использованные
+    std::list<Region*> resident_regions_;
+};
@@ -3,31 +3,70 @@
 #include "cell.h"
 #include "formula.h"
 #include "common.h"
+#include "workbook.h"
 
 #include <algorithm>
+#include <cmath>
 #include <functional>
 #include <iostream>
 #include <optional>
+#include <thread>
+#include <unordered_set>
 #include <variant>
 
 using namespace std::literals;
 
+namespace {
+
+// Выводит значения блока построчно (cols значений в строке) в формате PrintCells
+template <typename Value, typename Print>
+void PrintBlock(std::ostream& output, const std::vector<Value>& values, int cols, Print print) {
+    for (size_t i = 0; i < values.size(); ++i) {
+        if (i % cols != 0) {
+            output << '\t';
+        }
+        print(values[i]);
+        if ((i + 1) % cols == 0) {
+            output << '\n';
+        }
+    }
+}
+
+}  // namespace
+
+Sheet::Sheet(Workbook* workbook) :
+    workbook_(workbook)
+{}
+
 void Sheet::SetCell(Position pos, std::string text) {
+    ChangeScope scope(*this);
+    last_recalculation_count_ = 0;
+
     // Если ячейки не существует
     if (!HasCell(pos)) {
         // Создаем ячейку
-        cells_[pos] = std::make_unique<Cell>(this);
+        cells_[pos] = std::make_unique<Cell>(this, pos);
+        if (pager_) {
+            pager_->AddCell(cells_[pos].get());
+        }
 
         // Обновляем данные для вычисления размера печатной области
         ++row_to_cell_count_[pos.row];
         ++column_to_cell_count_[pos.col];
+    } else {
+        TouchRegion(pos);
     }
 
     // Устанавливаем содержимое ячейки
     cells_[pos]->Set(text);
+    if (pager_) {
+        pager_->EvictColdRegions();
+    }
+    scope.Finish();
 }
 
 const CellInterface* Sheet::GetCell(Position pos) const {
+    TouchRegion(pos);
     if (!HasCell(pos) || cells_.at(pos).get()->IsEmpty()) {
         return nullptr;
     }
@@ -35,6 +74,7 @@ const CellInterface* Sheet::GetCell(Position pos) const {
 }
 
 CellInterface* Sheet::GetCell(Position pos) {
+    TouchRegion(pos);
     if (!HasCell(pos) || cells_.at(pos).get()->IsEmpty()) {
         return nullptr;
     }
@@ -48,11 +88,20 @@ const CellInterface* Sheet::GetConcreteCell(Position pos) const {
     return cells_.at(pos).get();
 }
 
+Cell* Sheet::GetConcreteCell(Position pos) {
+    if (!HasCell(pos)) {
+        return nullptr;
+    }
+    return cells_.at(pos).get();
+}
+
 void Sheet::ClearCell(Position pos) {
     // Проверяем наличие ячейки (для которой был вызван SetCell)
     if (!GetCell(pos)) {
         return;
     }
+    ChangeScope scope(*this);
+    last_recalculation_count_ = 0;
     
     // Обновляем данные для вычисления размера печатной области
     --row_to_cell_count_[pos.row];
@@ -66,6 +115,153 @@ void Sheet::ClearCell(Position pos) {
 
     // Превращаем ячейку в пустую ячейку
     cells_[pos]->Clear();
+    scope.Finish();
+}
+
+void Sheet::LoadCells(std::vector<std::pair<Position, std::string>> cells) {
+    ChangeScope scope(*this);
+    last_recalculation_count_ = 0;
+
+    std::unordered_map<Position, size_t, PositionHasher> last_indexes;
+    last_indexes.reserve(cells.size());
+    for (size_t i = 0; i < cells.size(); ++i) {
+        if (!cells[i].first.IsValid()) {
+            throw InvalidPositionException("cells loading error: position is invalid"s);
+        }
+        last_indexes[cells[i].first] = i;
+    }
+    auto is_last = [&last_indexes, &cells](size_t i) {
+        return last_indexes.at(cells[i].first) == i;
+    };
+
+    // Ячейки непустой таблицы (или таблицы, в областях которой ищут значения формулы
+    // других таблиц книги) могут образовать цикл с существующими ячейками и должны
+    // сбрасывать значения зависимых от них формул
+    std::vector<size_t> deferred;
+    if (!cells_.empty() || !column_indexes_.empty()) {
+        for (size_t i = 0; i < cells.size(); ++i) {
+            if (is_last(i)) {
+                deferred.push_back(i);
+            }
+        }
+    } else {
+        std::vector<Cell*> loaded;
+        loaded.reserve(last_indexes.size());
+        cells_.reserve(last_indexes.size());
+        try {
+            // Различные выражения формул пакета разбираются заранее на всех ядрах
+            std::unordered_map<std::string, std::shared_ptr<FormulaInterface>> formulas;
+            std::vector<std::string> expressions;
+            for (size_t i = 0; i < cells.size(); ++i) {
+                const auto& text = cells[i].second;
+                if (is_last(i) && Cell::IsFormulaText(text) && formulas.emplace(text.substr(1), nullptr).second) {
+                    expressions.push_back(text.substr(1));
+                }
+            }
+            auto parsed = ParseFormulas(expressions);
+            for (size_t i = 0; i < expressions.size(); ++i) {
+                if (parsed[i].error) {
+                    throw *parsed[i].error;
+                }
+                formulas[expressions[i]] = std::move(parsed[i].formula);
+            }
+
+            for (size_t i = 0; i < cells.size(); ++i) {
+                if (!is_last(i)) {
+                    continue;
+                }
+                auto& [pos, text] = cells[i];
+                auto cell = std::make_unique<Cell>(this, pos);
+                std::shared_ptr<FormulaInterface> formula;
+                if (Cell::IsFormulaText(text)) {
+                    formula = formulas.at(text.substr(1));
+                }
+                if (!cell->Load(text, std::move(formula))) {
+                    deferred.push_back(i);
+                    continue;
+                }
+                loaded.push_back(cell.get());
+                if (IsSubscribed(pos)) {
+                    RecordValueChange(pos, CellInterface::Value(""s));
+                }
+                if (pager_) {
+                    pager_->AddCell(cell.get());
+                    pager_->EvictColdRegions();
+                }
+                cells_[pos] = std::move(cell);
+                ++row_to_cell_count_[pos.row];
+                ++column_to_cell_count_[pos.col];
+            }
+            Cell::LinkLoaded(loaded);
+        } catch (...) {
+            // Связи есть только между ячейками этой таблицы: таблица снова становится пустой
+            cells_.clear();
+            row_to_cell_count_.clear();
+            column_to_cell_count_.clear();
+            column_levels_.clear();
+            if (pager_) {
+                pager_->Clear();
+            }
+            throw;
+        }
+    }
+
+    for (auto i : deferred) {
+        SetCell(cells[i].first, std::move(cells[i].second));
+    }
+    scope.Finish();
+}
+
+void Sheet::InsertRows(int before, int count) {
+    if (before < 0 || before > Position::MAX_ROWS || count < 0) {
+        throw InvalidPositionException("rows insertion error: invalid rows"s);
+    }
+    MoveCells([before, count](Position pos) {
+        if (pos.row >= before) {
+            pos.row += count;
+        }
+        return pos;
+    });
+}
+
+void Sheet::DeleteRows(int first, int count) {
+    if (first < 0 || first >= Position::MAX_ROWS || count < 0) {
+        throw InvalidPositionException("rows deletion error: invalid rows"s);
+    }
+    MoveCells([first, count](Position pos) {
+        if (pos.row >= first + count) {
+            pos.row -= count;
+        } else if (pos.row >= first) {
+            pos = Position::NONE;
+        }
+        return pos;
+    });
+}
+
+void Sheet::InsertColumns(int before, int count) {
+    if (before < 0 || before > Position::MAX_COLS || count < 0) {
+        throw InvalidPositionException("columns insertion error: invalid columns"s);
+    }
+    MoveCells([before, count](Position pos) {
+        if (pos.col >= before) {
+            pos.col += count;
+        }
+        return pos;
+    });
+}
+
+void Sheet::DeleteColumns(int first, int count) {
+    if (first < 0 || first >= Position::MAX_COLS || count < 0) {
+        throw InvalidPositionException("columns deletion error: invalid columns"s);
+    }
+    MoveCells([first, count](Position pos) {
+        if (pos.col >= first + count) {
+            pos.col -= count;
+        } else if (pos.col >= first) {
+            pos = Position::NONE;
+        }
+        return pos;
+    });
 }
 
 Size Sheet::GetPrintableSize() const {
@@ -82,20 +278,547 @@ Size Sheet::GetPrintableSize() const {
     };
 }
 
+void Sheet::ReadRange(Position top_left, Size size, CellValueView* out) const {
+    if (!top_left.IsValid() || size.rows < 0 || size.cols < 0
+        || top_left.row + size.rows > Position::MAX_ROWS || top_left.col + size.cols > Position::MAX_COLS) {
+        throw InvalidPositionException("range read error: range is invalid"s);
+    }
+
+    // Значения области ссылаются на реализации её ячеек: до конца чтения они не выгружаются
+    ImplPin pin;
+    // Формулы области, значения которых ещё нужно вычислить
+    std::vector<std::pair<const Cell*, CellValueView*>> dirty_cells;
+    for (int row = 0; row < size.rows; ++row) {
+        for (int col = 0; col < size.cols; ++col) {
+            auto value = out++;
+            auto it = cells_.find({top_left.row + row, top_left.col + col});
+            if (it == cells_.end()) {
+                *value = ""sv;
+            } else if (it->second->HasValue()) {
+                *value = it->second->GetValueView();
+            } else {
+                dirty_cells.emplace_back(it->second.get(), value);
+            }
+        }
+    }
+    for (auto [cell, value] : dirty_cells) {
+        *value = cell->GetValueView();
+    }
+}
+
+std::future<CellInterface::Value> Sheet::GetValueAsync(Position pos, EvaluationLimits limits) const {
+    if (!pos.IsValid()) {
+        throw InvalidPositionException("async get value error: position is invalid"s);
+    }
+
+    auto promise = std::make_shared<std::promise<CellInterface::Value>>();
+    auto result = promise->get_future();
+    GetExecutor().Submit([this, pos, limits = std::move(limits), promise] {
+        try {
+            auto it = cells_.find(pos);
+            promise->set_value(it == cells_.end() ? CellInterface::Value(""s) : it->second->GetValue(limits));
+        } catch (...) {
+            promise->set_exception(std::current_exception());
+        }
+    });
+    return result;
+}
+
+Sheet::SubscriptionId Sheet::Subscribe(Position first, Position last, ChangeCallback callback) {
+    if (!first.IsValid() || !last.IsValid() || last.row < first.row || last.col < first.col) {
+        throw InvalidPositionException("subscription error: invalid range"s);
+    }
+    // Изменения ищутся среди сброшенных кэшей: формулы прямоугольника должны быть вычислены
+    std::vector<const Cell*> formulas;
+    auto area = static_cast<size_t>(last.row - first.row + 1) * (last.col - first.col + 1);
+    if (area <= cells_.size()) {
+        for (int row = first.row; row <= last.row; ++row) {
+            for (int col = first.col; col <= last.col; ++col) {
+                auto it = cells_.find({row, col});
+                if (it != cells_.end() && it->second->IsFormula()) {
+                    formulas.push_back(it->second.get());
+                }
+            }
+        }
+    } else {
+        for (const auto& [pos, cell] : cells_) {
+            if (first.row <= pos.row && pos.row <= last.row && first.col <= pos.col && pos.col <= last.col
+                && cell->IsFormula()) {
+                formulas.push_back(cell.get());
+            }
+        }
+    }
+    for (auto cell : formulas) {
+        cell->GetValue();
+    }
+
+    auto id = next_subscription_id_++;
+    subscriptions_.emplace(id, Subscription{first, last, std::move(callback)});
+    return id;
+}
+
+void Sheet::Unsubscribe(SubscriptionId id) {
+    subscriptions_.erase(id);
+    if (subscriptions_.empty()) {
+        changed_values_.clear();
+    }
+}
+
+void Sheet::BeginChanges() {
+    ++change_depth_;
+}
+
+void Sheet::EndChanges() {
+    if (change_depth_ > 0 && --change_depth_ == 0) {
+        DeliverChanges();
+    }
+}
+
+void Sheet::RecordValueChange(Position pos, std::optional<CellInterface::Value> old_value) {
+    // Сохраняется значение до первого изменения в операции
+    changed_values_.try_emplace(pos, std::move(old_value));
+}
+
+std::optional<Position> Sheet::FindValue(Position first, Position last, double value) const {
+    const auto& index = GetColumnIndex(first.col, first.row, last.row);
+    auto rows = index.rows_by_value.find(value);
+    if (rows == index.rows_by_value.end()) {
+        return std::nullopt;
+    }
+    auto row = std::lower_bound(rows->second.begin(), rows->second.end(), first.row);
+    if (row == rows->second.end() || *row > last.row) {
+        return std::nullopt;
+    }
+    return Position{*row, first.col};
+}
+
+RangeTotals Sheet::AggregateValues(Position first, Position last) const {
+    RangeTotals totals;
+    CompensatedSum sum;
+    std::optional<Position> error_pos;
+    for (int col = first.col; col <= last.col; ++col) {
+        auto& index = GetColumnIndex(col, first.row, last.row);
+        if (!index.sums) {
+            index.sums.emplace();
+            for (const auto& [row, value] : index.values) {
+                index.sums->Set(row, value);
+            }
+        }
+        auto column_totals = index.sums->Query(first.row, last.row);
+        sum.Add(column_totals.sum);
+        totals.count += column_totals.count;
+
+        // Ошибкой области считается первая по строкам
+        auto error = index.errors.lower_bound(first.row);
+        if (error != index.errors.end() && error->first <= last.row
+            && (!error_pos || error->first < error_pos->row)) {
+            error_pos = Position{error->first, col};
+            totals.error = error->second;
+        }
+    }
+    totals.sum = sum.Get();
+    return totals;
+}
+
+Sheet::ColumnIndex& Sheet::GetColumnIndex(int col, int first_row, int last_row) const {
+    auto& index = column_indexes_[col];
+    if (!index.built) {
+        for (const auto& [pos, cell] : cells_) {
+            if (pos.col == col) {
+                index.stale_rows.insert(pos.row);
+            }
+        }
+        index.built = true;
+    }
+
+    // Вычисление значения ячейки может прервать обновление (см. пробное вычисление условных
+    // формул) или вложенно обновить этот же индекс: строка считается обновлённой только
+    // после записи её значения, итераторы после вычисления не используются
+    for (auto it = index.stale_rows.lower_bound(first_row); it != index.stale_rows.end() && *it <= last_row;
+         it = index.stale_rows.lower_bound(first_row)) {
+        int row = *it;
+        std::optional<double> value;
+        std::optional<FormulaError::Category> error;
+        if (auto cell = cells_.find({row, col}); cell != cells_.end()) {
+            auto cell_value = cell->second->GetValue();
+            if (std::holds_alternative<FormulaError>(cell_value)) {
+                error = std::get<FormulaError>(cell_value).GetCategory();
+            }
+            value = GetLookupValue(cell_value);
+            // NaN (текст "nan") не равен ни одному значению и не суммируется
+            if (value && std::isnan(*value)) {
+                value.reset();
+            }
+        }
+
+        if (auto old_value = index.values.find(row); old_value != index.values.end()) {
+            auto rows = index.rows_by_value.find(old_value->second);
+            rows->second.erase(std::lower_bound(rows->second.begin(), rows->second.end(), row));
+            if (rows->second.empty()) {
+                index.rows_by_value.erase(rows);
+            }
+            index.values.erase(old_value);
+        }
+        if (value) {
+            auto& rows = index.rows_by_value[*value];
+            rows.insert(std::lower_bound(rows.begin(), rows.end(), row), row);
+            index.values[row] = *value;
+        }
+        if (error) {
+            index.errors[row] = *error;
+        } else {
+            index.errors.erase(row);
+        }
+        if (index.sums) {
+            index.sums->Set(row, value);
+        }
+        index.stale_rows.erase(row);
+    }
+    return index;
+}
+
+void Sheet::AddRangeDependent(Cell* cell, Position first, Position last) const {
+    for (int col = first.col; col <= last.col; ++col) {
+        auto [it, added] = column_indexes_[col].dependents.try_emplace({first.row, last.row});
+        auto& group = it->second;
+        group.min_level = added ? cell->GetLevel() : std::min(group.min_level, cell->GetLevel());
+        group.cells.insert(cell);
+        if (cell->HasValue()) {
+            group.armed.insert(cell);
+        }
+    }
+}
+
+void Sheet::RemoveRangeDependent(Cell* cell, Position first, Position last) const {
+    for (int col = first.col; col <= last.col; ++col) {
+        auto index = column_indexes_.find(col);
+        if (index == column_indexes_.end()) {
+            continue;
+        }
+        auto& dependents = index->second.dependents;
+        auto group = dependents.find({first.row, last.row});
+        if (group == dependents.end()) {
+            continue;
+        }
+        group->second.cells.erase(cell);
+        group->second.armed.erase(cell);
+        if (group->second.cells.empty()) {
+            dependents.erase(group);
+        }
+        if (dependents.empty() && !index->second.built) {
+            column_indexes_.erase(index);
+        }
+    }
+}
+
+void Sheet::ArmRangeDependent(Cell* cell, Position first, Position last) const {
+    for (int col = first.col; col <= last.col; ++col) {
+        column_indexes_.at(col).dependents.at({first.row, last.row}).armed.insert(cell);
+    }
+}
+
+void Sheet::GetRangeDependents(Position pos, std::vector<Cell*>& cells) const {
+    auto index = column_indexes_.find(pos.col);
+    if (index == column_indexes_.end()) {
+        return;
+    }
+    for (const auto& [rows, group] : index->second.dependents) {
+        if (rows.first > pos.row) {
+            break;
+        }
+        if (pos.row <= rows.second) {
+            cells.insert(cells.end(), group.cells.begin(), group.cells.end());
+        }
+    }
+}
+
+void Sheet::MarkValueChanged(Position pos, std::vector<Cell*>& cells) const {
+    auto index = column_indexes_.find(pos.col);
+    if (index == column_indexes_.end()) {
+        return;
+    }
+    if (index->second.built) {
+        index->second.stale_rows.insert(pos.row);
+    }
+    for (auto& [rows, group] : index->second.dependents) {
+        if (rows.first > pos.row) {
+            break;
+        }
+        if (pos.row <= rows.second) {
+            cells.insert(cells.end(), group.armed.begin(), group.armed.end());
+            group.armed.clear();
+        }
+    }
+}
+
+void Sheet::GetRangeDependentsToRaise(Position pos, size_t level, std::vector<Cell*>& cells) const {
+    auto index = column_indexes_.find(pos.col);
+    if (index == column_indexes_.end()) {
+        return;
+    }
+    for (auto& [rows, group] : index->second.dependents) {
+        if (rows.first > pos.row) {
+            break;
+        }
+        if (pos.row > rows.second || group.min_level > level) {
+            continue;
+        }
+        // После подъёма уровни формул группы не меньше level + 1
+        group.min_level = level + 1;
+        for (auto cell : group.cells) {
+            if (cell->GetLevel() <= level) {
+                cells.push_back(cell);
+            } else {
+                group.min_level = std::min(group.min_level, cell->GetLevel());
+            }
+        }
+    }
+}
+
+size_t Sheet::GetColumnLevel(int col) const {
+    auto level = column_levels_.find(col);
+    return level == column_levels_.end() ? 0 : level->second;
+}
+
+void Sheet::UpdateColumnLevel(int col, size_t level) const {
+    auto& column_level = column_levels_[col];
+    column_level = std::max(column_level, level);
+}
+
 void Sheet::PrintValues(std::ostream& output) const {
-    const std::function<void(const CellInterface&)> print_cell = [&output](const CellInterface& cell){
+    const std::function<void(const Cell&)> print_cell = [&output](const Cell& cell){
         std::visit([&output](const auto &elem) { output << elem; }, cell.GetValue());
     };
     PrintCells(output, print_cell);
 }
 
 void Sheet::PrintTexts(std::ostream& output) const {
-    std::function<void(const CellInterface&)> print_cell = [&output](const CellInterface& cell){
-        output << cell.GetText();
+    std::function<void(const Cell&)> print_cell = [&output](const Cell& cell){
+        output << cell.GetTextView();
     };
     PrintCells(output, print_cell);
 }
 
+void Sheet::PrintValuesParallel(std::ostream& output, ExportOptions options) const {
+    PrintBlocks(output, options, [this](Position top_left, Size size) -> BlockFormatter {
+        std::vector<CellValueView> values(static_cast<size_t>(size.rows) * size.cols);
+        ReadRange(top_left, size, values.data());
+        return [values = std::move(values), cols = size.cols](std::ostream& output) {
+            PrintBlock(output, values, cols, [&output](const CellValueView& value) {
+                std::visit([&output](const auto& elem) { output << elem; }, value);
+            });
+        };
+    });
+}
+
+void Sheet::PrintTextsParallel(std::ostream& output, ExportOptions options) const {
+    PrintBlocks(output, options, [this](Position top_left, Size size) -> BlockFormatter {
+        std::vector<std::string_view> texts;
+        texts.reserve(static_cast<size_t>(size.rows) * size.cols);
+        for (int row = top_left.row; row < top_left.row + size.rows; ++row) {
+            for (int col = 0; col < size.cols; ++col) {
+                auto it = cells_.find({row, col});
+                texts.push_back(it == cells_.end() ? ""sv : it->second->GetTextView());
+            }
+        }
+        return [texts = std::move(texts), cols = size.cols](std::ostream& output) {
+            PrintBlock(output, texts, cols, [&output](std::string_view text) {
+                output << text;
+            });
+        };
+    });
+}
+
+const SheetInterface* Sheet::FindSheet(std::string_view name) const {
+    return workbook_ ? workbook_->GetSheet(name) : nullptr;
+}
+
+Sheet* Sheet::FindSheet(std::string_view name) {
+    return workbook_ ? workbook_->GetSheet(name) : nullptr;
+}
+
+std::shared_ptr<FormulaInterface> Sheet::InternFormula(std::string expression,
+                                                       std::shared_ptr<FormulaInterface> parsed) const {
+    if (workbook_) {
+        return workbook_->InternFormula(std::move(expression), std::move(parsed));
+    }
+    return parsed ? std::move(parsed) : ParseFormula(std::move(expression));
+}
+
+void Sheet::ForgetFormula(std::string_view expression, const FormulaInterface& formula) const {
+    if (workbook_) {
+        workbook_->ForgetFormula(expression, formula);
+    }
+}
+
+void Sheet::SetRecalculationMode(RecalculationMode mode) {
+    if (workbook_) {
+        workbook_->SetRecalculationMode(mode);
+    } else {
+        recalculation_mode_ = mode;
+    }
+}
+
+RecalculationMode Sheet::GetRecalculationMode() const {
+    return workbook_ ? workbook_->GetRecalculationMode() : recalculation_mode_;
+}
+
+void Sheet::SetEvaluationStrategy(EvaluationStrategy strategy) {
+    if (workbook_) {
+        workbook_->SetEvaluationStrategy(strategy);
+    } else {
+        evaluation_strategy_ = strategy;
+    }
+}
+
+void Sheet::EnablePaging(PagingOptions options) {
+    DisablePaging();
+    pager_ = std::make_unique<RegionPager>(std::move(options));
+    for (const auto& [pos, cell] : cells_) {
+        pager_->AddCell(cell.get());
+        pager_->EvictColdRegions();
+    }
+}
+
+void Sheet::DisablePaging() {
+    if (pager_) {
+        pager_->PageInAll();
+        pager_.reset();
+    }
+}
+
+void Sheet::TouchRegion(Position pos) const {
+    if (pager_) {
+        pager_->Touch(pos);
+    }
+}
+
+Executor& Sheet::GetExecutor() const {
+    if (workbook_) {
+        return workbook_->GetExecutor();
+    }
+    if (!executor_) {
+        executor_ = std::make_unique<Executor>();
+    }
+    return *executor_;
+}
+
+EvaluationStrategy Sheet::GetEvaluationStrategy() const {
+    return workbook_ ? workbook_->GetEvaluationStrategy() : evaluation_strategy_;
+}
+
+MemoryUsage Sheet::GetMemoryUsage(MemoryUsageMode mode) const {
+    using namespace memory_usage;
+
+    MemoryUsage usage;
+    // Для пользовательской хэш-функции без noexcept хэш хранится в узлах (как в libstdc++)
+    usage.cell_map = HashTableSize(cells_)
+                     + (row_to_cell_count_.size() + column_to_cell_count_.size())
+                           * TreeNodeSize<std::pair<const int, int>>();
+
+    MemoryUsage cells_usage;
+    size_t counted_cells = 0;
+    for (const auto& [pos, cell] : cells_) {
+        if (mode == MemoryUsageMode::Approximate && counted_cells == MEMORY_SAMPLE_SIZE) {
+            break;
+        }
+        cell->AddMemoryUsage(cells_usage);
+        ++counted_cells;
+    }
+    if (counted_cells != 0 && counted_cells != cells_.size()) {
+        cells_usage.Scale(static_cast<double>(cells_.size()) / counted_cells);
+    }
+    usage += cells_usage;
+    usage.cached_values += value_cache_.GetMemoryUsage();
+    return usage;
+}
+
+void Sheet::ForEachCell(const std::function<void(Position, Cell&)>& func) {
+    for (auto& [pos, cell] : cells_) {
+        func(pos, *cell);
+    }
+}
+
+bool Sheet::IsInSubscription(Position pos) const {
+    for (const auto& [id, subscription] : subscriptions_) {
+        if (subscription.Contains(pos)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+std::optional<CellInterface::Value> Sheet::GetKnownValue(Position pos) const {
+    auto it = cells_.find(pos);
+    if (it == cells_.end()) {
+        return CellInterface::Value(""s);
+    }
+    if (!it->second->HasValue()) {
+        return std::nullopt;
+    }
+    return it->second->GetValue();
+}
+
+void Sheet::DeliverChanges() {
+    if (!workbook_) {
+        DeliverOwnChanges();
+        return;
+    }
+    // Изменение таблицы меняет значения формул других таблиц книги.
+    // Подписчики могут добавлять таблицы: имена копируются
+    auto names = workbook_->GetSheetNames();
+    for (const auto& name : names) {
+        if (auto sheet = workbook_->GetSheet(name)) {
+            sheet->DeliverOwnChanges();
+        }
+    }
+}
+
+void Sheet::DeliverOwnChanges() {
+    if (change_depth_ > 0 || changed_values_.empty()) {
+        return;
+    }
+    auto changed_values = std::move(changed_values_);
+    changed_values_.clear();
+
+    // Сообщаются только позиции, значения которых действительно изменились
+    std::vector<Position> changed;
+    for (const auto& [pos, old_value] : changed_values) {
+        auto it = cells_.find(pos);
+        auto value = it == cells_.end() ? CellInterface::Value(""s) : it->second->GetValue();
+        if (!old_value || !(*old_value == value)) {
+            changed.push_back(pos);
+        }
+    }
+    if (changed.empty()) {
+        return;
+    }
+    std::sort(changed.begin(), changed.end());
+
+    // Подписчики могут изменять таблицу и подписки
+    std::vector<SubscriptionId> ids;
+    for (const auto& [id, subscription] : subscriptions_) {
+        ids.push_back(id);
+    }
+    std::vector<Position> positions;
+    for (auto id : ids) {
+        auto it = subscriptions_.find(id);
+        if (it == subscriptions_.end()) {
+            continue;
+        }
+        positions.clear();
+        for (auto pos : changed) {
+            if (it->second.Contains(pos)) {
+                positions.push_back(pos);
+            }
+        }
+        if (!positions.empty()) {
+            auto callback = it->second.callback;
+            callback(positions);
+        }
+    }
+}
+
 bool Sheet::HasCell(Position pos) const {
     if (!pos.IsValid()) {
         throw InvalidPositionException("cell check error: position is invalid"s);
@@ -103,7 +826,125 @@ bool Sheet::HasCell(Position pos) const {
     return cells_.count(pos);
 }
 
-void Sheet::PrintCells(std::ostream& output, const std::function<void(const CellInterface&)>& printCell) const {
+void Sheet::MoveCells(const std::function<Position(Position)>& shift) {
+    // Ячейки, которые меняют позицию или удаляются
+    std::vector<std::pair<Position, Position>> moves;
+    for (const auto& [pos, cell] : cells_) {
+        auto new_pos = shift(pos);
+        if (new_pos == pos) {
+            continue;
+        }
+        if (!(new_pos == Position::NONE) && !new_pos.IsValid()) {
+            // Пустую ячейку, на которую никто не ссылается, можно просто удалить
+            if (!cell->IsEmpty() || !cell->GetDependentCells().empty()) {
+                throw InvalidPositionException("cells shift error: cells are shifted out of the table"s);
+            }
+            new_pos = Position::NONE;
+        }
+        moves.emplace_back(pos, new_pos);
+    }
+    if (moves.empty()) {
+        return;
+    }
+    ChangeScope scope(*this);
+    // Ячейки переходят в другие области: на время переноса все области загружаются
+    std::optional<ImplPin> pin;
+    pin.emplace();
+    if (pager_) {
+        pager_->PageInAll();
+        pager_->Clear();
+    }
+    // Значения меняются на прежних и новых позициях перенесённых ячеек
+    for (const auto& [pos, new_pos] : moves) {
+        if (IsSubscribed(pos)) {
+            RecordValueChange(pos, GetKnownValue(pos));
+        }
+        if (!(new_pos == Position::NONE) && IsSubscribed(new_pos)) {
+            RecordValueChange(new_pos, GetKnownValue(new_pos));
+        }
+    }
+
+    // Формулы, которые ссылаются на перенесённые ячейки (в том числе формулы других таблиц книги)
+    std::unordered_set<Cell*> dependents;
+    for (const auto& [pos, new_pos] : moves) {
+        const auto& cell_dependents = cells_.at(pos)->GetDependentCells();
+        dependents.insert(cell_dependents.begin(), cell_dependents.end());
+    }
+    // Формулы, которые ищут значения в областях таблицы: области меняются вместе с ячейками,
+    // поэтому связи с ними снимаются до переноса, а индексы столбцов строятся заново
+    std::unordered_set<Cell*> range_dependents;
+    for (const auto& [col, index] : column_indexes_) {
+        for (const auto& [rows, group] : index.dependents) {
+            range_dependents.insert(group.cells.begin(), group.cells.end());
+        }
+    }
+    for (auto cell : range_dependents) {
+        cell->DetachRanges();
+    }
+    column_indexes_.clear();
+    // Удаляемые ячейки отвязываются, пока позиции их ссылок ещё действительны
+    for (const auto& [pos, new_pos] : moves) {
+        if (new_pos == Position::NONE) {
+            cells_.at(pos)->Detach();
+        }
+    }
+
+    // Ячейки переносятся вместе с узлами хэш-таблицы, без создания новых ячеек
+    std::vector<std::unique_ptr<Cell>> removed_cells;
+    std::vector<decltype(cells_)::node_type> moved_cells;
+    moved_cells.reserve(moves.size());
+    for (const auto& [pos, new_pos] : moves) {
+        auto node = cells_.extract(pos);
+        if (new_pos == Position::NONE) {
+            dependents.erase(node.mapped().get());
+            range_dependents.erase(node.mapped().get());
+            removed_cells.push_back(std::move(node.mapped()));
+        } else {
+            node.key() = new_pos;
+            node.mapped()->SetPosition(new_pos);
+            moved_cells.push_back(std::move(node));
+        }
+    }
+    for (auto& node : moved_cells) {
+        cells_.insert(std::move(node));
+    }
+
+    auto sheet_name = workbook_ ? workbook_->GetSheetName(*this) : ""sv;
+    for (auto dependent : dependents) {
+        dependent->ShiftReferences(*this, sheet_name, shift);
+    }
+    for (auto dependent : range_dependents) {
+        if (!dependents.count(dependent)) {
+            dependent->ShiftReferences(*this, sheet_name, shift);
+        }
+    }
+
+    // Обновляем данные для вычисления размера печатной области
+    row_to_cell_count_.clear();
+    column_to_cell_count_.clear();
+    column_levels_.clear();
+    for (const auto& [pos, cell] : cells_) {
+        UpdateColumnLevel(pos.col, cell->GetLevel());
+        if (!cell->IsEmpty()) {
+            ++row_to_cell_count_[pos.row];
+            ++column_to_cell_count_[pos.col];
+        }
+    }
+    for (auto dependent : range_dependents) {
+        dependent->AttachRanges();
+    }
+
+    if (pager_) {
+        for (const auto& [pos, cell] : cells_) {
+            pager_->AddCell(cell.get());
+        }
+        pin.reset();
+        pager_->EvictColdRegions();
+    }
+    scope.Finish();
+}
+
+void Sheet::PrintCells(std::ostream& output, const std::function<void(const Cell&)>& printCell) const {
     auto size = GetPrintableSize();
     if (size == Size{}) {
         return;
@@ -125,6 +966,27 @@ void Sheet::PrintCells(std::ostream& output, const std::function<void(const Cell
     }
 }
 
+void Sheet::PrintBlocks(std::ostream& output, ExportOptions options,
+                        const std::function<BlockFormatter(Position top_left, Size size)>& prepare) const {
+    auto size = GetPrintableSize();
+    if (size == Size{}) {
+        return;
+    }
+
+    int block_rows = std::max(options.block_rows, 1);
+    size_t block_count = (size.rows + block_rows - 1) / block_rows;
+    size_t threads = options.threads != 0 ? options.threads : std::max(1u, std::thread::hardware_concurrency());
+    // Данные блока ссылаются на реализации ячеек, а выгрузка освобождает их при следующем
+    // обращении к таблице: блок форматируется сразу после подготовки
+    if (pager_) {
+        threads = 1;
+    }
+    RunExportPipeline(output, block_count, threads, [&](size_t block) {
+        int first_row = static_cast<int>(block) * block_rows;
+        return prepare({first_row, 0}, {std::min(block_rows, size.rows - first_row), size.cols});
+    });
+}
+
 std::unique_ptr<SheetInterface> CreateSheet() { 
     return std::make_unique<Sheet>(); 
 }
\ No newline at end of file
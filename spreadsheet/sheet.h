@@ -2,10 +2,21 @@
 
 #include "cell.h"
 #include "common.h"
+#include "executor.h"
+#include "export_pipeline.h"
+#include "memory_usage.h"
+#include "range_sum_tree.h"
+#include "region_pager.h"
+#include "string_pool.h"
+#include "value_cache.h"
 
 #include <algorithm>
 #include <functional>
+#include <future>
 #include <map>
+#include <set>
+#include <unordered_set>
+#include <unordered_map>
 
 struct PositionHasher {
     static const uint64_t N = 37;
@@ -15,9 +26,31 @@ struct PositionHasher {
 };
 
 class Cell;
+class Workbook;
+
+// Режим пересчёта значений формул после изменения ячейки
+enum class RecalculationMode {
+    // Кэши зависимых ячеек сбрасываются, значения вычисляются при следующем GetValue()
+    Lazy,
+    // Зависимые ячейки сразу пересчитываются в топологическом порядке; пересчёт
+    // останавливается на ячейках, значение которых не изменилось
+    Eager,
+};
+
+// Способ вычисления значений формул, ещё не находящихся в кэше
+enum class EvaluationStrategy {
+    // Ячейки, на которые ссылается формула, вычисляются вложенными вызовами GetValue();
+    // глубина стека растёт с длиной цепочки зависимостей
+    Recursive,
+    // Невычисленные ячейки цепочки сначала вычисляются в порядке зависимостей с явным стеком
+    Iterative,
+};
 
 class Sheet : public SheetInterface {
 public:
+    // Таблица книги workbook (nullptr - отдельная таблица)
+    explicit Sheet(Workbook* workbook = nullptr);
+
     void SetCell(Position pos, std::string text) override;
 
     // Методы получения ячейки (для которых был вызван SetCell)
@@ -26,23 +59,283 @@ public:
 
     // Метод получения ячейки, даже если она пустая
     const CellInterface* GetConcreteCell(Position pos) const;
+    Cell* GetConcreteCell(Position pos);
 
     void ClearCell(Position pos) override;
 
+    // Задаёт содержимое ячеек cells (из повторяющихся позиций действует последняя), как
+    // последовательность вызовов SetCell, но быстрее: в пустой таблице формулы разбираются
+    // параллельно (ParseFormulas), ячейки создаются без проверки циклов по одной ячейке,
+    // связи и уровни строятся одним проходом (используется при восстановлении таблицы
+    // из журнала, см. wal.h). Формулы с областями
+    // и ссылками на другие таблицы, а также все ячейки непустой таблицы задаются через SetCell.
+    // Если формула пакета некорректна или ячейки пакета образуют цикл, бросается FormulaException
+    // или CircularDependencyException и таблица остаётся пустой; исключение при задании
+    // формулы через SetCell оставляет уже заданные ячейки.
+    void LoadCells(std::vector<std::pair<Position, std::string>> cells);
+
+    // Вставка и удаление строк и столбцов. Ячейки за местом изменения сдвигаются,
+    // ссылки формул книги на сдвинутые ячейки исправляются без повторного разбора формул,
+    // ссылки на удалённые ячейки становятся ошибкой #REF!. Если непустая ячейка вышла бы
+    // за пределы таблицы, бросается InvalidPositionException и таблица не изменяется.
+    void InsertRows(int before, int count = 1);
+    void DeleteRows(int first, int count = 1);
+    void InsertColumns(int before, int count = 1);
+    void DeleteColumns(int first, int count = 1);
+
     Size GetPrintableSize() const override;
 
+    // Читает значения прямоугольной области size с левым верхним углом top_left в буфер out
+    // (size.rows * size.cols элементов, построчно). Пустые и отсутствующие ячейки читаются
+    // как пустая строка. Сначала заполняются ячейки с известными значениями, затем
+    // вычисляются формулы области без значения в кэше (только они и их зависимости).
+    // Значения действительны до следующего изменения таблицы. Если область выходит
+    // за пределы таблицы, бросается InvalidPositionException.
+    void ReadRange(Position top_left, Size size, CellValueView* out) const;
+
+    // Вычисляет значение ячейки на исполнителе движка (см. Cell::GetValue(limits)).
+    // При отмене или истечении срока future получает EvaluationCancelledException,
+    // вычисленные к этому моменту значения сохраняются, поэтому повторный запрос
+    // продолжает вычисление, а не начинает его заново. Некорректная позиция
+    // проверяется сразу (InvalidPositionException).
+    // Таблица не потокобезопасна: пока future не готов, таблицы книги нельзя
+    // изменять и читать из других потоков.
+    std::future<CellInterface::Value> GetValueAsync(Position pos, EvaluationLimits limits = {}) const;
+
+    // Подписка на изменения значений ячеек прямоугольника first..last (включительно).
+    // После каждой операции изменения (SetCell, ClearCell, LoadCells, вставка и удаление строк
+    // и столбцов) и пересчёта callback получает упорядоченный список позиций прямоугольника,
+    // значения которых изменились (значения сравниваются; для выгруженных на диск ячеек
+    // значение до изменения неизвестно, и они сообщаются без сравнения). Изменения ищутся
+    // среди сброшенных и пересчитанных ячеек, поэтому работа пропорциональна числу
+    // изменений, а не размеру прямоугольника. При подписке формулы прямоугольника
+    // вычисляются, после сообщения - вычисляются изменившиеся формулы. Подписки сообщают
+    // и изменения, вызванные изменением других таблиц книги.
+    using ChangeCallback = std::function<void(const std::vector<Position>& changed)>;
+    using SubscriptionId = uint64_t;
+    SubscriptionId Subscribe(Position first, Position last, ChangeCallback callback);
+    void Unsubscribe(SubscriptionId id);
+    // Изменения между BeginChanges и EndChanges (пары могут быть вложенными) сообщаются
+    // одним списком по завершении внешней пары
+    void BeginChanges();
+    void EndChanges();
+    // Значение ячейки pos подписанного прямоугольника может измениться (old_value - значение
+    // до изменения, nullopt - неизвестно)
+    bool IsSubscribed(Position pos) const { return !subscriptions_.empty() && IsInSubscription(pos); }
+    void RecordValueChange(Position pos, std::optional<CellInterface::Value> old_value);
+
+    // Поиск по индексу значений столбца: индекс строится при первом поиске в столбце,
+    // после изменения ячеек столбца обновляются только изменившиеся строки
+    std::optional<Position> FindValue(Position first, Position last, double value) const override;
+    // Итоги по деревьям сумм столбцов области: после изменения ячеек в дереве обновляются
+    // только изменившиеся строки (O(log n) на строку), область заново не суммируется
+    RangeTotals AggregateValues(Position first, Position last) const override;
+
     void PrintValues(std::ostream& output) const override;
     void PrintTexts(std::ostream& output) const override;
+    // Вывод, побайтно совпадающий с PrintValues/PrintTexts, блоками по options.block_rows
+    // строк: данные блока читаются в вызывающем потоке (формулы вычисляются там же,
+    // вычисление изменяет кэши таблицы), форматируются параллельно, и блоки выводятся по
+    // порядку. Если включена выгрузка на диск, блоки выводятся в вызывающем потоке.
+    void PrintValuesParallel(std::ostream& output, ExportOptions options = {}) const;
+    void PrintTextsParallel(std::ostream& output, ExportOptions options = {}) const;
+
+    const SheetInterface* FindSheet(std::string_view name) const override;
+    Sheet* FindSheet(std::string_view name);
+    Workbook* GetWorkbook() const { return workbook_; }
+    // Исполнитель асинхронных вычислений (общий для таблиц книги)
+    Executor& GetExecutor() const;
+
+    // Разбирает формулу (или берёт уже разобранную parsed); таблицы книги используют
+    // общий кэш разобранных формул
+    std::shared_ptr<FormulaInterface> InternFormula(std::string expression,
+                                                    std::shared_ptr<FormulaInterface> parsed = nullptr) const;
+    // Удаляет формулу из кэша книги перед её изменением
+    void ForgetFormula(std::string_view expression, const FormulaInterface& formula) const;
+    // Текст ячейки из пула строк таблицы: одинаковые тексты ячеек хранятся один раз
+    StringPool::Handle InternText(std::string text) { return text_pool_.Intern(std::move(text)); }
+    // Количество различных текстов (не формул) в ячейках таблицы
+    size_t GetInternedTextCount() const { return text_pool_.GetSize(); }
+
+    // Ограничение памяти вычисленных значений формул таблицы в байтах (0 - без ограничения,
+    // по умолчанию). Сверх ограничения значения вытесняются с учётом стоимости повторного
+    // вычисления и вычисляются заново при следующем чтении (см. ValueCache)
+    void SetValueCacheLimit(size_t max_bytes) { value_cache_.SetLimit(max_bytes); }
+    ValueCache& GetValueCache() const { return value_cache_; }
+
+    // Память, занимаемая таблицей, по компонентам
+    MemoryUsage GetMemoryUsage(MemoryUsageMode mode = MemoryUsageMode::Approximate) const;
+
+    // Обходит все ячейки таблицы (в том числе пустые) в произвольном порядке
+    void ForEachCell(const std::function<void(Position, Cell&)>& func);
+
+    // Режим пересчёта и способ вычисления таблицы книги общие для всей книги
+    void SetRecalculationMode(RecalculationMode mode);
+    RecalculationMode GetRecalculationMode() const;
+    // Количество ячеек, пересчитанных последним вызовом SetCell/ClearCell в режиме Eager
+    size_t GetLastRecalculationCount() const { return last_recalculation_count_; }
+    void AddRecalculatedCells(size_t count) { last_recalculation_count_ += count; }
+
+    void SetEvaluationStrategy(EvaluationStrategy strategy);
+    EvaluationStrategy GetEvaluationStrategy() const;
+
+    // Хранение вне памяти: реализации ячеек (тексты, разобранные формулы, значения в кэше)
+    // группируются в области options.region_rows x options.region_cols. В памяти остаются
+    // options.max_resident_regions недавно использованных областей, остальные выгружаются
+    // в файл options.file и загружаются при обращении (GetCell, вычисление формул).
+    // Сами ячейки со связями, уровнями и индексами столбцов остаются в памяти.
+    // Пока формула вычисляется, используемые области не выгружаются, поэтому во время
+    // вычисления областей в памяти может быть больше. Значения без копирования (GetValueView,
+    // ReadRange) действительны только до следующего обращения к таблице.
+    void EnablePaging(PagingOptions options);
+    // Загружает все области и удаляет файл выгрузки
+    void DisablePaging();
+    // nullptr, если выгрузка не включена
+    const RegionPager* GetPager() const { return pager_.get(); }
+    // Загружает выгруженную область ячейки pos и отмечает её как недавно использованную
+    void TouchRegion(Position pos) const;
 
 private:
+    // Связи с областями и уровни столбцов поддерживают сами ячейки
+    friend class Cell;
+
+    // Регистрирует формулу cell, которая ищет значения в области first..last таблицы:
+    // изменение ячеек области сбрасывает (в режиме Eager - пересчитывает) значение формулы.
+    // Уровень формулы должен быть уже вычислен
+    void AddRangeDependent(Cell* cell, Position first, Position last) const;
+    void RemoveRangeDependent(Cell* cell, Position first, Position last) const;
+    // Отмечает, что значение формулы cell вычислено и его нужно сбросить при изменении области
+    void ArmRangeDependent(Cell* cell, Position first, Position last) const;
+    // Добавляет в cells формулы, области поиска которых содержат позицию pos
+    void GetRangeDependents(Position pos, std::vector<Cell*>& cells) const;
+    // Значение ячейки pos изменилось: строка индекса поиска устаревает. Добавляет в cells
+    // формулы, области которых содержат pos, вычисленные после предыдущего изменения
+    void MarkValueChanged(Position pos, std::vector<Cell*>& cells) const;
+    // Добавляет в cells формулы, области которых содержат pos, с уровнем не выше level
+    // (их уровень нужно поднять выше level)
+    void GetRangeDependentsToRaise(Position pos, size_t level, std::vector<Cell*>& cells) const;
+    // Наибольший топологический уровень ячеек столбца (не меньше уровня любой его ячейки)
+    size_t GetColumnLevel(int col) const;
+    void UpdateColumnLevel(int col, size_t level) const;
+
+    // Операция изменения таблицы: изменения значений сообщаются подписчикам, когда
+    // завершается самая внешняя операция (вложенный SetCell формулы, которая создаёт
+    // ячейки, ничего не сообщает). Если операция прервана исключением, её изменения
+    // сообщаются вместе со следующей операцией
+    class ChangeScope {
+    public:
+        explicit ChangeScope(Sheet& sheet) :
+            sheet_(sheet)
+        {
+            ++sheet_.change_depth_;
+        }
+        ChangeScope(const ChangeScope&) = delete;
+        ChangeScope& operator=(const ChangeScope&) = delete;
+        ~ChangeScope() {
+            if (!finished_) {
+                --sheet_.change_depth_;
+            }
+        }
+
+        void Finish() {
+            finished_ = true;
+            sheet_.EndChanges();
+        }
+
+    private:
+        Sheet& sheet_;
+        bool finished_ = false;
+    };
+
+    struct Subscription {
+        Position first;
+        Position last;
+        ChangeCallback callback;
+
+        bool Contains(Position pos) const {
+            return first.row <= pos.row && pos.row <= last.row && first.col <= pos.col && pos.col <= last.col;
+        }
+    };
+
     bool HasCell(Position pos) const;
-    void PrintCells(std::ostream& output, const std::function<void(const CellInterface&)>& printCell) const;
+    bool IsInSubscription(Position pos) const;
+    // Значение ячейки pos, если оно известно без вычисления
+    std::optional<CellInterface::Value> GetKnownValue(Position pos) const;
+    // Сообщает изменения таблиц книги (таблицы, в которой нет незавершённых операций)
+    void DeliverChanges();
+    void DeliverOwnChanges();
+    // Переносит ячейки на позиции shift(pos) (Position::NONE - ячейка удаляется)
+    // и исправляет ссылки формул на перенесённые ячейки
+    void MoveCells(const std::function<Position(Position)>& shift);
+    void PrintCells(std::ostream& output, const std::function<void(const Cell&)>& printCell) const;
+    // Выводит печатную область блоками: prepare собирает данные блока строк
+    void PrintBlocks(std::ostream& output, ExportOptions options,
+                     const std::function<BlockFormatter(Position top_left, Size size)>& prepare) const;
+
+    // Формулы, которые ищут значения в одном и том же диапазоне строк столбца
+    struct RangeDependents {
+        std::unordered_set<Cell*> cells;
+        // Формулы, значения которых могли попасть в кэш после предыдущего изменения
+        // диапазона (в режиме Lazy сбрасываются только они)
+        std::unordered_set<Cell*> armed;
+        // Не больше уровня любой из формул
+        size_t min_level = 0;
+    };
+    // Индекс столбца для функций поиска (MATCH, VLOOKUP, XLOOKUP) и агрегатных функций
+    // (SUM, COUNT, AVERAGE)
+    struct ColumnIndex {
+        // Диапазон строк - формулы, которые ищут значения в нём. Обычно многие формулы
+        // ищут в одной области, поэтому диапазонов намного меньше, чем формул
+        std::map<std::pair<int, int>, RangeDependents> dependents;
+        // Индекс значений построен (строится при первом поиске или агрегате)
+        bool built = false;
+        // Числовое значение - строки с этим значением по возрастанию
+        std::unordered_map<double, std::vector<int>> rows_by_value;
+        // Строка - её значение в rows_by_value
+        std::unordered_map<int, double> values;
+        // Строки с ошибками
+        std::map<int, FormulaError::Category> errors;
+        // Суммы чисел столбца (строятся при первом агрегате)
+        std::optional<RangeSumTree> sums;
+        // Строки, значения которых изменились после построения индекса
+        std::set<int> stale_rows;
+    };
+    // Индекс столбца col, в котором обновлены устаревшие строки между first_row и last_row
+    ColumnIndex& GetColumnIndex(int col, int first_row, int last_row) const;
 
 private:
+    // Количество ячеек, по которым оценивается память в режиме MemoryUsageMode::Approximate
+    static const size_t MEMORY_SAMPLE_SIZE = 1024;
+
+    // Книга, в которую входит таблица
+    Workbook* workbook_;
+    // Тексты ячеек (объявлен до ячеек: ячейки удаляются раньше пула)
+    StringPool text_pool_;
+    // Значения формул (объявлен до ячеек: ячейки освобождают свои записи)
+    mutable ValueCache value_cache_;
     // Ячейки
     std::unordered_map<Position, std::unique_ptr<Cell>, PositionHasher> cells_;
     // Количество элементов в строке: номер строки - количество ячеек, которые у которых выполнен SetCell
     std::map<int, int> row_to_cell_count_;
     // Количество элементов в столбце: номер столбца - количество ячеек, которые у которых выполнен SetCell
     std::map<int, int> column_to_cell_count_;
+    RecalculationMode recalculation_mode_ = RecalculationMode::Lazy;
+    size_t last_recalculation_count_ = 0;
+    EvaluationStrategy evaluation_strategy_ = EvaluationStrategy::Iterative;
+    // Индексы столбцов, в которых ищут значения формулы
+    mutable std::unordered_map<int, ColumnIndex> column_indexes_;
+    // Столбец - наибольший топологический уровень его ячеек
+    mutable std::unordered_map<int, size_t> column_levels_;
+    // Подписки на изменения
+    std::map<SubscriptionId, Subscription> subscriptions_;
+    SubscriptionId next_subscription_id_ = 1;
+    // Позиции подписанных ячеек, значения которых могли измениться, - значения до изменения
+    std::unordered_map<Position, std::optional<CellInterface::Value>, PositionHasher> changed_values_;
+    // Вложенность незавершённых операций изменения и пакетов BeginChanges
+    int change_depth_ = 0;
+    // Выгрузка областей на диск (nullptr - все ячейки в памяти)
+    std::unique_ptr<RegionPager> pager_;
+    // Создаётся при первом асинхронном вычислении; объявлен после ячеек, чтобы
+    // при уничтожении таблицы дождаться задач до удаления ячеек
+    mutable std::unique_ptr<Executor> executor_;
 };
\ No newline at end of file
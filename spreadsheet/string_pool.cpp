@@ -0,0 +1,56 @@
+#include "string_pool.h"
+
+#include "memory_usage.h"
+
+#include <utility>
+
+StringPool::Handle::Handle(Node* node) :
+    node_(node)
+{
+    ++node_->second.refs;
+}
+
+StringPool::Handle::Handle(const Handle& other) :
+    node_(other.node_)
+{
+    if (node_) {
+        ++node_->second.refs;
+    }
+}
+
+StringPool::Handle::Handle(Handle&& other) noexcept :
+    node_(std::exchange(other.node_, nullptr))
+{}
+
+StringPool::Handle& StringPool::Handle::operator=(Handle other) noexcept {
+    std::swap(node_, other.node_);
+    return *this;
+}
+
+StringPool::Handle::~Handle() {
+    if (node_) {
+        node_->second.pool->Release(node_);
+    }
+}
+
+size_t StringPool::Handle::GetPooledSize() const {
+    if (!node_) {
+        return 0;
+    }
+    return memory_usage::HashNodeSize<Node>() + memory_usage::StringHeapSize(node_->first);
+}
+
+StringPool::Handle StringPool::Intern(std::string text) {
+    if (text.empty()) {
+        return {};
+    }
+    // Строка перемещается в пул, только если её в нём ещё нет
+    auto it = strings_.try_emplace(std::move(text), Entry{this, 0}).first;
+    return Handle(&*it);
+}
+
+void StringPool::Release(Node* node) {
+    if (--node->second.refs == 0) {
+        strings_.erase(strings_.find(node->first));
+    }
+}
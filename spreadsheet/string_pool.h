@@ -0,0 +1,62 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+// Пул строк с подсчётом ссылок: одинаковые строки хранятся в одном экземпляре и
+// удаляются из пула вместе с последней ссылкой на них. Ссылки на одну строку пула
+// равны, поэтому строки сравниваются по ссылке, без сравнения символов.
+// Ссылки не должны пережить пул; пул и его ссылки не потокобезопасны
+class StringPool {
+private:
+    struct Entry {
+        StringPool* pool;
+        size_t refs;
+    };
+    using Node = std::unordered_map<std::string, Entry>::value_type;
+
+public:
+    // Ссылка на строку пула (пустая ссылка - пустая строка)
+    class Handle {
+    public:
+        Handle() = default;
+        Handle(const Handle& other);
+        Handle(Handle&& other) noexcept;
+        Handle& operator=(Handle other) noexcept;
+        ~Handle();
+
+        std::string_view Get() const { return node_ ? std::string_view(node_->first) : std::string_view(); }
+        // Количество ссылок на строку (0 для пустой ссылки)
+        size_t GetRefCount() const { return node_ ? node_->second.refs : 0; }
+        // Память, которую строка занимает в пуле (узел хэш-таблицы и блок строки)
+        size_t GetPooledSize() const;
+
+        bool operator==(const Handle& other) const { return node_ == other.node_; }
+        bool operator!=(const Handle& other) const { return node_ != other.node_; }
+
+    private:
+        friend class StringPool;
+        explicit Handle(Node* node);
+
+    private:
+        Node* node_ = nullptr;
+    };
+
+    StringPool() = default;
+    StringPool(const StringPool&) = delete;
+    StringPool& operator=(const StringPool&) = delete;
+
+    // Ссылка на строку text (для пустой строки - пустая ссылка)
+    Handle Intern(std::string text);
+    // Количество различных строк пула
+    size_t GetSize() const { return strings_.size(); }
+
+private:
+    void Release(Node* node);
+
+private:
+    // Строка - число ссылок на неё (узлы не перемещаются при росте таблицы)
+    std::unordered_map<std::string, Entry> strings_;
+};
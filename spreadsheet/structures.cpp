@@ -1,12 +1,10 @@
 #include "common.h"
 
-#include <cctype>
-#include <sstream>
 #include <algorithm>
+#include <charconv>
+#include <tuple>
 
-const int LETTERS = 26;
-const int MAX_POSITION_LENGTH = 17;
-const int MAX_POS_LETTER_COUNT = 3;
+const size_t MAX_POS_LETTER_COUNT = 3;
 
 const Position Position::NONE = {-1, -1};
 
@@ -18,56 +16,98 @@ bool Position::operator<(const Position rhs) const {
     return std::tie(row, col) < std::tie(rhs.row, rhs.col);
 }
 
-bool Position::IsValid() const {
-    return row >= 0 && col >= 0 && row < MAX_ROWS && col < MAX_COLS;
+bool CellReference::operator==(const CellReference& rhs) const {
+    return pos == rhs.pos && sheet == rhs.sheet;
 }
 
-std::string Position::ToString() const {
-    if (!IsValid()) {
-        return "";
+bool CellReference::operator<(const CellReference& rhs) const {
+    return std::tie(sheet, pos) < std::tie(rhs.sheet, rhs.pos);
+}
+
+std::string CellReference::ToString() const {
+    if (sheet.empty()) {
+        return pos.ToString();
     }
+    return sheet + SHEET_SEPARATOR + pos.ToString();
+}
 
-    std::string result;
-    result.reserve(MAX_POSITION_LENGTH);
-    int c = col;
-    while (c >= 0) {
-        result.insert(result.begin(), 'A' + c % LETTERS);
-        c = c / LETTERS - 1;
+CellReference CellReference::FromString(std::string_view str) {
+    auto separator = str.rfind(SHEET_SEPARATOR);
+    if (separator == std::string_view::npos) {
+        return {{}, Position::FromString(str)};
     }
+    return {std::string(str.substr(0, separator)), Position::FromString(str.substr(separator + 1))};
+}
 
-    result += std::to_string(row + 1);
+bool CellRange::operator==(const CellRange& rhs) const {
+    return first == rhs.first && last == rhs.last && sheet == rhs.sheet;
+}
 
-    return result;
+bool CellRange::Contains(Position pos) const {
+    return first.row <= pos.row && pos.row <= last.row && first.col <= pos.col && pos.col <= last.col;
 }
 
-Position Position::FromString(std::string_view str) {
-    auto it = std::find_if(str.begin(), str.end(), [](const char c) {
-        return !(std::isalpha(c) && std::isupper(c));
-    });
-    auto letters = str.substr(0, it - str.begin());
-    auto digits = str.substr(it - str.begin());
+std::string CellRange::ToString() const {
+    auto range = first.ToString() + RANGE_SEPARATOR + last.ToString();
+    if (sheet.empty()) {
+        return range;
+    }
+    return sheet + CellReference::SHEET_SEPARATOR + range;
+}
 
-    if (letters.empty() || digits.empty()) {
-        return Position::NONE;
+CellRange CellRange::FromString(std::string_view str) {
+    CellRange range;
+    auto separator = str.rfind(CellReference::SHEET_SEPARATOR);
+    if (separator != std::string_view::npos) {
+        range.sheet = std::string(str.substr(0, separator));
+        str.remove_prefix(separator + 1);
     }
-    if (letters.size() > MAX_POS_LETTER_COUNT) {
-        return Position::NONE;
+    auto corner_separator = str.find(RANGE_SEPARATOR);
+    if (corner_separator == std::string_view::npos) {
+        range.first = range.last = Position::NONE;
+        return range;
     }
-
-    if (!std::isdigit(digits[0])) {
-        return Position::NONE;
+    auto first = Position::FromString(str.substr(0, corner_separator));
+    auto last = Position::FromString(str.substr(corner_separator + 1));
+    if (!first.IsValid() || !last.IsValid()) {
+        range.first = range.last = Position::NONE;
+        return range;
     }
+    range.first = {std::min(first.row, last.row), std::min(first.col, last.col)};
+    range.last = {std::max(first.row, last.row), std::max(first.col, last.col)};
+    return range;
+}
+
+std::string Position::ToString() const {
+    char buffer[MAX_STRING_LENGTH];
+    return std::string(buffer, ToChars(buffer));
+}
 
-    int row;
-    std::istringstream row_in{std::string{digits}};
-    if (!(row_in >> row) || !row_in.eof()) {
+Position Position::FromString(std::string_view str) {
+    auto is_letter = [](char c) {
+        return c >= 'A' && c <= 'Z';
+    };
+    auto is_digit = [](char c) {
+        return c >= '0' && c <= '9';
+    };
+
+    int col = 0;
+    size_t letter_count = 0;
+    for (; letter_count < str.size() && is_letter(str[letter_count]); ++letter_count) {
+        if (letter_count == MAX_POS_LETTER_COUNT) {
+            return Position::NONE;
+        }
+        col = col * position_codec::LETTERS + (str[letter_count] - 'A' + 1);
+    }
+    if (letter_count == 0 || letter_count == str.size() || !is_digit(str[letter_count])) {
         return Position::NONE;
     }
 
-    int col = 0;
-    for (char ch : letters) {
-        col *= LETTERS;
-        col += ch - 'A' + 1;
+    int row = 0;
+    const char* end = str.data() + str.size();
+    auto [ptr, error] = std::from_chars(str.data() + letter_count, end, row);
+    if (error != std::errc{} || ptr != end) {
+        return Position::NONE;
     }
 
     return {row - 1, col - 1};
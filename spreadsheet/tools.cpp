@@ -0,0 +1,84 @@
+#include "tools.h"
+
+#include "benchmark.h"
+#include "dependency_analysis.h"
+#include "sheet.h"
+#include "trace.h"
+
+#include <fstream>
+#include <iostream>
+#include <string>
+
+using namespace std::literals;
+
+namespace {
+
+int Analyze(const std::string& file_name) {
+    std::ifstream input(file_name);
+    if (!input) {
+        std::cerr << "cannot open file: "sv << file_name << std::endl;
+        return 1;
+    }
+
+    Sheet sheet;
+    LoadTexts(input, sheet);
+    std::cout << AnalyzeDependencies(sheet);
+    std::cout << sheet.GetMemoryUsage(MemoryUsageMode::Exact);
+    return 0;
+}
+
+int Replay(const std::string& file_name) {
+    std::ifstream input(file_name, std::ios::binary);
+    if (!input) {
+        std::cerr << "cannot open file: "sv << file_name << std::endl;
+        return 1;
+    }
+
+    auto sheet = CreateSheet();
+    try {
+        std::cout << ReplayTrace(input, *sheet);
+    } catch (const std::runtime_error& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+}  // namespace
+
+void LoadTexts(std::istream& input, SheetInterface& sheet) {
+    std::string line;
+    for (int row = 0; std::getline(input, line); ++row) {
+        int col = 0;
+        size_t begin = 0;
+        while (begin <= line.size()) {
+            size_t end = line.find('\t', begin);
+            if (end == std::string::npos) {
+                end = line.size();
+            }
+            if (end != begin) {
+                sheet.SetCell({row, col}, line.substr(begin, end - begin));
+            }
+            begin = end + 1;
+            ++col;
+        }
+    }
+}
+
+int RunTool(int argc, char* argv[]) {
+    std::string mode = argv[1];
+    if (mode == "analyze"sv && argc == 3) {
+        return Analyze(argv[2]);
+    }
+    if (mode == "replay"sv && argc == 3) {
+        return Replay(argv[2]);
+    }
+    if (mode == "bench"sv && argc == 3) {
+        return RunBenchmark(argv[2]);
+    }
+
+    std::cerr << "usage: "sv << argv[0] << " analyze <file>"sv << std::endl;
+    std::cerr << "       "sv << argv[0] << " replay <trace>"sv << std::endl;
+    std::cerr << "       "sv << argv[0] << " bench <name>"sv << std::endl;
+    return 1;
+}
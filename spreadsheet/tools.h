@@ -0,0 +1,17 @@
+#pragma once
+
+#include "common.h"
+
+#include <iosfwd>
+
+// Заполняет таблицу из потока в формате PrintTexts():
+// столбцы разделены табуляцией, строки - переводом строки, пустые ячейки пропускаются.
+void LoadTexts(std::istream& input, SheetInterface& sheet);
+
+// Режимы командной строки:
+//   spreadsheet analyze <file>  - отчёт о графе зависимостей таблицы из файла в формате PrintTexts()
+//   spreadsheet replay <trace>  - воспроизведение трассы (см. trace.h) на пустой таблице
+//                                 и гистограммы задержек операций
+//   spreadsheet bench <name>    - бенчмарк (см. benchmark.h)
+// Возвращает код завершения программы.
+int RunTool(int argc, char* argv[]);
@@ -0,0 +1,334 @@
+#include "trace.h"
+
+#include <cctype>
+#include <iostream>
+#include <streambuf>
+#include <string>
+
+using namespace std::literals;
+
+namespace {
+
+void WriteVarint(std::ostream& output, uint64_t value) {
+    while (value >= 0x80) {
+        output.put(static_cast<char>((value & 0x7F) | 0x80));
+        value >>= 7;
+    }
+    output.put(static_cast<char>(value));
+}
+
+bool ReadVarint(std::istream& input, uint64_t& value) {
+    value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        int byte = input.get();
+        if (byte == std::char_traits<char>::eof()) {
+            return false;
+        }
+        value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Буфер, который принимает и отбрасывает весь вывод (форматирование при этом выполняется)
+class DiscardBuffer : public std::streambuf {
+protected:
+    int_type overflow(int_type ch) override {
+        return ch;
+    }
+
+    std::streamsize xsputn(const char* /* s */, std::streamsize count) override {
+        return count;
+    }
+};
+
+std::string Anonymize(std::string text) {
+    if (!text.empty() && text.front() == FORMULA_SIGN && text.size() > 1) {
+        return text;
+    }
+    for (auto& ch : text) {
+        if (std::isalpha(static_cast<unsigned char>(ch))) {
+            ch = 'x';
+        } else if (std::isdigit(static_cast<unsigned char>(ch))) {
+            ch = '1';
+        }
+    }
+    return text;
+}
+
+std::ostream& PrintLatency(std::ostream& output, std::chrono::nanoseconds latency) {
+    return output << std::chrono::duration<double, std::micro>(latency).count();
+}
+
+}  // namespace
+
+std::string_view ToString(TraceOperation operation) {
+    switch (operation) {
+        case TraceOperation::SetCell: return "SetCell"sv;
+        case TraceOperation::GetCell: return "GetCell"sv;
+        case TraceOperation::GetValue: return "GetValue"sv;
+        case TraceOperation::GetText: return "GetText"sv;
+        case TraceOperation::ClearCell: return "ClearCell"sv;
+        case TraceOperation::PrintValues: return "PrintValues"sv;
+        case TraceOperation::PrintTexts: return "PrintTexts"sv;
+        default: break;
+    }
+    return ""sv;
+}
+
+TraceWriter::TraceWriter(std::ostream& output) :
+    output_(output)
+{
+    output_.write(TRACE_MAGIC.data(), TRACE_MAGIC.size());
+}
+
+void TraceWriter::Write(const TraceRecord& record) {
+    output_.put(static_cast<char>(record.operation));
+    WriteVarint(output_, (record.time - last_time_).count());
+    last_time_ = record.time;
+    // Позиции сдвинуты на единицу, чтобы Position::NONE кодировалась нулём
+    WriteVarint(output_, record.pos.row + 1);
+    WriteVarint(output_, record.pos.col + 1);
+    if (record.operation == TraceOperation::SetCell) {
+        WriteVarint(output_, record.text.size());
+        output_.write(record.text.data(), record.text.size());
+    }
+}
+
+TraceReader::TraceReader(std::istream& input) :
+    input_(input)
+{
+    std::string magic(TRACE_MAGIC.size(), '\0');
+    if (!input_.read(magic.data(), magic.size()) || magic != TRACE_MAGIC) {
+        throw std::runtime_error("not a spreadsheet trace"s);
+    }
+}
+
+bool TraceReader::Read(TraceRecord& record) {
+    int operation = input_.get();
+    if (operation == std::char_traits<char>::eof()) {
+        return false;
+    }
+    if (operation >= static_cast<int>(TraceOperation::Count)) {
+        throw std::runtime_error("corrupted trace: unknown operation"s);
+    }
+    record.operation = static_cast<TraceOperation>(operation);
+
+    uint64_t time_delta = 0;
+    uint64_t row = 0;
+    uint64_t col = 0;
+    if (!ReadVarint(input_, time_delta) || !ReadVarint(input_, row) || !ReadVarint(input_, col)) {
+        throw std::runtime_error("corrupted trace: truncated record"s);
+    }
+    last_time_ += std::chrono::microseconds(time_delta);
+    record.time = last_time_;
+    record.pos = {static_cast<int>(row) - 1, static_cast<int>(col) - 1};
+
+    record.text.clear();
+    if (record.operation == TraceOperation::SetCell) {
+        uint64_t size = 0;
+        if (!ReadVarint(input_, size)) {
+            throw std::runtime_error("corrupted trace: truncated record"s);
+        }
+        record.text.resize(size);
+        if (!input_.read(record.text.data(), size)) {
+            throw std::runtime_error("corrupted trace: truncated text"s);
+        }
+    }
+    return true;
+}
+
+// Обёртка ячейки, записывающая чтение её значения и текста
+class RecordingSheet::RecordingCell : public CellInterface {
+public:
+    RecordingCell(const RecordingSheet& sheet, Position pos) :
+        sheet_(sheet),
+        pos_(pos)
+    {}
+
+    void SetCell(const CellInterface* cell) {
+        cell_ = cell;
+    }
+
+    Value GetValue() const override {
+        sheet_.Record(TraceOperation::GetValue, pos_);
+        return cell_->GetValue();
+    }
+
+    std::string GetText() const override {
+        sheet_.Record(TraceOperation::GetText, pos_);
+        return cell_->GetText();
+    }
+
+    std::vector<Position> GetReferencedCells() const override {
+        return cell_->GetReferencedCells();
+    }
+
+private:
+    const RecordingSheet& sheet_;
+    Position pos_;
+    const CellInterface* cell_ = nullptr;
+};
+
+RecordingSheet::RecordingSheet(SheetInterface& sheet, std::ostream& trace, bool anonymize) :
+    sheet_(sheet),
+    writer_(trace),
+    anonymize_(anonymize),
+    start_(std::chrono::steady_clock::now())
+{}
+
+RecordingSheet::~RecordingSheet() = default;
+
+void RecordingSheet::SetCell(Position pos, std::string text) {
+    Record(TraceOperation::SetCell, pos, anonymize_ ? Anonymize(text) : text);
+    sheet_.SetCell(pos, std::move(text));
+}
+
+const CellInterface* RecordingSheet::GetCell(Position pos) const {
+    Record(TraceOperation::GetCell, pos);
+    return WrapCell(pos, sheet_.GetCell(pos));
+}
+
+CellInterface* RecordingSheet::GetCell(Position pos) {
+    Record(TraceOperation::GetCell, pos);
+    return WrapCell(pos, sheet_.GetCell(pos));
+}
+
+void RecordingSheet::ClearCell(Position pos) {
+    Record(TraceOperation::ClearCell, pos);
+    sheet_.ClearCell(pos);
+}
+
+Size RecordingSheet::GetPrintableSize() const {
+    return sheet_.GetPrintableSize();
+}
+
+void RecordingSheet::PrintValues(std::ostream& output) const {
+    Record(TraceOperation::PrintValues);
+    sheet_.PrintValues(output);
+}
+
+void RecordingSheet::PrintTexts(std::ostream& output) const {
+    Record(TraceOperation::PrintTexts);
+    sheet_.PrintTexts(output);
+}
+
+void RecordingSheet::Record(TraceOperation operation, Position pos, std::string text) const {
+    auto time = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start_);
+    writer_.Write({operation, time, pos, std::move(text)});
+}
+
+CellInterface* RecordingSheet::WrapCell(Position pos, const CellInterface* cell) const {
+    if (!cell) {
+        return nullptr;
+    }
+    auto& wrapper = cells_[pos];
+    if (!wrapper) {
+        wrapper = std::make_unique<RecordingCell>(*this, pos);
+    }
+    wrapper->SetCell(cell);
+    return wrapper.get();
+}
+
+void LatencyHistogram::Add(std::chrono::nanoseconds latency) {
+    int bucket = 0;
+    for (auto value = latency.count(); value > 1 && bucket < BUCKET_COUNT - 1; value >>= 1) {
+        ++bucket;
+    }
+    ++buckets[bucket];
+    ++count;
+    total += latency;
+    max = std::max(max, latency);
+}
+
+std::chrono::nanoseconds LatencyHistogram::Percentile(double percentile) const {
+    uint64_t threshold = static_cast<uint64_t>(percentile / 100.0 * count);
+    uint64_t seen = 0;
+    for (int i = 0; i < BUCKET_COUNT; ++i) {
+        seen += buckets[i];
+        if (seen > threshold || seen == count) {
+            return std::min(max, std::chrono::nanoseconds(int64_t{2} << i));
+        }
+    }
+    return max;
+}
+
+ReplayReport ReplayTrace(std::istream& trace, SheetInterface& sheet) {
+    TraceReader reader(trace);
+    ReplayReport report;
+    DiscardBuffer discard_buffer;
+    std::ostream discard(&discard_buffer);
+
+    TraceRecord record;
+    while (reader.Read(record)) {
+        auto& histogram = report.operations[static_cast<size_t>(record.operation)];
+        auto start = std::chrono::steady_clock::now();
+        try {
+            switch (record.operation) {
+                case TraceOperation::SetCell: sheet.SetCell(record.pos, record.text); break;
+                case TraceOperation::GetCell: sheet.GetCell(record.pos); break;
+                case TraceOperation::GetValue: {
+                    if (auto cell = sheet.GetCell(record.pos)) {
+                        cell->GetValue();
+                    }
+                    break;
+                }
+                case TraceOperation::GetText: {
+                    if (auto cell = sheet.GetCell(record.pos)) {
+                        cell->GetText();
+                    }
+                    break;
+                }
+                case TraceOperation::ClearCell: sheet.ClearCell(record.pos); break;
+                case TraceOperation::PrintValues: sheet.PrintValues(discard); break;
+                case TraceOperation::PrintTexts: sheet.PrintTexts(discard); break;
+                default: break;
+            }
+        } catch (const std::exception&) {
+            // В исходной нагрузке операция тоже завершилась ошибкой
+            ++histogram.errors;
+        }
+        auto latency = std::chrono::steady_clock::now() - start;
+        histogram.Add(latency);
+        report.total_time += latency;
+    }
+    return report;
+}
+
+std::ostream& operator<<(std::ostream& output, const ReplayReport& report) {
+    output << "operation\tcount\terrors\tmean(us)\tp50(us)\tp90(us)\tp99(us)\tmax(us)\n";
+    for (size_t i = 0; i < report.operations.size(); ++i) {
+        const auto& histogram = report.operations[i];
+        if (histogram.count == 0) {
+            continue;
+        }
+        output << ToString(static_cast<TraceOperation>(i)) << '\t' << histogram.count << '\t' << histogram.errors << '\t';
+        PrintLatency(output, histogram.total / histogram.count) << '\t';
+        PrintLatency(output, histogram.Percentile(50)) << '\t';
+        PrintLatency(output, histogram.Percentile(90)) << '\t';
+        PrintLatency(output, histogram.Percentile(99)) << '\t';
+        PrintLatency(output, histogram.max) << '\n';
+    }
+
+    output << "\nhistograms (us):\n";
+    for (size_t i = 0; i < report.operations.size(); ++i) {
+        const auto& histogram = report.operations[i];
+        if (histogram.count == 0) {
+            continue;
+        }
+        output << ToString(static_cast<TraceOperation>(i)) << ":\n";
+        for (int bucket = 0; bucket < LatencyHistogram::BUCKET_COUNT; ++bucket) {
+            if (histogram.buckets[bucket] == 0) {
+                continue;
+            }
+            output << "\t[";
+            PrintLatency(output, std::chrono::nanoseconds(int64_t{1} << bucket)) << ", ";
+            PrintLatency(output, std::chrono::nanoseconds(int64_t{2} << bucket)) << ")\t" << histogram.buckets[bucket] << '\n';
+        }
+    }
+    output << "total replay time (us): ";
+    PrintLatency(output, report.total_time) << '\n';
+    return output;
+}
@@ -0,0 +1,125 @@
+#pragma once
+
+#include "common.h"
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <iosfwd>
+#include <map>
+
+// Запись и воспроизведение нагрузки на таблицу.
+// Трасса - компактный бинарный поток операций над SheetInterface с отметками времени:
+// заголовок TRACE_MAGIC, затем записи вида
+//   <операция: 1 байт> <время от предыдущей записи, мкс: varint> <строка: varint> <столбец: varint>
+//   [<длина текста: varint> <текст>]  - только для SetCell
+// Числа кодируются в формате LEB128.
+
+inline constexpr std::string_view TRACE_MAGIC = "SPTRACE1";
+
+enum class TraceOperation : uint8_t {
+    SetCell,
+    GetCell,
+    GetValue,
+    GetText,
+    ClearCell,
+    PrintValues,
+    PrintTexts,
+    Count,
+};
+
+std::string_view ToString(TraceOperation operation);
+
+struct TraceRecord {
+    TraceOperation operation = TraceOperation::GetCell;
+    // Время от начала записи трассы
+    std::chrono::microseconds time{};
+    Position pos;
+    std::string text;
+};
+
+class TraceWriter {
+public:
+    explicit TraceWriter(std::ostream& output);
+
+    void Write(const TraceRecord& record);
+
+private:
+    std::ostream& output_;
+    std::chrono::microseconds last_time_{};
+};
+
+class TraceReader {
+public:
+    // Бросает std::runtime_error, если поток не является трассой
+    explicit TraceReader(std::istream& input);
+
+    // Возвращает false, если записи закончились
+    bool Read(TraceRecord& record);
+
+private:
+    std::istream& input_;
+    std::chrono::microseconds last_time_{};
+};
+
+// Таблица-обёртка: передаёт все вызовы в исходную таблицу и записывает их в трассу.
+// Если anonymize = true, в текстовых ячейках буквы заменяются на 'x', а цифры на '1'
+// (формулы сохраняются как есть), поэтому трассу можно передавать без данных клиента.
+class RecordingSheet : public SheetInterface {
+public:
+    RecordingSheet(SheetInterface& sheet, std::ostream& trace, bool anonymize = false);
+    ~RecordingSheet();
+
+    void SetCell(Position pos, std::string text) override;
+
+    const CellInterface* GetCell(Position pos) const override;
+    CellInterface* GetCell(Position pos) override;
+
+    void ClearCell(Position pos) override;
+
+    Size GetPrintableSize() const override;
+
+    void PrintValues(std::ostream& output) const override;
+    void PrintTexts(std::ostream& output) const override;
+
+private:
+    class RecordingCell;
+
+    void Record(TraceOperation operation, Position pos = Position::NONE, std::string text = {}) const;
+    CellInterface* WrapCell(Position pos, const CellInterface* cell) const;
+
+private:
+    SheetInterface& sheet_;
+    mutable TraceWriter writer_;
+    bool anonymize_;
+    std::chrono::steady_clock::time_point start_;
+    // Обёртки ячеек, выданные через GetCell (для записи GetValue/GetText)
+    mutable std::map<Position, std::unique_ptr<RecordingCell>> cells_;
+};
+
+// Гистограмма задержек операции: корзина i содержит задержки из [2^i, 2^(i+1)) нс
+// (последняя корзина - все задержки от 2^47 нс, это около 39 часов)
+struct LatencyHistogram {
+    static const int BUCKET_COUNT = 48;
+
+    std::array<uint64_t, BUCKET_COUNT> buckets{};
+    uint64_t count = 0;
+    // Операции, завершившиеся исключением (например, FormulaException)
+    uint64_t errors = 0;
+    std::chrono::nanoseconds total{};
+    std::chrono::nanoseconds max{};
+
+    void Add(std::chrono::nanoseconds latency);
+    // Верхняя граница корзины, в которую попадает заданный перцентиль
+    std::chrono::nanoseconds Percentile(double percentile) const;
+};
+
+struct ReplayReport {
+    std::array<LatencyHistogram, static_cast<size_t>(TraceOperation::Count)> operations;
+    std::chrono::nanoseconds total_time{};
+};
+
+// Выполняет операции трассы над таблицей (без соблюдения исходных пауз между ними)
+ReplayReport ReplayTrace(std::istream& trace, SheetInterface& sheet);
+
+std::ostream& operator<<(std::ostream& output, const ReplayReport& report);
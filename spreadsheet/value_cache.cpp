@@ -0,0 +1,90 @@
+#include "value_cache.h"
+
+#include <algorithm>
+#include <cassert>
+
+void ValueCache::SetLimit(size_t max_bytes) {
+    max_entries_ = max_bytes == 0 ? 0 : std::max<size_t>(max_bytes / sizeof(Entry), 1);
+    if (evaluation_depth_ == 0) {
+        Trim();
+    }
+}
+
+void ValueCache::Store(Slot* owner_slot, Value value, uint8_t cost) {
+    cost = std::clamp<uint8_t>(cost, 1, MAX_COST);
+    Slot slot = *owner_slot;
+    if (!IsStored(slot)) {
+        if (!free_slots_.empty()) {
+            slot = free_slots_.back();
+            free_slots_.pop_back();
+        } else {
+            assert(entries_.size() < EVICTED);
+            slot = static_cast<Slot>(entries_.size());
+            entries_.emplace_back();
+        }
+        *owner_slot = slot;
+    }
+    entries_[slot] = {value, owner_slot, cost, cost};
+    if (evaluation_depth_ == 0) {
+        Trim();
+    }
+}
+
+ValueCache::Value ValueCache::Get(Slot slot) {
+    auto& entry = entries_[slot];
+    entry.credit = entry.cost;
+    return entry.value;
+}
+
+void ValueCache::Release(Slot slot) {
+    if (!IsStored(slot)) {
+        return;
+    }
+    entries_[slot].owner_slot = nullptr;
+    free_slots_.push_back(slot);
+}
+
+void ValueCache::Trim() {
+    if (max_entries_ == 0) {
+        return;
+    }
+    while (GetSize() > max_entries_) {
+        if (hand_ >= entries_.size()) {
+            hand_ = 0;
+        }
+        auto& entry = entries_[hand_];
+        if (entry.owner_slot) {
+            if (entry.credit > 0) {
+                --entry.credit;
+            } else {
+                *entry.owner_slot = EVICTED;
+                Release(static_cast<Slot>(hand_));
+                ++evicted_count_;
+            }
+        }
+        ++hand_;
+    }
+    // После вычисления, превысившего ограничение, массив возвращает лишнюю память
+    if (entries_.size() > 2 * max_entries_) {
+        Compact();
+    }
+}
+
+void ValueCache::Compact() {
+    size_t size = 0;
+    for (size_t i = 0; i < entries_.size(); ++i) {
+        if (!entries_[i].owner_slot) {
+            continue;
+        }
+        if (i != size) {
+            entries_[size] = entries_[i];
+            *entries_[size].owner_slot = static_cast<Slot>(size);
+        }
+        ++size;
+    }
+    entries_.resize(size);
+    entries_.shrink_to_fit();
+    free_slots_.clear();
+    free_slots_.shrink_to_fit();
+    hand_ = 0;
+}
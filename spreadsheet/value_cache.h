@@ -0,0 +1,101 @@
+#pragma once
+
+#include "formula.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+// Кэш значений формул таблицы с ограничением памяти (см. Sheet::SetValueCacheLimit).
+// Значения хранятся в общем массиве записей, а формула хранит только номер своей записи.
+// При ограничении записи вытесняются алгоритмом CLOCK с весами: при записи и чтении
+// значение получает столько "жизней", сколько стоит повторное вычисление формулы, стрелка
+// часов отнимает по одной и вытесняет значение без жизней. Номер записи владельца при этом
+// заменяется на EVICTED: значение действительно, но должно быть вычислено заново.
+// Пока вычисляется значение (см. Evaluation), записи не вытесняются, так как формулы читают
+// только что вычисленные значения: на время вычисления ограничение может быть превышено
+// на число вычисленных при нём формул. Кэш не потокобезопасен
+class ValueCache {
+public:
+    using Value = FormulaInterface::Value;
+    // Номер записи значения
+    using Slot = uint32_t;
+    // Значения нет
+    static constexpr Slot NO_SLOT = std::numeric_limits<Slot>::max();
+    // Значение вытеснено из кэша
+    static constexpr Slot EVICTED = NO_SLOT - 1;
+    // Наибольшая стоимость вычисления значения
+    static constexpr uint8_t MAX_COST = 15;
+
+    static bool IsStored(Slot slot) { return slot < EVICTED; }
+
+    // Вычисление значения: записи вытесняются по завершении самого внешнего вычисления
+    class Evaluation {
+    public:
+        explicit Evaluation(ValueCache& cache) :
+            cache_(cache)
+        {
+            ++cache_.evaluation_depth_;
+        }
+        Evaluation(const Evaluation&) = delete;
+        Evaluation& operator=(const Evaluation&) = delete;
+        ~Evaluation() {
+            if (--cache_.evaluation_depth_ == 0) {
+                cache_.Trim();
+            }
+        }
+
+    private:
+        ValueCache& cache_;
+    };
+
+    ValueCache() = default;
+    ValueCache(const ValueCache&) = delete;
+    ValueCache& operator=(const ValueCache&) = delete;
+
+    // Ограничение памяти записей в байтах (0 - без ограничения)
+    void SetLimit(size_t max_bytes);
+    size_t GetLimit() const { return max_entries_ * sizeof(Entry); }
+
+    // Сохраняет значение формулы в записи *owner_slot (новой, если у формулы нет записи);
+    // cost - стоимость вычисления (1..MAX_COST). Адрес owner_slot не должен меняться, пока
+    // запись существует
+    void Store(Slot* owner_slot, Value value, uint8_t cost);
+    // Значение записи (чтение продлевает жизнь записи)
+    Value Get(Slot slot);
+    // Освобождает запись (номер без записи игнорируется)
+    void Release(Slot slot);
+
+    // Количество значений в кэше и количество вытесненных значений за всё время
+    size_t GetSize() const { return entries_.size() - free_slots_.size(); }
+    size_t GetEvictedCount() const { return evicted_count_; }
+    // Память массива записей
+    size_t GetMemoryUsage() const {
+        return entries_.capacity() * sizeof(Entry) + free_slots_.capacity() * sizeof(Slot);
+    }
+
+private:
+    struct Entry {
+        Value value;
+        // Номер записи у владельца (nullptr - свободная запись)
+        Slot* owner_slot = nullptr;
+        uint8_t cost = 0;
+        uint8_t credit = 0;
+    };
+
+    // Вытесняет значения сверх ограничения
+    void Trim();
+    // Переносит записи в начало массива и возвращает память свободных записей
+    void Compact();
+
+private:
+    std::vector<Entry> entries_;
+    std::vector<Slot> free_slots_;
+    // Наибольшее количество записей (0 - без ограничения)
+    size_t max_entries_ = 0;
+    // Стрелка часов
+    size_t hand_ = 0;
+    size_t evicted_count_ = 0;
+    int evaluation_depth_ = 0;
+};
@@ -0,0 +1,582 @@
+#include "wal.h"
+
+#include "sheet.h"
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <system_error>
+#include <unordered_map>
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#include <sys/stat.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+using namespace std::literals;
+
+namespace fs = std::filesystem;
+
+namespace {
+
+const char* const LOG_FILE_NAME = "wal";
+const char* const CHECKPOINT_FILE_NAME = "checkpoint";
+const char* const CHECKPOINT_TEMP_FILE_NAME = "checkpoint.tmp";
+
+const size_t CRC_SIZE = 4;
+
+// Таблица CRC-32 (полином 0xEDB88320, как в zlib)
+constexpr auto CRC32_TABLE = [] {
+    std::array<uint32_t, 256> table{};
+    for (uint32_t i = 0; i < 256; ++i) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; ++bit) {
+            crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320u : crc >> 1;
+        }
+        table[i] = crc;
+    }
+    return table;
+}();
+
+uint32_t Crc32(std::string_view data) {
+    uint32_t crc = 0xFFFFFFFFu;
+    for (unsigned char ch : data) {
+        crc = CRC32_TABLE[(crc ^ ch) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+void AppendVarint(std::string& output, uint64_t value) {
+    while (value >= 0x80) {
+        output.push_back(static_cast<char>((value & 0x7F) | 0x80));
+        value >>= 7;
+    }
+    output.push_back(static_cast<char>(value));
+}
+
+bool ReadVarint(std::string_view& input, uint64_t& value) {
+    value = 0;
+    for (int shift = 0; shift < 64 && !input.empty(); shift += 7) {
+        auto byte = static_cast<unsigned char>(input.front());
+        input.remove_prefix(1);
+        value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool ReadPosition(std::string_view& input, Position& pos) {
+    uint64_t row = 0;
+    uint64_t col = 0;
+    if (!ReadVarint(input, row) || !ReadVarint(input, col)
+        || row >= static_cast<uint64_t>(Position::MAX_ROWS) || col >= static_cast<uint64_t>(Position::MAX_COLS)) {
+        return false;
+    }
+    pos = {static_cast<int>(row), static_cast<int>(col)};
+    return true;
+}
+
+bool ReadText(std::string_view& input, std::string_view& text) {
+    uint64_t size = 0;
+    if (!ReadVarint(input, size) || size > input.size()) {
+        return false;
+    }
+    text = input.substr(0, size);
+    input.remove_prefix(size);
+    return true;
+}
+
+// Дописывает CRC-32 данных output, начиная с позиции begin
+void AppendCrc(std::string& output, size_t begin) {
+    uint32_t crc = Crc32(std::string_view(output).substr(begin));
+    for (size_t i = 0; i < CRC_SIZE; ++i) {
+        output.push_back(static_cast<char>((crc >> (8 * i)) & 0xFF));
+    }
+}
+
+uint32_t ReadCrc(std::string_view input) {
+    uint32_t crc = 0;
+    for (size_t i = 0; i < CRC_SIZE; ++i) {
+        crc |= static_cast<uint32_t>(static_cast<unsigned char>(input[i])) << (8 * i);
+    }
+    return crc;
+}
+
+void AppendRecord(std::string& output, WalOperation operation, Position pos, std::string_view text) {
+    size_t begin = output.size();
+    output.push_back(static_cast<char>(operation));
+    AppendVarint(output, pos.row);
+    AppendVarint(output, pos.col);
+    if (operation == WalOperation::SetCell) {
+        AppendVarint(output, text.size());
+        output.append(text);
+    }
+    AppendCrc(output, begin);
+}
+
+// Читает запись из начала input и сдвигает input за неё.
+// Возвращает false, если запись неполна или повреждена (input не изменяется)
+bool ReadRecord(std::string_view& input, WalOperation& operation, Position& pos, std::string_view& text) {
+    std::string_view rest = input;
+    if (rest.empty() || static_cast<uint8_t>(rest.front()) > static_cast<uint8_t>(WalOperation::ClearCell)) {
+        return false;
+    }
+    operation = static_cast<WalOperation>(rest.front());
+    rest.remove_prefix(1);
+
+    if (!ReadPosition(rest, pos)) {
+        return false;
+    }
+
+    text = {};
+    if (operation == WalOperation::SetCell && !ReadText(rest, text)) {
+        return false;
+    }
+
+    if (rest.size() < CRC_SIZE) {
+        return false;
+    }
+    size_t length = input.size() - rest.size();
+    if (ReadCrc(rest) != Crc32(input.substr(0, length))) {
+        return false;
+    }
+    input.remove_prefix(length + CRC_SIZE);
+    return true;
+}
+
+// Читает содержимое ячеек из контрольной точки input без заголовка.
+// Возвращает false, если контрольная точка повреждена
+bool ReadCheckpoint(std::string_view input, std::map<Position, std::string>& cells) {
+    if (input.size() < CRC_SIZE || ReadCrc(input.substr(input.size() - CRC_SIZE))
+                                       != Crc32(input.substr(0, input.size() - CRC_SIZE))) {
+        return false;
+    }
+    input.remove_suffix(CRC_SIZE);
+
+    uint64_t text_count = 0;
+    if (!ReadVarint(input, text_count)) {
+        return false;
+    }
+    std::vector<std::string_view> dictionary;
+    dictionary.reserve(std::min<uint64_t>(text_count, input.size()));
+    for (uint64_t i = 0; i < text_count; ++i) {
+        std::string_view text;
+        if (!ReadText(input, text)) {
+            return false;
+        }
+        dictionary.push_back(text);
+    }
+
+    while (!input.empty()) {
+        Position pos;
+        uint64_t index = 0;
+        if (!ReadPosition(input, pos) || !ReadVarint(input, index) || index >= dictionary.size()) {
+            return false;
+        }
+        cells[pos] = dictionary[index];
+    }
+    return true;
+}
+
+std::string ReadFile(const fs::path& path) {
+    std::ifstream input(path, std::ios::binary);
+    if (!input) {
+        throw std::runtime_error("cannot open file: "s + path.string());
+    }
+    return std::string(std::istreambuf_iterator<char>(input), std::istreambuf_iterator<char>());
+}
+
+[[noreturn]] void ThrowSystemError(const std::string& what, const fs::path& path) {
+    throw std::system_error(errno, std::generic_category(), what + ": "s + path.string());
+}
+
+// Файловые операции POSIX (в Windows - их аналоги из CRT). Каталог при fsync
+// открывается только в POSIX: в Windows переименование фиксируется самой ОС
+
+int OpenFile(const fs::path& path, bool append) {
+#ifdef _WIN32
+    int flags = _O_WRONLY | _O_CREAT | _O_BINARY | (append ? _O_APPEND : _O_TRUNC);
+    int fd = _wopen(path.c_str(), flags, _S_IREAD | _S_IWRITE);
+#else
+    int flags = O_WRONLY | O_CREAT | O_CLOEXEC | (append ? O_APPEND : O_TRUNC);
+    int fd = open(path.c_str(), flags, 0644);
+#endif
+    if (fd < 0) {
+        ThrowSystemError("cannot open file"s, path);
+    }
+    return fd;
+}
+
+void WriteAll(int fd, std::string_view data, const fs::path& path) {
+    while (!data.empty()) {
+#ifdef _WIN32
+        auto written = _write(fd, data.data(), static_cast<unsigned>(std::min<size_t>(data.size(), 1 << 30)));
+#else
+        auto written = write(fd, data.data(), data.size());
+#endif
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            ThrowSystemError("cannot write file"s, path);
+        }
+        data.remove_prefix(static_cast<size_t>(written));
+    }
+}
+
+void SyncFile(int fd, const fs::path& path) {
+#ifdef _WIN32
+    int result = _commit(fd);
+#else
+    int result = fsync(fd);
+#endif
+    if (result != 0) {
+        ThrowSystemError("cannot sync file"s, path);
+    }
+}
+
+void TruncateFile(int fd, size_t size, const fs::path& path) {
+#ifdef _WIN32
+    int result = _chsize_s(fd, static_cast<__int64>(size));
+#else
+    int result = ftruncate(fd, static_cast<off_t>(size));
+#endif
+    if (result != 0) {
+        ThrowSystemError("cannot truncate file"s, path);
+    }
+}
+
+void CloseFile(int fd) {
+#ifdef _WIN32
+    _close(fd);
+#else
+    close(fd);
+#endif
+}
+
+// Фиксирует создание и переименование файлов каталога
+void SyncDirectory(const fs::path& directory) {
+#ifndef _WIN32
+    int fd = open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        ThrowSystemError("cannot open directory"s, directory);
+    }
+    int result = fsync(fd);
+    close(fd);
+    if (result != 0) {
+        ThrowSystemError("cannot sync directory"s, directory);
+    }
+#endif
+}
+
+// Записывает файл целиком и фиксирует его на диске
+void WriteFileDurably(const fs::path& path, std::string_view data) {
+    int fd = OpenFile(path, /* append = */ false);
+    try {
+        WriteAll(fd, data, path);
+        SyncFile(fd, path);
+    } catch (...) {
+        CloseFile(fd);
+        throw;
+    }
+    CloseFile(fd);
+}
+
+}  // namespace
+
+WriteAheadLog::WriteAheadLog(std::filesystem::path directory, WalOptions options) :
+    directory_(std::move(directory)),
+    options_(options)
+{
+    Recover();
+    committer_ = std::thread([this] {
+        RunCommitter();
+    });
+}
+
+WriteAheadLog::~WriteAheadLog() {
+    {
+        std::lock_guard lock(mutex_);
+        stopping_ = true;
+    }
+    committer_wakeup_.notify_one();
+    committer_.join();
+    CloseFile(log_fd_);
+}
+
+std::vector<std::pair<Position, std::string>> WriteAheadLog::TakeRecoveredCells() {
+    return std::move(recovered_cells_);
+}
+
+void WriteAheadLog::AppendSetCell(Position pos, std::string_view text) {
+    Append(WalOperation::SetCell, pos, text);
+}
+
+void WriteAheadLog::AppendClearCell(Position pos) {
+    Append(WalOperation::ClearCell, pos, {});
+}
+
+void WriteAheadLog::Append(WalOperation operation, Position pos, std::string_view text) {
+    std::unique_lock lock(mutex_);
+    ThrowIfFailed();
+    bool was_empty = pending_.empty();
+    AppendRecord(pending_, operation, pos, text);
+    uint64_t seq = ++appended_seq_;
+    ++record_count_;
+
+    bool sync = options_.durability == WalDurability::Sync;
+    if (sync || pending_.size() >= options_.max_batch_bytes) {
+        commit_requested_ = true;
+        committer_wakeup_.notify_one();
+    } else if (was_empty) {
+        // Фоновый поток начинает отсчёт commit_interval с первой записи пакета
+        committer_wakeup_.notify_one();
+    }
+    if (sync) {
+        committed_.wait(lock, [this, seq] {
+            return committed_seq_ >= seq || error_;
+        });
+        ThrowIfFailed();
+    }
+}
+
+void WriteAheadLog::Commit() {
+    std::unique_lock lock(mutex_);
+    uint64_t seq = appended_seq_;
+    if (committed_seq_ < seq) {
+        commit_requested_ = true;
+        committer_wakeup_.notify_one();
+        committed_.wait(lock, [this, seq] {
+            return committed_seq_ >= seq || error_;
+        });
+    }
+    ThrowIfFailed();
+}
+
+void WriteAheadLog::Checkpoint(const std::vector<std::pair<Position, std::string>>& cells) {
+    // После Commit фоновый поток не пишет в журнал, пока не будут добавлены новые записи
+    Commit();
+
+    // Каждый различный текст записывается в словарь один раз, ячейки ссылаются на него номером
+    std::unordered_map<std::string_view, uint64_t> text_indexes;
+    std::string dictionary;
+    std::string cell_entries;
+    for (const auto& [pos, text] : cells) {
+        auto [it, inserted] = text_indexes.emplace(text, text_indexes.size());
+        if (inserted) {
+            AppendVarint(dictionary, text.size());
+            dictionary.append(text);
+        }
+        AppendVarint(cell_entries, pos.row);
+        AppendVarint(cell_entries, pos.col);
+        AppendVarint(cell_entries, it->second);
+    }
+    std::string data(CHECKPOINT_MAGIC);
+    AppendVarint(data, text_indexes.size());
+    data += dictionary;
+    data += cell_entries;
+    AppendCrc(data, CHECKPOINT_MAGIC.size());
+
+    std::lock_guard lock(file_mutex_);
+    // Сбой до переименования оставляет прежнюю контрольную точку, сбой после него - новую
+    // контрольную точку и журнал, повторное применение которого к ней ничего не меняет
+    auto temp_path = directory_ / CHECKPOINT_TEMP_FILE_NAME;
+    WriteFileDurably(temp_path, data);
+    fs::rename(temp_path, directory_ / CHECKPOINT_FILE_NAME);
+    SyncDirectory(directory_);
+
+    auto log_path = directory_ / LOG_FILE_NAME;
+    TruncateFile(log_fd_, WAL_MAGIC.size(), log_path);
+    SyncFile(log_fd_, log_path);
+    record_count_ = 0;
+}
+
+void WriteAheadLog::Recover() {
+    fs::create_directories(directory_);
+
+    // Содержимое ячеек: запись журнала заменяет содержимое ячейки целиком, поэтому важно
+    // только последнее изменение каждой ячейки
+    std::map<Position, std::string> cells;
+    WalOperation operation = WalOperation::SetCell;
+    Position pos;
+    std::string_view text;
+
+    auto checkpoint_path = directory_ / CHECKPOINT_FILE_NAME;
+    if (fs::exists(checkpoint_path)) {
+        // Контрольная точка заменяется атомарно, поэтому повреждение - не последствие сбоя
+        auto data = ReadFile(checkpoint_path);
+        std::string_view input = data;
+        if (input.substr(0, CHECKPOINT_MAGIC.size()) != CHECKPOINT_MAGIC) {
+            throw std::runtime_error("not a spreadsheet checkpoint: "s + checkpoint_path.string());
+        }
+        if (!ReadCheckpoint(input.substr(CHECKPOINT_MAGIC.size()), cells)) {
+            throw std::runtime_error("corrupted checkpoint: "s + checkpoint_path.string());
+        }
+    }
+
+    auto log_path = directory_ / LOG_FILE_NAME;
+    size_t valid_size = 0;
+    if (fs::exists(log_path)) {
+        auto data = ReadFile(log_path);
+        std::string_view input = data;
+        // Заголовок, не дописанный до сбоя, равен началу WAL_MAGIC: журнал создаётся заново
+        if ((input.size() >= WAL_MAGIC.size() && input.substr(0, WAL_MAGIC.size()) != WAL_MAGIC)
+            || (input.size() < WAL_MAGIC.size() && WAL_MAGIC.substr(0, input.size()) != input)) {
+            throw std::runtime_error("not a spreadsheet write-ahead log: "s + log_path.string());
+        }
+        if (input.size() >= WAL_MAGIC.size()) {
+            input.remove_prefix(WAL_MAGIC.size());
+            while (ReadRecord(input, operation, pos, text)) {
+                if (operation == WalOperation::SetCell) {
+                    cells[pos] = text;
+                } else {
+                    cells.erase(pos);
+                }
+                ++record_count_;
+            }
+            // Остаток - запись, прерванная сбоем: новые записи добавляются вместо неё
+            valid_size = data.size() - input.size();
+            if (!input.empty()) {
+                fs::resize_file(log_path, valid_size);
+            }
+        }
+    }
+
+    recovered_cells_.assign(std::make_move_iterator(cells.begin()), std::make_move_iterator(cells.end()));
+
+    if (valid_size == 0) {
+        WriteFileDurably(log_path, WAL_MAGIC);
+        SyncDirectory(directory_);
+    }
+    log_fd_ = OpenFile(log_path, /* append = */ true);
+}
+
+void WriteAheadLog::RunCommitter() {
+    std::unique_lock lock(mutex_);
+    while (true) {
+        committer_wakeup_.wait(lock, [this] {
+            return stopping_ || !pending_.empty();
+        });
+        // Записи, добавленные за commit_interval, фиксируются вместе
+        committer_wakeup_.wait_for(lock, options_.commit_interval, [this] {
+            return stopping_ || commit_requested_;
+        });
+        if (pending_.empty()) {
+            if (stopping_) {
+                return;
+            }
+            continue;
+        }
+
+        std::string batch;
+        batch.swap(pending_);
+        uint64_t seq = appended_seq_;
+        commit_requested_ = false;
+        lock.unlock();
+        std::exception_ptr error;
+        try {
+            WriteBatch(batch);
+        } catch (...) {
+            error = std::current_exception();
+        }
+        lock.lock();
+
+        if (error) {
+            // После ошибки журнал мог остаться с пропуском записей: дальнейшие записи отклоняются
+            error_ = error;
+            committed_.notify_all();
+            return;
+        }
+        committed_seq_ = seq;
+        committed_.notify_all();
+    }
+}
+
+void WriteAheadLog::WriteBatch(const std::string& batch) {
+    std::lock_guard lock(file_mutex_);
+    auto log_path = directory_ / LOG_FILE_NAME;
+    WriteAll(log_fd_, batch, log_path);
+    if (options_.durability != WalDurability::Buffered) {
+        SyncFile(log_fd_, log_path);
+    }
+}
+
+void WriteAheadLog::ThrowIfFailed() {
+    if (error_) {
+        std::rethrow_exception(error_);
+    }
+}
+
+DurableSheet::DurableSheet(Sheet& sheet, std::filesystem::path directory, WalOptions options) :
+    sheet_(sheet),
+    log_(std::move(directory), options)
+{
+    sheet_.LoadCells(log_.TakeRecoveredCells());
+}
+
+void DurableSheet::SetCell(Position pos, std::string text) {
+    // В журнал попадают только изменения, принятые таблицей
+    sheet_.SetCell(pos, text);
+    log_.AppendSetCell(pos, text);
+    CheckpointIfNeeded();
+}
+
+const CellInterface* DurableSheet::GetCell(Position pos) const {
+    return sheet_.GetCell(pos);
+}
+
+CellInterface* DurableSheet::GetCell(Position pos) {
+    return sheet_.GetCell(pos);
+}
+
+void DurableSheet::ClearCell(Position pos) {
+    if (!sheet_.GetCell(pos)) {
+        return;
+    }
+    sheet_.ClearCell(pos);
+    log_.AppendClearCell(pos);
+    CheckpointIfNeeded();
+}
+
+Size DurableSheet::GetPrintableSize() const {
+    return sheet_.GetPrintableSize();
+}
+
+void DurableSheet::PrintValues(std::ostream& output) const {
+    sheet_.PrintValues(output);
+}
+
+void DurableSheet::PrintTexts(std::ostream& output) const {
+    sheet_.PrintTexts(output);
+}
+
+void DurableSheet::Commit() {
+    log_.Commit();
+}
+
+void DurableSheet::Checkpoint() {
+    std::vector<std::pair<Position, std::string>> cells;
+    sheet_.ForEachCell([&cells](Position pos, Cell& cell) {
+        if (!cell.IsEmpty()) {
+            cells.emplace_back(pos, cell.GetText());
+        }
+    });
+    std::sort(cells.begin(), cells.end());
+    log_.Checkpoint(cells);
+}
+
+void DurableSheet::CheckpointIfNeeded() {
+    size_t limit = log_.GetOptions().checkpoint_records;
+    if (limit != 0 && log_.GetRecordCount() >= limit) {
+        Checkpoint();
+    }
+}
@@ -0,0 +1,161 @@
+#pragma once
+
+#include "common.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+class Sheet;
+
+// Журнал упреждающей записи (write-ahead log) изменений таблицы.
+// Каталог журнала содержит два файла:
+//   checkpoint - снимок содержимого таблицы: заголовок CHECKPOINT_MAGIC, словарь текстов
+//                <количество текстов: varint> {<длина текста: varint> <текст>}, ячейки
+//                {<строка: varint> <столбец: varint> <номер текста в словаре: varint>}
+//                и CRC-32 всего содержимого после заголовка. Одинаковые тексты ячеек
+//                записываются один раз (файл заменяется атомарно, через переименование
+//                временного файла)
+//   wal        - изменения после снимка: заголовок WAL_MAGIC и записи вида
+//                <операция: 1 байт> <строка: varint> <столбец: varint>
+//                [<длина текста: varint> <текст>]  - только для SetCell
+//                <CRC-32 записи: 4 байта, little-endian>
+// Числа кодируются в формате LEB128.
+
+inline constexpr std::string_view WAL_MAGIC = "SPWAL001";
+inline constexpr std::string_view CHECKPOINT_MAGIC = "SPCKPT02";
+
+enum class WalOperation : uint8_t {
+    SetCell,
+    ClearCell,
+};
+
+// Когда записи журнала попадают на диск
+enum class WalDurability {
+    // Записи передаются ОС не позже чем через commit_interval, fsync не выполняется:
+    // изменения переживают падение процесса, но не сбой питания или ОС
+    Buffered,
+    // Групповая фиксация: все записи, накопленные за commit_interval, фиксируются одним fsync.
+    // При сбое теряются изменения не более чем за commit_interval (Commit() дожидается фиксации)
+    Group,
+    // Изменение возвращается только после fsync своей записи. Записи, добавленные во время
+    // fsync, фиксируются следующим общим fsync
+    Sync,
+};
+
+struct WalOptions {
+    WalDurability durability = WalDurability::Group;
+    // Наибольшая задержка записи на диск в режимах Buffered и Group
+    std::chrono::milliseconds commit_interval{10};
+    // Накопленные записи передаются на диск раньше, если их размер превышает этот порог
+    size_t max_batch_bytes = 1 << 20;
+    // Контрольная точка создаётся после этого количества записей журнала (0 - только
+    // явным вызовом Checkpoint)
+    size_t checkpoint_records = 1 << 16;
+};
+
+// Файлы журнала и групповая фиксация. Добавление записей - из одного потока (как и
+// изменение таблицы), запись на диск выполняет фоновый поток. Ошибки ввода-вывода
+// бросаются как std::runtime_error (ошибка фонового потока - при следующем вызове).
+class WriteAheadLog {
+public:
+    // Открывает журнал в каталоге directory (каталог создаётся при необходимости) и читает
+    // сохранённое содержимое таблицы (см. TakeRecoveredCells). Неполная или повреждённая
+    // последняя запись журнала (запись, прерванная сбоем) отбрасывается
+    explicit WriteAheadLog(std::filesystem::path directory, WalOptions options = {});
+    // Дожидается записи на диск всех добавленных записей
+    ~WriteAheadLog();
+
+    WriteAheadLog(const WriteAheadLog&) = delete;
+    WriteAheadLog& operator=(const WriteAheadLog&) = delete;
+
+    // Содержимое непустых ячеек по контрольной точке и журналу, упорядоченное по позициям.
+    // Повторный вызов возвращает пустой список
+    std::vector<std::pair<Position, std::string>> TakeRecoveredCells();
+
+    void AppendSetCell(Position pos, std::string_view text);
+    void AppendClearCell(Position pos);
+    // Дожидается, пока все добавленные записи будут зафиксированы на диске
+    // (в режиме Buffered - переданы ОС)
+    void Commit();
+    // Атомарно заменяет контрольную точку снимком cells и очищает журнал
+    void Checkpoint(const std::vector<std::pair<Position, std::string>>& cells);
+
+    // Количество записей журнала после контрольной точки
+    size_t GetRecordCount() const { return record_count_; }
+    const WalOptions& GetOptions() const { return options_; }
+
+private:
+    void Append(WalOperation operation, Position pos, std::string_view text);
+    void Recover();
+    void RunCommitter();
+    // Записывает буфер в конец журнала и фиксирует его в соответствии с режимом
+    void WriteBatch(const std::string& batch);
+    void ThrowIfFailed();
+
+private:
+    std::filesystem::path directory_;
+    WalOptions options_;
+    // Файловый дескриптор журнала
+    int log_fd_ = -1;
+    std::vector<std::pair<Position, std::string>> recovered_cells_;
+    size_t record_count_ = 0;
+
+    // Защищает поля групповой фиксации
+    std::mutex mutex_;
+    std::condition_variable committer_wakeup_;
+    std::condition_variable committed_;
+    // Записи, ещё не переданные фоновому потоку
+    std::string pending_;
+    // Номер последней добавленной записи и последней записи, записанной на диск
+    uint64_t appended_seq_ = 0;
+    uint64_t committed_seq_ = 0;
+    // Запись на диск запрошена без ожидания commit_interval
+    bool commit_requested_ = false;
+    bool stopping_ = false;
+    std::exception_ptr error_;
+    // Запись в файл журнала (фоновым потоком или контрольной точкой)
+    std::mutex file_mutex_;
+    // Фоновый поток записи на диск
+    std::thread committer_;
+};
+
+// Таблица с журналом изменений: передаёт вызовы таблице sheet и записывает успешные
+// SetCell и ClearCell в журнал каталога directory. При создании пустая таблица sheet
+// восстанавливается из контрольной точки и журнала одним пакетом (Sheet::LoadCells).
+// Контрольные точки создаются каждые options.checkpoint_records записей журнала.
+class DurableSheet : public SheetInterface {
+public:
+    DurableSheet(Sheet& sheet, std::filesystem::path directory, WalOptions options = {});
+
+    void SetCell(Position pos, std::string text) override;
+
+    const CellInterface* GetCell(Position pos) const override;
+    CellInterface* GetCell(Position pos) override;
+
+    void ClearCell(Position pos) override;
+
+    Size GetPrintableSize() const override;
+
+    void PrintValues(std::ostream& output) const override;
+    void PrintTexts(std::ostream& output) const override;
+
+    // Дожидается фиксации всех изменений на диске
+    void Commit();
+    // Сохраняет снимок таблицы и очищает журнал
+    void Checkpoint();
+
+private:
+    void CheckpointIfNeeded();
+
+private:
+    Sheet& sheet_;
+    WriteAheadLog log_;
+};
@@ -0,0 +1,102 @@
+#include "workbook.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+using namespace std::literals;
+
+Sheet& Workbook::AddSheet(std::string name) {
+    if (!IsValidSheetName(name)) {
+        throw std::invalid_argument("invalid sheet name: "s + name);
+    }
+    if (sheets_.count(name)) {
+        throw std::invalid_argument("sheet already exists: "s + name);
+    }
+    auto& sheet = sheets_[name];
+    sheet = std::make_unique<Sheet>(this);
+    sheet_names_.push_back(std::move(name));
+    return *sheet;
+}
+
+Sheet* Workbook::GetSheet(std::string_view name) {
+    auto it = sheets_.find(name);
+    return it == sheets_.end() ? nullptr : it->second.get();
+}
+
+const Sheet* Workbook::GetSheet(std::string_view name) const {
+    auto it = sheets_.find(name);
+    return it == sheets_.end() ? nullptr : it->second.get();
+}
+
+std::string_view Workbook::GetSheetName(const Sheet& sheet) const {
+    for (const auto& [name, book_sheet] : sheets_) {
+        if (book_sheet.get() == &sheet) {
+            return name;
+        }
+    }
+    return {};
+}
+
+std::shared_ptr<FormulaInterface> Workbook::InternFormula(std::string expression,
+                                                          std::shared_ptr<FormulaInterface> parsed) {
+    auto& cached = formulas_[expression];
+    if (auto formula = cached.lock()) {
+        return formula;
+    }
+
+    std::shared_ptr<FormulaInterface> formula = std::move(parsed);
+    try {
+        if (!formula) {
+            formula = ParseFormula(expression);
+        }
+    } catch (...) {
+        // Некорректные формулы в кэше не хранятся
+        formulas_.erase(expression);
+        throw;
+    }
+    cached = formula;
+
+    // Удаляем формулы, которые больше не используются ячейками
+    if (formulas_.size() >= formula_sweep_size_) {
+        for (auto it = formulas_.begin(); it != formulas_.end();) {
+            it = it->second.expired() ? formulas_.erase(it) : std::next(it);
+        }
+        formula_sweep_size_ = std::max(MIN_FORMULA_SWEEP_SIZE, 2 * formulas_.size());
+    }
+    return formula;
+}
+
+void Workbook::ForgetFormula(std::string_view expression, const FormulaInterface& formula) {
+    auto it = formulas_.find(std::string(expression));
+    if (it != formulas_.end() && it->second.lock().get() == &formula) {
+        formulas_.erase(it);
+    }
+}
+
+size_t Workbook::GetInternedFormulaCount() const {
+    return std::count_if(formulas_.begin(), formulas_.end(), [](const auto& item) {
+        return !item.second.expired();
+    });
+}
+
+Executor& Workbook::GetExecutor() {
+    if (!executor_) {
+        executor_ = std::make_unique<Executor>();
+    }
+    return *executor_;
+}
+
+bool Workbook::IsValidSheetName(std::string_view name) {
+    auto is_letter = [](char c) {
+        return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || c == '_';
+    };
+    auto is_digit = [](char c) {
+        return c >= '0' && c <= '9';
+    };
+    if (name.empty() || !is_letter(name.front())) {
+        return false;
+    }
+    return std::all_of(name.begin(), name.end(), [&](char c) {
+        return is_letter(c) || is_digit(c);
+    });
+}
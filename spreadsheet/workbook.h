@@ -0,0 +1,82 @@
+#pragma once
+
+#include "common.h"
+#include "formula.h"
+#include "sheet.h"
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Книга из нескольких таблиц, формулы которых могут ссылаться на ячейки друг друга (Sheet2!A1).
+// Таблицы книги используют общие кэш разобранных формул, режим пересчёта и способ вычисления.
+// Связи между ячейками разных таблиц входят в общий граф зависимостей, поэтому сброс кэшей,
+// пересчёт и проверка циклических зависимостей выполняются по всей книге.
+class Workbook {
+public:
+    Workbook() = default;
+    // Таблицы хранят указатель на книгу
+    Workbook(const Workbook&) = delete;
+    Workbook& operator=(const Workbook&) = delete;
+
+    // Добавляет пустую таблицу. Имя должно начинаться с латинской буквы или '_'
+    // и содержать только латинские буквы, цифры и '_'. Если имя некорректно
+    // или уже занято, бросается std::invalid_argument.
+    Sheet& AddSheet(std::string name);
+
+    // Возвращают nullptr, если таблицы с таким именем нет
+    Sheet* GetSheet(std::string_view name);
+    const Sheet* GetSheet(std::string_view name) const;
+
+    // Имя таблицы книги (пустое, если таблица не входит в книгу)
+    std::string_view GetSheetName(const Sheet& sheet) const;
+    // Имена таблиц в порядке добавления
+    const std::vector<std::string>& GetSheetNames() const { return sheet_names_; }
+
+    void SetRecalculationMode(RecalculationMode mode) { recalculation_mode_ = mode; }
+    RecalculationMode GetRecalculationMode() const { return recalculation_mode_; }
+
+    void SetEvaluationStrategy(EvaluationStrategy strategy) { evaluation_strategy_ = strategy; }
+    EvaluationStrategy GetEvaluationStrategy() const { return evaluation_strategy_; }
+
+    // Разбирает формулу или возвращает уже разобранную формулу с тем же текстом:
+    // одинаковые формулы во всех таблицах книги хранятся в одном экземпляре.
+    // Формула parsed, если она передана, уже разобрана из expression (см. ParseFormulas)
+    // и используется вместо повторного разбора.
+    // Бросает FormulaException, если формула синтаксически некорректна.
+    std::shared_ptr<FormulaInterface> InternFormula(std::string expression,
+                                                    std::shared_ptr<FormulaInterface> parsed = nullptr);
+    // Удаляет формулу из кэша, если она хранится в нём под текстом expression
+    // (перед изменением формулы, см. FormulaInterface::ShiftReferences)
+    void ForgetFormula(std::string_view expression, const FormulaInterface& formula);
+    // Количество различных формул, используемых ячейками книги
+    size_t GetInternedFormulaCount() const;
+
+    // Исполнитель асинхронных вычислений таблиц книги: вычисление может затрагивать
+    // ячейки нескольких таблиц, поэтому задачи всех таблиц выполняются по очереди
+    Executor& GetExecutor();
+
+    static bool IsValidSheetName(std::string_view name);
+
+private:
+    // Минимальный размер кэша формул, при котором из него удаляются неиспользуемые формулы
+    static constexpr size_t MIN_FORMULA_SWEEP_SIZE = 64;
+
+    // Таблицы по имени
+    std::map<std::string, std::unique_ptr<Sheet>, std::less<>> sheets_;
+    std::vector<std::string> sheet_names_;
+
+    RecalculationMode recalculation_mode_ = RecalculationMode::Lazy;
+    EvaluationStrategy evaluation_strategy_ = EvaluationStrategy::Iterative;
+
+    // Текст формулы - разобранная формула (пока её используют ячейки)
+    std::unordered_map<std::string, std::weak_ptr<FormulaInterface>> formulas_;
+    // Размер кэша, при достижении которого из него удаляются неиспользуемые формулы
+    size_t formula_sweep_size_ = MIN_FORMULA_SWEEP_SIZE;
+    // Объявлен последним: при уничтожении книги задачи завершаются до удаления таблиц
+    std::unique_ptr<Executor> executor_;
+};